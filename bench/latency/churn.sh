@@ -0,0 +1,42 @@
+#!/bin/bash
+
+# Hammers the dynamic_upstream location with add/remove/down/up of
+# local peers and adds of a hostname which go through DNS resolving.
+# Runs until killed, then prints the number of requests made.
+
+API=${API:-http://127.0.0.1:7000/dynamic}
+UPSTREAM=${UPSTREAM:-backends}
+
+count=0
+
+trap 'echo "churn      $count requests"; exit 0' TERM INT
+
+call() {
+  curl -s -o /dev/null "$API?upstream=$UPSTREAM&$1"
+  count=$((count + 1))
+}
+
+while true
+do
+  for port in 7005 7006 7007
+  do
+    call "add=&server=127.0.0.1:$port"
+  done
+
+  call "add=&server=localhost:7008"
+
+  for port in 7001 7005
+  do
+    call "server=127.0.0.1:$port&down="
+    call "server=127.0.0.1:$port&up="
+  done
+
+  call "server=127.0.0.1:7002&weight=$((RANDOM % 10 + 1))"
+
+  for port in 7005 7006 7007
+  do
+    call "remove=&server=127.0.0.1:$port"
+  done
+
+  call "remove=&server=localhost:7008"
+done
@@ -0,0 +1,17 @@
+-- wrk script: proxied request latency percentiles
+
+function done(summary, latency, requests)
+  local seconds = summary.duration / 1000000
+  local errors = summary.errors
+
+  io.write(string.format("requests   %d\n", summary.requests))
+  io.write(string.format("rps        %.0f\n", summary.requests / seconds))
+  io.write(string.format("p50        %.3f ms\n", latency:percentile(50) / 1000))
+  io.write(string.format("p99        %.3f ms\n", latency:percentile(99) / 1000))
+  io.write(string.format("p999       %.3f ms\n",
+                         latency:percentile(99.9) / 1000))
+  io.write(string.format("max        %.3f ms\n", latency.max / 1000))
+  io.write(string.format("errors     %d\n",
+                         errors.connect + errors.read + errors.write
+                         + errors.timeout + errors.status))
+end
@@ -0,0 +1,60 @@
+#!/bin/bash
+
+# Proxied request latency and throughput with and without control
+# plane churn against the same upstream.
+#
+#   NGINX        nginx binary with the module (default: nginx in PATH)
+#   DURATION     wrk duration (default: 30s)
+#   CONNECTIONS  wrk connections (default: 64)
+#   THREADS      wrk threads (default: 4)
+
+DIR=$(cd $(dirname $0) && pwd)
+
+NGINX=${NGINX:-nginx}
+DURATION=${DURATION:-30s}
+CONNECTIONS=${CONNECTIONS:-64}
+THREADS=${THREADS:-4}
+
+URL=http://127.0.0.1:7000/
+
+if ! which wrk > /dev/null; then
+  echo "wrk is required"
+  exit 1
+fi
+
+prefix=$(mktemp -d)
+mkdir $prefix/logs
+
+cleanup() {
+  [ -n "$churn" ] && kill $churn 2>/dev/null
+  $NGINX -p $prefix -c $DIR/nginx.conf -s stop 2>/dev/null
+  sleep 1
+  rm -rf $prefix
+}
+
+trap cleanup EXIT
+
+$NGINX -p $prefix -c $DIR/nginx.conf || exit 1
+sleep 1
+
+load() {
+  wrk -t$THREADS -c$CONNECTIONS -d$DURATION -s $DIR/latency.lua $URL \
+    | sed -n '/^requests/,$p'
+}
+
+echo "== warmup"
+wrk -t$THREADS -c$CONNECTIONS -d5s $URL > /dev/null
+
+echo "== without churn"
+load
+
+echo "== with churn"
+$DIR/churn.sh &
+churn=$!
+load
+kill $churn
+wait $churn
+churn=
+
+grep -c '\[alert\]\|\[crit\]\|\[emerg\]' $prefix/logs/error.log \
+  | sed 's/^/alerts     /'
@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+extern "C" {
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include <sys/mman.h>
+
+}
+
+#include "ngx_dynamic_upstream_bench.h"
+
+
+static ngx_str_t
+bench_name = ngx_string(NGX_DYNAMIC_UPSTREAM_BENCH_NAME);
+
+static ngx_open_file_t  bench_log_file;
+static ngx_log_t        bench_log;
+static ngx_cycle_t      bench_cycle;
+
+
+ngx_int_t
+ngx_dynamic_upstream_bench_init(ngx_uint_t log_level)
+{
+    ngx_uint_t  n;
+
+    bench_log_file.fd = ngx_stderr;
+    bench_log.file = &bench_log_file;
+    bench_log.log_level = log_level;
+
+    ngx_pid = ngx_getpid();
+    ngx_ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    ngx_pagesize = getpagesize();
+    ngx_pagesize_shift = 0;
+    for (n = ngx_pagesize; n >>= 1; ngx_pagesize_shift++) {
+        /* void */
+    }
+
+    ngx_cacheline_size = NGX_CPU_CACHE_LINE;
+
+    ngx_time_init();
+
+    // trashed peers are freed by a timer, see ngx_dynamic_cleanup()
+
+    if (ngx_event_timer_init(&bench_log) != NGX_OK)
+        return NGX_ERROR;
+
+#if defined(nginx_version) && (nginx_version >= 1011007)
+    ngx_slab_sizes_init();
+#endif
+
+    bench_cycle.log = &bench_log;
+    bench_cycle.pool = ngx_create_pool(16384, &bench_log);
+    if (bench_cycle.pool == NULL)
+        return NGX_ERROR;
+
+    ngx_cycle = &bench_cycle;
+
+    return NGX_OK;
+}
+
+
+ngx_slab_pool_t *
+ngx_dynamic_upstream_bench_zone(size_t size, ngx_flag_t shared)
+{
+    u_char           *addr;
+    ngx_slab_pool_t  *shpool;
+
+    size = ngx_align(size, ngx_pagesize);
+
+    addr = (u_char *) mmap(NULL, size, PROT_READ|PROT_WRITE,
+        MAP_ANON|(shared ? MAP_SHARED : MAP_PRIVATE), -1, 0);
+    if (addr == MAP_FAILED) {
+
+        ngx_log_error(NGX_LOG_EMERG, &bench_log, ngx_errno,
+                      "mmap(%uz) failed", size);
+        return NULL;
+    }
+
+    shpool = (ngx_slab_pool_t *) addr;
+
+    shpool->end = addr + size;
+    shpool->min_shift = 3;
+    shpool->addr = addr;
+
+    if (ngx_shmtx_create(&shpool->mutex, &shpool->lock, NULL) != NGX_OK)
+        return NULL;
+
+    ngx_slab_init(shpool);
+
+    return shpool;
+}
+
+
+ngx_str_t
+ngx_dynamic_upstream_bench_server(ngx_uint_t i, u_char *buf)
+{
+    ngx_str_t  s;
+
+    s.data = buf;
+    s.len = ngx_sprintf(buf, "10.%ui.%ui.%ui:80",
+                        (i >> 16) & 255, (i >> 8) & 255, i & 255) - buf;
+
+    return s;
+}
+
+
+static ngx_bench_peer_t *
+ngx_dynamic_upstream_bench_peer(ngx_slab_pool_t *shpool, ngx_uint_t i)
+{
+    ngx_bench_peer_t    *peer;
+    struct sockaddr_in  *sin;
+    u_char               buf[32];
+    ngx_str_t            server;
+
+    server = ngx_dynamic_upstream_bench_server(i, buf);
+
+    peer = (ngx_bench_peer_t *) ngx_slab_calloc(shpool,
+        sizeof(ngx_bench_peer_t));
+    if (peer == NULL)
+        return NULL;
+
+    peer->server.data = (u_char *) ngx_slab_calloc(shpool, server.len + 1);
+    peer->name.data = (u_char *) ngx_slab_calloc(shpool, server.len + 1);
+    peer->sockaddr = (struct sockaddr *) ngx_slab_calloc(shpool,
+        sizeof(struct sockaddr_in));
+
+    if (peer->server.data == NULL || peer->name.data == NULL
+        || peer->sockaddr == NULL)
+        return NULL;
+
+    peer->server.len = server.len;
+    ngx_memcpy(peer->server.data, server.data, server.len);
+
+    peer->name.len = server.len;
+    ngx_memcpy(peer->name.data, server.data, server.len);
+
+    sin = (struct sockaddr_in *) peer->sockaddr;
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(80);
+    sin->sin_addr.s_addr = htonl(0x0a000000 | (i & 0xffffff));
+    peer->socklen = sizeof(struct sockaddr_in);
+
+    peer->weight = 1;
+    peer->effective_weight = 1;
+    peer->max_fails = 1;
+    peer->fail_timeout = 10;
+
+    return peer;
+}
+
+
+ngx_bench_peers_t *
+ngx_dynamic_upstream_bench_peers(ngx_slab_pool_t *shpool, ngx_uint_t n)
+{
+    ngx_bench_peers_t  *primary;
+    ngx_bench_peer_t   *peer, *last = NULL;
+    ngx_uint_t          i;
+
+    primary = (ngx_bench_peers_t *) ngx_slab_calloc(shpool,
+        sizeof(ngx_bench_peers_t));
+    if (primary == NULL)
+        return NULL;
+
+    primary->shpool = shpool;
+    primary->name = &bench_name;
+
+    for (i = 0; i < n; i++) {
+
+        peer = ngx_dynamic_upstream_bench_peer(shpool, i);
+        if (peer == NULL)
+            return NULL;
+
+        if (last == NULL)
+            primary->peer = peer;
+        else
+            last->next = peer;
+
+        last = peer;
+    }
+
+    primary->number = n;
+    primary->total_weight = n;
+    primary->single = n == 1;
+    primary->weighted = 0;
+
+    return primary;
+}
+
+
+void
+ngx_dynamic_upstream_bench_op(ngx_dynamic_upstream_op_t *op, ngx_int_t code)
+{
+    ngx_memzero(op, sizeof(ngx_dynamic_upstream_op_t));
+
+    op->op = code;
+    op->upstream = bench_name;
+    op->err = "unexpected";
+}
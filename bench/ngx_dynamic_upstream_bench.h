@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#ifndef NGX_DYNAMIC_UPSTREAM_BENCH_H
+#define NGX_DYNAMIC_UPSTREAM_BENCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#ifdef __cplusplus
+}
+#endif
+
+#include "ngx_dynamic_upstream_module.h"
+#include "ngx_dynamic_upstream_op.h"
+
+
+// minimal nginx core for running the op engine outside of nginx:
+// log to stderr, time, page size and a real slab pool
+
+#define NGX_DYNAMIC_UPSTREAM_BENCH_NAME  "bench"
+
+typedef ngx_http_upstream_rr_peers_t  ngx_bench_peers_t;
+typedef ngx_http_upstream_rr_peer_t   ngx_bench_peer_t;
+
+
+ngx_int_t
+ngx_dynamic_upstream_bench_init(ngx_uint_t log_level);
+
+
+// shared != 0 maps the zone MAP_SHARED, so it survives fork()
+
+ngx_slab_pool_t *
+ngx_dynamic_upstream_bench_zone(size_t size, ngx_flag_t shared);
+
+
+// server name of the i-th peer, 10.x.y.z:port
+
+ngx_str_t
+ngx_dynamic_upstream_bench_server(ngx_uint_t i, u_char *buf);
+
+
+// builds the primary peers with n peers directly in the zone,
+// bypassing the op engine which is quadratic in the number of peers
+
+ngx_bench_peers_t *
+ngx_dynamic_upstream_bench_peers(ngx_slab_pool_t *shpool, ngx_uint_t n);
+
+
+void
+ngx_dynamic_upstream_bench_op(ngx_dynamic_upstream_op_t *op, ngx_int_t code);
+
+
+ngx_inline uint64_t
+ngx_dynamic_upstream_bench_now()
+{
+    struct timespec  ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_BENCH_H */
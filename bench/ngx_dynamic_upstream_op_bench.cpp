@@ -0,0 +1,262 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+extern "C" {
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+#include <getopt.h>
+#include <sys/mman.h>
+
+}
+
+#include "ngx_dynamic_upstream_bench.h"
+
+
+// times ngx_dynamic_upstream_op_impl on upstreams of a given size,
+// every operation runs under the same locks as in nginx
+
+#define BENCH_MAX_SIZES  16
+
+static ngx_uint_t  sizes[BENCH_MAX_SIZES] = { 10, 100, 1000, 10000, 100000 };
+static ngx_uint_t  nsizes = 5;
+static ngx_uint_t  ops = 1000;
+static ngx_uint_t  sync_max = 10000;
+
+
+typedef struct {
+    const char  *name;
+    ngx_uint_t   ops;
+    uint64_t     nsec;
+    size_t       bytes;
+    ngx_uint_t   failed;
+} bench_result_t;
+
+
+static void
+bench_print(ngx_uint_t n, bench_result_t *r)
+{
+    if (r->ops == 0) {
+        printf("%8lu  %-8s  %8s  %12s  %10s  %s\n", (unsigned long) n,
+               r->name, "-", "-", "-", "skipped");
+        return;
+    }
+
+    printf("%8lu  %-8s  %8lu  %12.0f  %10.1f  %lu\n", (unsigned long) n,
+           r->name, (unsigned long) r->ops, (double) r->nsec / r->ops,
+           (double) r->bytes / r->ops, (unsigned long) r->failed);
+}
+
+
+static void
+bench_run(ngx_bench_peers_t *primary, ngx_slab_pool_t *shpool,
+    ngx_dynamic_upstream_op_t *op, bench_result_t *r)
+{
+    uint64_t  start;
+
+    start = ngx_dynamic_upstream_bench_now();
+
+    if (ngx_dynamic_upstream_op_impl(ngx_cycle->log, op, shpool, primary)
+            == NGX_ERROR)
+        r->failed++;
+
+    r->nsec += ngx_dynamic_upstream_bench_now() - start;
+    r->ops++;
+}
+
+
+static ngx_int_t
+bench_size(ngx_uint_t n)
+{
+    ngx_slab_pool_t            *shpool;
+    ngx_bench_peers_t          *primary;
+    ngx_dynamic_upstream_op_t   op;
+    ngx_uint_t                  i, k, reps;
+    u_char                      buf[32];
+    bench_result_t              add, update, hash, del, sync;
+
+    ngx_memzero(&add, sizeof(bench_result_t));
+    ngx_memzero(&update, sizeof(bench_result_t));
+    ngx_memzero(&hash, sizeof(bench_result_t));
+    ngx_memzero(&del, sizeof(bench_result_t));
+    ngx_memzero(&sync, sizeof(bench_result_t));
+
+    add.name = "add";
+    update.name = "update";
+    hash.name = "hash";
+    del.name = "remove";
+    sync.name = "sync";
+
+    shpool = ngx_dynamic_upstream_bench_zone(16 * 1024 * 1024 + n * 1024, 0);
+    if (shpool == NULL)
+        return NGX_ERROR;
+
+    primary = ngx_dynamic_upstream_bench_peers(shpool, n);
+    if (primary == NULL) {
+
+        fprintf(stderr, "failed to build %lu peers\n", (unsigned long) n);
+        return NGX_ERROR;
+    }
+
+    k = ngx_min(ops, n);
+
+    // adds new peers at the tail, then removes the same peers
+
+    for (i = n; i < n + k; i++) {
+
+        ngx_dynamic_upstream_bench_op(&op, NGX_DYNAMIC_UPSTEAM_OP_ADD);
+        op.server = ngx_dynamic_upstream_bench_server(i, buf);
+
+        bench_run(primary, shpool, &op, &add);
+        add.bytes += op.allocated;
+    }
+
+    for (i = 0; i < k; i++) {
+
+        ngx_dynamic_upstream_bench_op(&op, NGX_DYNAMIC_UPSTEAM_OP_PARAM);
+        op.server = ngx_dynamic_upstream_bench_server(i, buf);
+        op.op_param = NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT;
+        op.weight = 1 + i % 2;
+
+        bench_run(primary, shpool, &op, &update);
+    }
+
+    for (i = 0; i < k; i++) {
+
+        ngx_dynamic_upstream_bench_op(&op, NGX_DYNAMIC_UPSTEAM_OP_HASH);
+
+        bench_run(primary, shpool, &op, &hash);
+    }
+
+    for (i = n; i < n + k; i++) {
+
+        ngx_dynamic_upstream_bench_op(&op, NGX_DYNAMIC_UPSTEAM_OP_REMOVE);
+        op.server = ngx_dynamic_upstream_bench_server(i, buf);
+
+        bench_run(primary, shpool, &op, &del);
+        del.bytes += op.freed;
+    }
+
+    // full resolve and compare pass, the set of peers doesn't change
+
+    if (n <= sync_max) {
+
+        reps = ngx_max(1, ngx_min(k, 100000 / n));
+
+        for (i = 0; i < reps; i++) {
+
+            ngx_dynamic_upstream_bench_op(&op, NGX_DYNAMIC_UPSTEAM_OP_SYNC);
+
+            bench_run(primary, shpool, &op, &sync);
+            sync.bytes += op.allocated;
+        }
+    }
+
+    if (primary->number != n) {
+
+        fprintf(stderr, "%lu peers expected, %lu found\n", (unsigned long) n,
+                (unsigned long) primary->number);
+        return NGX_ERROR;
+    }
+
+    bench_print(n, &add);
+    bench_print(n, &update);
+    bench_print(n, &hash);
+    bench_print(n, &del);
+    bench_print(n, &sync);
+
+    munmap(shpool->addr, shpool->end - (u_char *) shpool->addr);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+bench_sizes(char *s)
+{
+    char  *p;
+
+    for (nsizes = 0, p = strtok(s, ","); p != NULL; p = strtok(NULL, ",")) {
+
+        if (nsizes == BENCH_MAX_SIZES)
+            return NGX_ERROR;
+
+        sizes[nsizes] = strtoul(p, NULL, 10);
+        if (sizes[nsizes] == 0)
+            return NGX_ERROR;
+
+        nsizes++;
+    }
+
+    return nsizes != 0 ? NGX_OK : NGX_ERROR;
+}
+
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-n sizes] [-k ops] [-s sync_max] [-v]\n"
+            "  -n  comma separated upstream sizes "
+                  "(default 10,100,1000,10000,100000)\n"
+            "  -k  operations per measurement (default 1000)\n"
+            "  -s  largest upstream to run sync on (default 10000)\n"
+            "  -v  log notices of the op engine\n", prog);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    ngx_uint_t  i, log_level = NGX_LOG_ERR;
+    int         c;
+
+    while ((c = getopt(argc, argv, "n:k:s:v")) != -1) {
+
+        switch (c) {
+
+            case 'n':
+                if (bench_sizes(optarg) != NGX_OK) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+
+            case 'k':
+                ops = strtoul(optarg, NULL, 10);
+                break;
+
+            case 's':
+                sync_max = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'v':
+                log_level = NGX_LOG_NOTICE;
+                break;
+
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (ops == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (ngx_dynamic_upstream_bench_init(log_level) != NGX_OK)
+        return 1;
+
+    printf("%8s  %-8s  %8s  %12s  %10s  %s\n",
+           "peers", "op", "ops", "ns/op", "shm B/op", "failed");
+
+    for (i = 0; i < nsizes; i++)
+        if (bench_size(sizes[i]) != NGX_OK)
+            return 1;
+
+    return 0;
+}
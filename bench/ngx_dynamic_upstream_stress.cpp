@@ -0,0 +1,540 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+extern "C" {
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_event.h>
+#include <ngx_http.h>
+
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+}
+
+#include "ngx_dynamic_upstream_bench.h"
+
+
+// writer processes mutate one shared upstream through the op engine
+// like nginx workers serving the API, reader processes pick and release
+// peers like the round robin balancer and check the invariants
+
+
+#define STRESS_HELD   32
+#define STRESS_NAME   64
+
+
+typedef struct {
+    ngx_atomic_t  ops[NGX_DYNAMIC_UPSTREAM_LOCK_OPS];
+    ngx_atomic_t  failed[NGX_DYNAMIC_UPSTREAM_LOCK_OPS];
+    ngx_atomic_t  picks;
+    ngx_atomic_t  no_peer;
+    ngx_atomic_t  checks;
+    ngx_atomic_t  violations;
+    ngx_atomic_t  stop;
+    ngx_atomic_t  readers_done;
+} stress_stat_t;
+
+
+typedef struct {
+    ngx_bench_peer_t  *peer;
+    u_char             name[STRESS_NAME];
+    size_t             len;
+    in_addr_t          addr;
+} stress_conn_t;
+
+
+static const char  *op_names[NGX_DYNAMIC_UPSTREAM_LOCK_OPS] = {
+    "list", "add", "remove", "update", "sync", "hash"
+};
+
+
+static ngx_uint_t  writers = 2;
+static ngx_uint_t  readers = 4;
+static ngx_uint_t  duration = 10;
+static ngx_uint_t  pool = 64;
+static unsigned    seed = 0;
+
+static ngx_slab_pool_t    *shpool;
+static ngx_bench_peers_t  *primary;
+static stress_stat_t      *stats;
+
+
+static void
+stress_violation(const char *fmt, ...)
+{
+    va_list  args;
+
+    fprintf(stderr, "[%d] invariant violated: ", (int) ngx_getpid());
+
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+
+    fprintf(stderr, "\n");
+
+    ngx_atomic_fetch_add(&stats->violations, 1);
+}
+
+
+// must be called under the peers lock
+
+static void
+stress_check()
+{
+    ngx_bench_peers_t  *peers;
+    ngx_bench_peer_t   *peer, *other;
+    ngx_uint_t          j, n, weight, max = 2 * pool + 2;
+
+    ngx_atomic_fetch_add(&stats->checks, 1);
+
+    if (primary->number == 0)
+        stress_violation("primary is empty");
+
+    for (peers = primary, j = 0;
+         peers != NULL && j < 2;
+         peers = peers->next, j++) {
+
+        n = 0;
+        weight = 0;
+
+        for (peer = peers->peer; peer != NULL; peer = peer->next) {
+
+            if (++n > max) {
+
+                stress_violation("list of %s peers is looped",
+                                 j == 0 ? "primary" : "backup");
+                return;
+            }
+
+            weight += peer->weight;
+
+            if (peer->server.data == NULL || peer->name.data == NULL
+                || peer->sockaddr == NULL) {
+
+                stress_violation("peer without address");
+                return;
+            }
+
+            for (other = peer->next; other != NULL; other = other->next)
+                if (str_eq(other->server, peer->server)
+                    && str_eq(other->name, peer->name))
+                    stress_violation("duplicate peer %.*s",
+                                     (int) peer->name.len, peer->name.data);
+        }
+
+        if (n != peers->number)
+            stress_violation("number %lu, %lu peers in list",
+                             (unsigned long) peers->number, (unsigned long) n);
+
+        if (weight != peers->total_weight)
+            stress_violation("total_weight %lu, sum of weights %lu",
+                             (unsigned long) peers->total_weight,
+                             (unsigned long) weight);
+
+        if ((ngx_uint_t) peers->single != (peers->number == 1))
+            stress_violation("single %d with %lu peers", (int) peers->single,
+                             (unsigned long) peers->number);
+
+        if ((ngx_uint_t) peers->weighted
+                != (peers->total_weight != peers->number))
+            stress_violation("weighted %d, total_weight %lu, number %lu",
+                             (int) peers->weighted,
+                             (unsigned long) peers->total_weight,
+                             (unsigned long) peers->number);
+
+        if (j == 1 && peers->number == 0)
+            stress_violation("empty backup peers are linked");
+    }
+}
+
+
+static void
+stress_writer()
+{
+    ngx_dynamic_upstream_op_t  op;
+    ngx_uint_t                 r, i, k;
+    u_char                     buf[32];
+    unsigned                   rnd = seed + ngx_getpid();
+
+    while (!stats->stop) {
+
+        r = rand_r(&rnd) % 100;
+        i = rand_r(&rnd) % pool;
+
+        if (r < 30) {
+
+            ngx_dynamic_upstream_bench_op(&op, NGX_DYNAMIC_UPSTEAM_OP_ADD);
+            op.server = ngx_dynamic_upstream_bench_server(i, buf);
+            op.backup = i % 8 == 7;
+
+            if (rand_r(&rnd) % 2) {
+                op.op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT;
+                op.weight = 1 + rand_r(&rnd) % 5;
+            }
+
+        } else if (r < 60) {
+
+            ngx_dynamic_upstream_bench_op(&op, NGX_DYNAMIC_UPSTEAM_OP_REMOVE);
+            op.server = ngx_dynamic_upstream_bench_server(i, buf);
+
+        } else if (r < 90) {
+
+            ngx_dynamic_upstream_bench_op(&op, NGX_DYNAMIC_UPSTEAM_OP_PARAM);
+            op.server = ngx_dynamic_upstream_bench_server(i, buf);
+
+            switch (rand_r(&rnd) % 3) {
+
+                case 0:
+                    op.op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT;
+                    op.weight = 1 + rand_r(&rnd) % 5;
+                    break;
+
+                case 1:
+                    op.op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN;
+                    op.down = 1;
+                    break;
+
+                default:
+                    op.op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP;
+                    op.up = 1;
+                    break;
+            }
+
+        } else {
+
+            ngx_dynamic_upstream_bench_op(&op, NGX_DYNAMIC_UPSTEAM_OP_SYNC);
+        }
+
+        for (k = 0; (1 << k) != op.op; k++) {
+            /* void */
+        }
+
+        // "not found", "exists" and primary<->backup errors are expected
+
+        if (ngx_dynamic_upstream_op_impl(ngx_cycle->log, &op, shpool, primary)
+                == NGX_ERROR
+            && op.status != NGX_HTTP_BAD_REQUEST
+            && op.status != NGX_HTTP_PRECONDITION_FAILED)
+            ngx_atomic_fetch_add(&stats->failed[k], 1);
+
+        ngx_atomic_fetch_add(&stats->ops[k], 1);
+
+        // runs the trash cleanup timer as the event loop would
+
+        ngx_time_update();
+        ngx_event_expire_timers();
+    }
+
+    // trashed peers are freed after readers release them
+
+    while (!stats->readers_done)
+        ngx_msleep(10);
+
+    ngx_msleep(1100);
+
+    ngx_time_update();
+    ngx_event_expire_timers();
+}
+
+
+// smooth weighted round robin, as ngx_http_upstream_get_peer()
+
+static ngx_int_t
+stress_pick(stress_conn_t *c)
+{
+    ngx_bench_peer_t  *peer, *best = NULL;
+    ngx_int_t          total = 0;
+
+    ngx_upstream_rr_peers_wlock<ngx_bench_peers_t> wl(primary);
+
+    for (peer = primary->peer; peer != NULL; peer = peer->next) {
+
+        if (peer->down)
+            continue;
+
+        peer->current_weight += peer->effective_weight;
+        total += peer->effective_weight;
+
+        if (best == NULL || peer->current_weight > best->current_weight)
+            best = peer;
+    }
+
+    if (best == NULL)
+        return NGX_DECLINED;
+
+    best->current_weight -= total;
+
+    ngx_upstream_rr_peer_lock<ngx_bench_peer_t> pl(best);
+
+    best->conns++;
+
+    c->peer = best;
+    c->len = ngx_min(best->name.len, STRESS_NAME);
+    ngx_memcpy(c->name, best->name.data, c->len);
+    c->addr = ((struct sockaddr_in *) best->sockaddr)->sin_addr.s_addr;
+
+    return NGX_OK;
+}
+
+
+// a removed peer stays alive while it has connections,
+// anything else means it was freed under the reader
+
+static void
+stress_release(stress_conn_t *c)
+{
+    ngx_bench_peer_t  *peer = c->peer;
+
+    ngx_upstream_rr_peers_rlock<ngx_bench_peers_t> rl(primary);
+    ngx_upstream_rr_peer_lock<ngx_bench_peer_t> pl(peer);
+
+    if (peer->name.len != c->len
+        || ngx_memcmp(peer->name.data, c->name, c->len) != 0
+        || ((struct sockaddr_in *) peer->sockaddr)->sin_addr.s_addr
+               != c->addr
+        || peer->conns == 0)
+        stress_violation("peer %.*s is used after free",
+                         (int) c->len, c->name);
+    else
+        peer->conns--;
+
+    c->peer = NULL;
+}
+
+
+static void
+stress_reader()
+{
+    stress_conn_t  held[STRESS_HELD];
+    ngx_uint_t     i, n = 0;
+    unsigned       rnd = seed + ngx_getpid();
+
+    ngx_memzero(held, sizeof(held));
+
+    while (!stats->stop) {
+
+        i = rand_r(&rnd) % STRESS_HELD;
+
+        if (held[i].peer != NULL) {
+
+            stress_release(&held[i]);
+            continue;
+        }
+
+        if (stress_pick(&held[i]) == NGX_OK)
+            ngx_atomic_fetch_add(&stats->picks, 1);
+        else
+            ngx_atomic_fetch_add(&stats->no_peer, 1);
+
+        if (++n % 1000 == 0) {
+
+            ngx_upstream_rr_peers_rlock<ngx_bench_peers_t> rl(primary);
+            stress_check();
+        }
+    }
+
+    for (i = 0; i < STRESS_HELD; i++)
+        if (held[i].peer != NULL)
+            stress_release(&held[i]);
+}
+
+
+static pid_t
+stress_fork(void (*fun)())
+{
+    pid_t  pid = fork();
+
+    if (pid == 0) {
+
+        ngx_pid = ngx_getpid();
+
+        fun();
+
+        exit(0);
+    }
+
+    if (pid == -1)
+        perror("fork");
+
+    return pid;
+}
+
+
+static ngx_int_t
+stress_wait(pid_t *pids, ngx_uint_t n)
+{
+    ngx_uint_t  i;
+    int         status;
+    ngx_int_t   rc = NGX_OK;
+
+    for (i = 0; i < n; i++) {
+
+        if (waitpid(pids[i], &status, 0) == -1
+            || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+
+            fprintf(stderr, "process %d crashed\n", (int) pids[i]);
+            rc = NGX_ERROR;
+        }
+    }
+
+    return rc;
+}
+
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [-w writers] [-r readers] [-d seconds] [-p peers] "
+                      "[-s seed]\n"
+            "  -w  processes changing the upstream (default 2)\n"
+            "  -r  processes balancing over the upstream (default 4)\n"
+            "  -d  duration in seconds (default 10)\n"
+            "  -p  number of distinct servers (default 64)\n"
+            "  -s  random seed (default 0)\n", prog);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    ngx_uint_t  i, n;
+    pid_t      *pids;
+    int         c;
+    ngx_int_t   rc = NGX_OK;
+
+    while ((c = getopt(argc, argv, "w:r:d:p:s:")) != -1) {
+
+        switch (c) {
+
+            case 'w':
+                writers = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'r':
+                readers = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'd':
+                duration = strtoul(optarg, NULL, 10);
+                break;
+
+            case 'p':
+                pool = strtoul(optarg, NULL, 10);
+                break;
+
+            case 's':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (writers == 0 || pool == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (ngx_dynamic_upstream_bench_init(NGX_LOG_ERR) != NGX_OK)
+        return 1;
+
+    shpool = ngx_dynamic_upstream_bench_zone(4 * 1024 * 1024 + pool * 2048,
+                                             1);
+    if (shpool == NULL)
+        return 1;
+
+    primary = ngx_dynamic_upstream_bench_peers(shpool, pool / 2 + 1);
+    if (primary == NULL)
+        return 1;
+
+    stats = (stress_stat_t *) mmap(NULL, sizeof(stress_stat_t),
+        PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED, -1, 0);
+    if (stats == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    ngx_memzero(stats, sizeof(stress_stat_t));
+
+    pids = (pid_t *) calloc(writers + readers, sizeof(pid_t));
+    if (pids == NULL)
+        return 1;
+
+    for (n = 0; n < writers + readers; n++) {
+
+        pids[n] = stress_fork(n < writers ? stress_writer : stress_reader);
+
+        if (pids[n] == -1) {
+
+            stats->stop = 1;
+            stats->readers_done = 1;
+            stress_wait(pids, n);
+
+            return 1;
+        }
+    }
+
+    sleep(duration);
+
+    stats->stop = 1;
+
+    if (stress_wait(pids + writers, readers) != NGX_OK)
+        rc = NGX_ERROR;
+
+    stats->readers_done = 1;
+
+    if (stress_wait(pids, writers) != NGX_OK)
+        rc = NGX_ERROR;
+
+    // nothing holds peers now, every connection is released
+
+    stress_check();
+
+    for (n = 0; n < 2; n++) {
+
+        ngx_bench_peers_t  *peers = n == 0 ? primary : primary->next;
+        ngx_bench_peer_t   *peer;
+
+        if (peers == NULL)
+            break;
+
+        for (peer = peers->peer; peer != NULL; peer = peer->next)
+            if (peer->conns != 0)
+                stress_violation("peer %.*s has %lu connections at exit",
+                                 (int) peer->name.len, peer->name.data,
+                                 (unsigned long) peer->conns);
+    }
+
+    printf("%-8s  %10s  %10s  %8s\n", "op", "ops", "ops/s", "failed");
+
+    for (i = 1; i < NGX_DYNAMIC_UPSTREAM_LOCK_OPS; i++)
+        if (stats->ops[i] != 0)
+            printf("%-8s  %10lu  %10.0f  %8lu\n", op_names[i],
+                   (unsigned long) stats->ops[i],
+                   (double) stats->ops[i] / duration,
+                   (unsigned long) stats->failed[i]);
+
+    printf("%-8s  %10lu  %10.0f\n", "pick", (unsigned long) stats->picks,
+           (double) stats->picks / duration);
+
+    printf("\nno peer     %lu\n"
+           "checks      %lu\n"
+           "peers       %lu primary, %lu backup\n"
+           "violations  %lu\n",
+           (unsigned long) stats->no_peer, (unsigned long) stats->checks,
+           (unsigned long) primary->number,
+           (unsigned long) (primary->next ? primary->next->number : 0),
+           (unsigned long) stats->violations);
+
+    if (stats->violations != 0)
+        rc = NGX_ERROR;
+
+    return rc == NGX_OK ? 0 : 1;
+}
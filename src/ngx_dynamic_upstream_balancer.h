@@ -0,0 +1,160 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#ifndef NGX_DYNAMIC_UPSTREAM_BALANCER_H
+#define NGX_DYNAMIC_UPSTREAM_BALANCER_H
+
+extern "C" {
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_stream.h>
+
+}
+
+#include "ngx_dynamic_upstream_module.h"
+
+
+// http and stream parts of the balancers of this module, the balancers
+// are built over round robin and fall back to it, and of the wrappers
+// of any balancer
+
+template <class S> struct BalancerSelect {};
+
+
+template <> struct BalancerSelect<ngx_http_upstream_srv_conf_t> {
+    typedef ngx_http_request_t                session_type;
+    typedef ngx_http_upstream_rr_peer_data_t  rr_data_type;
+    typedef ngx_http_complex_value_t          value_type;
+    typedef ngx_http_upstream_main_conf_t     main_type;
+    typedef ngx_http_upstream_init_peer_pt    init_peer_type;
+
+    static main_type * main_conf(ngx_cycle_t *cycle)
+    {
+        return (main_type *) ngx_http_cycle_get_module_main_conf(cycle,
+            ngx_http_upstream_module);
+    }
+
+    static ngx_dynamic_upstream_srv_conf_t *
+    srv_conf(ngx_http_upstream_srv_conf_t *us)
+    {
+        return (ngx_dynamic_upstream_srv_conf_t *)
+            ngx_http_conf_upstream_srv_conf(us,
+                ngx_http_dynamic_upstream_module);
+    }
+
+    static ngx_peer_connection_t * pc(session_type *r)
+    {
+        return &r->upstream->peer;
+    }
+
+    static ngx_pool_t * pool(session_type *r)
+    {
+        return r->pool;
+    }
+
+    // status of the response of the current peer, 0 if none
+
+    static ngx_uint_t status(session_type *r)
+    {
+        return r->upstream->headers_in.status_n;
+    }
+
+    static ngx_int_t value(session_type *r, void *cv, ngx_str_t *val)
+    {
+        return ngx_http_complex_value(r, (value_type *) cv, val);
+    }
+
+    static ngx_int_t init_rr(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+    {
+        return ngx_http_upstream_init_round_robin(cf, us);
+    }
+
+    static ngx_int_t init_rr_peer(session_type *r,
+        ngx_http_upstream_srv_conf_t *us)
+    {
+        return ngx_http_upstream_init_round_robin_peer(r, us);
+    }
+
+    static ngx_int_t get_rr_peer(ngx_peer_connection_t *pc, void *data)
+    {
+        return ngx_http_upstream_get_round_robin_peer(pc, data);
+    }
+
+    static void free_rr_peer(ngx_peer_connection_t *pc, void *data,
+        ngx_uint_t state)
+    {
+        ngx_http_upstream_free_round_robin_peer(pc, data, state);
+    }
+};
+
+
+template <> struct BalancerSelect<ngx_stream_upstream_srv_conf_t> {
+    typedef ngx_stream_session_t                session_type;
+    typedef ngx_stream_upstream_rr_peer_data_t  rr_data_type;
+    typedef ngx_stream_complex_value_t          value_type;
+    typedef ngx_stream_upstream_main_conf_t     main_type;
+    typedef ngx_stream_upstream_init_peer_pt    init_peer_type;
+
+    static main_type * main_conf(ngx_cycle_t *cycle)
+    {
+        return (main_type *) ngx_stream_cycle_get_module_main_conf(cycle,
+            ngx_stream_upstream_module);
+    }
+
+    static ngx_dynamic_upstream_srv_conf_t *
+    srv_conf(ngx_stream_upstream_srv_conf_t *us)
+    {
+        return (ngx_dynamic_upstream_srv_conf_t *)
+            ngx_stream_conf_upstream_srv_conf(us,
+                ngx_stream_dynamic_upstream_module);
+    }
+
+    static ngx_peer_connection_t * pc(session_type *s)
+    {
+        return &s->upstream->peer;
+    }
+
+    static ngx_pool_t * pool(session_type *s)
+    {
+        return s->connection->pool;
+    }
+
+    static ngx_uint_t status(session_type *s)
+    {
+        return 0;
+    }
+
+    static ngx_int_t value(session_type *s, void *cv, ngx_str_t *val)
+    {
+        return ngx_stream_complex_value(s, (value_type *) cv, val);
+    }
+
+    static ngx_int_t init_rr(ngx_conf_t *cf,
+        ngx_stream_upstream_srv_conf_t *us)
+    {
+        return ngx_stream_upstream_init_round_robin(cf, us);
+    }
+
+    static ngx_int_t init_rr_peer(session_type *s,
+        ngx_stream_upstream_srv_conf_t *us)
+    {
+        return ngx_stream_upstream_init_round_robin_peer(s, us);
+    }
+
+    static ngx_int_t get_rr_peer(ngx_peer_connection_t *pc, void *data)
+    {
+        return ngx_stream_upstream_get_round_robin_peer(pc, data);
+    }
+
+    static void free_rr_peer(ngx_peer_connection_t *pc, void *data,
+        ngx_uint_t state)
+    {
+        ngx_stream_upstream_free_round_robin_peer(pc, data, state);
+    }
+};
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_BALANCER_H */
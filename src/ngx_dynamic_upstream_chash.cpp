@@ -0,0 +1,672 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+extern "C" {
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_stream.h>
+
+}
+
+#include "ngx_dynamic_upstream_module.h"
+#include "ngx_dynamic_upstream_op.h"
+#include "ngx_dynamic_upstream_chash.h"
+#include "ngx_dynamic_upstream_balancer.h"
+
+
+extern ngx_int_t is_reserved_addr(ngx_str_t *addr);
+
+
+static int
+ngx_dynamic_upstream_chash_cmp(const void *one, const void *two)
+{
+    const ngx_dynamic_upstream_chash_point_t  *l, *r;
+
+    l = (const ngx_dynamic_upstream_chash_point_t *) one;
+    r = (const ngx_dynamic_upstream_chash_point_t *) two;
+
+    return l->hash < r->hash ? -1 : (l->hash > r->hash ? 1 : 0);
+}
+
+
+// points of the peer as ngx_http_upstream_update_chash() makes them
+// for a server: crc32 of host, '\0' and port, then crc32 chained
+// over the previous point
+
+static void
+ngx_dynamic_upstream_chash_make(ngx_dynamic_upstream_chash_point_t *point,
+    ngx_uint_t n, void *peer, ngx_str_t *name)
+{
+    u_char      *host, *port, c;
+    size_t       host_len, port_len;
+    uint32_t     base_hash, hash, prev_hash;
+    u_char       prev[4];
+    ngx_uint_t   j;
+
+    if (name->len >= 5
+        && ngx_strncasecmp(name->data, (u_char *) "unix:", 5) == 0) {
+
+        host = name->data + 5;
+        host_len = name->len - 5;
+        port = NULL;
+        port_len = 0;
+
+        goto done;
+    }
+
+    for (j = 0; j < name->len; j++) {
+
+        c = name->data[name->len - j - 1];
+
+        if (c == ':') {
+
+            host = name->data;
+            host_len = name->len - j - 1;
+            port = name->data + name->len - j;
+            port_len = j;
+
+            goto done;
+        }
+
+        if (c < '0' || c > '9')
+            break;
+    }
+
+    host = name->data;
+    host_len = name->len;
+    port = NULL;
+    port_len = 0;
+
+done:
+
+    ngx_crc32_init(base_hash);
+    ngx_crc32_update(&base_hash, host, host_len);
+    ngx_crc32_update(&base_hash, (u_char *) "", 1);
+    ngx_crc32_update(&base_hash, port, port_len);
+
+    prev_hash = 0;
+
+    for (j = 0; j < n; j++) {
+
+        // little endian bytes of the previous hash on any platform
+
+        prev[0] = (u_char) (prev_hash & 0xff);
+        prev[1] = (u_char) ((prev_hash >> 8) & 0xff);
+        prev[2] = (u_char) ((prev_hash >> 16) & 0xff);
+        prev[3] = (u_char) ((prev_hash >> 24) & 0xff);
+
+        hash = base_hash;
+
+        ngx_crc32_update(&hash, prev, 4);
+        ngx_crc32_final(hash);
+
+        point[j].hash = hash;
+        point[j].peer = peer;
+
+        prev_hash = hash;
+    }
+}
+
+
+// sorted points of the peer in the heap, the ring may be changed
+// by the background pass
+
+static ngx_dynamic_upstream_chash_point_t *
+ngx_dynamic_upstream_chash_points(void *peer, ngx_str_t *name,
+    ngx_int_t weight, ngx_uint_t *n)
+{
+    ngx_dynamic_upstream_chash_point_t  *point;
+
+    *n = weight > 0 ? weight * NGX_DYNAMIC_UPSTREAM_CHASH_POINTS : 0;
+    if (*n == 0)
+        return NULL;
+
+    point = (ngx_dynamic_upstream_chash_point_t *) ngx_alloc(
+        *n * sizeof(ngx_dynamic_upstream_chash_point_t), ngx_cycle->log);
+    if (point == NULL)
+        return NULL;
+
+    ngx_dynamic_upstream_chash_make(point, *n, peer, name);
+
+    ngx_qsort(point, *n, sizeof(ngx_dynamic_upstream_chash_point_t),
+              ngx_dynamic_upstream_chash_cmp);
+
+    return point;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_chash_reserve(ngx_dynamic_upstream_chash_t *ring,
+    ngx_uint_t n)
+{
+    ngx_dynamic_upstream_chash_point_t  *point;
+    ngx_uint_t                           size;
+
+    if (n <= ring->size)
+        return NGX_OK;
+
+    size = ngx_max(n, ring->size * 2);
+
+    point = (ngx_dynamic_upstream_chash_point_t *) ngx_slab_alloc(
+        ring->shpool, size * sizeof(ngx_dynamic_upstream_chash_point_t));
+    if (point == NULL)
+        return NGX_ERROR;
+
+    if (ring->point != NULL) {
+
+        ngx_memcpy(point, ring->point,
+                   ring->number * sizeof(ngx_dynamic_upstream_chash_point_t));
+        ngx_slab_free(ring->shpool, ring->point);
+    }
+
+    ring->point = point;
+    ring->size = size;
+
+    return NGX_OK;
+}
+
+
+// merges sorted points into the ring from the tail, the ring must have
+// room for them
+
+static void
+ngx_dynamic_upstream_chash_merge(ngx_dynamic_upstream_chash_t *ring,
+    ngx_dynamic_upstream_chash_point_t *point, ngx_uint_t n)
+{
+    ngx_int_t  i, j, k;
+
+    i = (ngx_int_t) ring->number - 1;
+    j = (ngx_int_t) n - 1;
+    k = (ngx_int_t) (ring->number + n) - 1;
+
+    while (j >= 0) {
+
+        if (i >= 0 && ring->point[i].hash > point[j].hash)
+            ring->point[k--] = ring->point[i--];
+        else
+            ring->point[k--] = point[j--];
+    }
+
+    ring->number += n;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_chash_add(ngx_dynamic_upstream_chash_t *ring,
+    void *peers, void *peer, ngx_str_t *name, ngx_int_t weight)
+{
+    ngx_dynamic_upstream_chash_point_t  *point;
+    ngx_uint_t                           n;
+
+    if (ring == NULL || ring->peers != peers || is_reserved_addr(name))
+        return NGX_OK;
+
+    point = ngx_dynamic_upstream_chash_points(peer, name, weight, &n);
+    if (n == 0)
+        return NGX_OK;
+
+    if (point == NULL)
+        return NGX_ERROR;
+
+    if (ngx_dynamic_upstream_chash_reserve(ring, ring->number + n)
+            != NGX_OK) {
+
+        ngx_free(point);
+        return NGX_ERROR;
+    }
+
+    ngx_dynamic_upstream_chash_merge(ring, point, n);
+
+    ngx_free(point);
+
+    return NGX_OK;
+}
+
+
+void
+ngx_dynamic_upstream_chash_del(ngx_dynamic_upstream_chash_t *ring,
+    void *peers, void *peer)
+{
+    ngx_uint_t  i, j;
+
+    if (ring == NULL || ring->peers != peers)
+        return;
+
+    for (i = 0, j = 0; i < ring->number; i++)
+        if (ring->point[i].peer != peer)
+            ring->point[j++] = ring->point[i];
+
+    ring->number = j;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_chash_weight(ngx_dynamic_upstream_chash_t *ring,
+    void *peers, void *peer, ngx_str_t *name, ngx_int_t old_weight,
+    ngx_int_t weight)
+{
+    ngx_dynamic_upstream_chash_point_t  *point;
+    ngx_uint_t                           n;
+
+    if (ring == NULL || ring->peers != peers || is_reserved_addr(name)
+        || old_weight == weight)
+        return NGX_OK;
+
+    point = ngx_dynamic_upstream_chash_points(peer, name, weight, &n);
+    if (point == NULL && n != 0)
+        return NGX_ERROR;
+
+    if (ngx_dynamic_upstream_chash_reserve(ring, ring->number + n)
+            != NGX_OK) {
+
+        ngx_free(point);
+        return NGX_ERROR;
+    }
+
+    ngx_dynamic_upstream_chash_del(ring, peers, peer);
+
+    if (point != NULL) {
+
+        ngx_dynamic_upstream_chash_merge(ring, point, n);
+        ngx_free(point);
+    }
+
+    return NGX_OK;
+}
+
+
+// first point with hash >= the key hash, number if the key is past
+// the last point
+
+static ngx_uint_t
+ngx_dynamic_upstream_chash_find(ngx_dynamic_upstream_chash_t *ring,
+    uint32_t hash)
+{
+    ngx_uint_t  i = 0, j = ring->number, k;
+
+    while (i < j) {
+
+        k = (i + j) / 2;
+
+        if (hash > ring->point[k].hash)
+            i = k + 1;
+        else
+            j = k;
+    }
+
+    return i;
+}
+
+
+// rrp goes first, the round robin free function gets it as the data
+
+template <class S> struct ngx_dynamic_upstream_chash_data_t {
+    typename BalancerSelect<S>::rr_data_type  rrp;
+    ngx_dynamic_upstream_chash_t             *ring;
+    uint32_t                                  hash;
+    ngx_uint_t                                index;
+    ngx_uint_t                                tries;
+    void                                     *tried[
+                                             NGX_DYNAMIC_UPSTREAM_CHASH_TRIES];
+};
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_chash_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    typedef typename TypeSelect<S>::peers_type  peers_type;
+    typedef typename TypeSelect<S>::peer_type   peer_type;
+
+    ngx_dynamic_upstream_chash_data_t<S> *hp =
+        (ngx_dynamic_upstream_chash_data_t<S> *) data;
+
+    ngx_dynamic_upstream_chash_t  *ring = hp->ring;
+    peer_type                     *peer;
+    ngx_uint_t                     i;
+    time_t                         now;
+
+    pc->connection = NULL;
+
+    {
+        // the ring is changed under the wlock, the state of the peer
+        // is changed under its own lock as by the stock hash
+
+        ngx_upstream_rr_peers_rlock<peers_type> rl(hp->rrp.peers);
+
+        // the ring may change between retries, the key is searched again
+
+        if (ring->number != 0)
+            hp->index = ngx_dynamic_upstream_chash_find(ring, hp->hash)
+                + hp->tries;
+
+        now = ngx_time();
+
+        while (hp->tries < NGX_DYNAMIC_UPSTREAM_CHASH_TRIES
+               && hp->tries < ring->number) {
+
+            peer = (peer_type *) ring->point[hp->index++ % ring->number].peer;
+
+            for (i = 0; i < hp->tries; i++)
+                if (hp->tried[i] == peer)
+                    break;
+
+            hp->tried[hp->tries++] = peer;
+
+            if (i != hp->tries - 1)
+                continue;
+
+            ngx_upstream_rr_peer_lock<peer_type> pl(peer);
+
+            if (peer->down)
+                continue;
+
+            if (peer->max_fails
+                && peer->fails >= peer->max_fails
+                && now - peer->checked <= peer->fail_timeout)
+                continue;
+
+#if defined(nginx_version) && (nginx_version >= 1011005)
+            if (peer->max_conns && peer->conns >= peer->max_conns)
+                continue;
+#endif
+
+            hp->rrp.current = peer;
+
+            pc->sockaddr = peer->sockaddr;
+            pc->socklen = peer->socklen;
+            pc->name = &peer->name;
+
+            peer->conns++;
+
+            if (now - peer->checked > peer->fail_timeout)
+                peer->checked = now;
+
+            return NGX_OK;
+        }
+    }
+
+    // no live peer near the key
+
+    return BalancerSelect<S>::get_rr_peer(pc, &hp->rrp);
+}
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_chash_init_peer(
+    typename BalancerSelect<S>::session_type *r, S *us)
+{
+    ngx_dynamic_upstream_srv_conf_t       *dscf;
+    ngx_dynamic_upstream_chash_data_t<S>  *hp;
+    ngx_str_t                              key;
+    ngx_peer_connection_t                 *pc;
+
+    dscf = BalancerSelect<S>::srv_conf(us);
+
+    hp = (ngx_dynamic_upstream_chash_data_t<S> *) ngx_pcalloc(
+        BalancerSelect<S>::pool(r),
+        sizeof(ngx_dynamic_upstream_chash_data_t<S>));
+    if (hp == NULL)
+        return NGX_ERROR;
+
+    pc = BalancerSelect<S>::pc(r);
+
+    pc->data = &hp->rrp;
+
+    if (BalancerSelect<S>::init_rr_peer(r, us) != NGX_OK)
+        return NGX_ERROR;
+
+    if (BalancerSelect<S>::value(r, dscf->chash_key, &key) != NGX_OK)
+        return NGX_ERROR;
+
+    hp->ring = dscf->chash;
+    hp->hash = ngx_crc32_long(key.data, key.len);
+
+    pc->get = ngx_dynamic_upstream_chash_get_peer<S>;
+
+    return NGX_OK;
+}
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_chash_init_upstream(ngx_conf_t *cf, S *us)
+{
+    if (BalancerSelect<S>::init_rr(cf, us) != NGX_OK)
+        return NGX_ERROR;
+
+    us->peer.init = ngx_dynamic_upstream_chash_init_peer<S>;
+
+    return NGX_OK;
+}
+
+
+char *
+ngx_http_dynamic_upstream_chash(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_dynamic_upstream_srv_conf_t   *dscf;
+    ngx_http_upstream_srv_conf_t      *uscf;
+    ngx_http_compile_complex_value_t   ccv;
+    ngx_http_complex_value_t          *cv;
+    ngx_str_t                         *value;
+
+    dscf = (ngx_dynamic_upstream_srv_conf_t *) conf;
+
+    if (dscf->chash_key != NULL)
+        return (char *) "is duplicate";
+
+    value = (ngx_str_t *) cf->args->elts;
+
+    cv = (ngx_http_complex_value_t *) ngx_pcalloc(cf->pool,
+        sizeof(ngx_http_complex_value_t));
+    if (cv == NULL)
+        return (char *) NGX_CONF_ERROR;
+
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = cv;
+
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK)
+        return (char *) NGX_CONF_ERROR;
+
+    dscf->chash_key = cv;
+    dscf->p2c_decay = NGX_CONF_UNSET_MSEC;
+
+    uscf = (ngx_http_upstream_srv_conf_t *)
+        ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream)
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+#if defined(nginx_version) && (nginx_version >= 1011005)
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS
+#endif
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN;
+
+    uscf->peer.init_upstream =
+        ngx_dynamic_upstream_chash_init_upstream<ngx_http_upstream_srv_conf_t>;
+
+    return NGX_CONF_OK;
+}
+
+
+char *
+ngx_stream_dynamic_upstream_chash(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_dynamic_upstream_srv_conf_t     *dscf;
+    ngx_stream_upstream_srv_conf_t      *uscf;
+    ngx_stream_compile_complex_value_t   ccv;
+    ngx_stream_complex_value_t          *cv;
+    ngx_str_t                           *value;
+
+    dscf = (ngx_dynamic_upstream_srv_conf_t *) conf;
+
+    if (dscf->chash_key != NULL)
+        return (char *) "is duplicate";
+
+    value = (ngx_str_t *) cf->args->elts;
+
+    cv = (ngx_stream_complex_value_t *) ngx_pcalloc(cf->pool,
+        sizeof(ngx_stream_complex_value_t));
+    if (cv == NULL)
+        return (char *) NGX_CONF_ERROR;
+
+    ngx_memzero(&ccv, sizeof(ngx_stream_compile_complex_value_t));
+
+    ccv.cf = cf;
+    ccv.value = &value[1];
+    ccv.complex_value = cv;
+
+    if (ngx_stream_compile_complex_value(&ccv) != NGX_OK)
+        return (char *) NGX_CONF_ERROR;
+
+    dscf->chash_key = cv;
+    dscf->p2c_decay = NGX_CONF_UNSET_MSEC;
+
+    uscf = (ngx_stream_upstream_srv_conf_t *)
+        ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_upstream_module);
+
+    if (uscf->peer.init_upstream)
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+
+    uscf->flags = NGX_STREAM_UPSTREAM_CREATE
+                  |NGX_STREAM_UPSTREAM_WEIGHT
+#if defined(nginx_version) && (nginx_version >= 1011005)
+                  |NGX_STREAM_UPSTREAM_MAX_CONNS
+#endif
+                  |NGX_STREAM_UPSTREAM_MAX_FAILS
+                  |NGX_STREAM_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_STREAM_UPSTREAM_DOWN;
+
+    uscf->peer.init_upstream =
+        ngx_dynamic_upstream_chash_init_upstream
+            <ngx_stream_upstream_srv_conf_t>;
+
+    return NGX_CONF_OK;
+}
+
+
+// the ring of the initial peers is sorted once
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_chash_create(S *uscf, ngx_log_t *log)
+{
+    typename TypeSelect<S>::peers_type  *peers;
+    typename TypeSelect<S>::peer_type   *peer;
+
+    ngx_dynamic_upstream_srv_conf_t  *dscf;
+    ngx_dynamic_upstream_chash_t     *ring;
+    ngx_slab_pool_t                  *shpool;
+    ngx_uint_t                        n = 0;
+
+    dscf = BalancerSelect<S>::srv_conf(uscf);
+
+    if (uscf->shm_zone == NULL) {
+
+        ngx_log_error(NGX_LOG_EMERG, log, 0,
+                      "upstream \"%V\": 'dynamic_hash' requires 'zone'",
+                      &uscf->host);
+        return NGX_ERROR;
+    }
+
+    shpool = (ngx_slab_pool_t *) uscf->shm_zone->shm.addr;
+    peers = (typename TypeSelect<S>::peers_type *) uscf->peer.data;
+
+    ring = (ngx_dynamic_upstream_chash_t *) ngx_slab_calloc(shpool,
+        sizeof(ngx_dynamic_upstream_chash_t));
+    if (ring == NULL)
+        goto nomem;
+
+    ring->shpool = shpool;
+    ring->peers = peers;
+
+    for (peer = peers->peer; peer != NULL; peer = peer->next)
+        if (!is_reserved_addr(&peer->name) && peer->weight > 0)
+            n += peer->weight * NGX_DYNAMIC_UPSTREAM_CHASH_POINTS;
+
+    if (ngx_dynamic_upstream_chash_reserve(ring, n) != NGX_OK)
+        goto nomem;
+
+    for (peer = peers->peer; peer != NULL; peer = peer->next) {
+
+        if (is_reserved_addr(&peer->name) || peer->weight <= 0)
+            continue;
+
+        n = peer->weight * NGX_DYNAMIC_UPSTREAM_CHASH_POINTS;
+
+        ngx_dynamic_upstream_chash_make(ring->point + ring->number, n, peer,
+                                        &peer->name);
+        ring->number += n;
+    }
+
+    ngx_qsort(ring->point, ring->number,
+              sizeof(ngx_dynamic_upstream_chash_point_t),
+              ngx_dynamic_upstream_chash_cmp);
+
+    dscf->chash = ring;
+
+    return NGX_OK;
+
+nomem:
+
+    ngx_log_error(NGX_LOG_EMERG, log, 0,
+                  "upstream \"%V\": no memory in zone for hash ring",
+                  &uscf->host);
+
+    return NGX_ERROR;
+}
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_chash_init_all(ngx_cycle_t *cycle)
+{
+    typename BalancerSelect<S>::main_type  *umcf;
+
+    S                                **uscf;
+    ngx_dynamic_upstream_srv_conf_t   *dscf;
+    ngx_uint_t                         j;
+
+    umcf = BalancerSelect<S>::main_conf(cycle);
+    if (umcf == NULL)
+        return NGX_OK;
+
+    uscf = (S **) umcf->upstreams.elts;
+
+    for (j = 0; j < umcf->upstreams.nelts; j++) {
+
+        if (uscf[j]->srv_conf == NULL)
+            continue;
+
+        dscf = BalancerSelect<S>::srv_conf(uscf[j]);
+        if (dscf == NULL || dscf->chash_key == NULL)
+            continue;
+
+        if (ngx_dynamic_upstream_chash_create(uscf[j], cycle->log) != NGX_OK)
+            return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_chash_init(ngx_cycle_t *cycle)
+{
+    if (ngx_dynamic_upstream_chash_init_all<ngx_http_upstream_srv_conf_t>
+            (cycle) != NGX_OK)
+        return NGX_ERROR;
+
+    return ngx_dynamic_upstream_chash_init_all<ngx_stream_upstream_srv_conf_t>
+        (cycle);
+}
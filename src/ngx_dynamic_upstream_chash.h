@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#ifndef NGX_DYNAMIC_UPSTREAM_CHASH_H
+#define NGX_DYNAMIC_UPSTREAM_CHASH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#ifdef __cplusplus
+}
+#endif
+
+
+// ketama ring of 'dynamic_hash' upstreams, kept in the upstream zone
+// and changed under the peers write lock together with the peers.
+// Points are built from the peer address as 'hash ... consistent' does
+// for servers with ip addresses, so both map keys the same way.
+
+#define NGX_DYNAMIC_UPSTREAM_CHASH_POINTS  160
+#define NGX_DYNAMIC_UPSTREAM_CHASH_TRIES   20
+
+
+typedef struct {
+    uint32_t   hash;
+    void      *peer;
+} ngx_dynamic_upstream_chash_point_t;
+
+
+typedef struct ngx_dynamic_upstream_chash_s {
+    ngx_slab_pool_t                     *shpool;
+    void                                *peers;
+    ngx_uint_t                           number;
+    ngx_uint_t                           size;
+    ngx_dynamic_upstream_chash_point_t  *point;
+} ngx_dynamic_upstream_chash_t;
+
+
+// all functions do nothing for a NULL ring or for peers other than
+// the primary peers of the ring
+
+ngx_int_t
+ngx_dynamic_upstream_chash_add(ngx_dynamic_upstream_chash_t *ring,
+    void *peers, void *peer, ngx_str_t *name, ngx_int_t weight);
+
+
+void
+ngx_dynamic_upstream_chash_del(ngx_dynamic_upstream_chash_t *ring,
+    void *peers, void *peer);
+
+
+// on failure the ring keeps the points of the old weight
+
+ngx_int_t
+ngx_dynamic_upstream_chash_weight(ngx_dynamic_upstream_chash_t *ring,
+    void *peers, void *peer, ngx_str_t *name, ngx_int_t old_weight,
+    ngx_int_t weight);
+
+
+char *
+ngx_http_dynamic_upstream_chash(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+char *
+ngx_stream_dynamic_upstream_chash(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+// builds the rings in the zones, after the zones are initialized
+
+ngx_int_t
+ngx_dynamic_upstream_chash_init(ngx_cycle_t *cycle);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_CHASH_H */
@@ -0,0 +1,423 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+extern "C" {
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#include <poll.h>
+
+}
+
+#include "ngx_dynamic_upstream_module.h"
+#include "ngx_dynamic_upstream_metrics.h"
+#include "ngx_dynamic_upstream_check.h"
+
+
+#define NGX_DYNAMIC_UPSTREAM_PROBE_CONNECT  0
+#define NGX_DYNAMIC_UPSTREAM_PROBE_SEND     1
+#define NGX_DYNAMIC_UPSTREAM_PROBE_RECV     2
+#define NGX_DYNAMIC_UPSTREAM_PROBE_DONE     3
+
+
+// dynamic_check [interval=time] [timeout=time] [rise=n] [fall=n] [uri=uri]
+
+char *
+ngx_dynamic_upstream_check_conf(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_dynamic_upstream_srv_conf_t  *dscf;
+    ngx_dynamic_upstream_check_t     *check;
+    ngx_str_t                        *value, s;
+    ngx_uint_t                        j;
+    ngx_int_t                         n;
+
+    dscf = (ngx_dynamic_upstream_srv_conf_t *) conf;
+
+    if (dscf->check != NULL)
+        return (char *) "is duplicate";
+
+    check = (ngx_dynamic_upstream_check_t *) ngx_pcalloc(cf->pool,
+        sizeof(ngx_dynamic_upstream_check_t));
+    if (check == NULL)
+        return (char *) NGX_CONF_ERROR;
+
+    check->interval = 5;
+    check->timeout = 1000;
+    check->rise = 2;
+    check->fall = 3;
+
+    value = (ngx_str_t *) cf->args->elts;
+
+    for (j = 1; j < cf->args->nelts; j++) {
+
+        if (ngx_strncmp(value[j].data, "interval=", 9) == 0) {
+
+            s.data = value[j].data + 9;
+            s.len = value[j].len - 9;
+
+            n = ngx_parse_time(&s, 1);
+            if (n == NGX_ERROR || n == 0)
+                goto invalid;
+
+            check->interval = (time_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[j].data, "timeout=", 8) == 0) {
+
+            s.data = value[j].data + 8;
+            s.len = value[j].len - 8;
+
+            n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR || n == 0)
+                goto invalid;
+
+            check->timeout = (ngx_msec_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[j].data, "rise=", 5) == 0) {
+
+            n = ngx_atoi(value[j].data + 5, value[j].len - 5);
+            if (n == NGX_ERROR || n == 0)
+                goto invalid;
+
+            check->rise = (ngx_uint_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[j].data, "fall=", 5) == 0) {
+
+            n = ngx_atoi(value[j].data + 5, value[j].len - 5);
+            if (n == NGX_ERROR || n == 0)
+                goto invalid;
+
+            check->fall = (ngx_uint_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[j].data, "uri=", 4) == 0) {
+
+            check->uri.data = value[j].data + 4;
+            check->uri.len = value[j].len - 4;
+
+            if (check->uri.len == 0 || check->uri.data[0] != '/')
+                goto invalid;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    // a probe must not hold the batch of jobs longer than a round
+
+    if (check->timeout >= (ngx_msec_t) check->interval * 1000) {
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "timeout must be less than interval");
+        return (char *) NGX_CONF_ERROR;
+    }
+
+    dscf->check = check;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[j]);
+
+    return (char *) NGX_CONF_ERROR;
+}
+
+
+int
+ngx_dynamic_upstream_check_cmp(const void *one, const void *two)
+{
+    const ngx_dynamic_upstream_check_peer_t  *l, *r;
+
+    l = (const ngx_dynamic_upstream_check_peer_t *) one;
+    r = (const ngx_dynamic_upstream_check_peer_t *) two;
+
+    return l->peer < r->peer ? -1 : (l->peer > r->peer ? 1 : 0);
+}
+
+
+ngx_dynamic_upstream_check_peer_t *
+ngx_dynamic_upstream_check_find(ngx_dynamic_upstream_check_t *check,
+    void *peer, ngx_str_t *name)
+{
+    ngx_dynamic_upstream_check_peer_t  key, *c;
+
+    if (check->peers == NULL)
+        return NULL;
+
+    key.peer = peer;
+
+    c = (ngx_dynamic_upstream_check_peer_t *) bsearch(&key,
+        check->peers->elts, check->peers->nelts,
+        sizeof(ngx_dynamic_upstream_check_peer_t),
+        ngx_dynamic_upstream_check_cmp);
+
+    // the memory of a removed peer may be reused by a new one
+
+    if (c == NULL || c->crc != ngx_crc32_short(name->data, name->len))
+        return NULL;
+
+    return c;
+}
+
+
+static void
+ngx_dynamic_upstream_probe_done(ngx_dynamic_upstream_probe_t *probe,
+    const char *err)
+{
+    if (probe->fd != (ngx_socket_t) -1) {
+
+        ngx_close_socket(probe->fd);
+        probe->fd = (ngx_socket_t) -1;
+    }
+
+    probe->err = err;
+    probe->state = NGX_DYNAMIC_UPSTREAM_PROBE_DONE;
+}
+
+
+static void
+ngx_dynamic_upstream_probe_connect(ngx_dynamic_upstream_probe_t *probe)
+{
+    probe->fd = ngx_socket(probe->sockaddr->sa_family, SOCK_STREAM, 0);
+    if (probe->fd == (ngx_socket_t) -1) {
+
+        ngx_dynamic_upstream_probe_done(probe, ngx_socket_n " failed");
+        return;
+    }
+
+    if (ngx_nonblocking(probe->fd) == -1) {
+
+        ngx_dynamic_upstream_probe_done(probe, ngx_nonblocking_n " failed");
+        return;
+    }
+
+    if (connect(probe->fd, probe->sockaddr, probe->socklen) == -1
+        && ngx_socket_errno != NGX_EINPROGRESS) {
+
+        ngx_dynamic_upstream_probe_done(probe, "connect() failed");
+        return;
+    }
+
+    probe->state = NGX_DYNAMIC_UPSTREAM_PROBE_CONNECT;
+}
+
+
+static void
+ngx_dynamic_upstream_probe_connected(ngx_dynamic_upstream_probe_t *probe)
+{
+    int        err = 0;
+    socklen_t  len = sizeof(int);
+
+    if (getsockopt(probe->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1 || err != 0) {
+
+        ngx_dynamic_upstream_probe_done(probe, "connect() failed");
+        return;
+    }
+
+    if (probe->request.len == 0) {
+
+        // tcp check
+
+        ngx_dynamic_upstream_probe_done(probe, NULL);
+        return;
+    }
+
+    probe->state = NGX_DYNAMIC_UPSTREAM_PROBE_SEND;
+}
+
+
+static void
+ngx_dynamic_upstream_probe_send(ngx_dynamic_upstream_probe_t *probe)
+{
+    ssize_t  n;
+
+    n = send(probe->fd, probe->request.data + probe->sent,
+             probe->request.len - probe->sent, 0);
+
+    if (n == -1) {
+
+        if (ngx_socket_errno != NGX_EAGAIN && ngx_socket_errno != NGX_EINTR)
+            ngx_dynamic_upstream_probe_done(probe, "send() failed");
+
+        return;
+    }
+
+    probe->sent += n;
+
+    if (probe->sent == probe->request.len)
+        probe->state = NGX_DYNAMIC_UPSTREAM_PROBE_RECV;
+}
+
+
+// "HTTP/1.x 2xx" or "HTTP/1.x 3xx" is alive
+
+static void
+ngx_dynamic_upstream_probe_recv(ngx_dynamic_upstream_probe_t *probe)
+{
+    ssize_t  n;
+    u_char  *status;
+
+    n = recv(probe->fd, probe->status + probe->received,
+             sizeof("HTTP/1.x NNN") - 1 - probe->received, 0);
+
+    if (n == -1) {
+
+        if (ngx_socket_errno != NGX_EAGAIN && ngx_socket_errno != NGX_EINTR)
+            ngx_dynamic_upstream_probe_done(probe, "recv() failed");
+
+        return;
+    }
+
+    if (n == 0) {
+
+        ngx_dynamic_upstream_probe_done(probe, "connection closed");
+        return;
+    }
+
+    probe->received += n;
+
+    if (probe->received < sizeof("HTTP/1.x NNN") - 1)
+        return;
+
+    status = probe->status + sizeof("HTTP/1.x ") - 1;
+
+    if (ngx_strncmp(probe->status, "HTTP/1.", 7) != 0
+        || (status[0] != '2' && status[0] != '3'))
+        ngx_dynamic_upstream_probe_done(probe, "bad response status");
+    else
+        ngx_dynamic_upstream_probe_done(probe, NULL);
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_probe_request(ngx_dynamic_upstream_check_t *check,
+    ngx_dynamic_upstream_probe_t *probe, ngx_pool_t *pool)
+{
+    static const char  fmt[] = "GET %V HTTP/1.0" CRLF
+                               "Host: %V" CRLF
+                               "User-Agent: nginx dynamic upstream check" CRLF
+                               "Connection: close" CRLF CRLF;
+
+    if (check->uri.len == 0)
+        return NGX_OK;
+
+    probe->request.data = (u_char *) ngx_pnalloc(pool,
+        sizeof(fmt) + check->uri.len + probe->server.len);
+    if (probe->request.data == NULL)
+        return NGX_ERROR;
+
+    probe->request.len = ngx_sprintf(probe->request.data, fmt, &check->uri,
+                                     &probe->server) - probe->request.data;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_check_probe(ngx_dynamic_upstream_check_t *check,
+    ngx_dynamic_upstream_probe_t *probe, ngx_uint_t n, ngx_pool_t *pool,
+    ngx_log_t *log)
+{
+    struct pollfd   *pfd;
+    ngx_uint_t       j, k;
+    ngx_msec_int_t   left;
+    struct timeval   start;
+    int              rc;
+
+    pfd = (struct pollfd *) ngx_palloc(pool, n * sizeof(struct pollfd));
+    if (pfd == NULL)
+        return NGX_ERROR;
+
+    for (j = 0; j < n; j++) {
+
+        probe[j].fd = (ngx_socket_t) -1;
+        probe[j].err = NULL;
+
+        if (ngx_dynamic_upstream_probe_request(check, probe + j, pool)
+                != NGX_OK)
+            return NGX_ERROR;
+
+        ngx_dynamic_upstream_probe_connect(probe + j);
+    }
+
+    ngx_gettimeofday(&start);
+
+    for ( ;; ) {
+
+        for (j = 0, k = 0; j < n; j++) {
+
+            if (probe[j].state == NGX_DYNAMIC_UPSTREAM_PROBE_DONE)
+                continue;
+
+            pfd[k].fd = probe[j].fd;
+            pfd[k].events =
+                probe[j].state == NGX_DYNAMIC_UPSTREAM_PROBE_RECV ? POLLIN
+                                                                  : POLLOUT;
+            pfd[k].revents = 0;
+            k++;
+        }
+
+        if (k == 0)
+            break;
+
+        left = (ngx_msec_int_t) check->timeout
+            - ngx_dynamic_upstream_elapsed(&start) / 1000;
+
+        if (left <= 0)
+            break;
+
+        rc = poll(pfd, k, (int) left);
+
+        if (rc == -1 && ngx_errno != NGX_EINTR) {
+
+            ngx_log_error(NGX_LOG_ERR, log, ngx_errno, "poll() failed");
+            break;
+        }
+
+        if (rc <= 0)
+            continue;
+
+        for (j = 0, k = 0; j < n; j++) {
+
+            if (probe[j].state == NGX_DYNAMIC_UPSTREAM_PROBE_DONE)
+                continue;
+
+            if (pfd[k++].revents == 0)
+                continue;
+
+            switch (probe[j].state) {
+
+                case NGX_DYNAMIC_UPSTREAM_PROBE_CONNECT:
+                    ngx_dynamic_upstream_probe_connected(probe + j);
+                    break;
+
+                case NGX_DYNAMIC_UPSTREAM_PROBE_SEND:
+                    ngx_dynamic_upstream_probe_send(probe + j);
+                    break;
+
+                case NGX_DYNAMIC_UPSTREAM_PROBE_RECV:
+                    ngx_dynamic_upstream_probe_recv(probe + j);
+                    break;
+            }
+        }
+    }
+
+    for (j = 0; j < n; j++)
+        if (probe[j].state != NGX_DYNAMIC_UPSTREAM_PROBE_DONE)
+            ngx_dynamic_upstream_probe_done(probe + j, "timed out");
+
+    return NGX_OK;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#ifndef NGX_DYNAMIC_UPSTREAM_CHECK_H
+#define NGX_DYNAMIC_UPSTREAM_CHECK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#ifdef __cplusplus
+}
+#endif
+
+
+// active health checks of 'dynamic_check' upstreams, probes are run
+// by the thread pool. Every peer is probed by one worker only, state
+// changes are applied by the op engine as ?up= and ?down= do.
+
+typedef struct {
+    void        *peer;
+    uint32_t     crc;
+    ngx_uint_t   rise;
+    ngx_uint_t   fall;
+    ngx_flag_t   down;     // brought down by the check
+} ngx_dynamic_upstream_check_peer_t;
+
+
+typedef struct ngx_dynamic_upstream_check_s {
+    time_t        interval;
+    ngx_msec_t    timeout;
+    ngx_uint_t    rise;
+    ngx_uint_t    fall;
+    ngx_str_t     uri;
+
+    time_t        last;
+    ngx_pool_t   *pool;
+    ngx_array_t  *peers;   // sorted by the peer pointer
+} ngx_dynamic_upstream_check_t;
+
+
+typedef struct {
+    struct sockaddr  *sockaddr;
+    socklen_t         socklen;
+    ngx_str_t         server;
+    ngx_str_t         name;
+
+    const char       *err;   // NULL if the peer is alive
+
+    ngx_socket_t      fd;
+    ngx_uint_t        state;
+    ngx_str_t         request;
+    size_t            sent;
+    u_char            status[16];
+    size_t            received;
+
+    ngx_dynamic_upstream_check_peer_t  *check;
+} ngx_dynamic_upstream_probe_t;
+
+
+char *
+ngx_dynamic_upstream_check_conf(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+ngx_dynamic_upstream_check_peer_t *
+ngx_dynamic_upstream_check_find(ngx_dynamic_upstream_check_t *check,
+    void *peer, ngx_str_t *name);
+
+
+int
+ngx_dynamic_upstream_check_cmp(const void *one, const void *two);
+
+
+// probes all peers at once, returns after all probes are completed
+// or after the timeout
+
+ngx_int_t
+ngx_dynamic_upstream_check_probe(ngx_dynamic_upstream_check_t *check,
+    ngx_dynamic_upstream_probe_t *probe, ngx_uint_t n, ngx_pool_t *pool,
+    ngx_log_t *log);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_CHECK_H */
@@ -0,0 +1,570 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+extern "C" {
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_stream.h>
+
+}
+
+#include "ngx_dynamic_upstream_module.h"
+#include "ngx_dynamic_upstream_op.h"
+#include "ngx_dynamic_upstream_control.h"
+#include "ngx_dynamic_upstream_balancer.h"
+
+
+// an idle session is closed after, ms
+
+#define NGX_DYNAMIC_UPSTREAM_CONTROL_TIMEOUT  60000
+
+// max size of a reply, the error text is cut
+
+#define NGX_DYNAMIC_UPSTREAM_CONTROL_ERR_MAX  255
+#define NGX_DYNAMIC_UPSTREAM_CONTROL_REPLY_MAX                              \
+    (sizeof(ngx_dynamic_upstream_control_reply_t)                           \
+     + NGX_DYNAMIC_UPSTREAM_CONTROL_ERR_MAX)
+
+
+typedef struct {
+    ngx_buf_t   *in;
+    ngx_buf_t   *out;
+    ngx_msec_t   timeout;
+} ngx_dynamic_upstream_control_ctx_t;
+
+
+static ngx_int_t
+ngx_dynamic_upstream_control_do(ngx_log_t *log, ngx_dynamic_upstream_op_t *op,
+    ngx_http_upstream_srv_conf_t *uscf)
+{
+    return ngx_dynamic_upstream_op(log, op, uscf);
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_control_do(ngx_log_t *log, ngx_dynamic_upstream_op_t *op,
+    ngx_stream_upstream_srv_conf_t *uscf)
+{
+    return ngx_dynamic_upstream_stream_op(log, op, uscf);
+}
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_control_op(ngx_log_t *log, ngx_dynamic_upstream_op_t *op)
+{
+    typename TypeSelect<S>::main_type  *umcf;
+
+    S                                **uscf;
+    ngx_dynamic_upstream_srv_conf_t   *dscf;
+    ngx_uint_t                         j;
+
+    umcf = TypeSelect<S>::main_conf();
+    if (umcf == NULL)
+        goto not_found;
+
+    uscf = (S **) umcf->upstreams.elts;
+
+    for (j = 0; j < umcf->upstreams.nelts; j++) {
+
+        if (uscf[j]->host.len != op->upstream.len
+            || ngx_strncmp(uscf[j]->host.data, op->upstream.data,
+                           op->upstream.len) != 0)
+            continue;
+
+        if (uscf[j]->srv_conf != NULL) {
+
+            dscf = BalancerSelect<S>::srv_conf(uscf[j]);
+
+            if (dscf->interval != NGX_CONF_UNSET_MSEC)
+                op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_RESOLVE;
+
+            if (dscf->ipv6 == 1)
+                op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_IPV6;
+        }
+
+        return ngx_dynamic_upstream_control_do(log, op, uscf[j]);
+    }
+
+not_found:
+
+    op->status = NGX_HTTP_NOT_FOUND;
+    op->err = "upstream is not found";
+
+    return NGX_ERROR;
+}
+
+
+static ngx_str_t
+ngx_dynamic_upstream_control_str(u_char **p, uint16_t len)
+{
+    ngx_str_t  s;
+
+    s.len = len;
+    s.data = len != 0 ? *p : NULL;
+
+    *p += len;
+
+    return s;
+}
+
+
+// the request as ngx_dynamic_upstream_build_op() makes it of the args
+
+static ngx_int_t
+ngx_dynamic_upstream_control_build_op(ngx_dynamic_upstream_control_req_t *req,
+    u_char *p, ngx_dynamic_upstream_op_t *op)
+{
+    static const ngx_uint_t UPDATE_OP_PARAM = (
+        NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT
+        | NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS
+        | NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT
+        | NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP
+        | NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN
+        | NGX_DYNAMIC_UPSTEAM_OP_PARAM_DRAIN
+#if defined(nginx_version) && (nginx_version >= 1011005)
+        | NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_CONNS
+#endif
+    );
+
+    ngx_memzero(op, sizeof(ngx_dynamic_upstream_op_t));
+
+    op->err = "unexpected";
+    op->status = NGX_HTTP_OK;
+
+    op->upstream = ngx_dynamic_upstream_control_str(&p, req->upstream_len);
+    op->server = ngx_dynamic_upstream_control_str(&p, req->server_len);
+    op->name = ngx_dynamic_upstream_control_str(&p, req->peer_len);
+
+    op->op = req->op;
+    op->op_param = req->op_param;
+    op->backup = (req->flags & NGX_DYNAMIC_UPSTREAM_CONTROL_BACKUP) != 0;
+    op->up = (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP) != 0;
+    op->down = (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN) != 0;
+
+    // values are signed as in the http api, out of range ones are refused
+
+    op->drain = (int32_t) req->drain;
+    op->weight = (int32_t) req->weight;
+    op->max_fails = (int32_t) req->max_fails;
+    op->fail_timeout = (int32_t) req->fail_timeout;
+#if defined(nginx_version) && (nginx_version >= 1011005)
+    op->max_conns = (int32_t) req->max_conns;
+#endif
+
+    op->status = NGX_HTTP_BAD_REQUEST;
+
+    if (req->version != NGX_DYNAMIC_UPSTREAM_CONTROL_VERSION) {
+
+        op->err = "unsupported version";
+        return NGX_ERROR;
+    }
+
+    if (op->op != NGX_DYNAMIC_UPSTEAM_OP_ADD
+        && op->op != NGX_DYNAMIC_UPSTEAM_OP_REMOVE
+        && op->op != NGX_DYNAMIC_UPSTEAM_OP_PARAM) {
+
+        op->err = "only add, remove and update are allowed";
+        return NGX_ERROR;
+    }
+
+    if (op->op_param & ~(UPDATE_OP_PARAM
+                         | NGX_DYNAMIC_UPSTEAM_OP_PARAM_STREAM)) {
+
+        op->err = "unexpected parameters";
+        return NGX_ERROR;
+    }
+
+    if (op->upstream.data == NULL) {
+
+        op->err = "upstream required";
+        return NGX_ERROR;
+    }
+
+    if (op->up && op->down) {
+
+        op->err = "down and up at once are not allowed";
+        return NGX_ERROR;
+    }
+
+    if ((op->up || op->down)
+        && (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DRAIN)) {
+
+        op->err = "drain with up or down is not allowed";
+        return NGX_ERROR;
+    }
+
+    if (ngx_dynamic_upstream_op_check(op) != NGX_OK)
+        return NGX_ERROR;
+
+    op->status = NGX_HTTP_BAD_REQUEST;
+
+    if (op->op == NGX_DYNAMIC_UPSTEAM_OP_PARAM) {
+
+        if (!(op->op_param & UPDATE_OP_PARAM)) {
+
+            op->err = "nothing to update";
+            return NGX_ERROR;
+        }
+
+        op->verbose = 1;
+
+    } else if (op->server.data == NULL) {
+
+        op->err = "'server' argument required";
+        return NGX_ERROR;
+    }
+
+    op->status = NGX_HTTP_OK;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_dynamic_upstream_control_reply(ngx_buf_t *out, uint32_t id,
+    ngx_uint_t status, const char *err)
+{
+    ngx_dynamic_upstream_control_reply_t  reply;
+    size_t                                len;
+
+    len = err != NULL ? ngx_strlen(err) : 0;
+    len = ngx_min(len, NGX_DYNAMIC_UPSTREAM_CONTROL_ERR_MAX);
+
+    reply.len = htonl(sizeof(ngx_dynamic_upstream_control_reply_t)
+                      - sizeof(uint32_t) + len);
+    reply.id = htonl(id);
+    reply.status = htons((uint16_t) status);
+    reply.err_len = htons((uint16_t) len);
+
+    out->last = ngx_cpymem(out->last, &reply,
+                           sizeof(ngx_dynamic_upstream_control_reply_t));
+    if (len != 0)
+        out->last = ngx_cpymem(out->last, err, len);
+}
+
+
+// runs the first request of the buffer, NGX_AGAIN if it is not complete
+
+static ngx_int_t
+ngx_dynamic_upstream_control_request(ngx_connection_t *c, ngx_buf_t *in,
+    ngx_buf_t *out)
+{
+    ngx_dynamic_upstream_control_req_t  req;
+    ngx_dynamic_upstream_op_t           op;
+    uint32_t                            len;
+    ngx_int_t                           rc;
+
+    if ((size_t) (in->last - in->pos) < sizeof(uint32_t))
+        return NGX_AGAIN;
+
+    ngx_memcpy(&len, in->pos, sizeof(uint32_t));
+    len = ntohl(len);
+
+    if (len < sizeof(ngx_dynamic_upstream_control_req_t) - sizeof(uint32_t)
+        || len > NGX_DYNAMIC_UPSTREAM_CONTROL_BUFFER - sizeof(uint32_t)) {
+
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "dynamic upstream control: invalid request length %uD",
+                      len);
+        return NGX_ERROR;
+    }
+
+    if ((size_t) (in->last - in->pos) < len + sizeof(uint32_t))
+        return NGX_AGAIN;
+
+    ngx_memcpy(&req, in->pos, sizeof(ngx_dynamic_upstream_control_req_t));
+
+    req.id = ntohl(req.id);
+    req.flags = ntohs(req.flags);
+    req.op_param = ntohl(req.op_param);
+    req.weight = ntohl(req.weight);
+    req.max_fails = ntohl(req.max_fails);
+    req.fail_timeout = ntohl(req.fail_timeout);
+    req.max_conns = ntohl(req.max_conns);
+    req.drain = ntohl(req.drain);
+    req.upstream_len = ntohs(req.upstream_len);
+    req.server_len = ntohs(req.server_len);
+    req.peer_len = ntohs(req.peer_len);
+
+    if (sizeof(ngx_dynamic_upstream_control_req_t) - sizeof(uint32_t)
+        + req.upstream_len + req.server_len + req.peer_len != len) {
+
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "dynamic upstream control: invalid request length %uD",
+                      len);
+        return NGX_ERROR;
+    }
+
+    rc = ngx_dynamic_upstream_control_build_op(&req,
+        in->pos + sizeof(ngx_dynamic_upstream_control_req_t), &op);
+
+    if (rc == NGX_OK) {
+
+        if (op.op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_STREAM)
+            rc = ngx_dynamic_upstream_control_op
+                    <ngx_stream_upstream_srv_conf_t>(c->log, &op);
+        else
+            rc = ngx_dynamic_upstream_control_op
+                    <ngx_http_upstream_srv_conf_t>(c->log, &op);
+    }
+
+    if (rc != NGX_OK && op.status == NGX_HTTP_INTERNAL_SERVER_ERROR)
+        ngx_log_error(NGX_LOG_ERR, c->log, 0, "%V: %s", &op.upstream, op.err);
+
+    ngx_dynamic_upstream_control_reply(out, req.id, op.status,
+                                       rc == NGX_OK ? NULL : op.err);
+
+    in->pos += len + sizeof(uint32_t);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_control_send(ngx_connection_t *c, ngx_buf_t *out)
+{
+    ssize_t  n;
+
+    while (out->pos < out->last) {
+
+        n = c->send(c, out->pos, out->last - out->pos);
+
+        if (n == NGX_ERROR)
+            return NGX_ERROR;
+
+        if (n == NGX_AGAIN || n == 0)
+            break;
+
+        out->pos += n;
+    }
+
+    if (out->pos == out->last) {
+
+        out->pos = out->start;
+        out->last = out->start;
+
+        return NGX_OK;
+    }
+
+    if (out->pos != out->start) {
+
+        ngx_memmove(out->start, out->pos, out->last - out->pos);
+        out->last = out->start + (out->last - out->pos);
+        out->pos = out->start;
+    }
+
+    return NGX_AGAIN;
+}
+
+
+// requests are run while there is room for the replies, the connection
+// is not read while the controller does not read the replies. A session
+// with no requests and no replies read for the timeout is closed.
+
+static void
+ngx_dynamic_upstream_control_handler(ngx_event_t *ev)
+{
+    ngx_connection_t                    *c;
+    ngx_stream_session_t                *s;
+    ngx_dynamic_upstream_control_ctx_t  *ctx;
+    ngx_buf_t                           *in, *out;
+    ssize_t                              n;
+    ngx_int_t                            rc;
+
+    c = (ngx_connection_t *) ev->data;
+    s = (ngx_stream_session_t *) c->data;
+    ctx = (ngx_dynamic_upstream_control_ctx_t *)
+        ngx_stream_get_module_ctx(s, ngx_stream_dynamic_upstream_module);
+
+    in = ctx->in;
+    out = ctx->out;
+
+    if (ev->timedout) {
+
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "dynamic upstream control: client timed out");
+
+        ngx_stream_finalize_session(s, NGX_STREAM_OK);
+        return;
+    }
+
+    if (c->close) {
+
+        ngx_stream_finalize_session(s, NGX_STREAM_OK);
+        return;
+    }
+
+    for ( ;; ) {
+
+        if (ngx_dynamic_upstream_control_send(c, out) == NGX_ERROR) {
+
+            ngx_stream_finalize_session(s, NGX_STREAM_OK);
+            return;
+        }
+
+        while ((size_t) (out->end - out->last)
+                   >= NGX_DYNAMIC_UPSTREAM_CONTROL_REPLY_MAX) {
+
+            rc = ngx_dynamic_upstream_control_request(c, in, out);
+
+            if (rc == NGX_AGAIN)
+                break;
+
+            if (rc == NGX_ERROR) {
+
+                ngx_stream_finalize_session(s, NGX_STREAM_BAD_REQUEST);
+                return;
+            }
+        }
+
+        if (in->pos != in->start) {
+
+            ngx_memmove(in->start, in->pos, in->last - in->pos);
+            in->last = in->start + (in->last - in->pos);
+            in->pos = in->start;
+        }
+
+        if ((size_t) (out->end - out->last)
+                < NGX_DYNAMIC_UPSTREAM_CONTROL_REPLY_MAX) {
+
+            rc = ngx_dynamic_upstream_control_send(c, out);
+
+            if (rc == NGX_ERROR) {
+
+                ngx_stream_finalize_session(s, NGX_STREAM_OK);
+                return;
+            }
+
+            if (rc == NGX_AGAIN
+                && (size_t) (out->end - out->last)
+                       < NGX_DYNAMIC_UPSTREAM_CONTROL_REPLY_MAX)
+                break;
+
+            continue;
+        }
+
+        n = c->recv(c, in->last, in->end - in->last);
+
+        if (n == NGX_AGAIN)
+            break;
+
+        if (n == 0 || n == NGX_ERROR) {
+
+            (void) ngx_dynamic_upstream_control_send(c, out);
+
+            ngx_stream_finalize_session(s, NGX_STREAM_OK);
+            return;
+        }
+
+        in->last += n;
+    }
+
+    if (ngx_dynamic_upstream_control_send(c, out) == NGX_ERROR) {
+
+        ngx_stream_finalize_session(s, NGX_STREAM_OK);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK
+        || ngx_handle_write_event(c->write, 0) != NGX_OK) {
+
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    // restarted by the requests and by the replies taken
+
+    ngx_add_timer(c->read, ctx->timeout);
+}
+
+
+static void
+ngx_dynamic_upstream_control_session(ngx_stream_session_t *s)
+{
+    ngx_connection_t                    *c = s->connection;
+    ngx_dynamic_upstream_control_ctx_t  *ctx;
+    ngx_dynamic_upstream_srv_conf_t     *dscf;
+
+    ctx = (ngx_dynamic_upstream_control_ctx_t *) ngx_pcalloc(c->pool,
+        sizeof(ngx_dynamic_upstream_control_ctx_t));
+    if (ctx == NULL) {
+
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    ctx->in = ngx_create_temp_buf(c->pool,
+                                  NGX_DYNAMIC_UPSTREAM_CONTROL_BUFFER);
+    ctx->out = ngx_create_temp_buf(c->pool,
+                                   NGX_DYNAMIC_UPSTREAM_CONTROL_BUFFER);
+
+    if (ctx->in == NULL || ctx->out == NULL) {
+
+        ngx_stream_finalize_session(s, NGX_STREAM_INTERNAL_SERVER_ERROR);
+        return;
+    }
+
+    dscf = (ngx_dynamic_upstream_srv_conf_t *)
+        ngx_stream_get_module_srv_conf(s, ngx_stream_dynamic_upstream_module);
+
+    ctx->timeout = dscf->control_timeout;
+
+    ngx_stream_set_ctx(s, ctx, ngx_stream_dynamic_upstream_module);
+
+    c->read->handler = ngx_dynamic_upstream_control_handler;
+    c->write->handler = ngx_dynamic_upstream_control_handler;
+
+    ngx_dynamic_upstream_control_handler(c->read);
+}
+
+
+// dynamic_upstream_control [timeout=time]
+
+char *
+ngx_dynamic_upstream_control_conf(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_stream_core_srv_conf_t       *cscf;
+    ngx_dynamic_upstream_srv_conf_t  *dscf;
+    ngx_str_t                        *value, s;
+
+    cscf = (ngx_stream_core_srv_conf_t *) ngx_stream_conf_get_module_srv_conf(
+        cf, ngx_stream_core_module);
+    dscf = (ngx_dynamic_upstream_srv_conf_t *) conf;
+
+    if (cscf->handler != NULL)
+        return (char *) "is duplicate";
+
+    dscf->control_timeout = NGX_DYNAMIC_UPSTREAM_CONTROL_TIMEOUT;
+
+    if (cf->args->nelts == 2) {
+
+        value = (ngx_str_t *) cf->args->elts;
+
+        if (ngx_strncmp(value[1].data, "timeout=", 8) != 0) {
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[1]);
+            return (char *) NGX_CONF_ERROR;
+        }
+
+        s.data = value[1].data + 8;
+        s.len = value[1].len - 8;
+
+        dscf->control_timeout = ngx_parse_time(&s, 0);
+        if (dscf->control_timeout == (ngx_msec_t) NGX_ERROR
+            || dscf->control_timeout == 0) {
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid timeout \"%V\"", &value[1]);
+            return (char *) NGX_CONF_ERROR;
+        }
+    }
+
+    cscf->handler = ngx_dynamic_upstream_control_session;
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#ifndef NGX_DYNAMIC_UPSTREAM_CONTROL_H
+#define NGX_DYNAMIC_UPSTREAM_CONTROL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#ifdef __cplusplus
+}
+#endif
+
+
+// binary control protocol of 'dynamic_upstream_control' stream servers,
+// for a local controller on a unix socket. Requests are pipelined, every
+// request gets a reply with its id in the order of the requests. All
+// fields are in the network byte order.
+
+#define NGX_DYNAMIC_UPSTREAM_CONTROL_VERSION  1
+
+// max size of a request, with the length
+
+#define NGX_DYNAMIC_UPSTREAM_CONTROL_BUFFER   16384
+
+// flags of the request
+
+#define NGX_DYNAMIC_UPSTREAM_CONTROL_BACKUP   1
+
+
+// request, followed by the names of the upstream, the server and the peer
+
+typedef struct {
+    uint32_t  len;           // of the request after this field
+    uint8_t   version;
+    uint8_t   op;            // NGX_DYNAMIC_UPSTEAM_OP_ADD, _REMOVE, _PARAM
+    uint16_t  flags;
+    uint32_t  id;
+    uint32_t  op_param;      // NGX_DYNAMIC_UPSTEAM_OP_PARAM_* of the values
+    uint32_t  weight;
+    uint32_t  max_fails;
+    uint32_t  fail_timeout;
+    uint32_t  max_conns;
+    uint32_t  drain;         // seconds
+    uint16_t  upstream_len;
+    uint16_t  server_len;
+    uint16_t  peer_len;
+    uint16_t  reserved;
+} ngx_dynamic_upstream_control_req_t;
+
+
+// reply, followed by the error text
+
+typedef struct {
+    uint32_t  len;           // of the reply after this field
+    uint32_t  id;
+    uint16_t  status;        // as of the http api
+    uint16_t  err_len;
+} ngx_dynamic_upstream_control_reply_t;
+
+
+char *
+ngx_dynamic_upstream_control_conf(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_CONTROL_H */
@@ -0,0 +1,266 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+extern "C" {
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_inet.h>
+
+}
+
+#include "ngx_dynamic_upstream_dns_cache.h"
+
+
+static ngx_shm_zone_t *
+ngx_dynamic_upstream_dns_cache_zone = NULL;
+
+
+static ngx_int_t
+ngx_dynamic_upstream_dns_cache_init_zone(ngx_shm_zone_t *zone, void *data)
+{
+    ngx_slab_pool_t                      *shpool;
+    ngx_dynamic_upstream_dns_cache_sh_t  *sh;
+
+    ngx_dynamic_upstream_dns_cache_zone = zone;
+
+    // answers survive reloads
+
+    if (data != NULL) {
+
+        zone->data = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) zone->shm.addr;
+
+    if (zone->shm.exists) {
+
+        zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    sh = (ngx_dynamic_upstream_dns_cache_sh_t *) ngx_slab_calloc(shpool,
+        sizeof(ngx_dynamic_upstream_dns_cache_sh_t));
+    if (sh == NULL)
+        return NGX_ERROR;
+
+    shpool->data = sh;
+    zone->data = sh;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_dns_cache_add_zone(ngx_conf_t *cf, void *tag)
+{
+    static ngx_str_t  name = ngx_string("ngx_dynamic_upstream_dns_cache");
+
+    ngx_shm_zone_t  *zone;
+
+    zone = ngx_shared_memory_add(cf, &name,
+                                 NGX_DYNAMIC_UPSTREAM_DNS_CACHE_ZONE_SIZE,
+                                 tag);
+    if (zone == NULL)
+        return NGX_ERROR;
+
+    zone->init = ngx_dynamic_upstream_dns_cache_init_zone;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_dynamic_upstream_dns_cache_set_port(struct sockaddr *sa, in_port_t port)
+{
+    switch (sa->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        ((struct sockaddr_in6 *) sa)->sin6_port = htons(port);
+        break;
+#endif
+
+    case AF_INET:
+        ((struct sockaddr_in *) sa)->sin_port = htons(port);
+        break;
+
+    default:
+        break;
+    }
+}
+
+
+// the answer goes to the url with the port of the url
+
+static ngx_int_t
+ngx_dynamic_upstream_dns_cache_get(ngx_dynamic_upstream_dns_cache_node_t *node,
+    ngx_url_t *u, ngx_pool_t *pool)
+{
+    ngx_addr_t  *addrs;
+    ngx_uint_t   i;
+    u_char       text[NGX_SOCKADDR_STRLEN];
+    size_t       len;
+
+    addrs = (ngx_addr_t *) ngx_pcalloc(pool, node->naddrs * sizeof(ngx_addr_t));
+    if (addrs == NULL)
+        return NGX_ERROR;
+
+    for (i = 0; i < node->naddrs; i++) {
+
+        addrs[i].sockaddr = (struct sockaddr *) ngx_palloc(pool,
+            node->addrs[i].socklen);
+        if (addrs[i].sockaddr == NULL)
+            return NGX_ERROR;
+
+        ngx_memcpy(addrs[i].sockaddr, &node->addrs[i].sockaddr,
+                   node->addrs[i].socklen);
+        addrs[i].socklen = node->addrs[i].socklen;
+
+        ngx_dynamic_upstream_dns_cache_set_port(addrs[i].sockaddr, u->port);
+
+        len = ngx_sock_ntop(addrs[i].sockaddr, addrs[i].socklen, text,
+                            NGX_SOCKADDR_STRLEN, 1);
+
+        addrs[i].name.data = (u_char *) ngx_pnalloc(pool, len);
+        if (addrs[i].name.data == NULL)
+            return NGX_ERROR;
+
+        ngx_memcpy(addrs[i].name.data, text, len);
+        addrs[i].name.len = len;
+    }
+
+    u->addrs = addrs;
+    u->naddrs = node->naddrs;
+
+    return NGX_OK;
+}
+
+
+// replaces the answer of the host, drops the answers unused for long
+
+static void
+ngx_dynamic_upstream_dns_cache_put(ngx_url_t *u, time_t now)
+{
+    ngx_slab_pool_t                        *shpool;
+    ngx_dynamic_upstream_dns_cache_sh_t    *sh;
+    ngx_dynamic_upstream_dns_cache_node_t  *node, **prev;
+    ngx_uint_t                              i;
+
+    shpool = (ngx_slab_pool_t *) ngx_dynamic_upstream_dns_cache_zone->shm.addr;
+    sh = (ngx_dynamic_upstream_dns_cache_sh_t *)
+        ngx_dynamic_upstream_dns_cache_zone->data;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    for (prev = &sh->hosts; *prev != NULL; /* void */) {
+
+        node = *prev;
+
+        if ((node->host.len == u->host.len
+             && ngx_strncasecmp(node->host.data, u->host.data,
+                                u->host.len) == 0)
+            || now - node->resolved >= NGX_DYNAMIC_UPSTREAM_DNS_CACHE_MAX_AGE)
+        {
+            *prev = node->next;
+            ngx_slab_free_locked(shpool, node);
+            continue;
+        }
+
+        prev = &node->next;
+    }
+
+    node = (ngx_dynamic_upstream_dns_cache_node_t *) ngx_slab_alloc_locked(
+        shpool, sizeof(ngx_dynamic_upstream_dns_cache_node_t)
+                + u->naddrs * sizeof(ngx_dynamic_upstream_dns_cache_addr_t)
+                + u->host.len);
+    if (node == NULL) {
+
+        ngx_shmtx_unlock(&shpool->mutex);
+
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "dynamic upstream: no shared memory for dns cache "
+                      "of %V", &u->host);
+        return;
+    }
+
+    node->addrs = (ngx_dynamic_upstream_dns_cache_addr_t *) (node + 1);
+    node->naddrs = u->naddrs;
+    node->resolved = now;
+
+    for (i = 0; i < u->naddrs; i++) {
+
+        node->addrs[i].socklen = ngx_min(u->addrs[i].socklen,
+            (socklen_t) sizeof(struct sockaddr_storage));
+        ngx_memcpy(&node->addrs[i].sockaddr, u->addrs[i].sockaddr,
+                   node->addrs[i].socklen);
+    }
+
+    node->host.data = (u_char *) (node->addrs + u->naddrs);
+    node->host.len = u->host.len;
+    ngx_memcpy(node->host.data, u->host.data, u->host.len);
+
+    node->next = sh->hosts;
+    sh->hosts = node;
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_dns_cache_resolve(ngx_url_t *u, ngx_pool_t *pool,
+    time_t max_age)
+{
+    ngx_slab_pool_t                        *shpool;
+    ngx_dynamic_upstream_dns_cache_sh_t    *sh;
+    ngx_dynamic_upstream_dns_cache_node_t  *node;
+    ngx_int_t                               rc = NGX_DECLINED;
+    time_t                                  now = ngx_time();
+
+    // addresses are not cached
+
+    if (ngx_dynamic_upstream_dns_cache_zone == NULL
+        || u->host.len == 0 || u->host.data[0] == '['
+        || ngx_inet_addr(u->host.data, u->host.len) != INADDR_NONE)
+        return ngx_inet_resolve_host(pool, u);
+
+    shpool = (ngx_slab_pool_t *) ngx_dynamic_upstream_dns_cache_zone->shm.addr;
+    sh = (ngx_dynamic_upstream_dns_cache_sh_t *)
+        ngx_dynamic_upstream_dns_cache_zone->data;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    for (node = sh->hosts; node != NULL; node = node->next) {
+
+        if (node->host.len == u->host.len
+            && ngx_strncasecmp(node->host.data, u->host.data,
+                               u->host.len) == 0) {
+
+            if (now - node->resolved < max_age)
+                rc = ngx_dynamic_upstream_dns_cache_get(node, u, pool);
+
+            break;
+        }
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    if (rc != NGX_DECLINED) {
+
+        ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                      "dynamic upstream: dns cache hit %V", &u->host);
+        return rc;
+    }
+
+    // resolved out of the lock, one more resolve of a host by another
+    // worker in between costs less than blocking the zone
+
+    if (ngx_inet_resolve_host(pool, u) != NGX_OK)
+        return NGX_ERROR;
+
+    ngx_dynamic_upstream_dns_cache_put(u, now);
+
+    return NGX_OK;
+}
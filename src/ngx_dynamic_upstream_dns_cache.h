@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#ifndef NGX_DYNAMIC_UPSTREAM_DNS_CACHE_H
+#define NGX_DYNAMIC_UPSTREAM_DNS_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#ifdef __cplusplus
+}
+#endif
+
+
+// answers of the background sync shared by all upstreams and workers,
+// a host is resolved once per 'dns_update' interval whatever number of
+// upstreams and ports it is used with
+
+#define NGX_DYNAMIC_UPSTREAM_DNS_CACHE_ZONE_SIZE  (1024 * 1024)
+
+// answers unused for so long are dropped, seconds
+
+#define NGX_DYNAMIC_UPSTREAM_DNS_CACHE_MAX_AGE  3600
+
+
+typedef struct {
+    socklen_t                socklen;
+    struct sockaddr_storage  sockaddr;
+} ngx_dynamic_upstream_dns_cache_addr_t;
+
+
+typedef struct ngx_dynamic_upstream_dns_cache_node_s
+    ngx_dynamic_upstream_dns_cache_node_t;
+
+struct ngx_dynamic_upstream_dns_cache_node_s {
+    ngx_dynamic_upstream_dns_cache_node_t  *next;
+    ngx_str_t                               host;
+    time_t                                  resolved;
+    ngx_uint_t                              naddrs;
+    ngx_dynamic_upstream_dns_cache_addr_t  *addrs;
+};
+
+
+typedef struct {
+    ngx_dynamic_upstream_dns_cache_node_t  *hosts;
+} ngx_dynamic_upstream_dns_cache_sh_t;
+
+
+ngx_int_t
+ngx_dynamic_upstream_dns_cache_add_zone(ngx_conf_t *cf, void *tag);
+
+
+// resolves u->host of the url parsed with no_resolve, answers younger
+// than max_age seconds are taken from the cache. The callers pass their
+// 'dns_update' interval: the TTL of the records is not returned by the
+// resolver of the system and is not used.
+
+ngx_int_t
+ngx_dynamic_upstream_dns_cache_resolve(ngx_url_t *u, ngx_pool_t *pool,
+    time_t max_age);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_DNS_CACHE_H */
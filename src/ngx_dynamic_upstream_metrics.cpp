@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+extern "C" {
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+}
+
+#include "ngx_dynamic_upstream_metrics.h"
+
+
+const ngx_msec_int_t
+ngx_dynamic_upstream_hist_bounds[NGX_DYNAMIC_UPSTREAM_HIST_BUCKETS - 1] = {
+    10, 100, 1000, 5000, 10000, 50000, 100000, 500000,
+    1000000, 5000000, 10000000
+};
+
+
+static ngx_shm_zone_t *
+ngx_dynamic_upstream_metrics_zone = NULL;
+
+
+static ngx_int_t
+ngx_dynamic_upstream_metrics_init_zone(ngx_shm_zone_t *zone, void *data)
+{
+    ngx_slab_pool_t                    *shpool;
+    ngx_dynamic_upstream_metrics_sh_t  *sh;
+
+    ngx_dynamic_upstream_metrics_zone = zone;
+
+    // counters survive reloads
+
+    if (data != NULL) {
+
+        zone->data = data;
+        return NGX_OK;
+    }
+
+    shpool = (ngx_slab_pool_t *) zone->shm.addr;
+
+    if (zone->shm.exists) {
+
+        zone->data = shpool->data;
+        return NGX_OK;
+    }
+
+    sh = (ngx_dynamic_upstream_metrics_sh_t *) ngx_slab_calloc(shpool,
+        sizeof(ngx_dynamic_upstream_metrics_sh_t));
+    if (sh == NULL)
+        return NGX_ERROR;
+
+    shpool->data = sh;
+    zone->data = sh;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_metrics_add_zone(ngx_conf_t *cf, void *tag)
+{
+    static ngx_str_t  name = ngx_string("ngx_dynamic_upstream_metrics");
+
+    ngx_shm_zone_t  *zone;
+
+    zone = ngx_shared_memory_add(cf, &name,
+                                 NGX_DYNAMIC_UPSTREAM_METRICS_ZONE_SIZE, tag);
+    if (zone == NULL)
+        return NGX_ERROR;
+
+    zone->init = ngx_dynamic_upstream_metrics_init_zone;
+
+    return NGX_OK;
+}
+
+
+ngx_dynamic_upstream_metrics_sh_t *
+ngx_dynamic_upstream_metrics_sh()
+{
+    if (ngx_dynamic_upstream_metrics_zone == NULL)
+        return NULL;
+
+    return (ngx_dynamic_upstream_metrics_sh_t *)
+        ngx_dynamic_upstream_metrics_zone->data;
+}
+
+
+ngx_dynamic_upstream_metrics_t *
+ngx_dynamic_upstream_metrics_get(ngx_str_t name, ngx_uint_t stream)
+{
+    ngx_slab_pool_t                    *shpool;
+    ngx_dynamic_upstream_metrics_sh_t  *sh;
+    ngx_dynamic_upstream_metrics_t     *m;
+
+    sh = ngx_dynamic_upstream_metrics_sh();
+    if (sh == NULL)
+        return NULL;
+
+    shpool = (ngx_slab_pool_t *) ngx_dynamic_upstream_metrics_zone->shm.addr;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    for (m = sh->upstreams; m != NULL; m = m->next)
+        if (m->stream == stream
+            && ngx_memn2cmp(m->name.data, name.data, m->name.len, name.len)
+                   == 0)
+            goto done;
+
+    m = (ngx_dynamic_upstream_metrics_t *) ngx_slab_calloc_locked(shpool,
+        sizeof(ngx_dynamic_upstream_metrics_t) + name.len);
+    if (m == NULL) {
+
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "dynamic upstream: no shared memory for metrics of %V",
+                      &name);
+        goto done;
+    }
+
+    m->name.data = (u_char *) (m + 1);
+    m->name.len = name.len;
+    ngx_memcpy(m->name.data, name.data, name.len);
+
+    m->stream = stream;
+
+    m->next = sh->upstreams;
+    sh->upstreams = m;
+
+done:
+
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    return m;
+}
+
+
+void
+ngx_dynamic_upstream_hist_observe(ngx_dynamic_upstream_hist_t *hist,
+    ngx_msec_int_t usec)
+{
+    ngx_uint_t  j;
+
+    if (usec < 0)
+        usec = 0;
+
+    for (j = 0; j < NGX_DYNAMIC_UPSTREAM_HIST_BUCKETS - 1; j++)
+        if (usec <= ngx_dynamic_upstream_hist_bounds[j])
+            break;
+
+    ngx_atomic_fetch_add(&hist->bucket[j], 1);
+    ngx_atomic_fetch_add(&hist->sum, usec);
+    ngx_atomic_fetch_add(&hist->count, 1);
+}
+
+
+void
+ngx_dynamic_upstream_metrics_trash(ngx_atomic_int_t delta)
+{
+    ngx_dynamic_upstream_metrics_sh_t  *sh;
+
+    sh = ngx_dynamic_upstream_metrics_sh();
+    if (sh != NULL)
+        ngx_atomic_fetch_add(&sh->trash, delta);
+}
+
+
+void
+ngx_dynamic_upstream_zone_stat(ngx_slab_pool_t *shpool,
+    ngx_dynamic_upstream_zone_stat_t *stat)
+{
+    ngx_slab_page_t  *page;
+    size_t            size;
+
+    stat->size = shpool->end - shpool->start;
+    stat->free = 0;
+    stat->largest = 0;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    // runs of free pages, slab is the number of pages in the run
+
+    for (page = shpool->free.next; page != &shpool->free; page = page->next) {
+
+        size = page->slab << ngx_pagesize_shift;
+
+        stat->free += size;
+        if (size > stat->largest)
+            stat->largest = size;
+    }
+
+    ngx_shmtx_unlock(&shpool->mutex);
+}
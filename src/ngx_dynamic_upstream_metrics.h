@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#ifndef NGX_DYNAMIC_UPSTREAM_METRICS_H
+#define NGX_DYNAMIC_UPSTREAM_METRICS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#define NGX_DYNAMIC_UPSTREAM_METRICS_ZONE_SIZE  (1024 * 1024)
+
+// upper bounds of histogram buckets in microseconds, the last one is +Inf
+
+#define NGX_DYNAMIC_UPSTREAM_HIST_BUCKETS  12
+
+extern const ngx_msec_int_t
+ngx_dynamic_upstream_hist_bounds[NGX_DYNAMIC_UPSTREAM_HIST_BUCKETS - 1];
+
+
+typedef struct {
+    ngx_atomic_t  bucket[NGX_DYNAMIC_UPSTREAM_HIST_BUCKETS];
+    ngx_atomic_t  count;
+    ngx_atomic_t  sum;
+} ngx_dynamic_upstream_hist_t;
+
+
+typedef struct ngx_dynamic_upstream_lock_stat_s {
+    ngx_dynamic_upstream_hist_t  wait;
+    ngx_dynamic_upstream_hist_t  hold;
+} ngx_dynamic_upstream_lock_stat_t;
+
+
+// list, add, remove, update, sync, hash, replace: log2 of the operation code
+
+#define NGX_DYNAMIC_UPSTREAM_LOCK_OPS  7
+
+
+typedef struct ngx_dynamic_upstream_metrics_s ngx_dynamic_upstream_metrics_t;
+
+struct ngx_dynamic_upstream_metrics_s {
+    ngx_dynamic_upstream_metrics_t  *next;
+
+    ngx_str_t                        name;
+    ngx_uint_t                       stream;
+
+    ngx_dynamic_upstream_hist_t      dns_sync;
+    ngx_atomic_t                     resolve_failed;
+
+    ngx_atomic_t                     added;
+    ngx_atomic_t                     removed;
+    ngx_atomic_t                     updated;
+
+    ngx_atomic_t                     zone_allocated;
+    ngx_atomic_t                     zone_freed;
+    ngx_atomic_t                     zone_failed;
+    ngx_atomic_t                     zone_refused;
+
+    ngx_dynamic_upstream_lock_stat_t
+        lock[NGX_DYNAMIC_UPSTREAM_LOCK_OPS];
+};
+
+
+typedef struct {
+    ngx_dynamic_upstream_metrics_t  *upstreams;
+    ngx_atomic_t                     trash;
+} ngx_dynamic_upstream_metrics_sh_t;
+
+
+typedef struct {
+    size_t  size;
+    size_t  free;
+    size_t  largest;
+} ngx_dynamic_upstream_zone_stat_t;
+
+
+ngx_int_t
+ngx_dynamic_upstream_metrics_add_zone(ngx_conf_t *cf, void *tag);
+
+
+ngx_dynamic_upstream_metrics_t *
+ngx_dynamic_upstream_metrics_get(ngx_str_t name, ngx_uint_t stream);
+
+
+ngx_dynamic_upstream_metrics_sh_t *
+ngx_dynamic_upstream_metrics_sh();
+
+
+void
+ngx_dynamic_upstream_hist_observe(ngx_dynamic_upstream_hist_t *hist,
+    ngx_msec_int_t usec);
+
+
+void
+ngx_dynamic_upstream_metrics_trash(ngx_atomic_int_t delta);
+
+
+void
+ngx_dynamic_upstream_zone_stat(ngx_slab_pool_t *shpool,
+    ngx_dynamic_upstream_zone_stat_t *stat);
+
+
+ngx_inline ngx_msec_int_t
+ngx_dynamic_upstream_elapsed(struct timeval *start)
+{
+    struct timeval  tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (tv.tv_sec - start->tv_sec) * 1000000
+        + (tv.tv_usec - start->tv_usec);
+}
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_METRICS_H */
@@ -20,12 +20,22 @@ extern "C" {
 #endif
 
 
+// stream sessions of the control protocol and complex values of the
+// stream balancers
+
+#if (nginx_version < 1011004)
+#error "nginx 1.11.4 or newer is required"
+#endif
+
+
 #define NGX_DYNAMIC_UPSTEAM_OP_LIST   1
 #define NGX_DYNAMIC_UPSTEAM_OP_ADD    2
 #define NGX_DYNAMIC_UPSTEAM_OP_REMOVE 4
 #define NGX_DYNAMIC_UPSTEAM_OP_PARAM  8
 #define NGX_DYNAMIC_UPSTEAM_OP_SYNC   16
 #define NGX_DYNAMIC_UPSTEAM_OP_HASH   32
+#define NGX_DYNAMIC_UPSTEAM_OP_REPLACE 64
+#define NGX_DYNAMIC_UPSTEAM_OP_RESOLVE 128
 
 #define NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT       1
 #define NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS    2
@@ -42,6 +52,141 @@ extern "C" {
 #define NGX_DYNAMIC_UPSTEAM_OP_PARAM_IPV6          256
 
 #define NGX_DYNAMIC_UPSTEAM_OP_PARAM_STREAM        1024
+#define NGX_DYNAMIC_UPSTEAM_OP_PARAM_ALL           2048
+#define NGX_DYNAMIC_UPSTEAM_OP_PARAM_METRICS       4096
+#define NGX_DYNAMIC_UPSTEAM_OP_PARAM_DRAIN         8192
+
+// draining peer is excluded from selection as a down one, the deadline
+// of the removal is kept in the slow_start field of the zone peer,
+// which is not used by nginx
+
+#define NGX_DYNAMIC_UPSTREAM_DRAIN_FOREVER  ((ngx_msec_t) NGX_MAX_INT_T_VALUE)
+#define ngx_dynamic_upstream_drain_deadline(peer)  ((peer)->slow_start)
+#define ngx_dynamic_upstream_draining(peer)                                   \
+    ((peer)->down && ngx_dynamic_upstream_drain_deadline(peer) != 0)
+
+// cap of the effective weight of a peer in the slow start ramp, 0 if
+// the peer is not ramped, in the start_time field of the zone peer
+
+#define ngx_dynamic_upstream_ramp_weight(peer)  ((peer)->start_time)
+
+// default of 'dns_max_backoff', seconds
+
+#define NGX_DYNAMIC_UPSTREAM_DNS_MAX_BACKOFF  300
+
+struct ngx_dynamic_upstream_lock_stat_s;
+struct ngx_dynamic_upstream_metrics_s;
+struct ngx_dynamic_upstream_chash_s;
+struct ngx_dynamic_upstream_p2c_s;
+struct ngx_dynamic_upstream_check_s;
+struct ngx_dynamic_upstream_outlier_s;
+struct ngx_dynamic_upstream_outlier_conf_s;
+
+
+extern ngx_module_t  ngx_http_dynamic_upstream_module;
+extern ngx_module_t  ngx_stream_dynamic_upstream_module;
+
+
+// domain name of a 'dns_update' upstream which fails to resolve,
+// the last known peers of the name are kept until 'dns_max_stale'
+
+typedef struct {
+    ngx_str_t   name;
+    ngx_uint_t  failures;  // in a row
+    time_t      failed;    // since
+    time_t      next;      // next attempt to resolve
+    time_t      seen;
+    ngx_flag_t  expired;
+} ngx_dynamic_upstream_dns_name_t;
+
+
+// peer of a resolved name missing in the answer, kept in the upstream
+// by 'dns_hold_down'
+
+typedef struct {
+    ngx_str_t   server;
+    ngx_str_t   name;
+    ngx_uint_t  absent;    // resolutions in a row
+    time_t      since;
+    time_t      seen;
+} ngx_dynamic_upstream_dns_addr_t;
+
+
+// local to the worker syncing the upstream
+
+typedef struct ngx_dynamic_upstream_dns_s {
+    time_t        interval;
+    time_t        max_backoff;
+    time_t        max_stale;   // 0 to keep the peers forever
+    ngx_uint_t    hold_count;  // 0 if not limited by resolutions
+    time_t        hold_time;   // 0 if not limited by time
+    ngx_uint_t    subset;      // 0 to add all addresses
+    ngx_str_t     subset_id;
+    ngx_addr_t   *srv_resolver;  // NULL for the resolvers of the system
+    ngx_pool_t   *pool;
+    ngx_array_t  *names;
+    ngx_array_t  *held;
+} ngx_dynamic_upstream_dns_t;
+
+
+// upstream block configuration, shared by http and stream
+
+typedef struct {
+    ngx_msec_t                                  interval;
+    time_t                                      last;
+    ngx_uint_t                                  hash;
+    ngx_flag_t                                  ipv6;
+    ngx_flag_t                                  add_down;
+    time_t                                      dns_max_stale;
+    time_t                                      dns_max_backoff;
+    ngx_uint_t                                  dns_hold_count;
+    time_t                                      dns_hold_time;
+    ngx_uint_t                                  dns_subset;
+    ngx_str_t                                   dns_subset_id;
+    ngx_addr_t                                 *dns_srv_resolver;
+    ngx_dynamic_upstream_dns_t                 *dns;
+    ngx_str_t                                   file;
+    ngx_flag_t                                  unresolved;  // in the file
+    ngx_flag_t                                  warm_reload;
+    ngx_uint_t                                  high_water;
+    ngx_flag_t                                  lock_stats;
+    time_t                                      slow_start;
+    ngx_pool_t                                 *ramp_pool;
+    ngx_array_t                                *ramp;
+    ngx_array_t                                *ramp_next;
+    void                                       *ramp_init;  // wrapped
+    void                                       *chash_key;
+    struct ngx_dynamic_upstream_chash_s        *chash;
+    ngx_msec_t                                  p2c_decay;
+    struct ngx_dynamic_upstream_p2c_s          *p2c;
+    struct ngx_dynamic_upstream_check_s        *check;
+    struct ngx_dynamic_upstream_outlier_conf_s *outlier;
+    struct ngx_dynamic_upstream_metrics_s      *metrics;
+    ngx_msec_t                                  control_timeout;
+} ngx_dynamic_upstream_srv_conf_t;
+
+
+// a server with its parameters, as in the upstream block
+
+struct ngx_server_s {
+    ngx_str_t name;
+    ngx_int_t backup;
+    ngx_int_t weight;
+    ngx_int_t max_fails;
+
+#if defined(nginx_version) && (nginx_version >= 1011005)
+    ngx_int_t max_conns;
+#endif
+
+    ngx_int_t fail_timeout;
+    ngx_int_t down;
+    ngx_url_t u;
+
+    ngx_int_t  *weights;    // of SRV targets, aligned with u.addrs
+    ngx_uint_t  nweights;
+};
+typedef struct ngx_server_s ngx_server_t;
+
 
 typedef struct ngx_dynamic_upstream_op_t {
     ngx_int_t   verbose;
@@ -59,16 +204,40 @@ typedef struct ngx_dynamic_upstream_op_t {
     ngx_int_t   fail_timeout;
     ngx_int_t   up;
     ngx_int_t   down;
+    ngx_int_t   drain;
     ngx_str_t   upstream;
     ngx_str_t   server;
     ngx_str_t   name;
 
     ngx_int_t   no_lock;
+    ngx_int_t   ejection;    // down by the outlier pass, keeps ejection
+    ngx_int_t   keep_drain;  // draining peers are left alone
 
     ngx_uint_t  status;
     const char *err;
 
     ngx_uint_t  hash;
+
+    ngx_array_t  *servers;
+    ngx_pool_t   *pool;      // of the servers resolved by OP_RESOLVE
+    time_t        now;       // of OP_RESOLVE, set on the event loop
+
+    ngx_uint_t  added;
+    ngx_uint_t  removed;
+    ngx_uint_t  updated;
+    ngx_uint_t  resolve_failed;
+
+    ngx_uint_t  high_water;
+    size_t      allocated;
+    size_t      freed;
+    ngx_uint_t  nomem;
+    ngx_uint_t  refused;
+
+    struct ngx_dynamic_upstream_lock_stat_s  *lock_stat;
+    struct ngx_dynamic_upstream_chash_s      *chash;
+    struct ngx_dynamic_upstream_p2c_s        *p2c;
+    struct ngx_dynamic_upstream_outlier_s    *outlier;
+    struct ngx_dynamic_upstream_dns_s        *dns;
 } ngx_dynamic_upstream_op_t;
 
 #ifdef __cplusplus
@@ -84,6 +253,12 @@ ngx_int_t
 ngx_dynamic_upstream_stream_op(ngx_log_t *log, ngx_dynamic_upstream_op_t *op,
     ngx_stream_upstream_srv_conf_t *uscf);
 
+
+// ranges of the values set by the op, status 400 otherwise
+
+ngx_int_t
+ngx_dynamic_upstream_op_check(ngx_dynamic_upstream_op_t *op);
+
 #ifdef __cplusplus
 }
 #endif
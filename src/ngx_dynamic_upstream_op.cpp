@@ -17,6 +17,12 @@ extern "C" {
 
 #include "ngx_dynamic_upstream_module.h"
 #include "ngx_dynamic_upstream_op.h"
+#include "ngx_dynamic_upstream_metrics.h"
+#include "ngx_dynamic_upstream_chash.h"
+#include "ngx_dynamic_upstream_p2c.h"
+#include "ngx_dynamic_upstream_outlier.h"
+#include "ngx_dynamic_upstream_dns_cache.h"
+#include "ngx_dynamic_upstream_srv.h"
 
 
 template <class S> static ngx_int_t
@@ -29,6 +35,11 @@ ngx_dynamic_upstream_op_sync(typename TypeSelect<S>::peers_type *primary,
     ngx_dynamic_upstream_op_t *op, ngx_slab_pool_t *shpool, ngx_log_t *log);
 
 
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_op_resolve(typename TypeSelect<S>::peers_type *primary,
+    ngx_dynamic_upstream_op_t *op, ngx_log_t *log);
+
+
 template <class S> static ngx_int_t
 ngx_dynamic_upstream_op_del(typename TypeSelect<S>::peers_type *primary,
     ngx_dynamic_upstream_op_t *op, ngx_slab_pool_t *shpool, ngx_log_t *log);
@@ -44,6 +55,17 @@ ngx_dynamic_upstream_op_hash(typename TypeSelect<S>::peers_type *primary,
     ngx_dynamic_upstream_op_t *op);
 
 
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_op_replace(typename TypeSelect<S>::peers_type *primary,
+    ngx_dynamic_upstream_op_t *op, ngx_slab_pool_t *shpool, ngx_log_t *log);
+
+
+template <class S> static void
+ngx_dynamic_upstream_op_update_peer(typename TypeSelect<S>::peers_type *peers,
+    typename TypeSelect<S>::peer_type *peer,
+    ngx_dynamic_upstream_op_t *op, ngx_log_t *log);
+
+
 template <class T> T*
 ngx_shm_calloc(ngx_slab_pool_t *shpool, size_t size = 0)
 {
@@ -59,6 +81,54 @@ ngx_shm_calloc(ngx_slab_pool_t *shpool, size_t size = 0)
             (ngx_http_upstream_rr_peers_t *) (peers), __VA_ARGS__))
 
 
+ngx_int_t
+ngx_dynamic_upstream_op_check(ngx_dynamic_upstream_op_t *op)
+{
+    op->status = NGX_HTTP_BAD_REQUEST;
+
+    if ((op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT)
+        && op->weight < 1) {
+
+        op->err = "weight: must be positive";
+        return NGX_ERROR;
+    }
+
+    if ((op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS)
+        && op->max_fails < 0) {
+
+        op->err = "max_fails: must not be negative";
+        return NGX_ERROR;
+    }
+
+    if ((op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT)
+        && op->fail_timeout < 0) {
+
+        op->err = "fail_timeout: must not be negative";
+        return NGX_ERROR;
+    }
+
+#if defined(nginx_version) && (nginx_version >= 1011005)
+    if ((op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_CONNS)
+        && op->max_conns < 0) {
+
+        op->err = "max_conns: must not be negative";
+        return NGX_ERROR;
+    }
+#endif
+
+    if ((op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DRAIN)
+        && op->drain < 0) {
+
+        op->err = "drain: must not be negative";
+        return NGX_ERROR;
+    }
+
+    op->status = NGX_HTTP_OK;
+
+    return NGX_OK;
+}
+
+
 ngx_int_t
 ngx_dynamic_upstream_op_impl(ngx_log_t *log, ngx_dynamic_upstream_op_t *op,
     ngx_slab_pool_t *shpool, void *peers)
@@ -82,10 +152,18 @@ ngx_dynamic_upstream_op_impl(ngx_log_t *log, ngx_dynamic_upstream_op_t *op,
             rc = CALL(ngx_dynamic_upstream_op_sync, peers, op, shpool, log);
             break;
 
+        case NGX_DYNAMIC_UPSTEAM_OP_RESOLVE:
+            rc = CALL(ngx_dynamic_upstream_op_resolve, peers, op, log);
+            break;
+
         case NGX_DYNAMIC_UPSTEAM_OP_PARAM:
             rc = CALL(ngx_dynamic_upstream_op_update, peers, op, log);
             break;
 
+        case NGX_DYNAMIC_UPSTEAM_OP_REPLACE:
+            rc = CALL(ngx_dynamic_upstream_op_replace, peers, op, shpool, log);
+            break;
+
         case NGX_DYNAMIC_UPSTEAM_OP_HASH:
             rc = CALL(ngx_dynamic_upstream_op_hash, peers, op);
             break;
@@ -116,12 +194,19 @@ static ngx_int_t
 ngx_dynamic_upstream_parse_url(ngx_url_t *u, ngx_pool_t *pool,
     ngx_dynamic_upstream_op_t *op)
 {
+    ngx_flag_t  cached;
+
     ngx_memzero(u, sizeof(ngx_url_t));
 
+    // the background sync resolves through the shared cache
+
+    cached = (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_RESOLVE_SYNC)
+        && op->dns != NULL;
+
     u->url = op->server;
     u->default_port = 80;
-    u->no_resolve = op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_RESOLVE_SYNC
-        ? 0 : 1;
+    u->no_resolve = (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_RESOLVE_SYNC)
+        && !cached ? 0 : 1;
 
     if (ngx_parse_url(pool, u) != NGX_OK) {
 
@@ -132,6 +217,16 @@ ngx_dynamic_upstream_parse_url(ngx_url_t *u, ngx_pool_t *pool,
         return NGX_ERROR;
     }
 
+    if (u->naddrs == 0 && cached
+        && ngx_dynamic_upstream_dns_cache_resolve(u, pool, op->dns->interval)
+               != NGX_OK) {
+
+        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        op->err = u->err ? u->err : "failed to resolve";
+
+        return NGX_ERROR;
+    }
+
     if (u->naddrs == 0) {
 
         if (u->no_resolve) {
@@ -175,6 +270,67 @@ equals(PeerT *peer, ngx_str_t server, ngx_str_t name)
 }
 
 
+// zone accounting
+
+template <class S> static size_t
+ngx_dynamic_upstream_op_peer_size(ngx_str_t *server, ngx_str_t *name,
+    socklen_t socklen)
+{
+    return sizeof(typename TypeSelect<S>::peer_type)
+        + server->len + 1 + name->len + 1 + socklen;
+}
+
+
+template <class S> static ngx_flag_t
+ngx_dynamic_upstream_op_peer_missing(
+    typename TypeSelect<S>::peers_type *primary, ngx_str_t server,
+    ngx_str_t name)
+{
+    typename TypeSelect<S>::peers_type  *peers;
+    typename TypeSelect<S>::peer_type   *peer;
+
+    ngx_uint_t  j;
+
+    for (peers = primary, j = 0;
+         peers != NULL && j < 2;
+         peers = peers->next, j++)
+
+        for (peer = peers->peer;
+             peer != NULL;
+             peer = peer->next)
+
+            if (equals<typename TypeSelect<S>::peer_type>(peer, server, name))
+                return 0;
+
+    return 1;
+}
+
+
+// refuses the whole batch of adds if the zone would be filled
+// above the high water mark, instead of failing halfway through
+
+static ngx_int_t
+ngx_dynamic_upstream_op_check_zone(ngx_dynamic_upstream_op_t *op,
+    ngx_slab_pool_t *shpool, size_t need)
+{
+    ngx_dynamic_upstream_zone_stat_t  stat;
+
+    if (op->high_water == 0 || need == 0)
+        return NGX_OK;
+
+    ngx_dynamic_upstream_zone_stat(shpool, &stat);
+
+    if ((stat.size - stat.free + need) * 100 <= stat.size * op->high_water)
+        return NGX_OK;
+
+    op->refused++;
+    op->status = NGX_HTTP_INSUFFICIENT_STORAGE;
+    op->err = "zone high water mark exceeded";
+
+    return NGX_ERROR;
+}
+
+
 template <class S> static ngx_int_t
 ngx_dynamic_upstream_op_add_peer(ngx_log_t *log,
     ngx_dynamic_upstream_op_t *op, ngx_slab_pool_t *shpool,
@@ -237,6 +393,7 @@ ngx_dynamic_upstream_op_add_peer(ngx_log_t *log,
             backup = ngx_shm_calloc<typename TypeSelect<S>::peers_type>(shpool);
             if (backup == NULL) {
 
+                op->nomem++;
                 op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
                 op->err = "no shared memory";
 
@@ -245,6 +402,8 @@ ngx_dynamic_upstream_op_add_peer(ngx_log_t *log,
 
             backup->shpool = primary->shpool;
             backup->name = primary->name;
+
+            op->allocated += sizeof(typename TypeSelect<S>::peers_type);
         }
 
         peers = backup;
@@ -308,6 +467,22 @@ ngx_dynamic_upstream_op_add_peer(ngx_log_t *log,
     if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN)
         npeer->down = op->down;
 
+    // the placeholder of a domain name is never selected
+
+    if (is_reserved_addr(&u->addrs[i].name))
+        npeer->down = 1;
+
+    if (ngx_dynamic_upstream_p2c_add(op->p2c, peers, npeer, &npeer->name)
+            != NGX_OK)
+        goto fail;
+
+    if (ngx_dynamic_upstream_chash_add(op->chash, peers, npeer, &npeer->name,
+                                       npeer->weight) != NGX_OK) {
+
+        ngx_dynamic_upstream_p2c_del(op->p2c, peers, npeer);
+        goto fail;
+    }
+
     if (last == NULL)
         peers->peer = npeer;
     else
@@ -321,6 +496,10 @@ ngx_dynamic_upstream_op_add_peer(ngx_log_t *log,
     if (backup != NULL && primary->next == NULL)
         primary->next = backup;
 
+    op->added++;
+    op->allocated += ngx_dynamic_upstream_op_peer_size<S>(&npeer->server,
+        &npeer->name, npeer->socklen);
+
     if (!is_reserved_addr(&u->addrs[i].name)) {
 
         ngx_log_error(NGX_LOG_NOTICE, log, 0, "%V: added server %V peer %V",
@@ -352,9 +531,13 @@ fail:
         ngx_slab_free(shpool, npeer);
     }
 
-    if (backup != NULL && primary->next == NULL)
+    if (backup != NULL && primary->next == NULL) {
+
         ngx_slab_free(shpool, backup);
+        op->allocated -= sizeof(typename TypeSelect<S>::peers_type);
+    }
 
+    op->nomem++;
     op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
     op->err = "no shared memory";
 
@@ -370,13 +553,25 @@ ngx_dynamic_upstream_op_add_impl(ngx_log_t *log,
     unsigned                   j;
     unsigned                   count = 0;
     ngx_flag_t                 empty;
+    size_t                     need = 0;
     ngx_dynamic_upstream_op_t  del_op;
 
     ngx_upstream_rr_peers_wlock<typename TypeSelect<S>::peers_type>
-        wl(primary, op->no_lock);
+        wl(primary, op->no_lock, op->lock_stat);
 
     empty = primary->single && is_reserved_addr(&primary->peer->server);
 
+    // the scan for the missing peers is paid with the high water only
+
+    for (j = 0; op->high_water != 0 && j < u->naddrs; j++)
+        if (ngx_dynamic_upstream_op_peer_missing<S>(primary, op->server,
+                                                    u->addrs[j].name))
+            need += ngx_dynamic_upstream_op_peer_size<S>(&u->url,
+                &u->addrs[j].name, u->addrs[j].socklen);
+
+    if (ngx_dynamic_upstream_op_check_zone(op, shpool, need) == NGX_ERROR)
+        return NGX_ERROR;
+
     for (j = 0; j < u->naddrs; j++) {
 
         if (ngx_dynamic_upstream_op_add_peer<S>(log, op, shpool, primary, u, j)
@@ -476,22 +671,6 @@ ngx_dynamic_upstream_op_add(typename TypeSelect<S>::peers_type *primary,
 }
 
 
-struct ngx_server_s {
-    ngx_str_t name;
-    ngx_int_t backup;
-    ngx_int_t weight;
-    ngx_int_t max_fails;
-
-#if defined(nginx_version) && (nginx_version >= 1011005)
-    ngx_int_t max_conns;
-#endif
-
-    ngx_int_t fail_timeout;
-    ngx_url_t u;
-};
-typedef struct ngx_server_s ngx_server_t;
-
-
 static ngx_uint_t
 ngx_dynamic_upstream_op_server_exist(ngx_array_t *servers,
     ngx_str_t name)
@@ -507,9 +686,11 @@ ngx_dynamic_upstream_op_server_exist(ngx_array_t *servers,
 }
 
 
-template <class S> ngx_uint_t
-ngx_dynamic_upstream_op_peer_exist(ngx_array_t *servers,
-    typename TypeSelect<S>::peer_type *peer)
+// server of the peer, backup is -1 to match the server in any list
+
+template <class S> static ngx_server_t *
+ngx_dynamic_upstream_op_peer_server(ngx_array_t *servers,
+    typename TypeSelect<S>::peer_type *peer, ngx_int_t backup)
 {
     ngx_server_t  *server = (ngx_server_t *) servers->elts;
     unsigned       i, j;
@@ -519,23 +700,27 @@ ngx_dynamic_upstream_op_peer_exist(ngx_array_t *servers,
         if (!str_eq(server[j].name, peer->server))
             continue;
 
+        if (backup != -1 && server[j].backup != backup)
+            continue;
+
         if (server[j].u.naddrs == 0)
-            return 1;
+            return &server[j];
 
         for (i = 0; i < server[j].u.naddrs; i++) {
 
             if (str_eq(server[j].u.addrs[i].name, peer->name))
-                return 1;
+                return &server[j];
         }
     }
 
-    return 0;
+    return NULL;
 }
 
 
 template <class S> static ngx_int_t
 ngx_dynamic_upstream_op_servers(typename TypeSelect<S>::peers_type *primary,
-    ngx_array_t *servers, ngx_pool_t *pool, ngx_uint_t *hash)
+    ngx_array_t *servers, ngx_pool_t *pool, ngx_uint_t *hash,
+    ngx_dynamic_upstream_lock_stat_t *lock_stat)
 {
     typename TypeSelect<S>::peers_type  *peers;
     typename TypeSelect<S>::peer_type   *peer;
@@ -545,7 +730,8 @@ ngx_dynamic_upstream_op_servers(typename TypeSelect<S>::peers_type *primary,
 
     *hash = 0;
 
-    ngx_upstream_rr_peers_rlock<typename TypeSelect<S>::peers_type> rl(primary);
+    ngx_upstream_rr_peers_rlock<typename TypeSelect<S>::peers_type> rl(primary,
+        0, lock_stat);
 
     for (peers = primary;
          peers != NULL && j < 2;
@@ -576,9 +762,11 @@ ngx_dynamic_upstream_op_servers(typename TypeSelect<S>::peers_type *primary,
 #if defined(nginx_version) && (nginx_version >= 1011005)
                 server->max_conns    = peer->max_conns;
 #endif
+                server->weights      = NULL;
             }
 
-            *hash += ngx_crc32_short(peer->server.data, peer->server.len);
+            *hash += ngx_crc32_short(peer->server.data, peer->server.len)
+                     + (peer->down != 0);
         }
     }
 
@@ -606,7 +794,10 @@ ngx_dynamic_upstream_op_check_hash(typename TypeSelect<S>::peers_type *primary,
              peer != NULL;
              peer = peer->next)
 
-            *hash += ngx_crc32_short(peer->server.data, peer->server.len);
+            // down peers are saved down, the flag is counted
+
+            *hash += ngx_crc32_short(peer->server.data, peer->server.len)
+                     + (peer->down != 0);
 
     return *hash == old_hash ? NGX_OK : NGX_DECLINED;
 }
@@ -616,93 +807,172 @@ template <class S> static ngx_int_t
 ngx_dynamic_upstream_op_hash(typename TypeSelect<S>::peers_type *primary,
     ngx_dynamic_upstream_op_t *op)
 {
-    ngx_upstream_rr_peers_rlock<typename TypeSelect<S>::peers_type> rl(primary);
+    ngx_upstream_rr_peers_rlock<typename TypeSelect<S>::peers_type> rl(primary,
+        0, op->lock_stat);
     return ngx_dynamic_upstream_op_check_hash<S>(primary,
         &op->hash);
 }
 
 
+// removes peers which are not in the set of servers, with typed
+// a peer must also be in the same primary or backup list
+
 template <class S> static ngx_int_t
-ngx_dynamic_upstream_op_sync(typename TypeSelect<S>::peers_type *primary,
-    ngx_dynamic_upstream_op_t *op, ngx_slab_pool_t *shpool, ngx_log_t *log)
+ngx_dynamic_upstream_op_remove_absent(
+    typename TypeSelect<S>::peers_type *primary, ngx_array_t *servers,
+    ngx_dynamic_upstream_op_t *op, ngx_slab_pool_t *shpool, ngx_log_t *log,
+    ngx_flag_t typed, unsigned *count)
 {
     typename TypeSelect<S>::peers_type  *peers;
-    typename TypeSelect<S>::peer_type   *peer;
+    typename TypeSelect<S>::peer_type   *peer, *next;
 
-    unsigned       i, j;
-    ngx_server_t  *server;
-    unsigned       count = 0;
-    ngx_array_t   *servers;
-    ngx_uint_t     hash = op->hash;
+    ngx_int_t   j;
+    ngx_int_t   rc;
+    ngx_str_t   server, name;
 
-    if (ngx_dynamic_upstream_op_hash<S>(primary, op) == NGX_OK) {
+    for (j = 0; j < 2; j++) {
 
-        op->status = NGX_HTTP_NOT_MODIFIED;
+        // backup peers are freed with the last backup peer
 
-        return NGX_OK;
-    }
+        peers = j == 0 ? primary : primary->next;
+        if (peers == NULL)
+            break;
 
-    op->hash = hash;
+        for (peer = peers->peer; peer != NULL; peer = next) {
 
-    ngx_pool_auto guard(log);
+            next = peer->next;
 
-    if (guard.pool == NULL) {
+            if ((peer->name.data[0] == '['
+                 && !(op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_IPV6))
+                || ngx_dynamic_upstream_op_peer_server<S>(servers, peer,
+                       typed ? j : -1) == NULL) {
 
-        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
-        op->err = "no memory";
+                // del compares with the server and the name after
+                // the peer is freed
 
-        return NGX_ERROR;
-    }
+                server.data = (u_char *) ngx_alloc(peer->server.len
+                    + peer->name.len, log);
+                if (server.data == NULL) {
 
-    servers = ngx_array_create(guard.pool, 100, sizeof(ngx_server_t));
-    if (servers == NULL) {
+                    op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+                    op->err = "no memory";
 
-        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
-        op->err = "no memory";
+                    return NGX_ERROR;
+                }
 
-        return NGX_ERROR;
-    }
+                server.len = peer->server.len;
+                ngx_memcpy(server.data, peer->server.data, server.len);
 
-again:
+                name.data = server.data + server.len;
+                name.len = peer->name.len;
+                ngx_memcpy(name.data, peer->name.data, name.len);
 
-    if (ngx_dynamic_upstream_op_servers<S>(primary,
-                                           servers,
-                                           guard.pool,
-                                           &hash)
-            == NGX_ERROR)
-    {
-        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
-        op->err = "no memory";
-        return NGX_ERROR;
-    }
+                op->server = server;
+                op->name = name;
 
-    server = (ngx_server_t *) servers->elts;
+                rc = ngx_dynamic_upstream_op_del<S>(primary, op, shpool, log);
 
-    for (j = 0; j < servers->nelts; j++) {
+                ngx_str_null(&op->server);
+                ngx_str_null(&op->name);
 
-        op->server = server[j].name;
+                ngx_free(server.data);
 
-        if (ngx_dynamic_upstream_parse_url(&server[j].u, guard.pool,
-                                           op) != NGX_OK) {
+                if (rc == NGX_ERROR)
+                    return NGX_ERROR;
 
-            ngx_log_error(NGX_LOG_WARN, log, 0, "%V: server %V: %s",
-                          &op->upstream, &op->server, op->err);
+                // the placeholder of an empty upstream is not removed
 
-            op->status = NGX_HTTP_OK;
-            op->err = NULL;
+                if (op->status == NGX_HTTP_OK)
+                    (*count)++;
+            }
         }
     }
 
-    ngx_upstream_rr_peers_wlock<typename TypeSelect<S>::peers_type> wl(primary);
+    return NGX_OK;
+}
+
 
-    if (ngx_dynamic_upstream_op_check_hash<S>(primary, &hash) == NGX_DECLINED) {
+// weights of SRV records go to the existing peers
 
-        servers->nelts = 0;
-        goto again;
+template <class S> static void
+ngx_dynamic_upstream_op_srv_weights(
+    typename TypeSelect<S>::peers_type *primary, ngx_array_t *servers,
+    ngx_dynamic_upstream_op_t *op, ngx_log_t *log, unsigned *count)
+{
+    typename TypeSelect<S>::peers_type  *peers;
+    typename TypeSelect<S>::peer_type   *peer;
+
+    ngx_server_t  *s;
+    ngx_uint_t     i, j;
+    ngx_int_t      op_param = op->op_param;
+
+    op->op_param = NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT;
+
+    for (peers = primary, j = 0;
+         peers != NULL && j < 2;
+         peers = peers->next, j++) {
+
+        for (peer = peers->peer;
+             peer != NULL;
+             peer = peer->next) {
+
+            s = ngx_dynamic_upstream_op_peer_server<S>(servers, peer, -1);
+            if (s == NULL || s->weights == NULL)
+                continue;
+
+            for (i = 0; i < s->nweights; i++)
+                if (str_eq(s->u.addrs[i].name, peer->name))
+                    break;
+
+            if (i == s->nweights || peer->weight == s->weights[i])
+                continue;
+
+            op->weight = s->weights[i];
+
+            ngx_dynamic_upstream_op_update_peer<S>(peers, peer, op, log);
+
+            op->updated++;
+            (*count)++;
+        }
     }
 
+    op->op_param = op_param;
+}
+
+
+// brings the peers to the set of servers under the write lock,
+// sync keeps parameters of existing peers, replace updates them
+// and moves peers between primary and backup
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_op_apply(typename TypeSelect<S>::peers_type *primary,
+    ngx_array_t *servers, ngx_dynamic_upstream_op_t *op,
+    ngx_slab_pool_t *shpool, ngx_log_t *log, ngx_flag_t replace)
+{
+    typename TypeSelect<S>::peers_type  *peers;
+    typename TypeSelect<S>::peer_type   *peer;
+
+    unsigned       i, j;
+    ngx_server_t  *server = (ngx_server_t *) servers->elts, *s;
+    unsigned       count = 0;
+    size_t         need = 0;
+
+    for (j = 0; op->high_water != 0 && j < servers->nelts; j++)
+        for (i = 0; i < server[j].u.naddrs; i++)
+            if (ngx_dynamic_upstream_op_peer_missing<S>(primary,
+                    server[j].name, server[j].u.addrs[i].name))
+                need += ngx_dynamic_upstream_op_peer_size<S>(&server[j].u.url,
+                    &server[j].u.addrs[i].name, server[j].u.addrs[i].socklen);
+
+    if (ngx_dynamic_upstream_op_check_zone(op, shpool, need) == NGX_ERROR)
+        return NGX_ERROR;
+
     op->no_lock = 1;
 
+    if (replace && ngx_dynamic_upstream_op_remove_absent<S>(primary, servers,
+                       op, shpool, log, 1, &count) == NGX_ERROR)
+        return NGX_ERROR;
+
     op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT;
     op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS;
     op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT;
@@ -721,11 +991,24 @@ again:
 #endif
         op->fail_timeout = server[j].fail_timeout;
 
+        if (replace) {
+
+            op->down = server[j].down;
+
+            if (op->down)
+                op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN;
+            else
+                op->op_param &= ~NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN;
+        }
+
         for (i = 0; i < server[j].u.naddrs; i++) {
 
-            if (str_eq(op->server, server[j].u.addrs[i].name))
+            if (!replace && str_eq(op->server, server[j].u.addrs[i].name))
                 break;
 
+            if (i < server[j].nweights)
+                op->weight = server[j].weights[i];
+
             if (ngx_dynamic_upstream_op_add_peer<S>
                     (log, op, shpool, primary, &server[j].u, i) == NGX_ERROR)
                 return NGX_ERROR;
@@ -735,6 +1018,19 @@ again:
         }
     }
 
+    // the placeholder of an empty upstream goes away here
+
+    if (ngx_dynamic_upstream_op_remove_absent<S>(primary, servers, op, shpool,
+            log, replace, &count) == NGX_ERROR)
+        return NGX_ERROR;
+
+    if (!replace) {
+
+        ngx_dynamic_upstream_op_srv_weights<S>(primary, servers, op, log,
+                                               &count);
+        goto done;
+    }
+
     for (peers = primary, j = 0;
          peers != NULL && j < 2;
          peers = peers->next, j++) {
@@ -743,35 +1039,861 @@ again:
              peer != NULL;
              peer = peer->next) {
 
-            if ((peer->name.data[0] == '['
-                 && !(op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_IPV6))
-                || !ngx_dynamic_upstream_op_peer_exist<S>(servers, peer)) {
+            s = ngx_dynamic_upstream_op_peer_server<S>(servers, peer, j);
+            if (s == NULL)
+                continue;
 
-                op->server = peer->server;
-                op->name = peer->name;
+            op->op_param &= ~(NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT
+                              | NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS
+                              | NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT
+#if defined(nginx_version) && (nginx_version >= 1011005)
+                              | NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_CONNS
+#endif
+                              | NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN);
 
-                if (ngx_dynamic_upstream_op_del<S>(primary, op, shpool, log)
-                        == NGX_ERROR)
-                    return NGX_ERROR;
+            op->weight       = s->weight;
+            op->max_fails    = s->max_fails;
+            op->fail_timeout = s->fail_timeout;
+            op->down         = 1;
+
+            if (peer->weight != s->weight)
+                op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT;
+
+            if (peer->max_fails != (ngx_uint_t) s->max_fails)
+                op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS;
+
+            if (peer->fail_timeout != (time_t) s->fail_timeout)
+                op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT;
+
+#if defined(nginx_version) && (nginx_version >= 1011005)
+            op->max_conns = s->max_conns;
 
+            if (peer->max_conns != (ngx_uint_t) s->max_conns)
+                op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_CONNS;
+#endif
+
+            if (s->down && !peer->down)
+                op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN;
+
+            if (op->op_param & (NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT
+                                | NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS
+                                | NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT
+#if defined(nginx_version) && (nginx_version >= 1011005)
+                                | NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_CONNS
+#endif
+                                | NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN)) {
+
+                ngx_dynamic_upstream_op_update_peer<S>(peers, peer, op, log);
+
+                op->updated++;
                 count++;
             }
         }
     }
 
-    op->hash = hash;
+done:
+
     op->status = count != 0 ? NGX_HTTP_OK : NGX_HTTP_NOT_MODIFIED;
 
     return NGX_OK;
 }
 
 
-typedef ngx_int_t (*cleanup_t) (ngx_slab_pool_t *shpool, void *peer);
+// a domain name failing to resolve in sync is retried after the
+// 'dns_update' interval doubled with every failure in a row, up to
+// 'dns_max_backoff', its last known peers are kept until 'dns_max_stale'
 
+static ngx_dynamic_upstream_dns_name_t *
+ngx_dynamic_upstream_dns_find(ngx_dynamic_upstream_dns_t *dns,
+    ngx_str_t name)
+{
+    ngx_dynamic_upstream_dns_name_t  *n;
+    ngx_uint_t                        j;
 
-typedef struct {
-    ngx_slab_pool_t  *shpool;
-    void             *peer;
+    if (dns == NULL || dns->names == NULL)
+        return NULL;
+
+    n = (ngx_dynamic_upstream_dns_name_t *) dns->names->elts;
+
+    for (j = 0; j < dns->names->nelts; j++)
+        if (str_eq(n[j].name, name))
+            return &n[j];
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_dns_init(ngx_dynamic_upstream_dns_t *dns, ngx_log_t *log)
+{
+    if (dns->pool != NULL)
+        return NGX_OK;
+
+    dns->pool = ngx_create_pool(1024, log);
+    if (dns->pool == NULL)
+        return NGX_ERROR;
+
+    dns->names = ngx_array_create(dns->pool, 10,
+        sizeof(ngx_dynamic_upstream_dns_name_t));
+    dns->held = ngx_array_create(dns->pool, 10,
+        sizeof(ngx_dynamic_upstream_dns_addr_t));
+
+    if (dns->names == NULL || dns->held == NULL) {
+
+        ngx_destroy_pool(dns->pool);
+        dns->pool = NULL;
+        dns->names = NULL;
+        dns->held = NULL;
+
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_dynamic_upstream_dns_name_t *
+ngx_dynamic_upstream_dns_failed(ngx_dynamic_upstream_dns_t *dns,
+    ngx_dynamic_upstream_dns_name_t *n, ngx_str_t name, time_t now,
+    ngx_log_t *log)
+{
+    time_t      delay;
+    ngx_uint_t  j;
+
+    if (n == NULL) {
+
+        if (ngx_dynamic_upstream_dns_init(dns, log) == NGX_ERROR)
+            return NULL;
+
+        n = (ngx_dynamic_upstream_dns_name_t *) ngx_array_push(dns->names);
+        if (n == NULL)
+            return NULL;
+
+        n->name.data = (u_char *) ngx_pnalloc(dns->pool, name.len);
+        if (n->name.data == NULL) {
+
+            dns->names->nelts--;
+            return NULL;
+        }
+
+        ngx_memcpy(n->name.data, name.data, name.len);
+        n->name.len = name.len;
+        n->failures = 0;
+        n->failed = now;
+        n->expired = 0;
+    }
+
+    n->failures++;
+    n->seen = now;
+
+    delay = dns->interval;
+
+    for (j = 1; j < n->failures && delay < dns->max_backoff; j++)
+        delay *= 2;
+
+    if (delay > dns->max_backoff)
+        delay = ngx_max(dns->max_backoff, dns->interval);
+
+    n->next = now + delay;
+
+    return n;
+}
+
+
+// address of a resolved name which is missing in the answer, counts
+// the resolutions in a row
+
+static ngx_dynamic_upstream_dns_addr_t *
+ngx_dynamic_upstream_dns_absent(ngx_dynamic_upstream_dns_t *dns,
+    ngx_str_t server, ngx_str_t name, time_t now, ngx_log_t *log)
+{
+    ngx_dynamic_upstream_dns_addr_t  *a;
+    ngx_uint_t                        j;
+
+    if (ngx_dynamic_upstream_dns_init(dns, log) == NGX_ERROR)
+        return NULL;
+
+    a = (ngx_dynamic_upstream_dns_addr_t *) dns->held->elts;
+
+    for (j = 0; j < dns->held->nelts; j++) {
+
+        if (str_eq(a[j].server, server) && str_eq(a[j].name, name)) {
+
+            if (a[j].seen != now) {
+
+                a[j].absent++;
+                a[j].seen = now;
+            }
+
+            return &a[j];
+        }
+    }
+
+    a = (ngx_dynamic_upstream_dns_addr_t *) ngx_array_push(dns->held);
+    if (a == NULL)
+        return NULL;
+
+    a->server.data = (u_char *) ngx_pnalloc(dns->pool,
+                                            server.len + name.len);
+    if (a->server.data == NULL) {
+
+        dns->held->nelts--;
+        return NULL;
+    }
+
+    a->server.len = server.len;
+    ngx_memcpy(a->server.data, server.data, server.len);
+
+    a->name.data = a->server.data + server.len;
+    a->name.len = name.len;
+    ngx_memcpy(a->name.data, name.data, name.len);
+
+    a->absent = 1;
+    a->since = now;
+    a->seen = now;
+
+    return a;
+}
+
+
+// with 'dns_subset' a large answer is cut to the addresses with the
+// highest rendezvous weights for the instance id, every instance gets
+// its own subset and a change of the answer moves few addresses
+
+typedef struct {
+    uint32_t     weight;
+    ngx_addr_t  *addr;
+} ngx_dynamic_upstream_dns_rank_t;
+
+
+static int
+ngx_dynamic_upstream_dns_rank_cmp(const void *one, const void *two)
+{
+    const ngx_dynamic_upstream_dns_rank_t  *l, *r;
+
+    l = (const ngx_dynamic_upstream_dns_rank_t *) one;
+    r = (const ngx_dynamic_upstream_dns_rank_t *) two;
+
+    if (l->weight != r->weight)
+        return l->weight > r->weight ? -1 : 1;
+
+    return ngx_memn2cmp(l->addr->name.data, r->addr->name.data,
+                        l->addr->name.len, r->addr->name.len);
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_dns_subset(ngx_dynamic_upstream_dns_t *dns,
+    ngx_url_t *u, ngx_pool_t *pool, ngx_flag_t ipv6)
+{
+    ngx_dynamic_upstream_dns_rank_t  *rank;
+    ngx_addr_t                       *addrs;
+    ngx_uint_t                        i, n;
+    uint32_t                          h;
+
+    if (dns == NULL || dns->subset == 0 || u->naddrs <= dns->subset)
+        return NGX_OK;
+
+    rank = (ngx_dynamic_upstream_dns_rank_t *) ngx_palloc(pool,
+        u->naddrs * sizeof(ngx_dynamic_upstream_dns_rank_t));
+    if (rank == NULL)
+        return NGX_ERROR;
+
+    for (i = 0, n = 0; i < u->naddrs; i++) {
+
+        // ipv6 peers are not added without 'dns_ipv6'
+
+        if (u->addrs[i].name.data[0] == '[' && !ipv6)
+            continue;
+
+        ngx_crc32_init(h);
+        ngx_crc32_update(&h, dns->subset_id.data, dns->subset_id.len);
+        ngx_crc32_update(&h, (u_char *) "", 1);
+        ngx_crc32_update(&h, u->addrs[i].name.data, u->addrs[i].name.len);
+        ngx_crc32_final(h);
+
+        // crc32 is linear, the finalizer of murmur3 spreads the weights
+
+        h ^= h >> 16;
+        h *= 0x85ebca6b;
+        h ^= h >> 13;
+        h *= 0xc2b2ae35;
+        h ^= h >> 16;
+
+        rank[n].weight = h;
+        rank[n].addr = &u->addrs[i];
+        n++;
+    }
+
+    if (n <= dns->subset)
+        return NGX_OK;
+
+    ngx_qsort(rank, n, sizeof(ngx_dynamic_upstream_dns_rank_t),
+              ngx_dynamic_upstream_dns_rank_cmp);
+
+    addrs = (ngx_addr_t *) ngx_palloc(pool, dns->subset * sizeof(ngx_addr_t));
+    if (addrs == NULL)
+        return NGX_ERROR;
+
+    for (i = 0; i < dns->subset; i++)
+        addrs[i] = *rank[i].addr;
+
+    u->addrs = addrs;
+    u->naddrs = dns->subset;
+
+    return NGX_OK;
+}
+
+
+// with 'dns_hold_down' the answer of a name is extended by its peers
+// absent less than the configured number of resolutions or time, so
+// the upstream keeps the union of the recent answers
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_dns_hold(typename TypeSelect<S>::peers_type *primary,
+    ngx_array_t *servers, ngx_dynamic_upstream_op_t *op, ngx_pool_t *pool,
+    time_t now, ngx_log_t *log)
+{
+    typename TypeSelect<S>::peers_type  *peers;
+    typename TypeSelect<S>::peer_type   *peer;
+
+    ngx_dynamic_upstream_dns_t       *dns = op->dns;
+    ngx_dynamic_upstream_dns_addr_t  *a;
+    ngx_server_t                     *server;
+    ngx_array_t                      *addrs;
+    ngx_addr_t                       *addr;
+    ngx_uint_t                        i, j, k;
+
+    if (dns == NULL || (dns->hold_count == 0 && dns->hold_time == 0))
+        return NGX_OK;
+
+    server = (ngx_server_t *) servers->elts;
+
+    for (j = 0; j < servers->nelts; j++) {
+
+        if (server[j].u.naddrs == 0
+            || is_reserved_addr(&server[j].u.addrs[0].name))
+            continue;
+
+        addrs = NULL;
+
+        for (peers = primary, k = 0;
+             peers != NULL && k < 2;
+             peers = peers->next, k++) {
+
+            for (peer = peers->peer;
+                 peer != NULL;
+                 peer = peer->next) {
+
+                if (!str_eq(peer->server, server[j].name)
+                    || is_reserved_addr(&peer->name))
+                    continue;
+
+                for (i = 0; i < server[j].u.naddrs; i++)
+                    if (str_eq(server[j].u.addrs[i].name, peer->name))
+                        break;
+
+                if (i < server[j].u.naddrs)
+                    continue;
+
+                a = ngx_dynamic_upstream_dns_absent(dns, peer->server,
+                                                    peer->name, now, log);
+                if (a == NULL)
+                    goto nomem;
+
+                if ((dns->hold_count == 0 || a->absent >= dns->hold_count)
+                    && (dns->hold_time == 0
+                        || now - a->since >= dns->hold_time))
+                    continue;
+
+                if (addrs == NULL) {
+
+                    addrs = ngx_array_create(pool, server[j].u.naddrs + 4,
+                                             sizeof(ngx_addr_t));
+                    if (addrs == NULL)
+                        goto nomem;
+
+                    for (i = 0; i < server[j].u.naddrs; i++) {
+
+                        addr = (ngx_addr_t *) ngx_array_push(addrs);
+                        if (addr == NULL)
+                            goto nomem;
+
+                        *addr = server[j].u.addrs[i];
+                    }
+                }
+
+                addr = (ngx_addr_t *) ngx_array_push(addrs);
+                if (addr == NULL)
+                    goto nomem;
+
+                addr->sockaddr = (struct sockaddr *) ngx_palloc(pool,
+                    peer->socklen);
+                if (addr->sockaddr == NULL)
+                    goto nomem;
+
+                ngx_memcpy(addr->sockaddr, peer->sockaddr, peer->socklen);
+                addr->socklen = peer->socklen;
+                addr->name = a->name;
+
+                if (a->absent == 1)
+                    ngx_log_error(NGX_LOG_INFO, log, 0,
+                                  "%V: server %V peer %V: absent in dns, "
+                                  "held down", &op->upstream, &peer->server,
+                                  &peer->name);
+            }
+        }
+
+        if (addrs != NULL) {
+
+            server[j].u.addrs = (ngx_addr_t *) addrs->elts;
+            server[j].u.naddrs = addrs->nelts;
+        }
+    }
+
+    return NGX_OK;
+
+nomem:
+
+    op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    op->err = "no memory";
+
+    return NGX_ERROR;
+}
+
+
+// forgets the names resolved or gone from the upstream and the
+// addresses back in the answer or removed
+
+static void
+ngx_dynamic_upstream_dns_forget(ngx_dynamic_upstream_dns_t *dns, time_t now)
+{
+    ngx_dynamic_upstream_dns_name_t  *n;
+    ngx_dynamic_upstream_dns_addr_t  *a;
+    ngx_uint_t                        i, j;
+
+    if (dns == NULL || dns->pool == NULL)
+        return;
+
+    n = (ngx_dynamic_upstream_dns_name_t *) dns->names->elts;
+
+    for (i = 0, j = 0; j < dns->names->nelts; j++)
+        if (n[j].seen == now)
+            n[i++] = n[j];
+
+    dns->names->nelts = i;
+
+    a = (ngx_dynamic_upstream_dns_addr_t *) dns->held->elts;
+
+    for (i = 0, j = 0; j < dns->held->nelts; j++)
+        if (a[j].seen == now)
+            a[i++] = a[j];
+
+    dns->held->nelts = i;
+
+    if (dns->names->nelts == 0 && dns->held->nelts == 0) {
+
+        ngx_destroy_pool(dns->pool);
+        dns->pool = NULL;
+        dns->names = NULL;
+        dns->held = NULL;
+    }
+}
+
+
+// SRV discovery of a server named as a service, the background sync only
+
+static ngx_int_t
+ngx_dynamic_upstream_parse_srv(ngx_server_t *server, ngx_pool_t *pool,
+    ngx_dynamic_upstream_op_t *op)
+{
+    ngx_url_t  *u = &server->u;
+
+    ngx_memzero(u, sizeof(ngx_url_t));
+
+    u->url = server->name;
+    u->host = server->name;
+
+    if (ngx_dynamic_upstream_srv_resolve(u, pool, &server->weights,
+                                         op->dns->interval,
+                                         op->dns->srv_resolver) != NGX_OK) {
+
+        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        op->err = u->err ? u->err : "failed to resolve";
+
+        return NGX_ERROR;
+    }
+
+    server->nweights = u->naddrs;
+
+    return NGX_OK;
+}
+
+
+// the second half of sync under the write lock
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_op_commit(typename TypeSelect<S>::peers_type *primary,
+    ngx_array_t *servers, ngx_dynamic_upstream_op_t *op,
+    ngx_slab_pool_t *shpool, ngx_pool_t *pool, time_t now, ngx_log_t *log)
+{
+    if (ngx_dynamic_upstream_dns_hold<S>(primary, servers, op, pool, now,
+                                         log) == NGX_ERROR)
+        return NGX_ERROR;
+
+    // names and addresses are seen by the resolve in the same second
+
+    ngx_dynamic_upstream_dns_forget(op->dns, now);
+
+    if (ngx_dynamic_upstream_op_apply<S>(primary, servers, op, shpool, log, 0)
+            == NGX_ERROR)
+        return NGX_ERROR;
+
+    // the hash of the synced peers for the next sync
+
+    ngx_dynamic_upstream_op_check_hash<S>(primary, &op->hash);
+
+    return NGX_OK;
+}
+
+
+// resolves the servers, the peers are not locked meanwhile
+
+static ngx_int_t
+ngx_dynamic_upstream_op_resolve_servers(ngx_array_t *servers,
+    ngx_pool_t *pool, ngx_dynamic_upstream_op_t *op, ngx_log_t *log,
+    time_t now)
+{
+    unsigned       j;
+    ngx_server_t  *server = (ngx_server_t *) servers->elts;
+    ngx_int_t      rc;
+
+    ngx_dynamic_upstream_dns_name_t  *failed;
+
+    for (j = 0; j < servers->nelts; j++) {
+
+        op->server = server[j].name;
+
+        failed = ngx_dynamic_upstream_dns_find(op->dns, op->server);
+
+        if (failed != NULL && failed->next > now) {
+
+            // backs off, the last known peers are kept
+
+            ngx_memzero(&server[j].u, sizeof(ngx_url_t));
+            failed->seen = now;
+
+            goto stale;
+        }
+
+        if (op->dns != NULL && ngx_dynamic_upstream_is_srv(op->server))
+            rc = ngx_dynamic_upstream_parse_srv(&server[j], pool, op);
+        else
+            rc = ngx_dynamic_upstream_parse_url(&server[j].u, pool, op);
+
+        if (rc == NGX_OK) {
+
+            // the weights of SRV targets are not subset
+
+            if (server[j].weights == NULL
+                && ngx_dynamic_upstream_dns_subset(op->dns, &server[j].u,
+                    pool, op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_IPV6)
+                    == NGX_ERROR) {
+
+                op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+                op->err = "no memory";
+
+                return NGX_ERROR;
+            }
+
+            if (failed != NULL) {
+
+                ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                              "%V: server %V: resolved after %ui failures",
+                              &op->upstream, &op->server, failed->failures);
+                failed->seen = 0;
+                failed->next = 0;
+            }
+
+            continue;
+        }
+
+        op->resolve_failed++;
+
+        if (op->dns == NULL) {
+
+            ngx_log_error(NGX_LOG_WARN, log, 0, "%V: server %V: %s",
+                          &op->upstream, &op->server, op->err);
+
+            op->status = NGX_HTTP_OK;
+            op->err = NULL;
+
+            continue;
+        }
+
+        failed = ngx_dynamic_upstream_dns_failed(op->dns, failed, op->server,
+                                                 now, log);
+
+        if (failed == NULL || failed->failures == 1)
+            ngx_log_error(NGX_LOG_WARN, log, 0, "%V: server %V: %s",
+                          &op->upstream, &op->server, op->err);
+        else
+            ngx_log_error(NGX_LOG_INFO, log, 0,
+                          "%V: server %V: %s, %ui failures, next in %Ts",
+                          &op->upstream, &op->server, op->err,
+                          failed->failures, failed->next - now);
+
+        op->status = NGX_HTTP_OK;
+        op->err = NULL;
+
+        if (failed == NULL)
+            continue;
+
+stale:
+
+        if (op->dns->max_stale == 0
+            || now - failed->failed < op->dns->max_stale)
+            continue;
+
+        // the name is kept by the placeholder
+
+        if (!failed->expired) {
+
+            ngx_log_error(NGX_LOG_WARN, log, 0, "%V: server %V: "
+                          "failed to resolve for %Ts, stale peers removed",
+                          &op->upstream, &op->server, now - failed->failed);
+            failed->expired = 1;
+        }
+
+        op->op_param &= ~NGX_DYNAMIC_UPSTEAM_OP_PARAM_RESOLVE_SYNC;
+
+        if (ngx_dynamic_upstream_parse_url(&server[j].u, pool, op)
+                != NGX_AGAIN)
+            ngx_memzero(&server[j].u, sizeof(ngx_url_t));
+
+        op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_RESOLVE_SYNC;
+        op->status = NGX_HTTP_OK;
+        op->err = NULL;
+    }
+
+    return NGX_OK;
+}
+
+
+// the first half of sync, may run in a thread: the servers of the
+// peers are resolved to op->servers in op->pool at op->now, the peers
+// are changed by the sync with these servers on the event loop
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_op_resolve(typename TypeSelect<S>::peers_type *primary,
+    ngx_dynamic_upstream_op_t *op, ngx_log_t *log)
+{
+    ngx_array_t  *servers;
+
+    if (op->pool == NULL || op->now == 0) {
+
+        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        op->err = "no pool or time";
+
+        return NGX_ERROR;
+    }
+
+    servers = ngx_array_create(op->pool, 100, sizeof(ngx_server_t));
+    if (servers == NULL
+        || ngx_dynamic_upstream_op_servers<S>(primary, servers, op->pool,
+                                              &op->hash, op->lock_stat)
+               == NGX_ERROR) {
+
+        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        op->err = "no memory";
+
+        return NGX_ERROR;
+    }
+
+    if (ngx_dynamic_upstream_op_resolve_servers(servers, op->pool, op, log,
+                                                op->now) == NGX_ERROR)
+        return NGX_ERROR;
+
+    op->servers = servers;
+
+    return NGX_OK;
+}
+
+
+// with op->servers resolved by ngx_dynamic_upstream_op_resolve() the
+// sync is declined if the servers are changed in between
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_op_sync(typename TypeSelect<S>::peers_type *primary,
+    ngx_dynamic_upstream_op_t *op, ngx_slab_pool_t *shpool, ngx_log_t *log)
+{
+    ngx_array_t   *servers = op->servers;
+    ngx_uint_t     hash = op->hash;
+    time_t         now = ngx_time();
+
+    ngx_pool_auto guard(log);
+
+    if (guard.pool == NULL) {
+
+        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        op->err = "no memory";
+
+        return NGX_ERROR;
+    }
+
+    if (servers != NULL) {
+
+        ngx_upstream_rr_peers_wlock<typename TypeSelect<S>::peers_type>
+            wl(primary, 0, op->lock_stat);
+
+        if (ngx_dynamic_upstream_op_check_hash<S>(primary, &hash)
+                == NGX_DECLINED) {
+
+            op->status = NGX_HTTP_NOT_MODIFIED;
+            op->err = "servers changed while resolved";
+
+            return NGX_DECLINED;
+        }
+
+        return ngx_dynamic_upstream_op_commit<S>(primary, servers, op,
+                                                 shpool, guard.pool, op->now,
+                                                 log);
+    }
+
+    if (ngx_dynamic_upstream_op_hash<S>(primary, op) == NGX_OK) {
+
+        op->status = NGX_HTTP_NOT_MODIFIED;
+
+        return NGX_OK;
+    }
+
+    op->hash = hash;
+
+    servers = ngx_array_create(guard.pool, 100, sizeof(ngx_server_t));
+    if (servers == NULL) {
+
+        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        op->err = "no memory";
+
+        return NGX_ERROR;
+    }
+
+again:
+
+    if (ngx_dynamic_upstream_op_servers<S>(primary,
+                                           servers,
+                                           guard.pool,
+                                           &hash,
+                                           op->lock_stat)
+            == NGX_ERROR)
+    {
+        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        op->err = "no memory";
+        return NGX_ERROR;
+    }
+
+    if (ngx_dynamic_upstream_op_resolve_servers(servers, guard.pool, op, log,
+                                                now) == NGX_ERROR)
+        return NGX_ERROR;
+
+    ngx_upstream_rr_peers_wlock<typename TypeSelect<S>::peers_type> wl(primary,
+        0, op->lock_stat);
+
+    if (ngx_dynamic_upstream_op_check_hash<S>(primary, &hash) == NGX_DECLINED) {
+
+        servers->nelts = 0;
+        goto again;
+    }
+
+    return ngx_dynamic_upstream_op_commit<S>(primary, servers, op, shpool,
+                                             guard.pool, now, log);
+}
+
+
+// the desired set of servers comes with the request, domain names are
+// not resolved here and are added as down peers until the background
+// sync resolves them, peers of a known domain name are kept
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_op_replace(typename TypeSelect<S>::peers_type *primary,
+    ngx_dynamic_upstream_op_t *op, ngx_slab_pool_t *shpool, ngx_log_t *log)
+{
+    ngx_server_t  *server;
+    unsigned       j;
+    ngx_int_t      rc;
+    ngx_str_t      name;
+
+    if (op->servers == NULL) {
+
+        op->status = NGX_HTTP_BAD_REQUEST;
+        op->err = "servers required";
+
+        return NGX_ERROR;
+    }
+
+    ngx_pool_auto guard(log);
+
+    if (guard.pool == NULL) {
+
+        op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        op->err = "no memory";
+
+        return NGX_ERROR;
+    }
+
+    server = (ngx_server_t *) op->servers->elts;
+
+    for (j = 0; j < op->servers->nelts; j++) {
+
+        op->server = server[j].name;
+
+        rc = ngx_dynamic_upstream_parse_url(&server[j].u, guard.pool, op);
+
+        if (rc == NGX_ERROR) {
+
+            op->status = NGX_HTTP_BAD_REQUEST;
+            return NGX_ERROR;
+        }
+
+        if (rc == NGX_AGAIN) {
+
+            if (!(op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_RESOLVE)) {
+
+                op->status = NGX_HTTP_BAD_REQUEST;
+                op->err = "domain names are supported only for upstreams "
+                          "with 'dns_update' directive";
+
+                return NGX_ERROR;
+            }
+
+            // the placeholder is added down by op_add_peer, a forced 'down'
+            // here would mark down the peers of an already known name
+        }
+    }
+
+    ngx_upstream_rr_peers_wlock<typename TypeSelect<S>::peers_type> wl(primary,
+        op->no_lock, op->lock_stat);
+
+    ngx_str_null(&name);
+
+    for (j = 0; j < op->servers->nelts; j++)
+        if (server[j].u.naddrs == 1
+            && is_reserved_addr(&server[j].u.addrs[0].name)
+            && !is_reserved_addr(&server[j].name)
+            && !ngx_dynamic_upstream_op_peer_missing<S>(primary,
+                    server[j].name, name))
+            server[j].u.naddrs = 0;
+
+    return ngx_dynamic_upstream_op_apply<S>(primary, op->servers, op, shpool,
+                                            log, 1);
+}
+
+typedef ngx_int_t (*cleanup_t) (ngx_slab_pool_t *shpool, void *peer);
+
+
+typedef struct {
+    ngx_slab_pool_t  *shpool;
+    void             *peer;
     cleanup_t         free;
 } ngx_dynamic_cleanup_t;
 
@@ -825,6 +1947,8 @@ ngx_dynamic_add_to_trash(ngx_slab_pool_t *shpool, void *peer, cleanup_t cb)
         p->shpool = shpool;
         p->peer = peer;
         p->free = cb;
+
+        ngx_dynamic_upstream_metrics_trash(1);
     }
 }
 
@@ -842,6 +1966,9 @@ ngx_dynamic_cleanup(ngx_event_t *ev)
         if (elts[i].free(elts[i].shpool, elts[i].peer) == -1)
             elts[j++] = elts[i];
 
+    ngx_dynamic_upstream_metrics_trash((ngx_atomic_int_t) j
+                                       - (ngx_atomic_int_t) trash->nelts);
+
     trash->nelts = j;
 
 settimer:
@@ -921,7 +2048,7 @@ ngx_dynamic_upstream_op_del(typename TypeSelect<S>::peers_type *primary,
     op->status = NGX_HTTP_OK;
 
     ngx_upstream_rr_peers_wlock<typename TypeSelect<S>::peers_type> wl(primary,
-        op->no_lock);
+        op->no_lock, op->lock_stat);
 
 again:
 
@@ -1011,6 +2138,14 @@ del:
 
  ok:
 
+    ngx_dynamic_upstream_chash_del(op->chash, peers, deleted);
+    ngx_dynamic_upstream_p2c_del(op->p2c, peers, deleted);
+    ngx_dynamic_upstream_outlier_del(op->outlier, peers, deleted);
+
+    op->removed++;
+    op->freed += ngx_dynamic_upstream_op_peer_size<S>(&deleted->server,
+        &deleted->name, deleted->socklen);
+
     peers->number--;
     peers->total_weight -= deleted->weight;
     peers->single = peers->number == 1;
@@ -1021,6 +2156,8 @@ del:
         assert(peers == backup);
         primary->next = NULL;
         ngx_slab_free(shpool, backup);
+
+        op->freed += sizeof(typename TypeSelect<S>::peers_type);
     }
 
     if (!is_reserved_addr(&deleted->name))
@@ -1043,13 +2180,13 @@ ngx_dynamic_upstream_op_update_peer(typename TypeSelect<S>::peers_type *peers,
 
     if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT) {
 
-        peers->total_weight -= peer->weight;
-        peers->total_weight += op->weight;
-        peers->weighted = peers->total_weight != peers->number;
-        peer->weight = op->weight;
-        peer->current_weight = op->weight;
-        peer->effective_weight = op->weight;
+        if (ngx_dynamic_upstream_chash_weight(op->chash, peers, peer,
+                &peer->name, peer->weight, op->weight) != NGX_OK)
+            ngx_log_error(NGX_LOG_WARN, log, 0, "%V: no shared memory for "
+                          "hash points of peer %V", &op->upstream,
+                          &peer->name);
 
+        ngx_dynamic_upstream_op_set_weight<S>(peers, peer, op->weight);
     }
 
     if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_FAILS)
@@ -1066,6 +2203,7 @@ ngx_dynamic_upstream_op_update_peer(typename TypeSelect<S>::peers_type *peers,
     if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP) {
 
         peer->down = 0;
+        ngx_dynamic_upstream_drain_deadline(peer) = 0;
         peer->checked = ngx_time();
         peer->fails = 0;
 
@@ -1076,12 +2214,32 @@ ngx_dynamic_upstream_op_update_peer(typename TypeSelect<S>::peers_type *peers,
     if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN) {
 
         peer->down = 1;
+        ngx_dynamic_upstream_drain_deadline(peer) = 0;
         peer->checked = ngx_time();
         peer->fails = peer->max_fails;
 
         ngx_log_error(NGX_LOG_NOTICE, log, 0, "%V: down peer %V",
                       &op->upstream, &peer->name);
     }
+
+    if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DRAIN) {
+
+        // removed by the background pass, see ngx_dynamic_upstream_drain()
+
+        peer->down = 1;
+        ngx_dynamic_upstream_drain_deadline(peer) = op->drain != 0
+            ? (ngx_msec_t) (ngx_time() + op->drain)
+            : NGX_DYNAMIC_UPSTREAM_DRAIN_FOREVER;
+
+        ngx_log_error(NGX_LOG_NOTICE, log, 0, "%V: drain peer %V, conns=%ui",
+                      &op->upstream, &peer->name, peer->conns);
+    }
+
+    if ((op->op_param & (NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP
+                         | NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN
+                         | NGX_DYNAMIC_UPSTEAM_OP_PARAM_DRAIN))
+        && !op->ejection)
+        ngx_dynamic_upstream_outlier_reset(op->outlier, peers, peer);
 }
 
 
@@ -1093,10 +2251,10 @@ ngx_dynamic_upstream_op_update(typename TypeSelect<S>::peers_type *primary,
     typename TypeSelect<S>::peer_type   *peer;
 
     ngx_uint_t  j;
-    unsigned    count = 0;
+    unsigned    count = 0, draining = 0;
 
     ngx_upstream_rr_peers_wlock<typename TypeSelect<S>::peers_type> wl(primary,
-        op->no_lock);
+        op->no_lock, op->lock_stat);
 
     for (peers = primary, j = 0;
          peers != NULL && j < 2;
@@ -1110,6 +2268,13 @@ ngx_dynamic_upstream_op_update(typename TypeSelect<S>::peers_type *primary,
                                                           op->server,
                                                           op->name)) {
 
+                // the drain may be started after the peer was probed
+
+                if (op->keep_drain && ngx_dynamic_upstream_draining(peer)) {
+                    draining++;
+                    continue;
+                }
+
                 ngx_dynamic_upstream_op_update_peer<S>(peers, peer, op, log);
                 count++;
             }
@@ -1118,11 +2283,21 @@ ngx_dynamic_upstream_op_update(typename TypeSelect<S>::peers_type *primary,
 
     if (count == 0) {
 
+        if (draining != 0) {
+
+            op->status = NGX_HTTP_CONFLICT;
+            op->err = "peer is draining";
+
+            return NGX_ERROR;
+        }
+
         op->status = NGX_HTTP_BAD_REQUEST;
         op->err = "server or peer is not found";
 
         return NGX_ERROR;
     }
 
+    op->updated += count;
+
     return NGX_OK;
 }
@@ -19,36 +19,72 @@ extern "C" {
 }
 #endif
 
+#include "ngx_dynamic_upstream_metrics.h"
+
+
+// lock_stat is NULL unless dynamic_lock_stats is enabled,
+// only a pointer check is paid then
 
 template <class PeersT>
 class ngx_upstream_rr_peers_lock {
-    PeersT *peers;
-    int     no_lock;
+    PeersT                            *peers;
+    int                                no_lock;
+    ngx_dynamic_upstream_lock_stat_t  *stat;
+    struct timeval                     start;
+
+    ngx_inline void
+    unlock()
+    {
+        ngx_rwlock_unlock(&peers->rwlock);
+
+        if (stat != NULL)
+            ngx_dynamic_upstream_hist_observe(&stat->hold,
+                ngx_dynamic_upstream_elapsed(&start));
+    }
+
+    ngx_inline void
+    acquired()
+    {
+        if (stat != NULL) {
+
+            ngx_dynamic_upstream_hist_observe(&stat->wait,
+                ngx_dynamic_upstream_elapsed(&start));
+            ngx_gettimeofday(&start);
+        }
+    }
 
 protected:
 
-    ngx_upstream_rr_peers_lock(PeersT *p, int no)
-      : peers(p), no_lock(no)
-    {}
+    ngx_upstream_rr_peers_lock(PeersT *p, int no,
+        ngx_dynamic_upstream_lock_stat_t *st)
+      : peers(p), no_lock(no), stat(no ? NULL : st)
+    {
+        if (stat != NULL)
+            ngx_gettimeofday(&start);
+    }
 
     virtual ~ngx_upstream_rr_peers_lock()
     {
         if (!no_lock)
-            ngx_rwlock_unlock(&peers->rwlock);
+            unlock();
     }
 
     ngx_inline void
     rlock()
     {
-        if (!no_lock)
+        if (!no_lock) {
             ngx_rwlock_rlock(&peers->rwlock);
+            acquired();
+        }
     }
 
     ngx_inline void
     wlock()
     {
-        if (!no_lock)
+        if (!no_lock) {
             ngx_rwlock_wlock(&peers->rwlock);
+            acquired();
+        }
     }
 
 public:
@@ -57,7 +93,7 @@ public:
     release()
     {
         if (!no_lock) {
-            ngx_rwlock_unlock(&peers->rwlock);
+            unlock();
             no_lock = 1;
         }
     }
@@ -66,8 +102,9 @@ public:
 
 template <class PeersT> struct ngx_upstream_rr_peers_rlock :
   public ngx_upstream_rr_peers_lock<PeersT> {
-    ngx_upstream_rr_peers_rlock(PeersT *p, int no_lock = 0) :
-        ngx_upstream_rr_peers_lock<PeersT>(p, no_lock)
+    ngx_upstream_rr_peers_rlock(PeersT *p, int no_lock = 0,
+        ngx_dynamic_upstream_lock_stat_t *stat = NULL) :
+        ngx_upstream_rr_peers_lock<PeersT>(p, no_lock, stat)
     {
         this->rlock();
     }
@@ -76,8 +113,9 @@ template <class PeersT> struct ngx_upstream_rr_peers_rlock :
 
 template <class PeersT> struct ngx_upstream_rr_peers_wlock :
   public ngx_upstream_rr_peers_lock<PeersT> {
-    ngx_upstream_rr_peers_wlock(PeersT *p, int no_lock = 0) :
-        ngx_upstream_rr_peers_lock<PeersT>(p, no_lock)
+    ngx_upstream_rr_peers_wlock(PeersT *p, int no_lock = 0,
+        ngx_dynamic_upstream_lock_stat_t *stat = NULL) :
+        ngx_upstream_rr_peers_lock<PeersT>(p, no_lock, stat)
     {
         this->wlock();
     }
@@ -121,6 +159,9 @@ struct TypeSelect<ngx_http_upstream_srv_conf_t> {
     typedef ngx_http_upstream_srv_conf_t   srv_type;
     typedef ngx_http_upstream_rr_peers_t   peers_type;
     typedef ngx_http_upstream_rr_peer_t    peer_type;
+    typedef ngx_http_upstream_server_t     server_type;
+
+    static const ngx_uint_t  stream = 0;
 
     static main_type * main_conf()
     {
@@ -128,6 +169,14 @@ struct TypeSelect<ngx_http_upstream_srv_conf_t> {
             ngx_http_upstream_module);
     }
 
+    // the upstream of the block being parsed
+
+    static srv_type * upstream(ngx_conf_t *cf)
+    {
+        return (srv_type *) ngx_http_conf_get_module_srv_conf(cf,
+            ngx_http_upstream_module);
+    }
+
     static void make_op(ngx_dynamic_upstream_op_t *op)
     {
         op->op_param &= ~NGX_DYNAMIC_UPSTEAM_OP_PARAM_STREAM;
@@ -141,6 +190,9 @@ struct TypeSelect<ngx_stream_upstream_srv_conf_t> {
     typedef ngx_stream_upstream_srv_conf_t   srv_type;
     typedef ngx_stream_upstream_rr_peers_t   peers_type;
     typedef ngx_stream_upstream_rr_peer_t    peer_type;
+    typedef ngx_stream_upstream_server_t     server_type;
+
+    static const ngx_uint_t  stream = 1;
 
     static main_type * main_conf()
     {
@@ -148,6 +200,12 @@ struct TypeSelect<ngx_stream_upstream_srv_conf_t> {
             ngx_stream_upstream_module);
     }
 
+    static srv_type * upstream(ngx_conf_t *cf)
+    {
+        return (srv_type *) ngx_stream_conf_get_module_srv_conf(cf,
+            ngx_stream_upstream_module);
+    }
+
     static void make_op(ngx_dynamic_upstream_op_t *op)
     {
         op->op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_STREAM;
@@ -155,6 +213,55 @@ struct TypeSelect<ngx_stream_upstream_srv_conf_t> {
 };
 
 
+// changes the weight of the peer without a burst of picks:
+// effective_weight is rescaled in proportion, current_weight is reset
+// to zero and its lag is handed to the other peers in proportion to
+// their weights, so the sum of current weights stays zero as in smooth
+// round robin. Requires the peers wlock and the peer lock.
+
+template <class S> void
+ngx_dynamic_upstream_op_set_weight(typename TypeSelect<S>::peers_type *peers,
+    typename TypeSelect<S>::peer_type *peer, ngx_int_t weight)
+{
+    typename TypeSelect<S>::peer_type  *p, *last = NULL;
+
+    ngx_int_t  lag = peer->current_weight, rest, other;
+
+    other = peers->total_weight - peer->weight;
+
+    if (peer->weight > 0)
+        peer->effective_weight = peer->effective_weight * weight
+            / peer->weight;
+    else
+        peer->effective_weight = weight;
+
+    peers->total_weight -= peer->weight;
+    peers->total_weight += weight;
+    peers->weighted = peers->total_weight != peers->number;
+
+    peer->weight = weight;
+    peer->current_weight = 0;
+
+    if (lag == 0 || other <= 0)
+        return;
+
+    rest = lag;
+
+    for (p = peers->peer; p != NULL; p = p->next) {
+
+        if (p == peer)
+            continue;
+
+        p->current_weight += lag * p->weight / other;
+        rest -= lag * p->weight / other;
+        last = p;
+    }
+
+    if (last != NULL)
+        last->current_weight += rest;
+}
+
+
 ngx_int_t ngx_dynamic_upstream_op_impl(ngx_log_t *log,
     ngx_dynamic_upstream_op_t *op, ngx_slab_pool_t *shpool,
     void *peers);
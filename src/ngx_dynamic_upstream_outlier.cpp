@@ -0,0 +1,542 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+extern "C" {
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_stream.h>
+
+}
+
+#include "ngx_dynamic_upstream_module.h"
+#include "ngx_dynamic_upstream_op.h"
+#include "ngx_dynamic_upstream_metrics.h"
+#include "ngx_dynamic_upstream_outlier.h"
+#include "ngx_dynamic_upstream_balancer.h"
+
+
+// first stat with peer >= the peer
+
+static ngx_uint_t
+ngx_dynamic_upstream_outlier_find(ngx_dynamic_upstream_outlier_t *table,
+    void *peer)
+{
+    ngx_uint_t  i = 0, j = table->number, k;
+
+    while (i < j) {
+
+        k = (i + j) / 2;
+
+        if ((uintptr_t) peer > (uintptr_t) table->stat[k].peer)
+            i = k + 1;
+        else
+            j = k;
+    }
+
+    return i;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_outlier_reserve(ngx_dynamic_upstream_outlier_t *table,
+    ngx_uint_t n)
+{
+    ngx_dynamic_upstream_outlier_stat_t  *stat;
+    ngx_uint_t                            size;
+
+    if (n <= table->size)
+        return NGX_OK;
+
+    size = ngx_max(n, ngx_max(table->size * 2, 8));
+
+    stat = (ngx_dynamic_upstream_outlier_stat_t *) ngx_slab_alloc(
+        table->shpool, size * sizeof(ngx_dynamic_upstream_outlier_stat_t));
+    if (stat == NULL)
+        return NGX_ERROR;
+
+    if (table->stat != NULL) {
+
+        ngx_memcpy(stat, table->stat,
+            table->number * sizeof(ngx_dynamic_upstream_outlier_stat_t));
+        ngx_slab_free(table->shpool, table->stat);
+    }
+
+    table->stat = stat;
+    table->size = size;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_dynamic_upstream_outlier_del(ngx_dynamic_upstream_outlier_t *table,
+    void *peers, void *peer)
+{
+    ngx_uint_t  i;
+
+    if (table == NULL || table->peers != peers)
+        return;
+
+    i = ngx_dynamic_upstream_outlier_find(table, peer);
+    if (i == table->number || table->stat[i].peer != peer)
+        return;
+
+    table->number--;
+
+    ngx_memmove(table->stat + i, table->stat + i + 1,
+        (table->number - i) * sizeof(ngx_dynamic_upstream_outlier_stat_t));
+}
+
+
+void
+ngx_dynamic_upstream_outlier_reset(ngx_dynamic_upstream_outlier_t *table,
+    void *peers, void *peer)
+{
+    ngx_uint_t  i;
+
+    if (table == NULL || table->peers != peers)
+        return;
+
+    i = ngx_dynamic_upstream_outlier_find(table, peer);
+    if (i == table->number || table->stat[i].peer != peer)
+        return;
+
+    table->stat[i].ejected = 0;
+}
+
+
+static void
+ngx_dynamic_upstream_outlier_count(ngx_dynamic_upstream_outlier_stat_t *stat,
+    ngx_flag_t failed, ngx_uint_t usec)
+{
+    if (failed)
+        ngx_atomic_fetch_add(&stat->errors, 1);
+    else
+        stat->errors = 0;
+
+    ngx_atomic_fetch_add(&stat->requests, 1);
+    ngx_atomic_fetch_add(&stat->usec, usec);
+}
+
+
+// the peer is known by pc->name which points to the name of the peer,
+// the table has only the peers found in the list. The write lock is
+// taken only for the first result of the peer.
+
+template <class S> static void
+ngx_dynamic_upstream_outlier_observe(ngx_dynamic_upstream_outlier_t *table,
+    ngx_str_t *name, ngx_flag_t failed, ngx_uint_t usec)
+{
+    typedef typename TypeSelect<S>::peers_type  peers_type;
+    typedef typename TypeSelect<S>::peer_type   peer_type;
+
+    peers_type  *peers = (peers_type *) table->peers;
+    peer_type   *peer;
+    ngx_uint_t   i;
+
+    peer = (peer_type *) ((u_char *) name - offsetof(peer_type, name));
+
+    {
+        ngx_upstream_rr_peers_rlock<peers_type> rl(peers);
+
+        i = ngx_dynamic_upstream_outlier_find(table, peer);
+
+        if (i < table->number && table->stat[i].peer == peer) {
+
+            ngx_dynamic_upstream_outlier_count(table->stat + i, failed, usec);
+            return;
+        }
+    }
+
+    ngx_upstream_rr_peers_wlock<peers_type> wl(peers);
+
+    i = ngx_dynamic_upstream_outlier_find(table, peer);
+
+    if (i == table->number || table->stat[i].peer != peer) {
+
+        // the peer may be removed while the request was in flight,
+        // or be a backup one
+
+        for (peer = peers->peer; peer != NULL; peer = peer->next)
+            if (&peer->name == name)
+                break;
+
+        if (peer == NULL)
+            return;
+
+        if (ngx_dynamic_upstream_outlier_reserve(table, table->number + 1)
+                != NGX_OK)
+            return;
+
+        ngx_memmove(table->stat + i + 1, table->stat + i,
+            (table->number - i) * sizeof(ngx_dynamic_upstream_outlier_stat_t));
+
+        ngx_memzero(table->stat + i,
+                    sizeof(ngx_dynamic_upstream_outlier_stat_t));
+
+        table->stat[i].peer = peer;
+        table->number++;
+    }
+
+    ngx_dynamic_upstream_outlier_count(table->stat + i, failed, usec);
+}
+
+
+// wrapper of the balancer, any balancer with the data of its own
+
+template <class S> struct ngx_dynamic_upstream_outlier_data_t {
+    void                                      *data;
+    ngx_event_get_peer_pt                      get;
+    ngx_event_free_peer_pt                     free;
+#if (NGX_SSL)
+    ngx_event_set_peer_session_pt              set_session;
+    ngx_event_save_peer_session_pt             save_session;
+#endif
+    typename BalancerSelect<S>::session_type  *session;
+    ngx_dynamic_upstream_outlier_t            *table;
+    struct timeval                             start;
+};
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_outlier_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_dynamic_upstream_outlier_data_t<S> *od =
+        (ngx_dynamic_upstream_outlier_data_t<S> *) data;
+
+    ngx_gettimeofday(&od->start);
+
+    return od->get(pc, od->data);
+}
+
+
+template <class S> static void
+ngx_dynamic_upstream_outlier_free_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state)
+{
+    ngx_dynamic_upstream_outlier_data_t<S> *od =
+        (ngx_dynamic_upstream_outlier_data_t<S> *) data;
+
+    ngx_dynamic_upstream_outlier_t  *table = od->table;
+    ngx_flag_t                       failed;
+    ngx_uint_t                       usec;
+
+    if (table != NULL && pc->name != NULL) {
+
+        failed = (state & NGX_PEER_FAILED)
+            || BalancerSelect<S>::status(od->session) >= 500;
+
+        usec = (ngx_uint_t) ngx_max(
+            ngx_dynamic_upstream_elapsed(&od->start), 0);
+
+        ngx_dynamic_upstream_outlier_observe<S>(table, pc->name, failed,
+                                                usec);
+    }
+
+    od->free(pc, od->data, state);
+}
+
+
+#if (NGX_SSL)
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_outlier_set_session(ngx_peer_connection_t *pc,
+    void *data)
+{
+    ngx_dynamic_upstream_outlier_data_t<S> *od =
+        (ngx_dynamic_upstream_outlier_data_t<S> *) data;
+
+    return od->set_session(pc, od->data);
+}
+
+
+template <class S> static void
+ngx_dynamic_upstream_outlier_save_session(ngx_peer_connection_t *pc,
+    void *data)
+{
+    ngx_dynamic_upstream_outlier_data_t<S> *od =
+        (ngx_dynamic_upstream_outlier_data_t<S> *) data;
+
+    od->save_session(pc, od->data);
+}
+
+#endif
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_outlier_init_peer(
+    typename BalancerSelect<S>::session_type *r, S *us)
+{
+    typedef typename BalancerSelect<S>::init_peer_type  init_peer_type;
+
+    ngx_dynamic_upstream_srv_conf_t         *dscf;
+    ngx_dynamic_upstream_outlier_data_t<S>  *od;
+    ngx_peer_connection_t                   *pc;
+
+    dscf = BalancerSelect<S>::srv_conf(us);
+
+    if (((init_peer_type) dscf->outlier->init)(r, us) != NGX_OK)
+        return NGX_ERROR;
+
+    od = (ngx_dynamic_upstream_outlier_data_t<S> *) ngx_pcalloc(
+        BalancerSelect<S>::pool(r),
+        sizeof(ngx_dynamic_upstream_outlier_data_t<S>));
+    if (od == NULL)
+        return NGX_ERROR;
+
+    pc = BalancerSelect<S>::pc(r);
+
+    od->data = pc->data;
+    od->get = pc->get;
+    od->free = pc->free;
+    od->session = r;
+    od->table = dscf->outlier->table;
+
+    pc->data = od;
+    pc->get = ngx_dynamic_upstream_outlier_get_peer<S>;
+    pc->free = ngx_dynamic_upstream_outlier_free_peer<S>;
+
+#if (NGX_SSL)
+    od->set_session = pc->set_session;
+    od->save_session = pc->save_session;
+
+    if (pc->set_session != NULL)
+        pc->set_session = ngx_dynamic_upstream_outlier_set_session<S>;
+
+    if (pc->save_session != NULL)
+        pc->save_session = ngx_dynamic_upstream_outlier_save_session<S>;
+#endif
+
+    return NGX_OK;
+}
+
+
+// dynamic_outlier [errors=n] [latency=time] [eject_time=time]
+//                 [max_eject_time=time] [max_percent=n]
+
+char *
+ngx_dynamic_upstream_outlier_conf(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_dynamic_upstream_srv_conf_t      *dscf;
+    ngx_dynamic_upstream_outlier_conf_t  *oc;
+    ngx_str_t                            *value, s;
+    ngx_uint_t                            j;
+    ngx_int_t                             n;
+
+    dscf = (ngx_dynamic_upstream_srv_conf_t *) conf;
+
+    if (dscf->outlier != NULL)
+        return (char *) "is duplicate";
+
+    oc = (ngx_dynamic_upstream_outlier_conf_t *) ngx_pcalloc(cf->pool,
+        sizeof(ngx_dynamic_upstream_outlier_conf_t));
+    if (oc == NULL)
+        return (char *) NGX_CONF_ERROR;
+
+    oc->errors = 5;
+    oc->latency = 0;
+    oc->eject_time = 30;
+    oc->max_eject_time = 300;
+    oc->max_percent = 10;
+
+    value = (ngx_str_t *) cf->args->elts;
+
+    for (j = 1; j < cf->args->nelts; j++) {
+
+        if (ngx_strncmp(value[j].data, "errors=", 7) == 0) {
+
+            n = ngx_atoi(value[j].data + 7, value[j].len - 7);
+            if (n == NGX_ERROR)
+                goto invalid;
+
+            oc->errors = (ngx_uint_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[j].data, "latency=", 8) == 0) {
+
+            s.data = value[j].data + 8;
+            s.len = value[j].len - 8;
+
+            n = ngx_parse_time(&s, 0);
+            if (n == NGX_ERROR)
+                goto invalid;
+
+            oc->latency = (ngx_msec_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[j].data, "eject_time=", 11) == 0) {
+
+            s.data = value[j].data + 11;
+            s.len = value[j].len - 11;
+
+            n = ngx_parse_time(&s, 1);
+            if (n == NGX_ERROR || n == 0)
+                goto invalid;
+
+            oc->eject_time = (time_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[j].data, "max_eject_time=", 15) == 0) {
+
+            s.data = value[j].data + 15;
+            s.len = value[j].len - 15;
+
+            n = ngx_parse_time(&s, 1);
+            if (n == NGX_ERROR || n == 0)
+                goto invalid;
+
+            oc->max_eject_time = (time_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[j].data, "max_percent=", 12) == 0) {
+
+            n = ngx_atoi(value[j].data + 12, value[j].len - 12);
+            if (n == NGX_ERROR || n > 100)
+                goto invalid;
+
+            oc->max_percent = (ngx_uint_t) n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    if (oc->max_eject_time < oc->eject_time)
+        oc->max_eject_time = oc->eject_time;
+
+    dscf->outlier = oc;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[j]);
+
+    return (char *) NGX_CONF_ERROR;
+}
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_outlier_wrap(ngx_conf_t *cf)
+{
+    typename BalancerSelect<S>::main_type  *umcf;
+
+    S                                **uscf;
+    ngx_dynamic_upstream_srv_conf_t   *dscf;
+    ngx_uint_t                         j;
+
+    umcf = BalancerSelect<S>::main_conf(cf->cycle);
+    if (umcf == NULL)
+        return NGX_OK;
+
+    uscf = (S **) umcf->upstreams.elts;
+
+    for (j = 0; j < umcf->upstreams.nelts; j++) {
+
+        if (uscf[j]->srv_conf == NULL)
+            continue;
+
+        dscf = BalancerSelect<S>::srv_conf(uscf[j]);
+        if (dscf == NULL || dscf->outlier == NULL)
+            continue;
+
+        if (uscf[j]->shm_zone == NULL) {
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "upstream \"%V\": 'dynamic_outlier' "
+                               "requires 'zone'", &uscf[j]->host);
+            return NGX_ERROR;
+        }
+
+        dscf->outlier->init = (void *) uscf[j]->peer.init;
+
+        uscf[j]->peer.init = ngx_dynamic_upstream_outlier_init_peer<S>;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_http_dynamic_upstream_outlier_wrap(ngx_conf_t *cf)
+{
+    return ngx_dynamic_upstream_outlier_wrap<ngx_http_upstream_srv_conf_t>
+        (cf);
+}
+
+
+ngx_int_t
+ngx_stream_dynamic_upstream_outlier_wrap(ngx_conf_t *cf)
+{
+    return ngx_dynamic_upstream_outlier_wrap<ngx_stream_upstream_srv_conf_t>
+        (cf);
+}
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_outlier_init_all(ngx_cycle_t *cycle)
+{
+    typename BalancerSelect<S>::main_type  *umcf;
+
+    S                                **uscf;
+    ngx_dynamic_upstream_srv_conf_t   *dscf;
+    ngx_dynamic_upstream_outlier_t    *table;
+    ngx_slab_pool_t                   *shpool;
+    ngx_uint_t                         j;
+
+    umcf = BalancerSelect<S>::main_conf(cycle);
+    if (umcf == NULL)
+        return NGX_OK;
+
+    uscf = (S **) umcf->upstreams.elts;
+
+    for (j = 0; j < umcf->upstreams.nelts; j++) {
+
+        if (uscf[j]->srv_conf == NULL || uscf[j]->shm_zone == NULL)
+            continue;
+
+        dscf = BalancerSelect<S>::srv_conf(uscf[j]);
+        if (dscf == NULL || dscf->outlier == NULL)
+            continue;
+
+        shpool = (ngx_slab_pool_t *) uscf[j]->shm_zone->shm.addr;
+
+        table = (ngx_dynamic_upstream_outlier_t *) ngx_slab_calloc(shpool,
+            sizeof(ngx_dynamic_upstream_outlier_t));
+        if (table == NULL) {
+
+            ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                          "upstream \"%V\": no memory in zone for outlier "
+                          "detection", &uscf[j]->host);
+            return NGX_ERROR;
+        }
+
+        table->shpool = shpool;
+        table->peers = uscf[j]->peer.data;
+
+        dscf->outlier->table = table;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_outlier_init(ngx_cycle_t *cycle)
+{
+    if (ngx_dynamic_upstream_outlier_init_all<ngx_http_upstream_srv_conf_t>
+            (cycle) != NGX_OK)
+        return NGX_ERROR;
+
+    return ngx_dynamic_upstream_outlier_init_all
+        <ngx_stream_upstream_srv_conf_t>(cycle);
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#ifndef NGX_DYNAMIC_UPSTREAM_OUTLIER_H
+#define NGX_DYNAMIC_UPSTREAM_OUTLIER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#ifdef __cplusplus
+}
+#endif
+
+
+// passive outlier detection of 'dynamic_outlier' upstreams. Results
+// of the requests are counted per peer in the upstream zone by
+// a wrapper of the balancer, the background pass ejects outliers
+// and restores them by the op engine as ?down= and ?up= do.
+// The counters are atomics changed under the peers read lock, the
+// table and the rest of the stat are changed under the write lock.
+
+// minimal number of requests for the latency of a peer to count
+
+#define NGX_DYNAMIC_UPSTREAM_OUTLIER_REQUESTS  10
+
+
+typedef struct {
+    void        *peer;
+    ngx_atomic_t errors;      // in a row
+    ngx_atomic_t requests;    // since the last evaluation
+    ngx_atomic_t usec;        // since the last evaluation
+    time_t       ejected;     // until, 0 if the peer is not ejected
+    time_t       restored;
+    ngx_uint_t   ejections;
+} ngx_dynamic_upstream_outlier_stat_t;
+
+
+typedef struct ngx_dynamic_upstream_outlier_s {
+    ngx_slab_pool_t                      *shpool;
+    void                                 *peers;
+    ngx_uint_t                            number;
+    ngx_uint_t                            size;
+    ngx_dynamic_upstream_outlier_stat_t  *stat;
+} ngx_dynamic_upstream_outlier_t;
+
+
+typedef struct ngx_dynamic_upstream_outlier_conf_s {
+    ngx_uint_t                       errors;
+    ngx_msec_t                       latency;
+    time_t                           eject_time;
+    time_t                           max_eject_time;
+    ngx_uint_t                       max_percent;  // 0 to never eject
+
+    void                            *init;    // the wrapped peer.init
+    ngx_dynamic_upstream_outlier_t  *table;
+} ngx_dynamic_upstream_outlier_conf_t;
+
+
+// does nothing for a NULL table or for peers other than the primary
+// peers of the table
+
+void
+ngx_dynamic_upstream_outlier_del(ngx_dynamic_upstream_outlier_t *table,
+    void *peers, void *peer);
+
+
+// cancels the ejection of the peer changed up, down or drained by
+// the api or the checks, the peer is not restored by the pass then
+
+void
+ngx_dynamic_upstream_outlier_reset(ngx_dynamic_upstream_outlier_t *table,
+    void *peers, void *peer);
+
+
+char *
+ngx_dynamic_upstream_outlier_conf(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+// wraps the balancers, after the upstreams are initialized
+
+ngx_int_t
+ngx_http_dynamic_upstream_outlier_wrap(ngx_conf_t *cf);
+
+
+ngx_int_t
+ngx_stream_dynamic_upstream_outlier_wrap(ngx_conf_t *cf);
+
+
+// creates the tables in the zones, after the zones are initialized
+
+ngx_int_t
+ngx_dynamic_upstream_outlier_init(ngx_cycle_t *cycle);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_OUTLIER_H */
@@ -0,0 +1,679 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+extern "C" {
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_stream.h>
+
+}
+
+#include "ngx_dynamic_upstream_module.h"
+#include "ngx_dynamic_upstream_op.h"
+#include "ngx_dynamic_upstream_metrics.h"
+#include "ngx_dynamic_upstream_p2c.h"
+#include "ngx_dynamic_upstream_balancer.h"
+
+
+extern ngx_int_t is_reserved_addr(ngx_str_t *addr);
+
+
+// first stat with peer >= the peer
+
+static ngx_uint_t
+ngx_dynamic_upstream_p2c_find(ngx_dynamic_upstream_p2c_t *p2c, void *peer)
+{
+    ngx_uint_t  i = 0, j = p2c->number, k;
+
+    while (i < j) {
+
+        k = (i + j) / 2;
+
+        if ((uintptr_t) peer > (uintptr_t) p2c->stat[k].peer)
+            i = k + 1;
+        else
+            j = k;
+    }
+
+    return i;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_p2c_reserve(ngx_dynamic_upstream_p2c_t *p2c,
+    ngx_uint_t n)
+{
+    ngx_dynamic_upstream_p2c_stat_t  *stat;
+    ngx_uint_t                        size;
+
+    if (n <= p2c->size)
+        return NGX_OK;
+
+    size = ngx_max(n, ngx_max(p2c->size * 2, 8));
+
+    stat = (ngx_dynamic_upstream_p2c_stat_t *) ngx_slab_alloc(p2c->shpool,
+        size * sizeof(ngx_dynamic_upstream_p2c_stat_t));
+    if (stat == NULL)
+        return NGX_ERROR;
+
+    if (p2c->stat != NULL) {
+
+        ngx_memcpy(stat, p2c->stat,
+                   p2c->number * sizeof(ngx_dynamic_upstream_p2c_stat_t));
+        ngx_slab_free(p2c->shpool, p2c->stat);
+    }
+
+    p2c->stat = stat;
+    p2c->size = size;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_p2c_add(ngx_dynamic_upstream_p2c_t *p2c,
+    void *peers, void *peer, ngx_str_t *name)
+{
+    ngx_dynamic_upstream_p2c_stat_t  *stat;
+    ngx_uint_t                        i;
+
+    if (p2c == NULL || p2c->peers != peers || is_reserved_addr(name))
+        return NGX_OK;
+
+    i = ngx_dynamic_upstream_p2c_find(p2c, peer);
+    if (i < p2c->number && p2c->stat[i].peer == peer)
+        return NGX_OK;
+
+    if (ngx_dynamic_upstream_p2c_reserve(p2c, p2c->number + 1) != NGX_OK)
+        return NGX_ERROR;
+
+    ngx_memmove(p2c->stat + i + 1, p2c->stat + i,
+                (p2c->number - i) * sizeof(ngx_dynamic_upstream_p2c_stat_t));
+
+    stat = p2c->stat + i;
+
+    stat->peer = peer;
+    stat->stamp = 0;
+    stat->ewma = 0;
+    stat->known = 0;
+
+    p2c->number++;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_dynamic_upstream_p2c_del(ngx_dynamic_upstream_p2c_t *p2c,
+    void *peers, void *peer)
+{
+    ngx_dynamic_upstream_p2c_stat_t  *stat;
+    ngx_uint_t                        i;
+
+    if (p2c == NULL || p2c->peers != peers)
+        return;
+
+    i = ngx_dynamic_upstream_p2c_find(p2c, peer);
+    if (i == p2c->number || p2c->stat[i].peer != peer)
+        return;
+
+    stat = p2c->stat + i;
+
+    if (stat->known) {
+
+        ngx_atomic_fetch_add(&p2c->sum, - (ngx_atomic_int_t) stat->ewma);
+        ngx_atomic_fetch_add(&p2c->known, (ngx_atomic_int_t) -1);
+    }
+
+    p2c->number--;
+
+    ngx_memmove(p2c->stat + i, p2c->stat + i + 1,
+                (p2c->number - i) * sizeof(ngx_dynamic_upstream_p2c_stat_t));
+}
+
+
+// peak ewma: the estimate jumps up to a slower response at once and
+// moves down to a faster one by the elapsed part of the decay window.
+// Between responses it decays to zero over the window, so a peer
+// which is not chosen anymore is tried again.
+
+static ngx_uint_t
+ngx_dynamic_upstream_p2c_decayed(ngx_dynamic_upstream_p2c_t *p2c,
+    ngx_dynamic_upstream_p2c_stat_t *stat)
+{
+    ngx_msec_t  dt = ngx_current_msec - stat->stamp;
+
+    if (dt >= p2c->decay)
+        return 0;
+
+    return (ngx_uint_t) ((uint64_t) stat->ewma * (p2c->decay - dt)
+                         / p2c->decay);
+}
+
+
+static ngx_uint_t
+ngx_dynamic_upstream_p2c_ewma(ngx_dynamic_upstream_p2c_t *p2c,
+    ngx_dynamic_upstream_p2c_stat_t *stat)
+{
+    ngx_atomic_uint_t  known = p2c->known;
+
+    if (stat->known)
+        return ngx_dynamic_upstream_p2c_decayed(p2c, stat);
+
+    // a new peer is taken twice as fast as others in average until
+    // its first response, so it gets requests before the known ones
+    // decay, and does not get all of them at once
+
+    return known != 0 ? (ngx_uint_t) (p2c->sum / known / 2) : 0;
+}
+
+
+// the stat of a peer removed while the request was in flight is gone,
+// the table is not changed under the read lock
+
+template <class S> static void
+ngx_dynamic_upstream_p2c_observe(ngx_dynamic_upstream_p2c_t *p2c,
+    void *peer, ngx_uint_t usec)
+{
+    typedef typename TypeSelect<S>::peer_type  peer_type;
+
+    ngx_dynamic_upstream_p2c_stat_t  *stat;
+    ngx_uint_t                        i, ewma;
+    ngx_msec_t                        dt;
+
+    i = ngx_dynamic_upstream_p2c_find(p2c, peer);
+
+    if (i == p2c->number || p2c->stat[i].peer != peer)
+        return;
+
+    stat = p2c->stat + i;
+
+    ngx_upstream_rr_peer_lock<peer_type> pl((peer_type *) peer);
+
+    if (!stat->known) {
+
+        stat->ewma = usec;
+        stat->stamp = ngx_current_msec;
+        stat->known = 1;
+
+        ngx_atomic_fetch_add(&p2c->sum, (ngx_atomic_int_t) usec);
+        ngx_atomic_fetch_add(&p2c->known, 1);
+
+        return;
+    }
+
+    dt = ngx_current_msec - stat->stamp;
+    ewma = ngx_dynamic_upstream_p2c_decayed(p2c, stat);
+
+    if (usec >= ewma || dt >= p2c->decay)
+        ewma = usec;
+    else if (dt != 0)
+        ewma -= (ngx_uint_t) ((uint64_t) (ewma - usec) * dt / p2c->decay);
+    else
+        // the same millisecond, only a peak is taken
+        return;
+
+    ngx_atomic_fetch_add(&p2c->sum, (ngx_atomic_int_t) ewma
+                                    - (ngx_atomic_int_t) stat->ewma);
+
+    stat->ewma = ewma;
+    stat->stamp = ngx_current_msec;
+}
+
+
+// lower ewma x (requests in flight + 1) / weight
+
+template <class S> static ngx_flag_t
+ngx_dynamic_upstream_p2c_cheaper(ngx_dynamic_upstream_p2c_t *p2c,
+    ngx_dynamic_upstream_p2c_stat_t *one, ngx_dynamic_upstream_p2c_stat_t *two)
+{
+    typedef typename TypeSelect<S>::peer_type  peer_type;
+
+    peer_type  *l_peer = (peer_type *) one->peer;
+    peer_type  *r_peer = (peer_type *) two->peer;
+    uint64_t    l, r;
+
+    l = (uint64_t) (ngx_dynamic_upstream_p2c_ewma(p2c, one) + 1)
+        * (l_peer->conns + 1) * ngx_max(r_peer->weight, 1);
+    r = (uint64_t) (ngx_dynamic_upstream_p2c_ewma(p2c, two) + 1)
+        * (r_peer->conns + 1) * ngx_max(l_peer->weight, 1);
+
+    return l < r;
+}
+
+
+// rrp goes first, the round robin free function gets it as the data
+
+template <class S> struct ngx_dynamic_upstream_p2c_data_t {
+    typename BalancerSelect<S>::rr_data_type  rrp;
+    ngx_dynamic_upstream_p2c_t               *p2c;
+    struct timeval                            start;
+    ngx_uint_t                                tries;
+    void                                     *tried[
+                                               NGX_DYNAMIC_UPSTREAM_P2C_TRIES];
+};
+
+
+// requires the peer lock
+
+template <class S> static ngx_flag_t
+ngx_dynamic_upstream_p2c_usable(ngx_dynamic_upstream_p2c_data_t<S> *pp,
+    typename TypeSelect<S>::peer_type *peer, time_t now)
+{
+    ngx_uint_t  i;
+
+    if (peer->down)
+        return 0;
+
+    if (peer->max_fails
+        && peer->fails >= peer->max_fails
+        && now - peer->checked <= peer->fail_timeout)
+        return 0;
+
+#if defined(nginx_version) && (nginx_version >= 1011005)
+    if (peer->max_conns && peer->conns >= peer->max_conns)
+        return 0;
+#endif
+
+    for (i = 0; i < pp->tries; i++)
+        if (pp->tried[i] == peer)
+            return 0;
+
+    return 1;
+}
+
+
+template <class S> static ngx_flag_t
+ngx_dynamic_upstream_p2c_live(ngx_dynamic_upstream_p2c_data_t<S> *pp,
+    ngx_dynamic_upstream_p2c_stat_t *stat, time_t now)
+{
+    typedef typename TypeSelect<S>::peer_type  peer_type;
+
+    ngx_upstream_rr_peer_lock<peer_type> pl((peer_type *) stat->peer);
+
+    return ngx_dynamic_upstream_p2c_usable<S>(pp, (peer_type *) stat->peer,
+                                              now);
+}
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_p2c_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    typedef typename TypeSelect<S>::peers_type  peers_type;
+    typedef typename TypeSelect<S>::peer_type   peer_type;
+
+    ngx_dynamic_upstream_p2c_data_t<S> *pp =
+        (ngx_dynamic_upstream_p2c_data_t<S> *) data;
+
+    ngx_dynamic_upstream_p2c_t       *p2c = pp->p2c;
+    ngx_dynamic_upstream_p2c_stat_t  *one, *two;
+    peers_type                       *peers;
+    peer_type                        *peer;
+    ngx_uint_t                        i, k, n;
+    time_t                            now;
+
+    pc->connection = NULL;
+
+    ngx_gettimeofday(&pp->start);
+
+    // round robin has gone to the backup peers
+
+    if (pp->rrp.peers != p2c->peers
+        || pp->tries == NGX_DYNAMIC_UPSTREAM_P2C_TRIES)
+        return BalancerSelect<S>::get_rr_peer(pc, &pp->rrp);
+
+    peers = (peers_type *) p2c->peers;
+
+    {
+        ngx_upstream_rr_peers_rlock<peers_type> rl(peers);
+
+        now = ngx_time();
+        n = p2c->number;
+
+        // two distinct random peers of the table, the table is changed
+        // by the api and dns updates under the write lock
+
+        for (k = 0; k < n && k < NGX_DYNAMIC_UPSTREAM_P2C_PICKS; k++) {
+
+            i = ngx_random() % n;
+
+            one = p2c->stat + i;
+            two = n > 1 ? p2c->stat + (i + 1 + ngx_random() % (n - 1)) % n
+                        : NULL;
+
+            if (two != NULL && !ngx_dynamic_upstream_p2c_live<S>(pp, two, now))
+                two = NULL;
+
+            if (!ngx_dynamic_upstream_p2c_live<S>(pp, one, now)) {
+                one = two;
+                two = NULL;
+            }
+
+            if (one == NULL)
+                continue;
+
+            if (two != NULL && ngx_dynamic_upstream_p2c_cheaper<S>(p2c, two,
+                                                                   one))
+                one = two;
+
+            peer = (peer_type *) one->peer;
+
+            ngx_upstream_rr_peer_lock<peer_type> pl(peer);
+
+            // may be taken by others meanwhile
+
+            if (!ngx_dynamic_upstream_p2c_usable<S>(pp, peer, now))
+                continue;
+
+            pp->tried[pp->tries++] = peer;
+            pp->rrp.current = peer;
+
+            pc->sockaddr = peer->sockaddr;
+            pc->socklen = peer->socklen;
+            pc->name = &peer->name;
+
+            peer->conns++;
+
+            if (now - peer->checked > peer->fail_timeout)
+                peer->checked = now;
+
+            return NGX_OK;
+        }
+    }
+
+    // no live peer drawn
+
+    return BalancerSelect<S>::get_rr_peer(pc, &pp->rrp);
+}
+
+
+template <class S> static void
+ngx_dynamic_upstream_p2c_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    typedef typename TypeSelect<S>::peers_type  peers_type;
+
+    ngx_dynamic_upstream_p2c_data_t<S> *pp =
+        (ngx_dynamic_upstream_p2c_data_t<S> *) data;
+
+    ngx_dynamic_upstream_p2c_t  *p2c = pp->p2c;
+    peers_type                  *peers;
+    ngx_uint_t                   usec;
+
+    if (pp->rrp.current != NULL && pp->rrp.peers == p2c->peers) {
+
+        peers = (peers_type *) p2c->peers;
+
+        usec = (ngx_uint_t) ngx_max(
+            ngx_dynamic_upstream_elapsed(&pp->start), 0);
+
+        // a failed peer answers fast, it is taken as slow as the window
+
+        if (state & NGX_PEER_FAILED)
+            usec = ngx_max(usec, (ngx_uint_t) p2c->decay * 1000);
+
+        ngx_upstream_rr_peers_rlock<peers_type> rl(peers);
+
+        ngx_dynamic_upstream_p2c_observe<S>(p2c, pp->rrp.current, usec);
+    }
+
+    BalancerSelect<S>::free_rr_peer(pc, &pp->rrp, state);
+}
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_p2c_init_peer(
+    typename BalancerSelect<S>::session_type *r, S *us)
+{
+    ngx_dynamic_upstream_srv_conf_t     *dscf;
+    ngx_dynamic_upstream_p2c_data_t<S>  *pp;
+    ngx_peer_connection_t               *pc;
+
+    dscf = BalancerSelect<S>::srv_conf(us);
+
+    pp = (ngx_dynamic_upstream_p2c_data_t<S> *) ngx_pcalloc(
+        BalancerSelect<S>::pool(r),
+        sizeof(ngx_dynamic_upstream_p2c_data_t<S>));
+    if (pp == NULL)
+        return NGX_ERROR;
+
+    pc = BalancerSelect<S>::pc(r);
+
+    pc->data = &pp->rrp;
+
+    if (BalancerSelect<S>::init_rr_peer(r, us) != NGX_OK)
+        return NGX_ERROR;
+
+    pp->p2c = dscf->p2c;
+
+    pc->get = ngx_dynamic_upstream_p2c_get_peer<S>;
+    pc->free = ngx_dynamic_upstream_p2c_free_peer<S>;
+
+    return NGX_OK;
+}
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_p2c_init_upstream(ngx_conf_t *cf, S *us)
+{
+    if (BalancerSelect<S>::init_rr(cf, us) != NGX_OK)
+        return NGX_ERROR;
+
+    us->peer.init = ngx_dynamic_upstream_p2c_init_peer<S>;
+
+    return NGX_OK;
+}
+
+
+// dynamic_p2c [decay=time]
+
+static char *
+ngx_dynamic_upstream_p2c_conf(ngx_conf_t *cf,
+    ngx_dynamic_upstream_srv_conf_t *dscf)
+{
+    ngx_str_t  *value, s;
+    ngx_int_t   decay = NGX_DYNAMIC_UPSTREAM_P2C_DECAY;
+
+    if (dscf->p2c_decay != NGX_CONF_UNSET_MSEC)
+        return (char *) "is duplicate";
+
+    value = (ngx_str_t *) cf->args->elts;
+
+    if (cf->args->nelts == 2) {
+
+        if (ngx_strncmp(value[1].data, "decay=", 6) != 0) {
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[1]);
+            return (char *) NGX_CONF_ERROR;
+        }
+
+        s.data = value[1].data + 6;
+        s.len = value[1].len - 6;
+
+        decay = ngx_parse_time(&s, 0);
+        if (decay == NGX_ERROR || decay == 0) {
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid decay \"%V\"", &value[1]);
+            return (char *) NGX_CONF_ERROR;
+        }
+    }
+
+    dscf->p2c_decay = (ngx_msec_t) decay;
+    dscf->chash_key = NULL;
+
+    return NGX_CONF_OK;
+}
+
+
+char *
+ngx_http_dynamic_upstream_p2c(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_upstream_srv_conf_t  *uscf;
+    char                          *rv;
+
+    rv = ngx_dynamic_upstream_p2c_conf(cf,
+        (ngx_dynamic_upstream_srv_conf_t *) conf);
+    if (rv != NGX_CONF_OK)
+        return rv;
+
+    uscf = (ngx_http_upstream_srv_conf_t *)
+        ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->peer.init_upstream)
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+
+    uscf->flags = NGX_HTTP_UPSTREAM_CREATE
+                  |NGX_HTTP_UPSTREAM_WEIGHT
+#if defined(nginx_version) && (nginx_version >= 1011005)
+                  |NGX_HTTP_UPSTREAM_MAX_CONNS
+#endif
+                  |NGX_HTTP_UPSTREAM_MAX_FAILS
+                  |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_HTTP_UPSTREAM_DOWN
+                  |NGX_HTTP_UPSTREAM_BACKUP;
+
+    uscf->peer.init_upstream =
+        ngx_dynamic_upstream_p2c_init_upstream<ngx_http_upstream_srv_conf_t>;
+
+    return NGX_CONF_OK;
+}
+
+
+char *
+ngx_stream_dynamic_upstream_p2c(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_stream_upstream_srv_conf_t  *uscf;
+    char                            *rv;
+
+    rv = ngx_dynamic_upstream_p2c_conf(cf,
+        (ngx_dynamic_upstream_srv_conf_t *) conf);
+    if (rv != NGX_CONF_OK)
+        return rv;
+
+    uscf = (ngx_stream_upstream_srv_conf_t *)
+        ngx_stream_conf_get_module_srv_conf(cf, ngx_stream_upstream_module);
+
+    if (uscf->peer.init_upstream)
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "load balancing method redefined");
+
+    uscf->flags = NGX_STREAM_UPSTREAM_CREATE
+                  |NGX_STREAM_UPSTREAM_WEIGHT
+#if defined(nginx_version) && (nginx_version >= 1011005)
+                  |NGX_STREAM_UPSTREAM_MAX_CONNS
+#endif
+                  |NGX_STREAM_UPSTREAM_MAX_FAILS
+                  |NGX_STREAM_UPSTREAM_FAIL_TIMEOUT
+                  |NGX_STREAM_UPSTREAM_DOWN
+                  |NGX_STREAM_UPSTREAM_BACKUP;
+
+    uscf->peer.init_upstream =
+        ngx_dynamic_upstream_p2c_init_upstream
+            <ngx_stream_upstream_srv_conf_t>;
+
+    return NGX_CONF_OK;
+}
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_p2c_create(S *uscf, ngx_log_t *log)
+{
+    typename TypeSelect<S>::peers_type  *peers;
+    typename TypeSelect<S>::peer_type   *peer;
+
+    ngx_dynamic_upstream_srv_conf_t  *dscf;
+    ngx_dynamic_upstream_p2c_t       *p2c;
+    ngx_slab_pool_t                  *shpool;
+
+    dscf = BalancerSelect<S>::srv_conf(uscf);
+
+    if (uscf->shm_zone == NULL) {
+
+        ngx_log_error(NGX_LOG_EMERG, log, 0,
+                      "upstream \"%V\": 'dynamic_p2c' requires 'zone'",
+                      &uscf->host);
+        return NGX_ERROR;
+    }
+
+    shpool = (ngx_slab_pool_t *) uscf->shm_zone->shm.addr;
+
+    peers = (typename TypeSelect<S>::peers_type *) uscf->peer.data;
+
+    p2c = (ngx_dynamic_upstream_p2c_t *) ngx_slab_calloc(shpool,
+        sizeof(ngx_dynamic_upstream_p2c_t));
+    if (p2c == NULL)
+        goto nomem;
+
+    p2c->shpool = shpool;
+    p2c->peers = peers;
+    p2c->decay = dscf->p2c_decay;
+
+    for (peer = peers->peer; peer != NULL; peer = peer->next)
+        if (ngx_dynamic_upstream_p2c_add(p2c, peers, peer, &peer->name)
+                != NGX_OK)
+            goto nomem;
+
+    dscf->p2c = p2c;
+
+    return NGX_OK;
+
+nomem:
+
+    ngx_log_error(NGX_LOG_EMERG, log, 0,
+                  "upstream \"%V\": no memory in zone for p2c",
+                  &uscf->host);
+
+    return NGX_ERROR;
+}
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_p2c_init_all(ngx_cycle_t *cycle)
+{
+    typename BalancerSelect<S>::main_type  *umcf;
+
+    S                                **uscf;
+    ngx_dynamic_upstream_srv_conf_t   *dscf;
+    ngx_uint_t                         j;
+
+    umcf = BalancerSelect<S>::main_conf(cycle);
+    if (umcf == NULL)
+        return NGX_OK;
+
+    uscf = (S **) umcf->upstreams.elts;
+
+    for (j = 0; j < umcf->upstreams.nelts; j++) {
+
+        if (uscf[j]->srv_conf == NULL)
+            continue;
+
+        dscf = BalancerSelect<S>::srv_conf(uscf[j]);
+        if (dscf == NULL || dscf->p2c_decay == NGX_CONF_UNSET_MSEC)
+            continue;
+
+        if (ngx_dynamic_upstream_p2c_create(uscf[j], cycle->log) != NGX_OK)
+            return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_p2c_init(ngx_cycle_t *cycle)
+{
+    if (ngx_dynamic_upstream_p2c_init_all<ngx_http_upstream_srv_conf_t>
+            (cycle) != NGX_OK)
+        return NGX_ERROR;
+
+    return ngx_dynamic_upstream_p2c_init_all<ngx_stream_upstream_srv_conf_t>
+        (cycle);
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#ifndef NGX_DYNAMIC_UPSTREAM_P2C_H
+#define NGX_DYNAMIC_UPSTREAM_P2C_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#ifdef __cplusplus
+}
+#endif
+
+
+// response times of the primary peers of 'dynamic_p2c' upstreams, kept
+// in the upstream zone sorted by the peer pointer. The table is changed
+// under the peers write lock, the stat of a peer under the peer lock.
+// Requests in flight are the peer->conns.
+
+#define NGX_DYNAMIC_UPSTREAM_P2C_DECAY  10000
+#define NGX_DYNAMIC_UPSTREAM_P2C_TRIES  20
+
+// pairs of random peers drawn for a request before round robin
+
+#define NGX_DYNAMIC_UPSTREAM_P2C_PICKS  4
+
+
+typedef struct {
+    void        *peer;
+    ngx_msec_t   stamp;
+    ngx_uint_t   ewma;
+    ngx_flag_t   known;          // has responded
+} ngx_dynamic_upstream_p2c_stat_t;
+
+
+typedef struct ngx_dynamic_upstream_p2c_s {
+    ngx_slab_pool_t                  *shpool;
+    void                             *peers;
+    ngx_msec_t                        decay;
+    ngx_uint_t                        number;
+    ngx_uint_t                        size;
+    ngx_atomic_t                      known;
+    ngx_atomic_t                      sum;    // of the known ewma
+    ngx_dynamic_upstream_p2c_stat_t  *stat;
+} ngx_dynamic_upstream_p2c_t;
+
+
+// do nothing for a NULL table, for peers other than the primary
+// peers of the table and for placeholders
+
+ngx_int_t
+ngx_dynamic_upstream_p2c_add(ngx_dynamic_upstream_p2c_t *p2c,
+    void *peers, void *peer, ngx_str_t *name);
+
+
+void
+ngx_dynamic_upstream_p2c_del(ngx_dynamic_upstream_p2c_t *p2c,
+    void *peers, void *peer);
+
+
+char *
+ngx_http_dynamic_upstream_p2c(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+char *
+ngx_stream_dynamic_upstream_p2c(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+// creates the tables in the zones, after the zones are initialized
+
+ngx_int_t
+ngx_dynamic_upstream_p2c_init(ngx_cycle_t *cycle);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_P2C_H */
@@ -0,0 +1,625 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+extern "C" {
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_stream.h>
+
+}
+
+#include "ngx_dynamic_upstream_module.h"
+#include "ngx_dynamic_upstream_op.h"
+#include "ngx_dynamic_upstream_reload.h"
+#include "ngx_dynamic_upstream_balancer.h"
+
+
+extern ngx_int_t is_reserved_addr(ngx_str_t *addr);
+
+
+typedef struct {
+    ngx_str_t   *server;
+    void        *peer;     // NULL for the servers of a config
+    ngx_uint_t   backup;
+    ngx_flag_t   used;
+} ngx_dynamic_upstream_reload_peer_t;
+
+
+typedef struct {
+    ngx_pool_t       *pool;
+    ngx_slab_pool_t  *shpool;
+    ngx_flag_t        reset;     // 'down' is restored by check or outlier
+    ngx_array_t       peers[2];  // primary and backup, in order
+    ngx_array_t       copies;    // allocated in the zone
+    ngx_array_t       dropped;   // peers of the config which are replaced
+    ngx_uint_t        carried;
+    ngx_uint_t        added;
+    ngx_uint_t        removed;
+} ngx_dynamic_upstream_reload_t;
+
+
+static int
+ngx_dynamic_upstream_reload_strcmp(ngx_str_t *one, ngx_str_t *two)
+{
+    if (one->len != two->len)
+        return one->len < two->len ? -1 : 1;
+
+    return ngx_strncmp(one->data, two->data, one->len);
+}
+
+
+static int
+ngx_dynamic_upstream_reload_cmp(const void *one, const void *two)
+{
+    const ngx_dynamic_upstream_reload_peer_t  *l, *r;
+
+    l = (const ngx_dynamic_upstream_reload_peer_t *) one;
+    r = (const ngx_dynamic_upstream_reload_peer_t *) two;
+
+    return ngx_dynamic_upstream_reload_strcmp(l->server, r->server);
+}
+
+
+// first entry with the server, NULL if there is none
+
+static ngx_dynamic_upstream_reload_peer_t *
+ngx_dynamic_upstream_reload_find(ngx_array_t *a, ngx_str_t *server)
+{
+    ngx_dynamic_upstream_reload_peer_t  *rp;
+    ngx_uint_t                           i = 0, j = a->nelts, k;
+
+    rp = (ngx_dynamic_upstream_reload_peer_t *) a->elts;
+
+    while (i < j) {
+
+        k = (i + j) / 2;
+
+        if (ngx_dynamic_upstream_reload_strcmp(server, rp[k].server) > 0)
+            i = k + 1;
+        else
+            j = k;
+    }
+
+    if (i == a->nelts
+        || ngx_dynamic_upstream_reload_strcmp(server, rp[i].server) != 0)
+        return NULL;
+
+    return &rp[i];
+}
+
+
+static ngx_array_t *
+ngx_dynamic_upstream_reload_sort(ngx_array_t *a)
+{
+    ngx_qsort(a->elts, a->nelts, sizeof(ngx_dynamic_upstream_reload_peer_t),
+              ngx_dynamic_upstream_reload_cmp);
+    return a;
+}
+
+
+template <class S> static ngx_array_t *
+ngx_dynamic_upstream_reload_servers(S *uscf, ngx_pool_t *pool)
+{
+    typename TypeSelect<S>::server_type  *server;
+
+    ngx_array_t                         *a;
+    ngx_dynamic_upstream_reload_peer_t  *rp;
+    ngx_uint_t                           i;
+
+    a = ngx_array_create(pool, 16, sizeof(ngx_dynamic_upstream_reload_peer_t));
+    if (a == NULL)
+        return NULL;
+
+    if (uscf->servers == NULL)
+        return a;
+
+    server = (typename TypeSelect<S>::server_type *) uscf->servers->elts;
+
+    for (i = 0; i < uscf->servers->nelts; i++) {
+
+        rp = (ngx_dynamic_upstream_reload_peer_t *) ngx_array_push(a);
+        if (rp == NULL)
+            return NULL;
+
+        ngx_memzero(rp, sizeof(ngx_dynamic_upstream_reload_peer_t));
+        rp->server = &server[i].name;
+    }
+
+    return ngx_dynamic_upstream_reload_sort(a);
+}
+
+
+template <class S> static ngx_array_t *
+ngx_dynamic_upstream_reload_peers(typename TypeSelect<S>::peers_type *primary,
+    ngx_pool_t *pool)
+{
+    typename TypeSelect<S>::peers_type  *peers;
+    typename TypeSelect<S>::peer_type   *peer;
+
+    ngx_array_t                         *a;
+    ngx_dynamic_upstream_reload_peer_t  *rp;
+    ngx_uint_t                           j;
+
+    a = ngx_array_create(pool, 16, sizeof(ngx_dynamic_upstream_reload_peer_t));
+    if (a == NULL)
+        return NULL;
+
+    for (peers = primary, j = 0;
+         peers != NULL && j < 2;
+         peers = peers->next, j++) {
+
+        for (peer = peers->peer; peer != NULL; peer = peer->next) {
+
+            rp = (ngx_dynamic_upstream_reload_peer_t *) ngx_array_push(a);
+            if (rp == NULL)
+                return NULL;
+
+            rp->server = &peer->server;
+            rp->peer = peer;
+            rp->backup = j;
+            rp->used = 0;
+        }
+    }
+
+    return ngx_dynamic_upstream_reload_sort(a);
+}
+
+
+template <class PeerT> static void
+ngx_dynamic_upstream_reload_free(ngx_slab_pool_t *shpool, PeerT *peer)
+{
+    if (peer->server.data != NULL)
+        ngx_slab_free(shpool, peer->server.data);
+
+    if (peer->name.data != NULL)
+        ngx_slab_free(shpool, peer->name.data);
+
+    if (peer->sockaddr != NULL)
+        ngx_slab_free(shpool, peer->sockaddr);
+
+    ngx_slab_free(shpool, peer);
+}
+
+
+// copy of the peer of the previous cycle, with the parameters of the
+// config peer if there is one. Connections are not carried, they are
+// counted on the peers of the previous cycle until they are closed.
+
+template <class S> static typename TypeSelect<S>::peer_type *
+ngx_dynamic_upstream_reload_copy(ngx_dynamic_upstream_reload_t *ctx,
+    typename TypeSelect<S>::peer_type *peer,
+    typename TypeSelect<S>::peer_type *conf)
+{
+    typedef typename TypeSelect<S>::peer_type  peer_type;
+
+    peer_type  *npeer, *src, **p;
+
+    src = conf != NULL ? conf : peer;
+
+    p = (peer_type **) ngx_array_push(&ctx->copies);
+    if (p == NULL)
+        return NULL;
+
+    npeer = (peer_type *) ngx_slab_calloc(ctx->shpool, sizeof(peer_type));
+    if (npeer == NULL) {
+
+        ctx->copies.nelts--;
+        return NULL;
+    }
+
+    *p = npeer;
+
+    npeer->server.data = (u_char *) ngx_slab_calloc(ctx->shpool,
+        peer->server.len + 1);
+    npeer->name.data = (u_char *) ngx_slab_calloc(ctx->shpool,
+        peer->name.len + 1);
+    npeer->sockaddr = (struct sockaddr *) ngx_slab_calloc(ctx->shpool,
+        peer->socklen);
+
+    if (npeer->server.data == NULL
+        || npeer->name.data == NULL
+        || npeer->sockaddr == NULL)
+        return NULL;
+
+    npeer->server.len = peer->server.len;
+    ngx_memcpy(npeer->server.data, peer->server.data, peer->server.len);
+
+    npeer->name.len = peer->name.len;
+    ngx_memcpy(npeer->name.data, peer->name.data, peer->name.len);
+
+    npeer->socklen = peer->socklen;
+    ngx_memcpy(npeer->sockaddr, peer->sockaddr, peer->socklen);
+
+    npeer->weight = src->weight;
+    npeer->effective_weight = src->weight;
+    npeer->max_conns = src->max_conns;
+    npeer->max_fails = src->max_fails;
+    npeer->fail_timeout = src->fail_timeout;
+    npeer->slow_start = ngx_dynamic_upstream_draining(peer)
+        ? ngx_dynamic_upstream_drain_deadline(peer) : src->slow_start;
+    npeer->start_time = peer->start_time;
+
+    npeer->fails = peer->fails;
+    npeer->accessed = peer->accessed;
+    npeer->checked = peer->checked;
+
+    // placeholders and draining peers keep their 'down', peers brought
+    // down by the check or outlier detection are probed again
+
+    if (is_reserved_addr(&peer->name) || ngx_dynamic_upstream_draining(peer))
+        npeer->down = peer->down;
+    else if (ctx->reset)
+        npeer->down = conf != NULL ? conf->down : 0;
+    else
+        npeer->down = conf != NULL && conf->down ? conf->down : peer->down;
+
+    return npeer;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_reload_push(ngx_array_t *a, void *peer)
+{
+    void  **p;
+
+    p = (void **) ngx_array_push(a);
+    if (p == NULL)
+        return NGX_ERROR;
+
+    *p = peer;
+
+    return NGX_OK;
+}
+
+
+// the peers of the config are merged with the peers of the previous
+// cycle, by the server:
+//   - the server is in the previous cycle: its peers are carried,
+//   - the server was in the previous config only: removed at runtime,
+//   - the server is new in the config: the peers of the config are kept,
+// the servers added at runtime follow the servers of the config
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_reload_merge(ngx_dynamic_upstream_reload_t *ctx,
+    S *uscf, S *old)
+{
+    typedef typename TypeSelect<S>::peers_type  peers_type;
+    typedef typename TypeSelect<S>::peer_type   peer_type;
+
+    peers_type                          *peers;
+    peer_type                           *peer, *npeer;
+    ngx_array_t                         *runtime, *oconf, *nconf;
+    ngx_dynamic_upstream_reload_peer_t  *rp, *first, *last;
+    ngx_uint_t                           i, j, resolved;
+
+    ngx_upstream_rr_peers_rlock<peers_type> rl((peers_type *) old->peer.data);
+
+    runtime = ngx_dynamic_upstream_reload_peers<S>(
+        (peers_type *) old->peer.data, ctx->pool);
+    oconf = ngx_dynamic_upstream_reload_servers<S>(old, ctx->pool);
+    nconf = ngx_dynamic_upstream_reload_servers<S>(uscf, ctx->pool);
+
+    if (runtime == NULL || oconf == NULL || nconf == NULL)
+        return NGX_ERROR;
+
+    last = (ngx_dynamic_upstream_reload_peer_t *) runtime->elts
+        + runtime->nelts;
+
+    for (peers = (peers_type *) uscf->peer.data, j = 0;
+         peers != NULL && j < 2;
+         peers = peers->next, j++) {
+
+        for (peer = peers->peer; peer != NULL; peer = peer->next) {
+
+            first = ngx_dynamic_upstream_reload_find(runtime, &peer->server);
+
+            if (first == NULL) {
+
+                if (ngx_dynamic_upstream_reload_find(oconf, &peer->server)
+                        == NULL) {
+
+                    if (ngx_dynamic_upstream_reload_push(&ctx->peers[j], peer)
+                            != NGX_OK)
+                        return NGX_ERROR;
+
+                    continue;
+                }
+
+                ctx->removed++;
+
+                if (ngx_dynamic_upstream_reload_push(&ctx->dropped, peer)
+                        != NGX_OK)
+                    return NGX_ERROR;
+
+                continue;
+            }
+
+            resolved = 0;
+
+            for (rp = first;
+                 rp < last && ngx_dynamic_upstream_reload_strcmp(rp->server,
+                     &peer->server) == 0;
+                 rp++) {
+
+                if (!is_reserved_addr(&((peer_type *) rp->peer)->name))
+                    resolved++;
+            }
+
+            // the name was not resolved in the previous cycle,
+            // the addresses of the config are better
+
+            if (resolved == 0) {
+
+                for (; first < rp; first++)
+                    first->used = 1;
+
+                if (ngx_dynamic_upstream_reload_push(&ctx->peers[j], peer)
+                        != NGX_OK)
+                    return NGX_ERROR;
+
+                continue;
+            }
+
+            if (ngx_dynamic_upstream_reload_push(&ctx->dropped, peer)
+                    != NGX_OK)
+                return NGX_ERROR;
+
+            if (first->used)
+                continue;
+
+            for (; first < rp; first++) {
+
+                first->used = 1;
+
+                if (is_reserved_addr(&((peer_type *) first->peer)->name))
+                    continue;
+
+                npeer = ngx_dynamic_upstream_reload_copy<S>(ctx,
+                    (peer_type *) first->peer, peer);
+                if (npeer == NULL)
+                    return NGX_ERROR;
+
+                if (ngx_dynamic_upstream_reload_push(&ctx->peers[j], npeer)
+                        != NGX_OK)
+                    return NGX_ERROR;
+
+                ctx->carried++;
+            }
+        }
+    }
+
+    rp = (ngx_dynamic_upstream_reload_peer_t *) runtime->elts;
+
+    for (i = 0; i < runtime->nelts; i++) {
+
+        // the placeholder of an empty upstream is not carried
+
+        if (rp[i].used
+            || is_reserved_addr(rp[i].server)
+            || ngx_dynamic_upstream_reload_find(oconf, rp[i].server) != NULL
+            || ngx_dynamic_upstream_reload_find(nconf, rp[i].server) != NULL)
+            continue;
+
+        npeer = ngx_dynamic_upstream_reload_copy<S>(ctx,
+            (peer_type *) rp[i].peer, NULL);
+        if (npeer == NULL)
+            return NGX_ERROR;
+
+        if (ngx_dynamic_upstream_reload_push(&ctx->peers[rp[i].backup], npeer)
+                != NGX_OK)
+            return NGX_ERROR;
+
+        ctx->added++;
+    }
+
+    return ctx->peers[0].nelts != 0 ? NGX_OK : NGX_DECLINED;
+}
+
+
+template <class S> static void
+ngx_dynamic_upstream_reload_link(typename TypeSelect<S>::peers_type *peers,
+    ngx_array_t *list)
+{
+    typename TypeSelect<S>::peer_type  **peer;
+
+    ngx_uint_t  i;
+
+    peer = (typename TypeSelect<S>::peer_type **) list->elts;
+
+    peers->peer = NULL;
+    peers->total_weight = 0;
+
+    for (i = list->nelts; i > 0; i--) {
+
+        peer[i - 1]->next = peers->peer;
+        peers->peer = peer[i - 1];
+        peers->total_weight += peer[i - 1]->weight;
+    }
+
+    peers->number = list->nelts;
+    peers->single = peers->number == 1;
+    peers->weighted = peers->total_weight != peers->number;
+}
+
+
+template <class S> static void
+ngx_dynamic_upstream_reload_upstream(ngx_cycle_t *cycle, S *uscf, S *old,
+    ngx_dynamic_upstream_srv_conf_t *dscf)
+{
+    typedef typename TypeSelect<S>::peers_type  peers_type;
+    typedef typename TypeSelect<S>::peer_type   peer_type;
+
+    peers_type                     *primary, *backup;
+    peer_type                     **peer;
+    ngx_dynamic_upstream_reload_t   ctx;
+    ngx_int_t                       rc;
+    ngx_uint_t                      i;
+
+    ngx_memzero(&ctx, sizeof(ngx_dynamic_upstream_reload_t));
+
+    ctx.shpool = (ngx_slab_pool_t *) uscf->shm_zone->shm.addr;
+    ctx.reset = dscf->check != NULL || dscf->outlier != NULL;
+
+    ctx.pool = ngx_create_pool(ngx_pagesize, cycle->log);
+    if (ctx.pool == NULL)
+        return;
+
+    if (ngx_array_init(&ctx.peers[0], ctx.pool, 16, sizeof(void *))
+            != NGX_OK
+        || ngx_array_init(&ctx.peers[1], ctx.pool, 4, sizeof(void *))
+            != NGX_OK
+        || ngx_array_init(&ctx.copies, ctx.pool, 16, sizeof(void *))
+            != NGX_OK
+        || ngx_array_init(&ctx.dropped, ctx.pool, 16, sizeof(void *))
+            != NGX_OK) {
+
+        ngx_destroy_pool(ctx.pool);
+        return;
+    }
+
+    primary = (peers_type *) uscf->peer.data;
+    backup = primary->next;
+
+    rc = ngx_dynamic_upstream_reload_merge<S>(&ctx, uscf, old);
+
+    if (rc == NGX_OK && ctx.peers[1].nelts != 0 && backup == NULL) {
+
+        backup = (peers_type *) ngx_slab_calloc(ctx.shpool,
+                                                sizeof(peers_type));
+        if (backup == NULL)
+            rc = NGX_ERROR;
+        else {
+
+            backup->shpool = primary->shpool;
+            backup->name = primary->name;
+        }
+    }
+
+    if (rc != NGX_OK) {
+
+        peer = (peer_type **) ctx.copies.elts;
+
+        for (i = 0; i < ctx.copies.nelts; i++)
+            ngx_dynamic_upstream_reload_free(ctx.shpool, peer[i]);
+
+        ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                      "upstream \"%V\": %s, peers of the config are used",
+                      &uscf->host, rc == NGX_DECLINED
+                          ? "no primary peers to carry"
+                          : "no memory to carry the peers");
+
+        ngx_destroy_pool(ctx.pool);
+        return;
+    }
+
+    peer = (peer_type **) ctx.dropped.elts;
+
+    for (i = 0; i < ctx.dropped.nelts; i++)
+        ngx_dynamic_upstream_reload_free(ctx.shpool, peer[i]);
+
+    ngx_dynamic_upstream_reload_link<S>(primary, &ctx.peers[0]);
+
+    if (ctx.peers[1].nelts != 0) {
+
+        ngx_dynamic_upstream_reload_link<S>(backup, &ctx.peers[1]);
+        primary->next = backup;
+
+    } else if (backup != NULL) {
+
+        ngx_slab_free(ctx.shpool, backup);
+        primary->next = NULL;
+    }
+
+    ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
+                  "upstream \"%V\": warm reload, %ui peers carried, "
+                  "%ui added and %ui removed at runtime",
+                  &uscf->host, ctx.carried, ctx.added, ctx.removed);
+
+    ngx_destroy_pool(ctx.pool);
+}
+
+
+// the upstream of the previous cycle with the same name and zone, the
+// layout is the same as of this cycle, see ngx_dynamic_upstream_reload.h
+
+template <class S> static S *
+ngx_dynamic_upstream_reload_old(typename BalancerSelect<S>::main_type *umcf,
+    S *uscf)
+{
+    S           **old;
+    ngx_uint_t    j;
+
+    old = (S **) umcf->upstreams.elts;
+
+    for (j = 0; j < umcf->upstreams.nelts; j++) {
+
+        if (old[j]->shm_zone == NULL || old[j]->peer.data == NULL)
+            continue;
+
+        if (ngx_dynamic_upstream_reload_strcmp(&old[j]->host,
+                &uscf->host) == 0
+            && ngx_dynamic_upstream_reload_strcmp(&old[j]->shm_zone->shm.name,
+                &uscf->shm_zone->shm.name) == 0)
+            return old[j];
+    }
+
+    return NULL;
+}
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_reload_init_all(ngx_cycle_t *cycle)
+{
+    typename BalancerSelect<S>::main_type  *umcf, *oumcf;
+
+    S                                **uscf, *old;
+    ngx_dynamic_upstream_srv_conf_t   *dscf;
+    ngx_uint_t                         j;
+
+    umcf = BalancerSelect<S>::main_conf(cycle);
+    if (umcf == NULL)
+        return NGX_OK;
+
+    oumcf = BalancerSelect<S>::main_conf(cycle->old_cycle);
+    if (oumcf == NULL)
+        return NGX_OK;
+
+    uscf = (S **) umcf->upstreams.elts;
+
+    for (j = 0; j < umcf->upstreams.nelts; j++) {
+
+        if (uscf[j]->srv_conf == NULL || uscf[j]->shm_zone == NULL
+            || uscf[j]->peer.data == NULL)
+            continue;
+
+        dscf = BalancerSelect<S>::srv_conf(uscf[j]);
+        if (dscf == NULL || dscf->warm_reload != 1)
+            continue;
+
+        old = ngx_dynamic_upstream_reload_old<S>(oumcf, uscf[j]);
+        if (old == NULL)
+            continue;
+
+        ngx_dynamic_upstream_reload_upstream<S>(cycle, uscf[j], old, dscf);
+    }
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_reload_init(ngx_cycle_t *cycle)
+{
+    if (cycle->old_cycle == NULL || cycle->old_cycle->conf_ctx == NULL)
+        return NGX_OK;
+
+    if (ngx_dynamic_upstream_reload_init_all<ngx_http_upstream_srv_conf_t>
+            (cycle) != NGX_OK)
+        return NGX_ERROR;
+
+    return ngx_dynamic_upstream_reload_init_all
+        <ngx_stream_upstream_srv_conf_t>(cycle);
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#ifndef NGX_DYNAMIC_UPSTREAM_RELOAD_H
+#define NGX_DYNAMIC_UPSTREAM_RELOAD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#ifdef __cplusplus
+}
+#endif
+
+
+// warm reload of 'dynamic_warm_reload' upstreams: the peers of the
+// upstream with the same name and zone name in the previous cycle are
+// copied to the zone of the new cycle with their addresses and state,
+// instead of the peers of the config. Runs in the master when the zones
+// of the new cycle are initialized and the zones of the previous one
+// are still mapped.
+//
+// The previous cycle is read without a layout stamp: only the upstream
+// configs and the round robin peers are read, which are the structures
+// of the nginx binary run by the master in both cycles. A dynamic module
+// is refused by nginx if built for another version, and a binary upgrade
+// starts a new master with no previous cycle. The tables of this module
+// in the zones (hash ring, p2c and outlier stats) are never read, they
+// are built again for the new cycle.
+
+ngx_int_t
+ngx_dynamic_upstream_reload_init(ngx_cycle_t *cycle);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_RELOAD_H */
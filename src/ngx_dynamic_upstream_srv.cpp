@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+extern "C" {
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_inet.h>
+
+#include <arpa/nameser.h>
+#include <resolv.h>
+
+}
+
+#include "ngx_dynamic_upstream_srv.h"
+#include "ngx_dynamic_upstream_dns_cache.h"
+
+
+#define NGX_DYNAMIC_UPSTREAM_SRV_ANSWER  65536
+
+
+typedef struct {
+    ngx_uint_t  priority;
+    ngx_int_t   weight;
+    in_port_t   port;
+    ngx_str_t   target;
+} ngx_dynamic_upstream_srv_t;
+
+
+static ngx_array_t *
+ngx_dynamic_upstream_srv_query(ngx_url_t *u, ngx_pool_t *pool,
+    ngx_addr_t *resolver)
+{
+    ngx_array_t                 *records;
+    ngx_dynamic_upstream_srv_t  *srv;
+    u_char                      *answer, *name;
+    const u_char                *rdata;
+    char                         target[NS_MAXDNAME];
+    int                          len, i, n;
+    ns_msg                       msg;
+    ns_rr                        rr;
+    struct __res_state           state;
+
+    name = (u_char *) ngx_pnalloc(pool, u->host.len + 1);
+    answer = (u_char *) ngx_palloc(pool, NGX_DYNAMIC_UPSTREAM_SRV_ANSWER);
+    records = ngx_array_create(pool, 8, sizeof(ngx_dynamic_upstream_srv_t));
+
+    if (name == NULL || answer == NULL || records == NULL) {
+
+        u->err = (char *) "no memory";
+        return NULL;
+    }
+
+    ngx_cpystrn(name, u->host.data, u->host.len + 1);
+
+    // a state of its own, the resolver is set per upstream
+
+    ngx_memzero(&state, sizeof(struct __res_state));
+
+    if (res_ninit(&state) < 0) {
+
+        u->err = (char *) "resolver not initialized";
+        return NULL;
+    }
+
+    // the slots of the state are IPv4, others are refused by the config
+
+    if (resolver != NULL) {
+
+        if (resolver->sockaddr->sa_family != AF_INET
+            || resolver->socklen != sizeof(struct sockaddr_in)) {
+
+            res_nclose(&state);
+
+            u->err = (char *) "resolver is not IPv4";
+            return NULL;
+        }
+
+        ngx_memcpy(&state.nsaddr_list[0], resolver->sockaddr,
+                   sizeof(struct sockaddr_in));
+        state.nscount = 1;
+    }
+
+    len = res_nquery(&state, (char *) name, ns_c_in, ns_t_srv, answer,
+                     NGX_DYNAMIC_UPSTREAM_SRV_ANSWER);
+
+    res_nclose(&state);
+
+    if (len < 0) {
+
+        u->err = (char *) "SRV records not found";
+        return NULL;
+    }
+
+    if (ns_initparse(answer, len, &msg) < 0) {
+
+        u->err = (char *) "invalid SRV answer";
+        return NULL;
+    }
+
+    n = ns_msg_count(msg, ns_s_an);
+
+    for (i = 0; i < n; i++) {
+
+        if (ns_parserr(&msg, ns_s_an, i, &rr) < 0)
+            continue;
+
+        if (ns_rr_type(rr) != ns_t_srv || ns_rr_rdlen(rr) < 7)
+            continue;
+
+        rdata = ns_rr_rdata(rr);
+
+        if (dn_expand(ns_msg_base(msg), ns_msg_end(msg), rdata + 6,
+                      target, sizeof(target)) < 0)
+            continue;
+
+        // "." is the service decidedly not available
+
+        if (target[0] == '\0' || (target[0] == '.' && target[1] == '\0'))
+            continue;
+
+        srv = (ngx_dynamic_upstream_srv_t *) ngx_array_push(records);
+        if (srv == NULL) {
+
+            u->err = (char *) "no memory";
+            return NULL;
+        }
+
+        srv->priority = ns_get16(rdata);
+        srv->weight = ngx_max(ns_get16(rdata + 2), 1);
+        srv->port = (in_port_t) ns_get16(rdata + 4);
+
+        srv->target.len = ngx_strlen(target);
+        srv->target.data = (u_char *) ngx_pnalloc(pool, srv->target.len);
+        if (srv->target.data == NULL) {
+
+            u->err = (char *) "no memory";
+            return NULL;
+        }
+
+        ngx_memcpy(srv->target.data, target, srv->target.len);
+    }
+
+    if (records->nelts == 0) {
+
+        u->err = (char *) "no SRV targets";
+        return NULL;
+    }
+
+    return records;
+}
+
+
+ngx_int_t
+ngx_dynamic_upstream_srv_resolve(ngx_url_t *u, ngx_pool_t *pool,
+    ngx_int_t **weights, time_t max_age, ngx_addr_t *resolver)
+{
+    ngx_array_t                 *records, *addrs, *w;
+    ngx_dynamic_upstream_srv_t  *srv;
+    ngx_uint_t                   i, j, priority = NGX_MAX_UINT32_VALUE;
+    ngx_int_t                    max = 0;
+    ngx_url_t                    t;
+    ngx_addr_t                  *addr;
+    ngx_int_t                   *weight;
+
+    records = ngx_dynamic_upstream_srv_query(u, pool, resolver);
+    if (records == NULL)
+        return NGX_ERROR;
+
+    srv = (ngx_dynamic_upstream_srv_t *) records->elts;
+
+    for (i = 0; i < records->nelts; i++)
+        priority = ngx_min(priority, srv[i].priority);
+
+    for (i = 0; i < records->nelts; i++)
+        if (srv[i].priority == priority)
+            max = ngx_max(max, srv[i].weight);
+
+    // the ratios of the weights are kept, the small ones get at least 1
+
+    if (max > NGX_DYNAMIC_UPSTREAM_SRV_WEIGHT)
+        for (i = 0; i < records->nelts; i++)
+            srv[i].weight = ngx_max(srv[i].weight
+                * NGX_DYNAMIC_UPSTREAM_SRV_WEIGHT / max, 1);
+
+    addrs = ngx_array_create(pool, records->nelts, sizeof(ngx_addr_t));
+    w = ngx_array_create(pool, records->nelts, sizeof(ngx_int_t));
+
+    if (addrs == NULL || w == NULL) {
+
+        u->err = (char *) "no memory";
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < records->nelts; i++) {
+
+        if (srv[i].priority != priority)
+            continue;
+
+        ngx_memzero(&t, sizeof(ngx_url_t));
+
+        t.url = srv[i].target;
+        t.host = srv[i].target;
+        t.port = srv[i].port;
+
+        // a target failed to resolve is skipped, others are kept
+
+        if (ngx_dynamic_upstream_dns_cache_resolve(&t, pool, max_age)
+                != NGX_OK)
+            continue;
+
+        for (j = 0; j < t.naddrs; j++) {
+
+            addr = (ngx_addr_t *) ngx_array_push(addrs);
+            weight = (ngx_int_t *) ngx_array_push(w);
+
+            if (addr == NULL || weight == NULL) {
+
+                u->err = (char *) "no memory";
+                return NGX_ERROR;
+            }
+
+            *addr = t.addrs[j];
+            *weight = srv[i].weight;
+        }
+    }
+
+    if (addrs->nelts == 0) {
+
+        u->err = (char *) "SRV targets not resolved";
+        return NGX_ERROR;
+    }
+
+    u->addrs = (ngx_addr_t *) addrs->elts;
+    u->naddrs = addrs->nelts;
+
+    *weights = (ngx_int_t *) w->elts;
+
+    return NGX_OK;
+}
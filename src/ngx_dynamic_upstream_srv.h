@@ -0,0 +1,41 @@
+/*
+ * Copyright (C) 2018 Aleksei Konovkin (alkon2000@mail.ru)
+ */
+
+#ifndef NGX_DYNAMIC_UPSTREAM_SRV_H
+#define NGX_DYNAMIC_UPSTREAM_SRV_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+
+#ifdef __cplusplus
+}
+#endif
+
+
+// a server named as a service, '_service._proto.name', is discovered
+// by SRV records in the background sync: the targets of the lowest
+// priority are resolved through the dns cache, with the ports and
+// the weights of the records. Weights of the records, up to 65535, are
+// scaled down to the peer weights of 1-100 in proportion to the largest
+// one of the priority.
+
+#define NGX_DYNAMIC_UPSTREAM_SRV_WEIGHT  100
+
+#define ngx_dynamic_upstream_is_srv(name)                                     \
+    ((name).len > 1 && (name).data[0] == '_')
+
+
+// weights are aligned with u->addrs, the records are queried from
+// the resolver if not NULL, from the resolvers of the system otherwise
+
+ngx_int_t
+ngx_dynamic_upstream_srv_resolve(ngx_url_t *u, ngx_pool_t *pool,
+    ngx_int_t **weights, time_t max_age, ngx_addr_t *resolver);
+
+
+#endif /* NGX_DYNAMIC_UPSTREAM_SRV_H */
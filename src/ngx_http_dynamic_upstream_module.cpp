@@ -8,19 +8,54 @@ extern "C" {
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_http.h>
-#include <pthread.h>
 #include <errno.h>
 
+#if !(NGX_THREADS)
+#include <pthread.h>
+#endif
+
 }
 
 #include "ngx_dynamic_upstream_module.h"
+#include "ngx_dynamic_upstream_balancer.h"
 #include "ngx_dynamic_upstream_op.h"
+#include "ngx_dynamic_upstream_metrics.h"
+#include "ngx_dynamic_upstream_chash.h"
+#include "ngx_dynamic_upstream_p2c.h"
+#include "ngx_dynamic_upstream_check.h"
+#include "ngx_dynamic_upstream_outlier.h"
+#include "ngx_dynamic_upstream_dns_cache.h"
+#include "ngx_dynamic_upstream_reload.h"
+#include "ngx_dynamic_upstream_control.h"
 
 
 static char *
 ngx_dynamic_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 
 
+static char *
+ngx_dynamic_upstream_dns_hold_down(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+static char *
+ngx_dynamic_upstream_dns_subset(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+static char *
+ngx_dynamic_upstream_dns_srv_resolver(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_post_conf(ngx_conf_t *cf);
+
+static ngx_int_t
+ngx_stream_dynamic_upstream_post_conf(ngx_conf_t *cf);
+
+
+static ngx_int_t
+ngx_dynamic_upstream_init_module(ngx_cycle_t *cycle);
+
 static ngx_int_t
 ngx_http_dynamic_upstream_init_worker(ngx_cycle_t *cycle);
 
@@ -32,23 +67,18 @@ static void *
 ngx_dynamic_upstream_create_srv_conf(ngx_conf_t *cf);
 
 
-static char *
+template <class S> static char *
 ngx_create_servers_file(ngx_conf_t *cf, void *post, void *data);
 
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_ramp_wrap(ngx_conf_t *cf);
 
-typedef struct {
-    ngx_msec_t  interval;
-    time_t      last;
-    ngx_uint_t  hash;
-    ngx_flag_t  ipv6;
-    ngx_flag_t  add_down;
-    ngx_str_t   file;
-} ngx_dynamic_upstream_srv_conf_t;
+static ngx_conf_post_t  ngx_http_servers_file_post = {
+    ngx_create_servers_file<ngx_http_upstream_srv_conf_t>
+};
 
-static char *
-ngx_create_servers_file(ngx_conf_t *cf, void *post, void *data);
-static ngx_conf_post_t  ngx_servers_file_post = {
-    ngx_create_servers_file
+static ngx_conf_post_t  ngx_stream_servers_file_post = {
+    ngx_create_servers_file<ngx_stream_upstream_srv_conf_t>
 };
 
 static ngx_conf_num_bounds_t  ngx_check_update = {
@@ -56,6 +86,11 @@ static ngx_conf_num_bounds_t  ngx_check_update = {
     1, 3600
 };
 
+static ngx_conf_num_bounds_t  ngx_check_high_water = {
+    ngx_conf_check_num_bounds,
+    1, 100
+};
+
 static ngx_command_t ngx_http_dynamic_upstream_commands[] = {
 
     { ngx_string("dynamic_upstream"),
@@ -86,12 +121,103 @@ static ngx_command_t ngx_http_dynamic_upstream_commands[] = {
       offsetof(ngx_dynamic_upstream_srv_conf_t, ipv6),
       NULL },
 
+    { ngx_string("dns_max_stale"),
+      NGX_HTTP_UPS_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_dynamic_upstream_srv_conf_t, dns_max_stale),
+      NULL },
+
+    { ngx_string("dns_max_backoff"),
+      NGX_HTTP_UPS_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_dynamic_upstream_srv_conf_t, dns_max_backoff),
+      NULL },
+
+    { ngx_string("dns_hold_down"),
+      NGX_HTTP_UPS_CONF | NGX_CONF_TAKE12,
+      ngx_dynamic_upstream_dns_hold_down,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dns_subset"),
+      NGX_HTTP_UPS_CONF | NGX_CONF_TAKE12,
+      ngx_dynamic_upstream_dns_subset,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dns_srv_resolver"),
+      NGX_HTTP_UPS_CONF | NGX_CONF_TAKE1,
+      ngx_dynamic_upstream_dns_srv_resolver,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("dynamic_state_file"),
       NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_str_slot,
       NGX_HTTP_SRV_CONF_OFFSET,
       offsetof(ngx_dynamic_upstream_srv_conf_t, file),
-      &ngx_servers_file_post },
+      &ngx_http_servers_file_post },
+
+    { ngx_string("dynamic_zone_high_water"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_dynamic_upstream_srv_conf_t, high_water),
+      &ngx_check_high_water },
+
+    { ngx_string("dynamic_warm_reload"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_dynamic_upstream_srv_conf_t, warm_reload),
+      NULL },
+
+    { ngx_string("dynamic_lock_stats"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_dynamic_upstream_srv_conf_t, lock_stats),
+      NULL },
+
+    { ngx_string("slow_start"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_dynamic_upstream_srv_conf_t, slow_start),
+      NULL },
+
+    { ngx_string("dynamic_hash"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_http_dynamic_upstream_chash,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dynamic_p2c"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_http_dynamic_upstream_p2c,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dynamic_check"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_dynamic_upstream_check_conf,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dynamic_outlier"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_ANY,
+      ngx_dynamic_upstream_outlier_conf,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
 
     ngx_null_command
 };
@@ -120,12 +246,110 @@ static ngx_command_t ngx_stream_dynamic_upstream_commands[] = {
       offsetof(ngx_dynamic_upstream_srv_conf_t, ipv6),
       NULL },
 
+    { ngx_string("dns_max_stale"),
+      NGX_STREAM_UPS_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_dynamic_upstream_srv_conf_t, dns_max_stale),
+      NULL },
+
+    { ngx_string("dns_max_backoff"),
+      NGX_STREAM_UPS_CONF | NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_dynamic_upstream_srv_conf_t, dns_max_backoff),
+      NULL },
+
+    { ngx_string("dns_hold_down"),
+      NGX_STREAM_UPS_CONF | NGX_CONF_TAKE12,
+      ngx_dynamic_upstream_dns_hold_down,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dns_subset"),
+      NGX_STREAM_UPS_CONF | NGX_CONF_TAKE12,
+      ngx_dynamic_upstream_dns_subset,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dns_srv_resolver"),
+      NGX_STREAM_UPS_CONF | NGX_CONF_TAKE1,
+      ngx_dynamic_upstream_dns_srv_resolver,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
     { ngx_string("dynamic_state_file"),
       NGX_STREAM_UPS_CONF|NGX_CONF_TAKE1,
       ngx_conf_set_str_slot,
       NGX_STREAM_SRV_CONF_OFFSET,
       offsetof(ngx_dynamic_upstream_srv_conf_t, file),
-      &ngx_servers_file_post },
+      &ngx_stream_servers_file_post },
+
+    { ngx_string("dynamic_zone_high_water"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_dynamic_upstream_srv_conf_t, high_water),
+      &ngx_check_high_water },
+
+    { ngx_string("dynamic_warm_reload"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_dynamic_upstream_srv_conf_t, warm_reload),
+      NULL },
+
+    { ngx_string("dynamic_lock_stats"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_flag_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_dynamic_upstream_srv_conf_t, lock_stats),
+      NULL },
+
+    { ngx_string("slow_start"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      offsetof(ngx_dynamic_upstream_srv_conf_t, slow_start),
+      NULL },
+
+    { ngx_string("dynamic_hash"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_stream_dynamic_upstream_chash,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dynamic_p2c"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_stream_dynamic_upstream_p2c,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dynamic_check"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_ANY,
+      ngx_dynamic_upstream_check_conf,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dynamic_outlier"),
+      NGX_STREAM_UPS_CONF|NGX_CONF_ANY,
+      ngx_dynamic_upstream_outlier_conf,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("dynamic_upstream_control"),
+      NGX_STREAM_SRV_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+      ngx_dynamic_upstream_control_conf,
+      NGX_STREAM_SRV_CONF_OFFSET,
+      0,
+      NULL },
 
     ngx_null_command
 };
@@ -133,7 +357,7 @@ static ngx_command_t ngx_stream_dynamic_upstream_commands[] = {
 
 static ngx_http_module_t ngx_http_dynamic_upstream_module_ctx = {
     NULL,                                       /* preconfiguration  */
-    NULL,                                       /* postconfiguration */
+    ngx_http_dynamic_upstream_post_conf,        /* postconfiguration */
 
     NULL,                                       /* create main       */
     NULL,                                       /* init main         */
@@ -148,7 +372,7 @@ static ngx_http_module_t ngx_http_dynamic_upstream_module_ctx = {
 
 static ngx_stream_module_t ngx_stream_dynamic_upstream_module_ctx = {
     NULL,                                       /* preconfiguration  */
-    NULL,                                       /* postconfiguration */
+    ngx_stream_dynamic_upstream_post_conf,      /* postconfiguration */
 
     NULL,                                       /* create main       */
     NULL,                                       /* init main         */
@@ -164,7 +388,7 @@ ngx_module_t ngx_http_dynamic_upstream_module = {
     ngx_http_dynamic_upstream_commands,        /* module directives */
     NGX_HTTP_MODULE,                           /* module type       */
     NULL,                                      /* init master       */
-    NULL,                                      /* init module       */
+    ngx_dynamic_upstream_init_module,          /* init module       */
     ngx_http_dynamic_upstream_init_worker,     /* init process      */
     NULL,                                      /* init thread       */
     NULL,                                      /* exit thread       */
@@ -204,34 +428,6 @@ state_open(ngx_str_t *state_file, const char *mode)
 }
 
 
-static char *
-ngx_create_servers_file(ngx_conf_t *cf, void *post, void *data)
-{
-    ngx_str_t  *fname = (ngx_str_t *) data;
-    FILE       *f;
-
-    static const ngx_str_t
-        default_server = ngx_string("server 0.0.0.0:1 down;");
-
-    if (ngx_conf_full_name(cf->cycle, fname, 1) != NGX_OK)
-        return (char *) NGX_CONF_ERROR;
-
-    f = state_open(fname, "r");
-    if (f != NULL) {
-        fclose(f);
-        return ngx_conf_include(cf, NULL, NULL);
-    }
-
-    f = state_open(fname, "w+");
-    if (f == NULL)
-        return (char *) NGX_CONF_ERROR;
-
-    fwrite(default_server.data, default_server.len, 1, f);
-
-    fclose(f);
-
-    return ngx_conf_include(cf, NULL, NULL);
-}
 
 
 // parse uri parameters
@@ -297,18 +493,26 @@ ngx_dynamic_upstream_build_op(ngx_http_request_t *r,
         | NGX_DYNAMIC_UPSTEAM_OP_PARAM_FAIL_TIMEOUT
         | NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP
         | NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN
+        | NGX_DYNAMIC_UPSTEAM_OP_PARAM_DRAIN
 #if defined(nginx_version) && (nginx_version >= 1011005)
         | NGX_DYNAMIC_UPSTEAM_OP_PARAM_MAX_CONNS
 #endif
     );
 
+    ngx_str_t  drain;
+
     ngx_memzero(op, sizeof(ngx_dynamic_upstream_op_t));
 
     op->err = "unexpected";
     op->status = NGX_HTTP_OK;
 
+    get_bool(r, "all", op, NGX_DYNAMIC_UPSTEAM_OP_PARAM_ALL);
+    get_bool(r, "metrics", op, NGX_DYNAMIC_UPSTEAM_OP_PARAM_METRICS);
+
     op->upstream = get_str(r, "upstream", op);
-    if (!op->upstream.data) {
+    if (!op->upstream.data
+        && !(op->op_param & (NGX_DYNAMIC_UPSTEAM_OP_PARAM_ALL
+                             | NGX_DYNAMIC_UPSTEAM_OP_PARAM_METRICS))) {
 
         op->status = NGX_HTTP_BAD_REQUEST;
         op->err = "upstream required";
@@ -322,6 +526,18 @@ ngx_dynamic_upstream_build_op(ngx_http_request_t *r,
     op->name = get_str(r, "peer", op);
     op->up = get_bool(r, "up", op, NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP);
     op->down = get_bool(r, "down", op, NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN);
+    drain = get_str(r, "drain", op, NGX_DYNAMIC_UPSTEAM_OP_PARAM_DRAIN);
+    if (drain.len != 0) {
+
+        op->drain = ngx_parse_time(&drain, 1);
+        if (op->drain == NGX_ERROR) {
+
+            op->status = NGX_HTTP_BAD_REQUEST;
+            op->err = "drain: invalid time";
+
+            return NGX_ERROR;
+        }
+    }
     op->weight = get_num(r, "weight", op,
         NGX_DYNAMIC_UPSTEAM_OP_PARAM_WEIGHT);
     op->max_fails = get_num(r, "max_fails", op,
@@ -342,6 +558,9 @@ ngx_dynamic_upstream_build_op(ngx_http_request_t *r,
     if (op->status == NGX_HTTP_BAD_REQUEST)
         return NGX_ERROR;
 
+    if (ngx_dynamic_upstream_op_check(op) != NGX_OK)
+        return NGX_ERROR;
+
     if (op->op_param & UPDATE_OP_PARAM) {
 
         op->op |= NGX_DYNAMIC_UPSTEAM_OP_PARAM;
@@ -368,6 +587,15 @@ ngx_dynamic_upstream_build_op(ngx_http_request_t *r,
         return NGX_ERROR;
     }
 
+    if ((op->up || op->down)
+        && (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_DRAIN)) {
+
+        op->status = NGX_HTTP_BAD_REQUEST;
+        op->err = "drain with up or down is not allowed";
+
+        return NGX_ERROR;
+    }
+
     if (op->op & NGX_DYNAMIC_UPSTEAM_OP_ADD)
 
         op->op = NGX_DYNAMIC_UPSTEAM_OP_ADD;
@@ -380,6 +608,16 @@ ngx_dynamic_upstream_build_op(ngx_http_request_t *r,
 
         op->op = NGX_DYNAMIC_UPSTEAM_OP_LIST;
 
+    if ((op->op_param & (NGX_DYNAMIC_UPSTEAM_OP_PARAM_ALL
+                         | NGX_DYNAMIC_UPSTEAM_OP_PARAM_METRICS))
+        && op->op != NGX_DYNAMIC_UPSTEAM_OP_LIST) {
+
+        op->status = NGX_HTTP_BAD_REQUEST;
+        op->err = "only list is allowed for all upstreams";
+
+        return NGX_ERROR;
+    }
+
     if ((op->op & NGX_DYNAMIC_UPSTEAM_OP_ADD) ||
         (op->op & NGX_DYNAMIC_UPSTEAM_OP_REMOVE)) {
 
@@ -460,12 +698,57 @@ ngx_dynamic_upstream_get(ngx_dynamic_upstream_op_t *op)
 }
 
 
+template <class S> static ngx_dynamic_upstream_metrics_t *
+ngx_dynamic_upstream_get_metrics(S *uscf)
+{
+    ngx_dynamic_upstream_srv_conf_t  *dscf = srv_conf(uscf);
+
+    if (dscf == NULL)
+        return NULL;
+
+    if (dscf->metrics == NULL)
+        dscf->metrics = ngx_dynamic_upstream_metrics_get(uscf->host,
+            TypeSelect<S>::stream);
+
+    return dscf->metrics;
+}
+
+
+template <class S> static ngx_dynamic_upstream_lock_stat_t *
+ngx_dynamic_upstream_get_lock_stat(S *uscf, ngx_int_t op)
+{
+    ngx_dynamic_upstream_srv_conf_t  *dscf;
+    ngx_dynamic_upstream_metrics_t   *m;
+    ngx_uint_t                        j;
+
+    if (uscf->srv_conf == NULL)
+        return NULL;
+
+    dscf = srv_conf(uscf);
+    if (dscf->lock_stats != 1)
+        return NULL;
+
+    m = ngx_dynamic_upstream_get_metrics(uscf);
+    if (m == NULL)
+        return NULL;
+
+    for (j = 0; (op >> (j + 1)) != 0; j++)
+        /* void */ ;
+
+    return j < NGX_DYNAMIC_UPSTREAM_LOCK_OPS ? &m->lock[j] : NULL;
+}
+
+
 template <class S> ngx_int_t
 ngx_dynamic_upstream_do_op(ngx_log_t *log, ngx_dynamic_upstream_op_t *op,
     void *uscfp)
 {
     S  *uscf = static_cast<S*>(uscfp);
 
+    ngx_int_t                         rc;
+    ngx_dynamic_upstream_srv_conf_t  *dscf = NULL;
+    ngx_dynamic_upstream_metrics_t   *m;
+
     if (uscf->shm_zone == NULL) {
 
         op->status = NGX_HTTP_NOT_IMPLEMENTED;
@@ -474,8 +757,42 @@ ngx_dynamic_upstream_do_op(ngx_log_t *log, ngx_dynamic_upstream_op_t *op,
         return NGX_ERROR;
     }
 
-    return ngx_dynamic_upstream_op_impl(log, op,
+    if (uscf->srv_conf != NULL)
+        dscf = srv_conf(uscf);
+
+    if (dscf != NULL && op->high_water == 0
+        && dscf->high_water != NGX_CONF_UNSET_UINT)
+        op->high_water = dscf->high_water;
+
+    if (op->lock_stat == NULL)
+        op->lock_stat = ngx_dynamic_upstream_get_lock_stat(uscf, op->op);
+
+    if (dscf != NULL && op->chash == NULL)
+        op->chash = dscf->chash;
+
+    if (dscf != NULL && op->p2c == NULL)
+        op->p2c = dscf->p2c;
+
+    if (dscf != NULL && op->outlier == NULL && dscf->outlier != NULL)
+        op->outlier = dscf->outlier->table;
+
+    rc = ngx_dynamic_upstream_op_impl(log, op,
         (ngx_slab_pool_t *) uscf->shm_zone->shm.addr, uscf->peer.data);
+
+    if (dscf != NULL && (m = ngx_dynamic_upstream_get_metrics(uscf)) != NULL) {
+
+        ngx_atomic_fetch_add(&m->added, op->added);
+        ngx_atomic_fetch_add(&m->removed, op->removed);
+        ngx_atomic_fetch_add(&m->updated, op->updated);
+        ngx_atomic_fetch_add(&m->resolve_failed, op->resolve_failed);
+
+        ngx_atomic_fetch_add(&m->zone_allocated, op->allocated);
+        ngx_atomic_fetch_add(&m->zone_freed, op->freed);
+        ngx_atomic_fetch_add(&m->zone_failed, op->nomem);
+        ngx_atomic_fetch_add(&m->zone_refused, op->refused);
+    }
+
+    return rc;
 }
 
 
@@ -497,233 +814,3010 @@ ngx_dynamic_upstream_stream_op(ngx_log_t *log, ngx_dynamic_upstream_op_t *op,
 }
 
 
-template <class S> static void
-ngx_dynamic_upstream_print_response(void *uscfp,
-    ngx_buf_t *b, ngx_int_t verbose)
-{
-    S  *uscf = static_cast<S*>(uscfp);
+// response buffers
 
-    typename TypeSelect<S>::peers_type  *peers;
-    typename TypeSelect<S>::peer_type   *peer;
+typedef struct {
+    ngx_pool_t    *pool;
+    ngx_chain_t   *out;
+    ngx_chain_t  **last;
+    ngx_buf_t     *b;
+    off_t          size;
+    ngx_chain_t   *free;     // sent buffers to reuse
+} ngx_dynamic_upstream_out_t;
 
-    ngx_uint_t  j;
 
-    peers = (typename TypeSelect<S>::peers_type *) uscf->peer.data;
+static void
+ngx_dynamic_upstream_out_init(ngx_dynamic_upstream_out_t *out,
+    ngx_pool_t *pool)
+{
+    ngx_memzero(out, sizeof(ngx_dynamic_upstream_out_t));
 
-    ngx_upstream_rr_peers_rlock<typename TypeSelect<S>::peers_type> lock(peers);
+    out->pool = pool;
+    out->last = &out->out;
+}
 
-    for (j = 0;
-         peers != NULL && j < 2;
-         peers = peers->next, j++) {
 
-        for (peer = peers->peer;
-             peer != NULL;
-             peer = peer->next) {
-            
-            if (verbose) {
+static ngx_int_t
+ngx_dynamic_upstream_printf(ngx_dynamic_upstream_out_t *out,
+    const char *fmt, ...)
+{
+    static const size_t  line_max = 2048;
 
-                b->last = ngx_snprintf(b->last, b->end - b->last,
-                    "server %V addr=%V weight=%d max_fails=%d fail_timeout=%d"
-#if defined(nginx_version) && (nginx_version >= 1011005)
-                    " max_conns=%d"
-#endif
-                    " conns=%d",
-                    &peer->server, &peer->name, peer->weight, peer->max_fails,
-                    peer->fail_timeout,
-#if defined(nginx_version) && (nginx_version >= 1011005)
-                    peer->max_conns,
-#endif
-                    peer->conns);
+    ngx_chain_t  *cl;
+    ngx_buf_t    *b;
+    u_char       *p;
+    va_list       args;
 
-            } else
-                b->last = ngx_snprintf(b->last, b->end - b->last,
-                                       "server %V addr=%V", &peer->server,
-                                       &peer->name);
+    if (out->b == NULL || (size_t) (out->b->end - out->b->last) < line_max) {
 
-            if (peer->down)
-                b->last = ngx_snprintf(b->last, b->end - b->last, " down");
+        cl = ngx_chain_get_free_buf(out->pool, &out->free);
+        if (cl == NULL)
+            return NGX_ERROR;
+
+        b = cl->buf;
 
-            if (j == 1)
-                b->last = ngx_snprintf(b->last, b->end - b->last, " backup");
+        if (b->start == NULL) {
 
-            b->last =  ngx_snprintf(b->last, b->end - b->last, ";\n");
+            b->start = (u_char *) ngx_palloc(out->pool, ngx_pagesize * 4);
+            if (b->start == NULL)
+                return NGX_ERROR;
+
+            b->pos = b->start;
+            b->last = b->start;
+            b->end = b->start + ngx_pagesize * 4;
+            b->temporary = 1;
+            b->tag = (ngx_buf_tag_t) &ngx_http_dynamic_upstream_module;
         }
+
+        cl->next = NULL;
+
+        *out->last = cl;
+        out->last = &cl->next;
+        out->b = cl->buf;
     }
-}
 
+    va_start(args, fmt);
+    p = ngx_vslprintf(out->b->last, out->b->end, fmt, args);
+    va_end(args);
 
-static void
-ngx_dynamic_upstream_response(ngx_upstream_conf_t *conf,
-    ngx_buf_t *b, ngx_dynamic_upstream_op_t *op)
+    out->size += p - out->b->last;
+    out->b->last = p;
+
+    return NGX_OK;
+}
+
+
+// filters and pagination of the peers list
+
+typedef struct {
+    ngx_int_t     state;
+    ngx_int_t     type;
+    ngx_str_t     server;
+    ngx_array_t  *cidrs;
+    ngx_uint_t    limit;
+    ngx_flag_t    cursor;
+    ngx_uint_t    start;
+    uint32_t      start_crc;
+    ngx_flag_t    more;
+    ngx_uint_t    next;
+    uint32_t      next_crc;
+} ngx_dynamic_upstream_filter_t;
+
+
+#define NGX_DYNAMIC_UPSTREAM_FILTER_UP       1
+#define NGX_DYNAMIC_UPSTREAM_FILTER_DOWN     2
+
+#define NGX_DYNAMIC_UPSTREAM_FILTER_PRIMARY  1
+#define NGX_DYNAMIC_UPSTREAM_FILTER_BACKUP   2
+
+
+static ngx_int_t
+ngx_dynamic_upstream_build_filter(ngx_http_request_t *r,
+    ngx_dynamic_upstream_op_t *op, ngx_dynamic_upstream_filter_t *filter)
+{
+    static const ngx_str_t  up = ngx_string("up");
+    static const ngx_str_t  down = ngx_string("down");
+
+    ngx_str_t    s;
+    ngx_int_t    n;
+    u_char      *p, *last, *sep;
+    ngx_cidr_t  *cidr;
+
+    ngx_memzero(filter, sizeof(ngx_dynamic_upstream_filter_t));
+
+    s = get_str(r, "state");
+    if (s.data != NULL) {
+
+        if (str_eq(s, up))
+            filter->state = NGX_DYNAMIC_UPSTREAM_FILTER_UP;
+        else if (str_eq(s, down))
+            filter->state = NGX_DYNAMIC_UPSTREAM_FILTER_DOWN;
+        else {
+
+            op->err = "state: up or down expected";
+            goto invalid;
+        }
+    }
+
+    if (get_bool(r, "primary", NULL))
+        filter->type = NGX_DYNAMIC_UPSTREAM_FILTER_PRIMARY;
+
+    if (op->op == NGX_DYNAMIC_UPSTEAM_OP_LIST && op->backup) {
+
+        if (filter->type != 0) {
+
+            op->err = "primary and backup at once are not allowed";
+            goto invalid;
+        }
+
+        filter->type = NGX_DYNAMIC_UPSTREAM_FILTER_BACKUP;
+    }
+
+    filter->server = get_str(r, "match");
+
+    s = get_str(r, "cidr");
+    if (s.data != NULL) {
+
+        filter->cidrs = ngx_array_create(r->pool, 2, sizeof(ngx_cidr_t));
+        if (filter->cidrs == NULL)
+            return NGX_ERROR;
+
+        for (p = s.data, last = s.data + s.len; p < last; p = sep + 1) {
+
+            sep = ngx_strlchr(p, last, ',');
+            if (sep == NULL)
+                sep = last;
+
+            cidr = (ngx_cidr_t *) ngx_array_push(filter->cidrs);
+            if (cidr == NULL)
+                return NGX_ERROR;
+
+            s.data = p;
+            s.len = sep - p;
+
+            if (ngx_ptocidr(&s, cidr) == NGX_ERROR) {
+
+                op->err = "cidr: invalid value";
+                goto invalid;
+            }
+        }
+    }
+
+    s = get_str(r, "limit");
+    if (s.data != NULL) {
+
+        n = ngx_atoi(s.data, s.len);
+        if (n == NGX_ERROR || n == 0) {
+
+            op->err = "limit: positive number expected";
+            goto invalid;
+        }
+
+        filter->limit = n;
+    }
+
+    // cursor: <position>-<crc32 of the peer expected at this position>
+
+    s = get_str(r, "cursor");
+    if (s.data != NULL) {
+
+        sep = ngx_strlchr(s.data, s.data + s.len, '-');
+        if (sep == NULL)
+            goto invalid_cursor;
+
+        n = ngx_atoi(s.data, sep - s.data);
+        if (n == NGX_ERROR)
+            goto invalid_cursor;
+
+        filter->start = n;
+
+        n = ngx_hextoi(sep + 1, s.data + s.len - sep - 1);
+        if (n == NGX_ERROR)
+            goto invalid_cursor;
+
+        filter->start_crc = (uint32_t) n;
+        filter->cursor = 1;
+    }
+
+    if ((op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_ALL)
+        && (filter->limit != 0 || filter->cursor)) {
+
+        op->err = "pagination is not allowed for all upstreams";
+        goto invalid;
+    }
+
+    return NGX_OK;
+
+invalid_cursor:
+
+    op->err = "cursor: invalid value";
+
+invalid:
+
+    op->status = NGX_HTTP_BAD_REQUEST;
+
+    return NGX_DECLINED;
+}
+
+
+template <class PeerT> static uint32_t
+ngx_dynamic_upstream_peer_crc(PeerT *peer)
+{
+    uint32_t  crc;
+
+    ngx_crc32_init(crc);
+    ngx_crc32_update(&crc, peer->server.data, peer->server.len);
+    ngx_crc32_update(&crc, peer->name.data, peer->name.len);
+    ngx_crc32_final(crc);
+
+    return crc;
+}
+
+
+template <class PeerT> static ngx_flag_t
+ngx_dynamic_upstream_filter_peer(ngx_dynamic_upstream_filter_t *filter,
+    PeerT *peer, ngx_uint_t backup)
+{
+    if (filter->state == NGX_DYNAMIC_UPSTREAM_FILTER_UP && peer->down)
+        return 0;
+
+    if (filter->state == NGX_DYNAMIC_UPSTREAM_FILTER_DOWN && !peer->down)
+        return 0;
+
+    if (filter->type == NGX_DYNAMIC_UPSTREAM_FILTER_PRIMARY && backup)
+        return 0;
+
+    if (filter->type == NGX_DYNAMIC_UPSTREAM_FILTER_BACKUP && !backup)
+        return 0;
+
+    if (filter->server.len > peer->server.len
+        || ngx_strncmp(peer->server.data, filter->server.data,
+                       filter->server.len) != 0)
+        return 0;
+
+    if (filter->cidrs != NULL
+        && ngx_cidr_match(peer->sockaddr, filter->cidrs) != NGX_OK)
+        return 0;
+
+    return 1;
+}
+
+
+// position of the cursor may be shifted by adds and removes,
+// the peer it points to is searched then
+
+template <class S> static ngx_uint_t
+ngx_dynamic_upstream_filter_start(typename TypeSelect<S>::peers_type *peers,
+    ngx_dynamic_upstream_filter_t *filter)
+{
+    typename TypeSelect<S>::peer_type  *peer;
+
+    ngx_uint_t  i, j;
+
+    if (!filter->cursor)
+        return 0;
+
+    for (i = 0, j = 0;
+         peers != NULL && j < 2;
+         peers = peers->next, j++) {
+
+        for (peer = peers->peer;
+             peer != NULL;
+             peer = peer->next, i++) {
+
+            if (ngx_dynamic_upstream_peer_crc(peer) == filter->start_crc)
+                return i;
+        }
+    }
+
+    return filter->start;
+}
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_print_response(void *uscfp,
+    ngx_dynamic_upstream_out_t *out, ngx_int_t verbose, const char *indent,
+    ngx_dynamic_upstream_filter_t *filter)
+{
+    S  *uscf = static_cast<S*>(uscfp);
+
+    typename TypeSelect<S>::peers_type  *peers;
+    typename TypeSelect<S>::peer_type   *peer;
+
+    ngx_uint_t  i, j, start, count = 0;
+
+    peers = (typename TypeSelect<S>::peers_type *) uscf->peer.data;
+
+    ngx_upstream_rr_peers_rlock<typename TypeSelect<S>::peers_type> lock(peers,
+        0, ngx_dynamic_upstream_get_lock_stat(uscf,
+               NGX_DYNAMIC_UPSTEAM_OP_LIST));
+
+    start = ngx_dynamic_upstream_filter_start<S>(peers, filter);
+
+    for (i = 0, j = 0;
+         peers != NULL && j < 2;
+         peers = peers->next, j++) {
+
+        for (peer = peers->peer;
+             peer != NULL;
+             peer = peer->next, i++) {
+
+            if (i < start || !ngx_dynamic_upstream_filter_peer(filter, peer, j))
+                continue;
+
+            if (filter->limit != 0 && count == filter->limit) {
+
+                filter->more = 1;
+                filter->next = i;
+                filter->next_crc = ngx_dynamic_upstream_peer_crc(peer);
+
+                return NGX_OK;
+            }
+
+            count++;
+
+            if (ngx_dynamic_upstream_printf(out, "%sserver %V addr=%V",
+                    indent, &peer->server, &peer->name) == NGX_ERROR)
+                return NGX_ERROR;
+
+            if (verbose
+                && ngx_dynamic_upstream_printf(out,
+                       " weight=%d max_fails=%d fail_timeout=%d"
+#if defined(nginx_version) && (nginx_version >= 1011005)
+                       " max_conns=%d"
+#endif
+                       " conns=%d",
+                       peer->weight, peer->max_fails, peer->fail_timeout,
+#if defined(nginx_version) && (nginx_version >= 1011005)
+                       peer->max_conns,
+#endif
+                       peer->conns) == NGX_ERROR)
+                return NGX_ERROR;
+
+            if (ngx_dynamic_upstream_printf(out, "%s%s;\n",
+                    ngx_dynamic_upstream_draining(peer)
+                        ? " draining"
+                        : peer->down ? " down" : "",
+                    j == 1 ? " backup" : "") == NGX_ERROR)
+                return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_response(ngx_upstream_conf_t *conf,
+    ngx_dynamic_upstream_out_t *out, ngx_dynamic_upstream_op_t *op,
+    ngx_dynamic_upstream_filter_t *filter)
 {
     if (op->op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_STREAM)
         return ngx_dynamic_upstream_print_response
-            <ngx_stream_upstream_srv_conf_t>(conf->uscf, b, op->verbose);
+            <ngx_stream_upstream_srv_conf_t>(conf->uscf, out, op->verbose, "",
+                                             filter);
 
-    ngx_dynamic_upstream_print_response
-        <ngx_http_upstream_srv_conf_t>(conf->uscf, b, op->verbose);
+    return ngx_dynamic_upstream_print_response
+        <ngx_http_upstream_srv_conf_t>(conf->uscf, out, op->verbose, "",
+                                       filter);
 }
 
 
 static ngx_int_t
-ngx_dynamic_upstream_handler(ngx_http_request_t *r)
+ngx_dynamic_upstream_set_cursor(ngx_http_request_t *r,
+    ngx_dynamic_upstream_filter_t *filter)
 {
-    ngx_int_t                    rc = NGX_ERROR;
-    ngx_dynamic_upstream_op_t    op;
-    ngx_buf_t                   *b;
-    ngx_upstream_conf_t          conf;
-    ngx_http_complex_value_t     cv;
+    ngx_table_elt_t  *h;
+    u_char           *p;
 
-    if (r->method != NGX_HTTP_GET) {
+    if (!filter->more)
+        return NGX_OK;
 
-        op.err = "only GET allowed";
-        op.status = NGX_HTTP_NOT_ALLOWED;
+    h = (ngx_table_elt_t *) ngx_list_push(&r->headers_out.headers);
+    if (h == NULL)
+        return NGX_ERROR;
 
-        goto response;
+    p = (u_char *) ngx_pnalloc(r->pool, NGX_INT_T_LEN + 10);
+    if (p == NULL)
+        return NGX_ERROR;
+
+    h->hash = 1;
+    ngx_str_set(&h->key, "X-Next-Cursor");
+    h->value.data = p;
+    h->value.len = ngx_sprintf(p, "%ui-%08xD", filter->next, filter->next_crc)
+        - p;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_send_header(ngx_http_request_t *r, ngx_uint_t status,
+    off_t content_length)
+{
+    r->headers_out.status = status;
+    r->headers_out.content_length_n = content_length;
+
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+    r->headers_out.content_type_len = r->headers_out.content_type.len;
+
+    return ngx_http_send_header(r);
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_send_last(ngx_http_request_t *r, ngx_chain_t *out)
+{
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl, *last;
+
+    b = ngx_calloc_buf(r->pool);
+    if (b == NULL)
+        return NGX_ERROR;
+
+    last = ngx_alloc_chain_link(r->pool);
+    if (last == NULL)
+        return NGX_ERROR;
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    last->buf = b;
+    last->next = NULL;
+
+    if (out == NULL)
+        return ngx_http_output_filter(r, last);
+
+    for (cl = out; cl->next != NULL; cl = cl->next)
+        /* void */ ;
+
+    cl->next = last;
+
+    return ngx_http_output_filter(r, out);
+}
+
+
+// dump of all upstreams, an upstream at a time: when the client is slow
+// the dump stops and is resumed by the write event from the cursor
+
+typedef struct {
+    ngx_dynamic_upstream_op_t      op;
+    ngx_dynamic_upstream_filter_t  filter;
+    ngx_str_t                      prefix;
+    ngx_flag_t                     stream;   // http upstreams are dumped
+    ngx_uint_t                     next;     // upstream to dump
+    ngx_flag_t                     done;     // last buffer is sent
+    ngx_chain_t                   *free;
+    ngx_chain_t                   *busy;
+} ngx_dynamic_upstream_dump_t;
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_print_all(ngx_http_request_t *r,
+    ngx_dynamic_upstream_dump_t *dump, const char *type)
+{
+    typename TypeSelect<S>::main_type  *umcf;
+    S                                 **uscf;
+    ngx_uint_t                          j;
+    ngx_dynamic_upstream_out_t          out;
+    ngx_int_t                           rc;
+
+    umcf = TypeSelect<S>::main_conf();
+    if (umcf == NULL)
+        return NGX_OK;
+
+    uscf = (S **) umcf->upstreams.elts;
+
+    while (dump->next < umcf->upstreams.nelts) {
+
+        j = dump->next++;
+
+        if (uscf[j]->shm_zone == NULL)
+            continue;
+
+        if (dump->prefix.len > uscf[j]->host.len
+            || ngx_strncmp(uscf[j]->host.data, dump->prefix.data,
+                           dump->prefix.len) != 0)
+            continue;
+
+        ngx_dynamic_upstream_out_init(&out, r->pool);
+        out.free = dump->free;
+
+        if (ngx_dynamic_upstream_printf(&out, "%supstream %V {\n", type,
+                                        &uscf[j]->host) == NGX_ERROR)
+            return NGX_ERROR;
+
+        if (ngx_dynamic_upstream_print_response<S>(uscf[j], &out,
+                dump->op.verbose, "    ", &dump->filter) == NGX_ERROR)
+            return NGX_ERROR;
+
+        if (ngx_dynamic_upstream_printf(&out, "}\n") == NGX_ERROR)
+            return NGX_ERROR;
+
+        // peers lock is released, flush this upstream before the next one
+        rc = ngx_http_output_filter(r, out.out);
+        if (rc == NGX_ERROR)
+            return NGX_ERROR;
+
+        // buffers sent are reused by the next upstream
+
+        dump->free = out.free;
+        ngx_chain_update_chains(r->pool, &dump->free, &dump->busy, &out.out,
+            (ngx_buf_tag_t) &ngx_http_dynamic_upstream_module);
+
+        // the client is slow, nothing more is buffered until it reads
+
+        if (rc == NGX_AGAIN)
+            return NGX_AGAIN;
     }
 
-    if ((rc = ngx_dynamic_upstream_build_op(r, &op)) != NGX_OK)
-        goto response;
+    return NGX_OK;
+}
 
-    if (op.op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_STREAM)
-        conf = ngx_dynamic_upstream_get
-                    <ngx_stream_upstream_srv_conf_t>(&op);
-    else
-        conf = ngx_dynamic_upstream_get
-                    <ngx_http_upstream_srv_conf_t>(&op);
 
-    if (conf.uscf != NULL) {
+static ngx_int_t
+ngx_dynamic_upstream_dump(ngx_http_request_t *r,
+    ngx_dynamic_upstream_dump_t *dump)
+{
+    ngx_int_t  rc;
 
-        if (conf.dscf->interval != NGX_CONF_UNSET_MSEC)
-            op.op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_RESOLVE;
+    if (!dump->stream) {
 
-        if (conf.dscf->ipv6 == 1)
-            op.op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_IPV6;
+        rc = ngx_dynamic_upstream_print_all<ngx_http_upstream_srv_conf_t>
+                (r, dump, "");
+        if (rc != NGX_OK)
+            return rc;
 
-        if (op.op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_STREAM)
-            rc = ngx_dynamic_upstream_do_op
-                    <ngx_stream_upstream_srv_conf_t>(r->connection->log, &op,
-                        conf.uscf);
-        else
-            rc = ngx_dynamic_upstream_do_op
-                    <ngx_http_upstream_srv_conf_t>(r->connection->log, &op,
-                        conf.uscf);
-    } else
-        rc = NGX_ERROR;
+        dump->stream = 1;
+        dump->next = 0;
+    }
 
-response:
+    rc = ngx_dynamic_upstream_print_all<ngx_stream_upstream_srv_conf_t>
+            (r, dump, "stream ");
+    if (rc != NGX_OK)
+        return rc;
 
-    static ngx_str_t TEXT_PLAIN = ngx_string("text/plain");
+    dump->done = 1;
 
-    ngx_memzero(&cv, sizeof(ngx_http_complex_value_t));
+    return ngx_dynamic_upstream_send_last(r, NULL);
+}
 
-    if (rc == NGX_OK) {
 
-        if (op.status != NGX_HTTP_NOT_MODIFIED) {
+static ngx_int_t
+ngx_dynamic_upstream_dump_wait(ngx_http_request_t *r)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+    ngx_event_t               *wev = r->connection->write;
+
+    clcf = (ngx_http_core_loc_conf_t *)
+        ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (!wev->delayed)
+        ngx_add_timer(wev, clcf->send_timeout);
+
+    return ngx_handle_write_event(wev, clcf->send_lowat);
+}
+
+
+static void
+ngx_dynamic_upstream_dump_handler(ngx_http_request_t *r)
+{
+    ngx_dynamic_upstream_dump_t  *dump;
+    ngx_event_t                  *wev = r->connection->write;
+    ngx_int_t                     rc;
+
+    if (wev->timedout) {
+
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, NGX_ETIMEDOUT,
+                      "client timed out");
+
+        r->connection->timedout = 1;
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    if (wev->delayed)
+        return;
+
+    dump = (ngx_dynamic_upstream_dump_t *)
+        ngx_http_get_module_ctx(r, ngx_http_dynamic_upstream_module);
+
+    // the rest of the last upstream goes first
+
+    rc = ngx_http_output_filter(r, NULL);
+
+    if (rc == NGX_OK)
+        rc = ngx_dynamic_upstream_dump(r, dump);
+
+    if (rc == NGX_AGAIN && !dump->done) {
+
+        if (ngx_dynamic_upstream_dump_wait(r) != NGX_OK)
+            ngx_http_finalize_request(r, NGX_ERROR);
+
+        return;
+    }
+
+    if (wev->timer_set)
+        ngx_del_timer(wev);
+
+    ngx_http_finalize_request(r, rc);
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_list_all(ngx_http_request_t *r,
+    ngx_dynamic_upstream_op_t *op, ngx_str_t prefix,
+    ngx_dynamic_upstream_filter_t *filter)
+{
+    ngx_dynamic_upstream_dump_t  *dump;
+    ngx_int_t                     rc;
+
+    dump = (ngx_dynamic_upstream_dump_t *)
+        ngx_pcalloc(r->pool, sizeof(ngx_dynamic_upstream_dump_t));
+    if (dump == NULL)
+        return NGX_ERROR;
+
+    dump->op = *op;
+    dump->filter = *filter;
+    dump->prefix = prefix;
+
+    rc = ngx_dynamic_upstream_send_header(r, NGX_HTTP_OK, -1);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+        return rc;
+
+    rc = ngx_dynamic_upstream_dump(r, dump);
+    if (rc != NGX_AGAIN || dump->done)
+        return rc;
+
+    if (ngx_dynamic_upstream_dump_wait(r) != NGX_OK)
+        return NGX_ERROR;
+
+    ngx_http_set_ctx(r, dump, ngx_http_dynamic_upstream_module);
+
+    r->main->count++;
+    r->write_event_handler = ngx_dynamic_upstream_dump_handler;
+
+    return NGX_DONE;
+}
+
+
+// metrics in the prometheus text format
+
+typedef struct {
+    const char  *name;
+    const char  *type;
+    const char  *help;
+} ngx_dynamic_upstream_metric_t;
+
+
+enum {
+    NGX_DYNAMIC_UPSTREAM_METRIC_PEER_CONNS = 0,
+    NGX_DYNAMIC_UPSTREAM_METRIC_PEER_FAILS,
+    NGX_DYNAMIC_UPSTREAM_METRIC_PEER_DOWN,
+    NGX_DYNAMIC_UPSTREAM_METRIC_PEER_WEIGHT,
+    NGX_DYNAMIC_UPSTREAM_METRIC_DNS_SYNC,
+    NGX_DYNAMIC_UPSTREAM_METRIC_RESOLVE_FAILED,
+    NGX_DYNAMIC_UPSTREAM_METRIC_ADDED,
+    NGX_DYNAMIC_UPSTREAM_METRIC_REMOVED,
+    NGX_DYNAMIC_UPSTREAM_METRIC_UPDATED,
+    NGX_DYNAMIC_UPSTREAM_METRIC_ZONE_SIZE,
+    NGX_DYNAMIC_UPSTREAM_METRIC_ZONE_FREE,
+    NGX_DYNAMIC_UPSTREAM_METRIC_ZONE_LARGEST,
+    NGX_DYNAMIC_UPSTREAM_METRIC_ZONE_ALLOCATED,
+    NGX_DYNAMIC_UPSTREAM_METRIC_ZONE_FREED,
+    NGX_DYNAMIC_UPSTREAM_METRIC_ZONE_FAILED,
+    NGX_DYNAMIC_UPSTREAM_METRIC_ZONE_REFUSED,
+    NGX_DYNAMIC_UPSTREAM_METRIC_LOCK_WAIT,
+    NGX_DYNAMIC_UPSTREAM_METRIC_LOCK_HOLD,
+    NGX_DYNAMIC_UPSTREAM_METRIC_TRASH,
+    NGX_DYNAMIC_UPSTREAM_METRIC_MAX
+};
+
+
+static ngx_dynamic_upstream_metric_t
+ngx_dynamic_upstream_metrics[NGX_DYNAMIC_UPSTREAM_METRIC_MAX] = {
+    { "peer_conns", "gauge", "Active connections of the peer" },
+    { "peer_fails", "gauge", "Failures of the peer in fail_timeout" },
+    { "peer_down", "gauge", "Peer is down" },
+    { "peer_weight", "gauge", "Weight of the peer" },
+    { "dns_sync_seconds", "histogram", "Duration of DNS synchronization" },
+    { "resolve_failures_total", "counter", "Failed resolves of servers" },
+    { "peers_added_total", "counter", "Peers added" },
+    { "peers_removed_total", "counter", "Peers removed" },
+    { "peers_updated_total", "counter", "Peers updated" },
+    { "zone_size_bytes", "gauge", "Size of the upstream zone" },
+    { "zone_free_bytes", "gauge", "Free pages of the upstream zone" },
+    { "zone_largest_free_bytes", "gauge", "Largest run of free pages" },
+    { "zone_allocated_bytes_total", "counter", "Bytes allocated for peers" },
+    { "zone_freed_bytes_total", "counter", "Bytes released by removes" },
+    { "zone_alloc_failures_total", "counter", "Failed allocations" },
+    { "zone_refused_total", "counter", "Adds refused by the high water mark" },
+    { "lock_wait_seconds", "histogram", "Wait for the peers lock" },
+    { "lock_hold_seconds", "histogram", "Hold of the peers lock" },
+    { "trash_peers", "gauge", "Removed peers waiting for connections" }
+};
+
+
+// label values are escaped: backslash, double quote and line feed
+
+static ngx_int_t
+ngx_dynamic_upstream_label(ngx_pool_t *pool, ngx_str_t *src, ngx_str_t *dst)
+{
+    u_char      *p;
+    ngx_uint_t   j, n = 0;
+
+    for (j = 0; j < src->len; j++)
+        if (src->data[j] == '\\' || src->data[j] == '"'
+            || src->data[j] == '\n')
+            n++;
+
+    if (n == 0) {
+
+        *dst = *src;
+        return NGX_OK;
+    }
+
+    p = (u_char *) ngx_pnalloc(pool, src->len + n);
+    if (p == NULL)
+        return NGX_ERROR;
+
+    dst->data = p;
+
+    for (j = 0; j < src->len; j++) {
+
+        switch (src->data[j]) {
+
+            case '\\':
+            case '"':
+                *p++ = '\\';
+                *p++ = src->data[j];
+                break;
+
+            case '\n':
+                *p++ = '\\';
+                *p++ = 'n';
+                break;
+
+            default:
+                *p++ = src->data[j];
+        }
+    }
+
+    dst->len = p - dst->data;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_print_hist(ngx_dynamic_upstream_out_t *out,
+    ngx_dynamic_upstream_hist_t *hist, const char *name, const char *labels,
+    ngx_str_t *upstream, const char *extra)
+{
+    ngx_uint_t         j;
+    ngx_msec_int_t     le;
+    ngx_atomic_uint_t  count = 0;
+
+    for (j = 0; j < NGX_DYNAMIC_UPSTREAM_HIST_BUCKETS - 1; j++) {
+
+        count += hist->bucket[j];
+        le = ngx_dynamic_upstream_hist_bounds[j];
+
+        if (ngx_dynamic_upstream_printf(out,
+                "nginx_dynamic_upstream_%s_bucket"
+                "{%s%V\"%s,le=\"%d.%06d\"} %uA\n",
+                name, labels, upstream, extra,
+                (int) (le / 1000000), (int) (le % 1000000), count)
+                == NGX_ERROR)
+            return NGX_ERROR;
+    }
+
+    if (ngx_dynamic_upstream_printf(out,
+            "nginx_dynamic_upstream_%s_bucket{%s%V\"%s,le=\"+Inf\"} %uA\n"
+            "nginx_dynamic_upstream_%s_sum{%s%V\"%s} %uA.%06uA\n"
+            "nginx_dynamic_upstream_%s_count{%s%V\"%s} %uA\n",
+            name, labels, upstream, extra, hist->count,
+            name, labels, upstream, extra,
+            hist->sum / 1000000, hist->sum % 1000000,
+            name, labels, upstream, extra, hist->count) == NGX_ERROR)
+        return NGX_ERROR;
+
+    return NGX_OK;
+}
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_print_metrics(S *uscf, ngx_dynamic_upstream_out_t *out)
+{
+    typename TypeSelect<S>::peers_type  *peers;
+    typename TypeSelect<S>::peer_type   *peer;
+
+    ngx_uint_t                        j;
+    ngx_dynamic_upstream_metrics_t   *m;
+    ngx_dynamic_upstream_zone_stat_t  stat;
+    ngx_str_t                         host, zone, server, name;
+
+    const char  *labels = TypeSelect<S>::stream
+        ? "type=\"stream\",upstream=\"" : "type=\"http\",upstream=\"";
+
+    static const char  *lock_ops[NGX_DYNAMIC_UPSTREAM_LOCK_OPS] = {
+        ",op=\"list\"", ",op=\"add\"", ",op=\"remove\"",
+        ",op=\"update\"", ",op=\"sync\"", ",op=\"hash\"",
+        ",op=\"replace\""
+    };
+
+    if (ngx_dynamic_upstream_label(out->pool, &uscf->host, &host) != NGX_OK
+        || ngx_dynamic_upstream_label(out->pool, &uscf->shm_zone->shm.name,
+                                      &zone) != NGX_OK)
+        return NGX_ERROR;
+
+    peers = (typename TypeSelect<S>::peers_type *) uscf->peer.data;
+
+    {
+        ngx_upstream_rr_peers_rlock<typename TypeSelect<S>::peers_type>
+            lock(peers);
+
+        for (j = 0;
+             peers != NULL && j < 2;
+             peers = peers->next, j++) {
+
+            for (peer = peers->peer;
+                 peer != NULL;
+                 peer = peer->next) {
+
+                if (ngx_dynamic_upstream_label(out->pool, &peer->server,
+                                               &server) != NGX_OK
+                    || ngx_dynamic_upstream_label(out->pool, &peer->name,
+                                                  &name) != NGX_OK)
+                    return NGX_ERROR;
+
+                if (ngx_dynamic_upstream_printf(
+                        &out[NGX_DYNAMIC_UPSTREAM_METRIC_PEER_CONNS],
+                        "nginx_dynamic_upstream_peer_conns{%s%V\","
+                        "server=\"%V\",addr=\"%V\",backup=\"%ui\"} %ui\n",
+                        labels, &host, &server, &name, j,
+                        peer->conns) == NGX_ERROR
+                    || ngx_dynamic_upstream_printf(
+                        &out[NGX_DYNAMIC_UPSTREAM_METRIC_PEER_FAILS],
+                        "nginx_dynamic_upstream_peer_fails{%s%V\","
+                        "server=\"%V\",addr=\"%V\",backup=\"%ui\"} %ui\n",
+                        labels, &host, &server, &name, j,
+                        peer->fails) == NGX_ERROR
+                    || ngx_dynamic_upstream_printf(
+                        &out[NGX_DYNAMIC_UPSTREAM_METRIC_PEER_DOWN],
+                        "nginx_dynamic_upstream_peer_down{%s%V\","
+                        "server=\"%V\",addr=\"%V\",backup=\"%ui\"} %ui\n",
+                        labels, &host, &server, &name, j,
+                        (ngx_uint_t) (peer->down != 0)) == NGX_ERROR
+                    || ngx_dynamic_upstream_printf(
+                        &out[NGX_DYNAMIC_UPSTREAM_METRIC_PEER_WEIGHT],
+                        "nginx_dynamic_upstream_peer_weight{%s%V\","
+                        "server=\"%V\",addr=\"%V\",backup=\"%ui\"} %i\n",
+                        labels, &host, &server, &name, j,
+                        peer->weight) == NGX_ERROR)
+                    return NGX_ERROR;
+            }
+        }
+    }
+
+    m = ngx_dynamic_upstream_get_metrics(uscf);
+
+    if (m != NULL) {
+
+        if (ngx_dynamic_upstream_print_hist(
+                &out[NGX_DYNAMIC_UPSTREAM_METRIC_DNS_SYNC], &m->dns_sync,
+                "dns_sync_seconds", labels, &host, "") == NGX_ERROR
+            || ngx_dynamic_upstream_printf(
+                &out[NGX_DYNAMIC_UPSTREAM_METRIC_RESOLVE_FAILED],
+                "nginx_dynamic_upstream_resolve_failures_total{%s%V\"} %uA\n",
+                labels, &host, m->resolve_failed) == NGX_ERROR
+            || ngx_dynamic_upstream_printf(
+                &out[NGX_DYNAMIC_UPSTREAM_METRIC_ADDED],
+                "nginx_dynamic_upstream_peers_added_total{%s%V\"} %uA\n",
+                labels, &host, m->added) == NGX_ERROR
+            || ngx_dynamic_upstream_printf(
+                &out[NGX_DYNAMIC_UPSTREAM_METRIC_REMOVED],
+                "nginx_dynamic_upstream_peers_removed_total{%s%V\"} %uA\n",
+                labels, &host, m->removed) == NGX_ERROR
+            || ngx_dynamic_upstream_printf(
+                &out[NGX_DYNAMIC_UPSTREAM_METRIC_UPDATED],
+                "nginx_dynamic_upstream_peers_updated_total{%s%V\"} %uA\n",
+                labels, &host, m->updated) == NGX_ERROR)
+            return NGX_ERROR;
+    }
+
+    ngx_dynamic_upstream_zone_stat((ngx_slab_pool_t *)
+                                   uscf->shm_zone->shm.addr, &stat);
+
+    if (ngx_dynamic_upstream_printf(
+            &out[NGX_DYNAMIC_UPSTREAM_METRIC_ZONE_SIZE],
+            "nginx_dynamic_upstream_zone_size_bytes{%s%V\",zone=\"%V\"} %uz\n",
+            labels, &host, &zone, stat.size)
+            == NGX_ERROR
+        || ngx_dynamic_upstream_printf(
+            &out[NGX_DYNAMIC_UPSTREAM_METRIC_ZONE_FREE],
+            "nginx_dynamic_upstream_zone_free_bytes{%s%V\",zone=\"%V\"} %uz\n",
+            labels, &host, &zone, stat.free)
+            == NGX_ERROR
+        || ngx_dynamic_upstream_printf(
+            &out[NGX_DYNAMIC_UPSTREAM_METRIC_ZONE_LARGEST],
+            "nginx_dynamic_upstream_zone_largest_free_bytes"
+            "{%s%V\",zone=\"%V\"} %uz\n",
+            labels, &host, &zone, stat.largest)
+            == NGX_ERROR)
+        return NGX_ERROR;
+
+    if (m == NULL)
+        return NGX_OK;
+
+    if (ngx_dynamic_upstream_printf(
+            &out[NGX_DYNAMIC_UPSTREAM_METRIC_ZONE_ALLOCATED],
+            "nginx_dynamic_upstream_zone_allocated_bytes_total{%s%V\"} %uA\n",
+            labels, &host, m->zone_allocated) == NGX_ERROR
+        || ngx_dynamic_upstream_printf(
+            &out[NGX_DYNAMIC_UPSTREAM_METRIC_ZONE_FREED],
+            "nginx_dynamic_upstream_zone_freed_bytes_total{%s%V\"} %uA\n",
+            labels, &host, m->zone_freed) == NGX_ERROR
+        || ngx_dynamic_upstream_printf(
+            &out[NGX_DYNAMIC_UPSTREAM_METRIC_ZONE_FAILED],
+            "nginx_dynamic_upstream_zone_alloc_failures_total{%s%V\"} %uA\n",
+            labels, &host, m->zone_failed) == NGX_ERROR
+        || ngx_dynamic_upstream_printf(
+            &out[NGX_DYNAMIC_UPSTREAM_METRIC_ZONE_REFUSED],
+            "nginx_dynamic_upstream_zone_refused_total{%s%V\"} %uA\n",
+            labels, &host, m->zone_refused) == NGX_ERROR)
+        return NGX_ERROR;
+
+    if (srv_conf(uscf)->lock_stats != 1)
+        return NGX_OK;
+
+    for (j = 0; j < NGX_DYNAMIC_UPSTREAM_LOCK_OPS; j++) {
+
+        if (ngx_dynamic_upstream_print_hist(
+                &out[NGX_DYNAMIC_UPSTREAM_METRIC_LOCK_WAIT], &m->lock[j].wait,
+                "lock_wait_seconds", labels, &host, lock_ops[j])
+                == NGX_ERROR
+            || ngx_dynamic_upstream_print_hist(
+                &out[NGX_DYNAMIC_UPSTREAM_METRIC_LOCK_HOLD], &m->lock[j].hold,
+                "lock_hold_seconds", labels, &host, lock_ops[j])
+                == NGX_ERROR)
+            return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_print_metrics_all(ngx_dynamic_upstream_out_t *out)
+{
+    typename TypeSelect<S>::main_type  *umcf;
+    S                                 **uscf;
+    ngx_uint_t                          j;
+
+    umcf = TypeSelect<S>::main_conf();
+    if (umcf == NULL)
+        return NGX_OK;
+
+    uscf = (S **) umcf->upstreams.elts;
+
+    for (j = 0; j < umcf->upstreams.nelts; j++) {
+
+        if (uscf[j]->srv_conf == NULL || uscf[j]->shm_zone == NULL)
+            continue;
+
+        if (ngx_dynamic_upstream_print_metrics<S>(uscf[j], out) == NGX_ERROR)
+            return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_send_metrics(ngx_http_request_t *r)
+{
+    ngx_dynamic_upstream_out_t          out[NGX_DYNAMIC_UPSTREAM_METRIC_MAX];
+    ngx_dynamic_upstream_metrics_sh_t  *sh;
+    ngx_chain_t                        *chain = NULL, **last = &chain;
+    ngx_uint_t                          j;
+    off_t                               size = 0;
+    ngx_int_t                           rc;
+
+    // samples of a metric must be grouped,
+    // so each metric is rendered into its own chain
+
+    for (j = 0; j < NGX_DYNAMIC_UPSTREAM_METRIC_MAX; j++) {
+
+        ngx_dynamic_upstream_out_init(&out[j], r->pool);
+
+        if (ngx_dynamic_upstream_printf(&out[j],
+                "# HELP nginx_dynamic_upstream_%s %s\n"
+                "# TYPE nginx_dynamic_upstream_%s %s\n",
+                ngx_dynamic_upstream_metrics[j].name,
+                ngx_dynamic_upstream_metrics[j].help,
+                ngx_dynamic_upstream_metrics[j].name,
+                ngx_dynamic_upstream_metrics[j].type) == NGX_ERROR)
+            goto nomem;
+    }
+
+    if (ngx_dynamic_upstream_print_metrics_all<ngx_http_upstream_srv_conf_t>
+            (out) == NGX_ERROR)
+        goto nomem;
+
+    if (ngx_dynamic_upstream_print_metrics_all<ngx_stream_upstream_srv_conf_t>
+            (out) == NGX_ERROR)
+        goto nomem;
+
+    sh = ngx_dynamic_upstream_metrics_sh();
+
+    if (ngx_dynamic_upstream_printf(&out[NGX_DYNAMIC_UPSTREAM_METRIC_TRASH],
+            "nginx_dynamic_upstream_trash_peers %uA\n",
+            sh != NULL ? sh->trash : 0) == NGX_ERROR)
+        goto nomem;
+
+    for (j = 0; j < NGX_DYNAMIC_UPSTREAM_METRIC_MAX; j++) {
+
+        *last = out[j].out;
+        last = out[j].last;
+        size += out[j].size;
+    }
+
+    rc = ngx_dynamic_upstream_send_header(r, NGX_HTTP_OK, size);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+        return rc;
+
+    return ngx_dynamic_upstream_send_last(r, chain);
+
+nomem:
+
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "no memory");
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+}
+
+
+// PUT body: servers in the syntax of the upstream block,
+// server <addr> [weight=] [max_fails=] [fail_timeout=] [max_conns=]
+// [backup] [down];
+
+#define NGX_DYNAMIC_UPSTREAM_MAX_WORDS  16
+
+
+static const char *
+ngx_dynamic_upstream_servers_err(ngx_pool_t *pool, const char *fmt,
+    ngx_str_t *s)
+{
+    u_char  *err;
+
+    err = (u_char *) ngx_pcalloc(pool, 256);
+    if (err == NULL)
+        return "no memory";
+
+    ngx_snprintf(err, 255, fmt, s);
+
+    return (const char *) err;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_parse_server(ngx_pool_t *pool, ngx_str_t *word,
+    ngx_uint_t nwords, ngx_server_t *server, ngx_dynamic_upstream_op_t *op)
+{
+    ngx_uint_t  i;
+    ngx_str_t   s;
+    ngx_int_t   n;
+
+    static const ngx_str_t  kw_server = ngx_string("server");
+    static const ngx_str_t  kw_backup = ngx_string("backup");
+    static const ngx_str_t  kw_down = ngx_string("down");
+
+    if (nwords < 2 || !str_eq(word[0], kw_server)) {
+
+        op->err = ngx_dynamic_upstream_servers_err(pool,
+            "\"server <address>\" expected near \"%V\"", &word[0]);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(server, sizeof(ngx_server_t));
+
+    server->name = word[1];
+    server->weight = 1;
+    server->max_fails = 1;
+    server->fail_timeout = 10;
+
+    for (i = 2; i < nwords; i++) {
+
+        s = word[i];
+
+        if (s.len > 7 && ngx_strncmp(s.data, "weight=", 7) == 0) {
+
+            n = ngx_atoi(s.data + 7, s.len - 7);
+            if (n == NGX_ERROR || n == 0)
+                goto invalid;
+
+            server->weight = n;
+
+        } else if (s.len > 10 && ngx_strncmp(s.data, "max_fails=", 10) == 0) {
+
+            n = ngx_atoi(s.data + 10, s.len - 10);
+            if (n == NGX_ERROR)
+                goto invalid;
+
+            server->max_fails = n;
+
+        } else if (s.len > 13
+                   && ngx_strncmp(s.data, "fail_timeout=", 13) == 0) {
+
+            s.data += 13;
+            s.len -= 13;
+
+            n = ngx_parse_time(&s, 1);
+            if (n == NGX_ERROR)
+                goto invalid;
+
+            server->fail_timeout = n;
+
+#if defined(nginx_version) && (nginx_version >= 1011005)
+        } else if (s.len > 10 && ngx_strncmp(s.data, "max_conns=", 10) == 0) {
+
+            n = ngx_atoi(s.data + 10, s.len - 10);
+            if (n == NGX_ERROR)
+                goto invalid;
+
+            server->max_conns = n;
+#endif
+
+        } else if (str_eq(s, kw_backup)) {
+
+            server->backup = 1;
+
+        } else if (str_eq(s, kw_down)) {
+
+            server->down = 1;
+
+        } else
+            goto unknown;
+    }
+
+    return NGX_OK;
+
+unknown:
+
+    op->err = ngx_dynamic_upstream_servers_err(pool,
+        "unknown parameter \"%V\", weight, max_fails, fail_timeout, "
+#if defined(nginx_version) && (nginx_version >= 1011005)
+        "max_conns, "
+#endif
+        "backup and down are expected", &word[i]);
+
+    return NGX_ERROR;
+
+invalid:
+
+    op->err = ngx_dynamic_upstream_servers_err(pool,
+        "invalid parameter \"%V\"", &word[i]);
+
+    return NGX_ERROR;
+}
+
+
+static ngx_array_t *
+ngx_dynamic_upstream_parse_servers(ngx_pool_t *pool, ngx_str_t body,
+    ngx_dynamic_upstream_op_t *op)
+{
+    ngx_array_t   *servers;
+    ngx_server_t  *server;
+    u_char        *p, *last, *start;
+    ngx_str_t      word[NGX_DYNAMIC_UPSTREAM_MAX_WORDS];
+    ngx_uint_t     nwords = 0;
+
+    op->status = NGX_HTTP_BAD_REQUEST;
+
+    servers = ngx_array_create(pool, 16, sizeof(ngx_server_t));
+    if (servers == NULL)
+        goto nomem;
+
+    p = body.data;
+    last = body.data + body.len;
+
+    while (p < last) {
+
+        if (*p == '#') {
+
+            while (p < last && *p != LF)
+                p++;
+            continue;
+        }
+
+        if (*p == ' ' || *p == '\t' || *p == CR || *p == LF) {
+
+            p++;
+            continue;
+        }
+
+        if (*p == ';') {
+
+            p++;
+
+            if (nwords == 0)
+                continue;
+
+            server = (ngx_server_t *) ngx_array_push(servers);
+            if (server == NULL)
+                goto nomem;
+
+            if (ngx_dynamic_upstream_parse_server(pool, word, nwords,
+                    server, op) == NGX_ERROR)
+                return NULL;
+
+            nwords = 0;
+            continue;
+        }
+
+        for (start = p; p < last; p++)
+            if (*p == ' ' || *p == '\t' || *p == CR || *p == LF
+                || *p == ';' || *p == '#')
+                break;
+
+        if (nwords == NGX_DYNAMIC_UPSTREAM_MAX_WORDS) {
+
+            op->err = "too many parameters";
+            return NULL;
+        }
+
+        word[nwords].data = start;
+        word[nwords].len = p - start;
+        nwords++;
+    }
+
+    if (nwords != 0) {
+
+        op->err = "unexpected end of servers, \";\" expected";
+        return NULL;
+    }
+
+    op->status = NGX_HTTP_OK;
+
+    return servers;
+
+nomem:
+
+    op->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    op->err = "no memory";
+
+    return NULL;
+}
+
+
+// the state file is parsed here instead of the included 'server'
+// directives: hostnames are not resolved at the config load, they are
+// added as down peers with the reserved address and resolved by the
+// background pass after the start
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_conf_server(ngx_conf_t *cf, S *uscf,
+    ngx_server_t *server, ngx_dynamic_upstream_srv_conf_t *dscf)
+{
+    typename TypeSelect<S>::server_type  *us;
+
+    ngx_url_t  u;
+
+    static ngx_str_t  placeholder = ngx_string("0.0.0.0:1");
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = server->name;
+    u.default_port = 80;
+    u.no_resolve = 1;
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+
+        if (u.err)
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%s in \"%V\" of %V",
+                               u.err, &server->name, &dscf->file);
+        return NGX_ERROR;
+    }
+
+    if (u.naddrs == 0) {
+
+        u.url = placeholder;
+
+        if (ngx_parse_url(cf->pool, &u) != NGX_OK)
+            return NGX_ERROR;
+
+        server->down = 1;
+        dscf->unresolved = 1;
+    }
+
+    us = (typename TypeSelect<S>::server_type *) ngx_array_push(uscf->servers);
+    if (us == NULL)
+        return NGX_ERROR;
+
+    ngx_memzero(us, sizeof(typename TypeSelect<S>::server_type));
+
+    us->name = server->name;
+    us->addrs = u.addrs;
+    us->naddrs = u.naddrs;
+    us->weight = server->weight;
+    us->max_fails = server->max_fails;
+    us->fail_timeout = server->fail_timeout;
+#if defined(nginx_version) && (nginx_version >= 1011005)
+    us->max_conns = server->max_conns;
+#endif
+    us->down = server->down ? 1 : 0;
+    us->backup = server->backup ? 1 : 0;
+
+    return NGX_OK;
+}
+
+
+template <class S> static char *
+ngx_create_servers_file(ngx_conf_t *cf, void *post, void *data)
+{
+    ngx_str_t                        *fname = (ngx_str_t *) data;
+    FILE                             *f;
+    ngx_str_t                         text;
+    ngx_array_t                      *servers;
+    ngx_server_t                     *server;
+    ngx_uint_t                        j;
+    long                              size;
+    ngx_dynamic_upstream_op_t         op;
+    S                                *uscf;
+    ngx_dynamic_upstream_srv_conf_t  *dscf;
+
+    static ngx_str_t
+        default_server = ngx_string("server 0.0.0.0:1 down;");
+
+    if (ngx_conf_full_name(cf->cycle, fname, 1) != NGX_OK)
+        return (char *) NGX_CONF_ERROR;
+
+    text = default_server;
+
+    f = state_open(fname, "r");
+    if (f != NULL) {
+
+        if (fseek(f, 0, SEEK_END) != 0
+            || (size = ftell(f)) < 0
+            || fseek(f, 0, SEEK_SET) != 0)
+            goto failed;
+
+        text.len = (size_t) size;
+        text.data = (u_char *) ngx_pnalloc(cf->pool, text.len + 1);
+        if (text.data == NULL)
+            goto failed;
+
+        if (text.len != 0 && fread(text.data, text.len, 1, f) != 1)
+            goto failed;
+
+        fclose(f);
+
+    } else {
+
+        f = state_open(fname, "w+");
+        if (f == NULL)
+            return (char *) NGX_CONF_ERROR;
+
+        fwrite(default_server.data, default_server.len, 1, f);
+
+        fclose(f);
+    }
+
+    ngx_memzero(&op, sizeof(ngx_dynamic_upstream_op_t));
+
+    servers = ngx_dynamic_upstream_parse_servers(cf->pool, text, &op);
+    if (servers == NULL) {
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%s in %V", op.err, fname);
+        return (char *) NGX_CONF_ERROR;
+    }
+
+    uscf = TypeSelect<S>::upstream(cf);
+    dscf = srv_conf(uscf);
+
+    server = (ngx_server_t *) servers->elts;
+
+    for (j = 0; j < servers->nelts; j++)
+        if (ngx_dynamic_upstream_conf_server(cf, uscf, &server[j], dscf)
+                != NGX_OK)
+            return (char *) NGX_CONF_ERROR;
+
+    return NGX_CONF_OK;
+
+failed:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, ngx_errno, "can't read %V", fname);
+
+    fclose(f);
+
+    return (char *) NGX_CONF_ERROR;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_read_body(ngx_http_request_t *r, ngx_str_t *body)
+{
+    ngx_chain_t  *cl;
+    ngx_buf_t    *b;
+    size_t        len = 0;
+    u_char       *p;
+    ssize_t       n;
+
+    ngx_str_null(body);
+
+    if (r->request_body == NULL)
+        return NGX_OK;
+
+    for (cl = r->request_body->bufs; cl != NULL; cl = cl->next) {
+
+        b = cl->buf;
+
+        len += b->in_file ? (size_t) (b->file_last - b->file_pos)
+                          : (size_t) (b->last - b->pos);
+    }
+
+    if (len == 0)
+        return NGX_OK;
+
+    p = body->data = (u_char *) ngx_pnalloc(r->pool, len);
+    if (p == NULL)
+        return NGX_ERROR;
+
+    for (cl = r->request_body->bufs; cl != NULL; cl = cl->next) {
+
+        b = cl->buf;
+
+        if (b->in_file) {
+
+            n = ngx_read_file(b->file, p, b->file_last - b->file_pos,
+                              b->file_pos);
+            if (n == NGX_ERROR)
+                return NGX_ERROR;
+
+            p += n;
+
+        } else
+            p = ngx_cpymem(p, b->pos, b->last - b->pos);
+    }
+
+    body->len = p - body->data;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_process(ngx_http_request_t *r, ngx_flag_t replace);
+
+
+static void
+ngx_dynamic_upstream_body_handler(ngx_http_request_t *r)
+{
+    ngx_http_finalize_request(r, ngx_dynamic_upstream_process(r, 1));
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_handler(ngx_http_request_t *r)
+{
+    ngx_int_t  rc;
+
+    if (r->method == NGX_HTTP_PUT) {
+
+        rc = ngx_http_read_client_request_body(r,
+            ngx_dynamic_upstream_body_handler);
+        if (rc >= NGX_HTTP_SPECIAL_RESPONSE)
+            return rc;
+
+        return NGX_DONE;
+    }
+
+    return ngx_dynamic_upstream_process(r, 0);
+}
+
+
+static ngx_int_t
+ngx_dynamic_upstream_process(ngx_http_request_t *r, ngx_flag_t replace)
+{
+    ngx_int_t                       rc = NGX_ERROR;
+    ngx_dynamic_upstream_op_t       op;
+    ngx_upstream_conf_t             conf;
+    ngx_http_complex_value_t        cv;
+    ngx_dynamic_upstream_out_t      out;
+    ngx_dynamic_upstream_filter_t   filter;
+    ngx_str_t                       body;
+
+    if (r->method != NGX_HTTP_GET && !replace) {
+
+        op.err = "only GET and PUT allowed";
+        op.status = NGX_HTTP_NOT_ALLOWED;
+
+        goto response;
+    }
+
+    if ((rc = ngx_dynamic_upstream_build_op(r, &op)) != NGX_OK)
+        goto response;
+
+    if (replace) {
+
+        rc = NGX_ERROR;
+
+        if (op.op != NGX_DYNAMIC_UPSTEAM_OP_LIST
+            || (op.op_param & (NGX_DYNAMIC_UPSTEAM_OP_PARAM_ALL
+                               | NGX_DYNAMIC_UPSTEAM_OP_PARAM_METRICS))) {
+
+            op.status = NGX_HTTP_BAD_REQUEST;
+            op.err = "PUT replaces servers of one upstream, "
+                     "no other operations are allowed";
+
+            goto response;
+        }
+
+        if (ngx_dynamic_upstream_read_body(r, &body) == NGX_ERROR) {
+
+            op.status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+            op.err = "failed to read request body";
+
+            goto response;
+        }
+
+        op.servers = ngx_dynamic_upstream_parse_servers(r->pool, body, &op);
+        if (op.servers == NULL)
+            goto response;
+
+        op.op = NGX_DYNAMIC_UPSTEAM_OP_REPLACE;
+        op.verbose = 1;
+    }
+
+    if (op.op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_METRICS)
+        return ngx_dynamic_upstream_send_metrics(r);
+
+    switch (ngx_dynamic_upstream_build_filter(r, &op, &filter)) {
+
+        case NGX_OK:
+            break;
+
+        case NGX_DECLINED:
+            rc = NGX_ERROR;
+            goto response;
+
+        default:
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "no memory");
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (op.op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_ALL)
+        return ngx_dynamic_upstream_list_all(r, &op, get_str(r, "prefix"),
+                                             &filter);
+
+    if (op.op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_STREAM)
+        conf = ngx_dynamic_upstream_get
+                    <ngx_stream_upstream_srv_conf_t>(&op);
+    else
+        conf = ngx_dynamic_upstream_get
+                    <ngx_http_upstream_srv_conf_t>(&op);
+
+    if (conf.uscf != NULL) {
+
+        if (conf.dscf->interval != NGX_CONF_UNSET_MSEC)
+            op.op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_RESOLVE;
+
+        if (conf.dscf->ipv6 == 1)
+            op.op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_IPV6;
+
+        if (op.op_param & NGX_DYNAMIC_UPSTEAM_OP_PARAM_STREAM)
+            rc = ngx_dynamic_upstream_do_op
+                    <ngx_stream_upstream_srv_conf_t>(r->connection->log, &op,
+                        conf.uscf);
+        else
+            rc = ngx_dynamic_upstream_do_op
+                    <ngx_http_upstream_srv_conf_t>(r->connection->log, &op,
+                        conf.uscf);
+    } else
+        rc = NGX_ERROR;
+
+response:
+
+    static ngx_str_t TEXT_PLAIN = ngx_string("text/plain");
+
+    ngx_memzero(&cv, sizeof(ngx_http_complex_value_t));
+
+    if (rc == NGX_OK) {
+
+        if (op.status != NGX_HTTP_NOT_MODIFIED) {
+
+            ngx_dynamic_upstream_out_init(&out, r->pool);
+
+            if (ngx_dynamic_upstream_response(&conf, &out, &op, &filter)
+                    == NGX_ERROR
+                || ngx_dynamic_upstream_set_cursor(r, &filter) == NGX_ERROR) {
+
+                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "no memory");
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            rc = ngx_dynamic_upstream_send_header(r, op.status, out.size);
+            if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+                return rc;
+
+            return ngx_dynamic_upstream_send_last(r, out.out);
+        }
+
+    } else {
+
+        if (op.status == NGX_HTTP_INTERNAL_SERVER_ERROR) {
+
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "%V: %s",
+                          &op.upstream, op.err);
+        }
+
+        cv.value.len = strlen(op.err);
+        cv.value.data = (u_char *) op.err;
+    }
+
+    return ngx_http_send_response(r, op.status, &TEXT_PLAIN, &cv);
+}
+
+
+static char *
+ngx_dynamic_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = (ngx_http_core_loc_conf_t *) ngx_http_conf_get_module_loc_conf(cf,
+        ngx_http_core_module);
+    clcf->handler = ngx_dynamic_upstream_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+// dns_hold_down [resolves=n] [time=t]
+
+static char *
+ngx_dynamic_upstream_dns_hold_down(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_dynamic_upstream_srv_conf_t  *dscf;
+    ngx_str_t                        *value, s;
+    ngx_uint_t                        j;
+    ngx_int_t                         n;
+
+    dscf = (ngx_dynamic_upstream_srv_conf_t *) conf;
+
+    if (dscf->dns_hold_count != NGX_CONF_UNSET_UINT)
+        return (char *) "is duplicate";
+
+    dscf->dns_hold_count = 0;
+    dscf->dns_hold_time = 0;
+
+    value = (ngx_str_t *) cf->args->elts;
+
+    for (j = 1; j < cf->args->nelts; j++) {
+
+        if (ngx_strncmp(value[j].data, "resolves=", 9) == 0) {
+
+            n = ngx_atoi(value[j].data + 9, value[j].len - 9);
+            if (n == NGX_ERROR || n == 0)
+                goto invalid;
+
+            dscf->dns_hold_count = (ngx_uint_t) n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[j].data, "time=", 5) == 0) {
+
+            s.data = value[j].data + 5;
+            s.len = value[j].len - 5;
+
+            n = ngx_parse_time(&s, 1);
+            if (n == NGX_ERROR || n == 0)
+                goto invalid;
+
+            dscf->dns_hold_time = (time_t) n;
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid parameter \"%V\"",
+                       &value[j]);
+
+    return (char *) NGX_CONF_ERROR;
+}
+
+
+// dns_subset k [id=string], the id is the host name by default
+
+static char *
+ngx_dynamic_upstream_dns_subset(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_dynamic_upstream_srv_conf_t  *dscf;
+    ngx_str_t                        *value;
+    ngx_int_t                         n;
+
+    dscf = (ngx_dynamic_upstream_srv_conf_t *) conf;
+
+    if (dscf->dns_subset != NGX_CONF_UNSET_UINT)
+        return (char *) "is duplicate";
+
+    value = (ngx_str_t *) cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0) {
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid value \"%V\"",
+                           &value[1]);
+        return (char *) NGX_CONF_ERROR;
+    }
+
+    dscf->dns_subset = (ngx_uint_t) n;
+
+    if (cf->args->nelts == 3) {
+
+        if (ngx_strncmp(value[2].data, "id=", 3) != 0
+            || value[2].len == 3) {
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return (char *) NGX_CONF_ERROR;
+        }
+
+        dscf->dns_subset_id.data = value[2].data + 3;
+        dscf->dns_subset_id.len = value[2].len - 3;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+// dns_srv_resolver address[:port], an IPv4 address, the port is 53
+// by default
+
+static char *
+ngx_dynamic_upstream_dns_srv_resolver(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_dynamic_upstream_srv_conf_t  *dscf;
+    ngx_str_t                        *value;
+    ngx_url_t                         u;
+
+    dscf = (ngx_dynamic_upstream_srv_conf_t *) conf;
+
+    if (dscf->dns_srv_resolver != NULL)
+        return (char *) "is duplicate";
+
+    value = (ngx_str_t *) cf->args->elts;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = value[1];
+    u.default_port = 53;
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK || u.naddrs == 0
+        || u.addrs[0].sockaddr->sa_family != AF_INET) {
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid address \"%V\", IPv4 is expected",
+                           &value[1]);
+        return (char *) NGX_CONF_ERROR;
+    }
+
+    dscf->dns_srv_resolver = &u.addrs[0];
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_dynamic_upstream_post_conf(ngx_conf_t *cf)
+{
+    if (ngx_http_dynamic_upstream_outlier_wrap(cf) != NGX_OK)
+        return NGX_ERROR;
+
+    if (ngx_dynamic_upstream_ramp_wrap<ngx_http_upstream_srv_conf_t>(cf)
+            != NGX_OK)
+        return NGX_ERROR;
+
+#if (NGX_THREADS)
+    // the background jobs run in the 'default' thread pool
+
+    if (ngx_thread_pool_add(cf, NULL) == NULL)
+        return NGX_ERROR;
+#endif
+
+    if (ngx_dynamic_upstream_dns_cache_add_zone(cf,
+            &ngx_http_dynamic_upstream_module) != NGX_OK)
+        return NGX_ERROR;
+
+    return ngx_dynamic_upstream_metrics_add_zone(cf,
+        &ngx_http_dynamic_upstream_module);
+}
+
+
+static ngx_int_t
+ngx_stream_dynamic_upstream_post_conf(ngx_conf_t *cf)
+{
+    if (ngx_stream_dynamic_upstream_outlier_wrap(cf) != NGX_OK)
+        return NGX_ERROR;
+
+    if (ngx_dynamic_upstream_ramp_wrap<ngx_stream_upstream_srv_conf_t>(cf)
+            != NGX_OK)
+        return NGX_ERROR;
+
+#if (NGX_THREADS)
+    if (ngx_thread_pool_add(cf, NULL) == NULL)
+        return NGX_ERROR;
+#endif
+
+    // the cache is shared with http upstreams
+
+    return ngx_dynamic_upstream_dns_cache_add_zone(cf,
+        &ngx_http_dynamic_upstream_module);
+}
+
+
+// balancer data in the upstream zones, the zones are initialized here,
+// the peers of the previous cycle are carried before the balancers are
+// built
+
+static ngx_int_t
+ngx_dynamic_upstream_init_module(ngx_cycle_t *cycle)
+{
+    if (ngx_dynamic_upstream_reload_init(cycle) != NGX_OK)
+        return NGX_ERROR;
+
+    if (ngx_dynamic_upstream_chash_init(cycle) != NGX_OK)
+        return NGX_ERROR;
+
+    if (ngx_dynamic_upstream_p2c_init(cycle) != NGX_OK)
+        return NGX_ERROR;
+
+    return ngx_dynamic_upstream_outlier_init(cycle);
+}
+
+
+static void *
+ngx_dynamic_upstream_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_dynamic_upstream_srv_conf_t  *conf;
+
+    conf = (ngx_dynamic_upstream_srv_conf_t *)
+        ngx_pcalloc(cf->pool, sizeof(ngx_dynamic_upstream_srv_conf_t));
+    if (conf == NULL)
+        return NULL;
+
+    conf->interval = NGX_CONF_UNSET_MSEC;
+    conf->last = 0;
+    conf->ipv6 = NGX_CONF_UNSET;
+    conf->add_down = NGX_CONF_UNSET;
+    conf->high_water = NGX_CONF_UNSET_UINT;
+    conf->lock_stats = NGX_CONF_UNSET;
+    conf->warm_reload = NGX_CONF_UNSET;
+    conf->slow_start = NGX_CONF_UNSET;
+    conf->dns_max_stale = NGX_CONF_UNSET;
+    conf->dns_max_backoff = NGX_CONF_UNSET;
+    conf->dns_hold_count = NGX_CONF_UNSET_UINT;
+    conf->dns_hold_time = NGX_CONF_UNSET;
+    conf->dns_subset = NGX_CONF_UNSET_UINT;
+    conf->p2c_decay = NGX_CONF_UNSET_MSEC;
+    conf->control_timeout = NGX_CONF_UNSET_MSEC;
+
+    return conf;
+}
+
+
+template <class S> ngx_int_t
+not_resolved(typename TypeSelect<S>::peer_type  *peer)
+{
+    extern ngx_int_t is_reserved_addr(ngx_str_t *addr);
+    return is_reserved_addr(&peer->name) && !is_reserved_addr(&peer->server);
+}
+
+
+// slow start: peers which appear in the upstream or come up after down
+// get the effective weight ramped from 1 to the weight in 'slow_start'
+// time, the weight itself is left to the api. The pass sets the cap of
+// the ramped weight in the zone, the wrapper of the balancer applies it
+// before every selection since round robin raises the effective weight
+// by one per request. The ring of 'dynamic_hash' gets the points of the
+// ramped weight. The ramp state is local to the worker owning the
+// upstream in ngx_dynamic_upstream_loop().
+
+typedef struct {
+    void        *peer;
+    uint32_t     crc;
+    time_t       start;
+    ngx_int_t    weight;     // of the peer in the last pass
+    ngx_int_t    current;    // ramped
+    ngx_int_t    ring;       // of the points in the ring
+    ngx_flag_t   down;
+} ngx_dynamic_upstream_ramp_t;
+
+
+static int
+ngx_dynamic_upstream_ramp_cmp(const void *one, const void *two)
+{
+    const ngx_dynamic_upstream_ramp_t  *l, *r;
+
+    l = (const ngx_dynamic_upstream_ramp_t *) one;
+    r = (const ngx_dynamic_upstream_ramp_t *) two;
+
+    return l->peer < r->peer ? -1 : (l->peer > r->peer ? 1 : 0);
+}
+
+
+static ngx_dynamic_upstream_ramp_t *
+ngx_dynamic_upstream_ramp_find(ngx_array_t *ramp, void *peer, ngx_str_t *name)
+{
+    ngx_dynamic_upstream_ramp_t  key, *r;
+
+    if (ramp == NULL)
+        return NULL;
+
+    key.peer = peer;
+
+    r = (ngx_dynamic_upstream_ramp_t *) bsearch(&key, ramp->elts, ramp->nelts,
+        sizeof(ngx_dynamic_upstream_ramp_t), ngx_dynamic_upstream_ramp_cmp);
+
+    // the memory of a removed peer may be reused by a new one
+
+    if (r == NULL || r->crc != ngx_crc32_short(name->data, name->len))
+        return NULL;
+
+    return r;
+}
+
+
+// the ring is changed under the write lock, peers removed since the
+// ramp was computed are not in the list anymore
+
+template <class S> static void
+ngx_dynamic_upstream_ramp_ring(S *uscf, ngx_dynamic_upstream_srv_conf_t *dscf)
+{
+    typename TypeSelect<S>::peer_type   *peer;
+    typename TypeSelect<S>::peers_type  *primary;
+
+    ngx_dynamic_upstream_ramp_t  *r;
+
+    primary = (typename TypeSelect<S>::peers_type *) uscf->peer.data;
+
+    ngx_upstream_rr_peers_wlock<typename TypeSelect<S>::peers_type>
+        wl(primary);
+
+    for (peer = primary->peer; peer != NULL; peer = peer->next) {
+
+        r = ngx_dynamic_upstream_ramp_find(dscf->ramp, peer, &peer->name);
+        if (r == NULL || r->ring == r->current)
+            continue;
+
+        if (ngx_dynamic_upstream_chash_weight(dscf->chash, primary, peer,
+                &peer->name, r->ring, r->current) != NGX_OK) {
+
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                          "dynamic upstream: no shared memory for hash points");
+            continue;
+        }
+
+        r->ring = r->current;
+    }
+}
+
+
+template <class S> static void
+ngx_dynamic_upstream_slow_start(S *uscf, ngx_dynamic_upstream_srv_conf_t *dscf)
+{
+    typedef typename TypeSelect<S>::peer_type   peer_type;
+    typedef typename TypeSelect<S>::peers_type  peers_type;
+
+    peer_type                    *peer;
+    peers_type                   *primary, *peers;
+    ngx_array_t                  *ramp;
+    ngx_dynamic_upstream_ramp_t  *r, *prev;
+    ngx_uint_t                    j;
+    ngx_flag_t                    ring = 0;
+    time_t                        now;
+
+    // the states of the last and of this pass are swapped, both live
+    // in the pool of the upstream
+
+    if (dscf->ramp_pool == NULL) {
+
+        dscf->ramp_pool = ngx_create_pool(2048, ngx_cycle->log);
+        if (dscf->ramp_pool == NULL)
+            goto nomem;
+    }
+
+    if (dscf->ramp_next == NULL) {
+
+        dscf->ramp_next = ngx_array_create(dscf->ramp_pool, 16,
+            sizeof(ngx_dynamic_upstream_ramp_t));
+        if (dscf->ramp_next == NULL)
+            goto nomem;
+    }
+
+    ramp = dscf->ramp_next;
+    ramp->nelts = 0;
+
+    now = ngx_time();
+
+    primary = (peers_type *) uscf->peer.data;
+
+    {
+        ngx_upstream_rr_peers_rlock<peers_type> rl(primary);
+
+        for (peers = primary, j = 0;
+             peers != NULL && j < 2;
+             peers = peers->next, j++) {
+
+            for (peer = peers->peer;
+                 peer != NULL;
+                 peer = peer->next) {
+
+                r = (ngx_dynamic_upstream_ramp_t *) ngx_array_push(ramp);
+                if (r == NULL)
+                    goto nomem;
+
+                prev = ngx_dynamic_upstream_ramp_find(dscf->ramp, peer,
+                                                      &peer->name);
+                if (prev == NULL) {
+
+                    // on the first pass all peers are considered as old
+
+                    r->peer = peer;
+                    r->crc = ngx_crc32_short(peer->name.data, peer->name.len);
+                    r->start = dscf->ramp != NULL && !peer->down ? now : 0;
+                    r->weight = peer->weight;
+                    r->current = peer->weight;
+                    r->ring = peer->weight;
+                    r->down = peer->down;
+
+                    if (r->start != 0)
+                        ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                                      "%V: slow start peer %V",
+                                      &uscf->host, &peer->name);
+
+                } else
+                    *r = *prev;
+
+                if (peer->weight != r->weight) {
+
+                    // updated by api, the points are made again
+
+                    r->weight = peer->weight;
+                    r->ring = peer->weight;
+                }
+
+                if (r->down && !peer->down) {
+
+                    r->start = now;
+
+                    ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                                  "%V: slow start peer %V",
+                                  &uscf->host, &peer->name);
+                }
+
+                r->down = peer->down;
+
+                if (peer->down)
+                    r->start = 0;
+
+                r->current = peer->weight;
+
+                if (r->start != 0) {
+
+                    if (now - r->start < dscf->slow_start)
+                        r->current = ngx_max(1, (ngx_int_t) (peer->weight
+                            * (now - r->start) / dscf->slow_start));
+                    else
+                        r->start = 0;
+                }
+
+                if (r->current < peer->weight) {
+
+                    ngx_upstream_rr_peer_lock<peer_type> pl(peer);
+
+                    ngx_dynamic_upstream_ramp_weight(peer) = r->current;
+
+                    if (peer->effective_weight > r->current)
+                        peer->effective_weight = r->current;
+
+                } else if (ngx_dynamic_upstream_ramp_weight(peer) != 0) {
+
+                    ngx_upstream_rr_peer_lock<peer_type> pl(peer);
+
+                    ngx_dynamic_upstream_ramp_weight(peer) = 0;
+                }
+
+                if (dscf->chash != NULL && peers == primary
+                    && r->ring != r->current)
+                    ring = 1;
+            }
+        }
+    }
+
+    ngx_qsort(ramp->elts, ramp->nelts, sizeof(ngx_dynamic_upstream_ramp_t),
+              ngx_dynamic_upstream_ramp_cmp);
+
+    dscf->ramp_next = dscf->ramp;
+    dscf->ramp = ramp;
+
+    if (ring)
+        ngx_dynamic_upstream_ramp_ring(uscf, dscf);
+
+    return;
+
+nomem:
+
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                  "dynamic upstream: no memory");
+}
+
+
+// wrapper of the balancer of 'slow_start' upstreams, any balancer with
+// the data of its own
+
+template <class S> struct ngx_dynamic_upstream_ramp_data_t {
+    void                                 *data;
+    ngx_event_get_peer_pt                 get;
+    ngx_event_free_peer_pt                free;
+#if (NGX_SSL)
+    ngx_event_set_peer_session_pt         set_session;
+    ngx_event_save_peer_session_pt        save_session;
+#endif
+    typename TypeSelect<S>::peers_type   *peers;
+};
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_ramp_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    typedef typename TypeSelect<S>::peer_type   peer_type;
+    typedef typename TypeSelect<S>::peers_type  peers_type;
+
+    ngx_dynamic_upstream_ramp_data_t<S> *rd =
+        (ngx_dynamic_upstream_ramp_data_t<S> *) data;
+
+    peer_type   *peer;
+    peers_type  *peers;
+    ngx_uint_t   j;
+    ngx_int_t    cap;
+
+    {
+        ngx_upstream_rr_peers_rlock<peers_type> rl(rd->peers);
+
+        for (peers = rd->peers, j = 0;
+             peers != NULL && j < 2;
+             peers = peers->next, j++) {
+
+            for (peer = peers->peer;
+                 peer != NULL;
+                 peer = peer->next) {
+
+                cap = (ngx_int_t) ngx_dynamic_upstream_ramp_weight(peer);
+                if (cap == 0 || peer->effective_weight <= cap)
+                    continue;
+
+                ngx_upstream_rr_peer_lock<peer_type> pl(peer);
+
+                if (peer->effective_weight > cap)
+                    peer->effective_weight = cap;
+            }
+        }
+    }
+
+    return rd->get(pc, rd->data);
+}
+
+
+template <class S> static void
+ngx_dynamic_upstream_ramp_free_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state)
+{
+    ngx_dynamic_upstream_ramp_data_t<S> *rd =
+        (ngx_dynamic_upstream_ramp_data_t<S> *) data;
+
+    rd->free(pc, rd->data, state);
+}
+
+
+#if (NGX_SSL)
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_ramp_set_session(ngx_peer_connection_t *pc,
+    void *data)
+{
+    ngx_dynamic_upstream_ramp_data_t<S> *rd =
+        (ngx_dynamic_upstream_ramp_data_t<S> *) data;
+
+    return rd->set_session(pc, rd->data);
+}
+
+
+template <class S> static void
+ngx_dynamic_upstream_ramp_save_session(ngx_peer_connection_t *pc,
+    void *data)
+{
+    ngx_dynamic_upstream_ramp_data_t<S> *rd =
+        (ngx_dynamic_upstream_ramp_data_t<S> *) data;
+
+    rd->save_session(pc, rd->data);
+}
+
+#endif
+
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_ramp_init_peer(
+    typename BalancerSelect<S>::session_type *r, S *us)
+{
+    typedef typename BalancerSelect<S>::init_peer_type  init_peer_type;
+
+    ngx_dynamic_upstream_srv_conf_t      *dscf;
+    ngx_dynamic_upstream_ramp_data_t<S>  *rd;
+    ngx_peer_connection_t                *pc;
+
+    dscf = BalancerSelect<S>::srv_conf(us);
+
+    if (((init_peer_type) dscf->ramp_init)(r, us) != NGX_OK)
+        return NGX_ERROR;
+
+    rd = (ngx_dynamic_upstream_ramp_data_t<S> *) ngx_pcalloc(
+        BalancerSelect<S>::pool(r),
+        sizeof(ngx_dynamic_upstream_ramp_data_t<S>));
+    if (rd == NULL)
+        return NGX_ERROR;
+
+    pc = BalancerSelect<S>::pc(r);
+
+    rd->data = pc->data;
+    rd->get = pc->get;
+    rd->free = pc->free;
+    rd->peers = (typename TypeSelect<S>::peers_type *) us->peer.data;
+
+    pc->data = rd;
+    pc->get = ngx_dynamic_upstream_ramp_get_peer<S>;
+    pc->free = ngx_dynamic_upstream_ramp_free_peer<S>;
+
+#if (NGX_SSL)
+    rd->set_session = pc->set_session;
+    rd->save_session = pc->save_session;
+
+    if (pc->set_session != NULL)
+        pc->set_session = ngx_dynamic_upstream_ramp_set_session<S>;
+
+    if (pc->save_session != NULL)
+        pc->save_session = ngx_dynamic_upstream_ramp_save_session<S>;
+#endif
+
+    return NGX_OK;
+}
+
+
+// wraps the balancers, after the upstreams are initialized
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_ramp_wrap(ngx_conf_t *cf)
+{
+    typename BalancerSelect<S>::main_type  *umcf;
+
+    S                                **uscf;
+    ngx_dynamic_upstream_srv_conf_t   *dscf;
+    ngx_uint_t                         j;
+
+    umcf = BalancerSelect<S>::main_conf(cf->cycle);
+    if (umcf == NULL)
+        return NGX_OK;
+
+    uscf = (S **) umcf->upstreams.elts;
+
+    for (j = 0; j < umcf->upstreams.nelts; j++) {
+
+        if (uscf[j]->srv_conf == NULL)
+            continue;
+
+        dscf = BalancerSelect<S>::srv_conf(uscf[j]);
+        if (dscf == NULL || dscf->slow_start <= 0)
+            continue;
+
+        dscf->ramp_init = (void *) uscf[j]->peer.init;
+
+        uscf[j]->peer.init = ngx_dynamic_upstream_ramp_init_peer<S>;
+    }
+
+    return NGX_OK;
+}
+
+
+template <class S> static ngx_flag_t
+ngx_dynamic_upstream_has_draining(typename TypeSelect<S>::peers_type *primary)
+{
+    typename TypeSelect<S>::peer_type   *peer;
+    typename TypeSelect<S>::peers_type  *peers;
+
+    ngx_uint_t  j;
+
+    ngx_upstream_rr_peers_rlock<typename TypeSelect<S>::peers_type> rl(primary);
+
+    for (peers = primary, j = 0;
+         peers != NULL && j < 2;
+         peers = peers->next, j++)
+        for (peer = peers->peer; peer != NULL; peer = peer->next)
+            if (ngx_dynamic_upstream_draining(peer))
+                return 1;
+
+    return 0;
+}
+
+
+// removes draining peers without connections or with expired deadline,
+// the peers with connections go to the trash
+
+template <class S> static void
+ngx_dynamic_upstream_drain(S *uscf)
+{
+    typename TypeSelect<S>::peer_type   *peer;
+    typename TypeSelect<S>::peers_type  *primary, *peers;
+
+    ngx_dynamic_upstream_op_t  op;
+    ngx_pool_t                *pool = NULL;
+    ngx_uint_t                 j;
+    time_t                     now;
+
+    primary = (typename TypeSelect<S>::peers_type *) uscf->peer.data;
+
+    if (!ngx_dynamic_upstream_has_draining<S>(primary))
+        return;
+
+    now = ngx_time();
+
+    ngx_upstream_rr_peers_wlock<typename TypeSelect<S>::peers_type>
+        wl(primary);
+
+again:
+
+    for (peers = primary, j = 0;
+         peers != NULL && j < 2;
+         peers = peers->next, j++) {
+
+        for (peer = peers->peer;
+             peer != NULL;
+             peer = peer->next) {
+
+            if (!ngx_dynamic_upstream_draining(peer))
+                continue;
+
+            if (peer->conns != 0
+                && (time_t) ngx_dynamic_upstream_drain_deadline(peer) > now)
+                continue;
+
+            if (pool == NULL) {
+
+                pool = ngx_create_pool(1024, ngx_cycle->log);
+                if (pool == NULL)
+                    goto nomem;
+            }
+
+            ngx_memzero(&op, sizeof(ngx_dynamic_upstream_op_t));
+
+            op.err = "unexpected";
+            op.status = NGX_HTTP_OK;
+
+            TypeSelect<S>::make_op(&op);
+
+            op.op = NGX_DYNAMIC_UPSTEAM_OP_REMOVE;
+            op.upstream = uscf->host;
+            op.no_lock = 1;
+
+            // the peer is freed by the remove
+
+            op.server.data = ngx_pstrdup(pool, &peer->server);
+            op.server.len = peer->server.len;
+            op.name.data = ngx_pstrdup(pool, &peer->name);
+            op.name.len = peer->name.len;
+
+            if (op.server.data == NULL || op.name.data == NULL)
+                goto nomem;
+
+            ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                          "%V: drained peer %V, conns=%ui",
+                          &uscf->host, &peer->name, peer->conns);
+
+            if (ngx_dynamic_upstream_do_op<S>(ngx_cycle->log, &op, uscf)
+                    != NGX_OK || op.status != NGX_HTTP_OK) {
+
+                ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0,
+                              "%V: failed to remove drained peer %V, %s",
+                              &uscf->host, &op.name, op.err);
+                goto end;
+            }
+
+            goto again;
+        }
+    }
+
+end:
+
+    if (pool != NULL)
+        ngx_destroy_pool(pool);
+
+    return;
+
+nomem:
+
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                  "dynamic upstream: no memory");
+    goto end;
+}
+
+
+// background work of the worker: a timer on the event loop passes the
+// upstreams once a second, blocking work (probes, dns, state files) is
+// collected into a batch of jobs run by the thread pool, the results
+// are applied to the peers by the completion handler on the event loop.
+// One batch is in flight at once. Without thread pools the batch is run
+// by a background thread of the worker and is taken back by the timer,
+// blocking jobs never run on the event loop.
+
+typedef struct ngx_dynamic_upstream_job_s  ngx_dynamic_upstream_job_t;
+
+typedef void (*ngx_dynamic_upstream_job_pt)(ngx_dynamic_upstream_job_t *job);
+
+struct ngx_dynamic_upstream_job_s {
+    ngx_dynamic_upstream_job_t       *next;
+    ngx_dynamic_upstream_job_pt       run;      // in a thread
+    ngx_dynamic_upstream_job_pt       done;     // on the event loop
+    ngx_pool_t                       *pool;
+    void                             *uscf;
+    ngx_int_t                         rc;
+
+    // check
+
+    ngx_dynamic_upstream_check_t     *check;
+    ngx_array_t                      *probes;
+    ngx_array_t                      *states;
+
+    // dns
+
+    ngx_dynamic_upstream_op_t         op;
+    ngx_uint_t                        old_hash;
+    ngx_flag_t                        resolve;
+    ngx_msec_int_t                    elapsed;
+
+    // state file
+
+    ngx_str_t                         file;
+    ngx_chain_t                      *text;
+};
+
+
+static ngx_dynamic_upstream_job_t *
+ngx_dynamic_upstream_job(ngx_dynamic_upstream_job_t ***last, size_t size)
+{
+    ngx_dynamic_upstream_job_t  *job;
+    ngx_pool_t                  *pool;
+
+    pool = ngx_create_pool(size, ngx_cycle->log);
+    if (pool == NULL)
+        return NULL;
+
+    job = (ngx_dynamic_upstream_job_t *) ngx_pcalloc(pool,
+        sizeof(ngx_dynamic_upstream_job_t));
+    if (job == NULL) {
+        ngx_destroy_pool(pool);
+        return NULL;
+    }
+
+    job->pool = pool;
+
+    **last = job;
+    *last = &job->next;
+
+    return job;
+}
+
+
+// applies the result of the check by the op engine as ?up= and ?down= do
+
+template <class S> static ngx_int_t
+ngx_dynamic_upstream_check_apply(S *uscf, ngx_dynamic_upstream_probe_t *probe,
+    ngx_flag_t up, ngx_flag_t ejection = 0)
+{
+    ngx_dynamic_upstream_op_t  op;
+
+    ngx_memzero(&op, sizeof(ngx_dynamic_upstream_op_t));
+
+    op.err = "unexpected";
+    op.status = NGX_HTTP_OK;
+
+    TypeSelect<S>::make_op(&op);
+
+    op.op = NGX_DYNAMIC_UPSTEAM_OP_PARAM;
+    op.upstream = uscf->host;
+    op.server = probe->server;
+    op.name = probe->name;
+    op.ejection = ejection;
+    op.keep_drain = 1;
+
+    if (up) {
+
+        op.op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_UP;
+        op.up = 1;
+
+    } else {
+
+        op.op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN;
+        op.down = 1;
+    }
+
+    if (ngx_dynamic_upstream_do_op<S>(ngx_cycle->log, &op, uscf) != NGX_OK) {
+
+        // removed or drained while probed
+
+        ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0, "%V: peer %V: %s",
+                      &uscf->host, &probe->name, op.err);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+// probes the peers of this worker, a peer is probed by the worker
+// selected by the crc of its address. Peers brought down by api
+// are not probed, draining peers are left alone. The peers to probe
+// are copied here, the probes are run by the job.
+
+template <class S> static void ngx_dynamic_upstream_check_done(
+    ngx_dynamic_upstream_job_t *job);
+
+static void ngx_dynamic_upstream_check_run(ngx_dynamic_upstream_job_t *job);
+
+
+template <class S> static void
+ngx_dynamic_upstream_check(S *uscf, ngx_dynamic_upstream_srv_conf_t *dscf,
+    ngx_dynamic_upstream_job_t ***last)
+{
+    typename TypeSelect<S>::peer_type   *peer;
+    typename TypeSelect<S>::peers_type  *primary, *peers;
+
+    ngx_dynamic_upstream_check_t       *check = dscf->check;
+    ngx_dynamic_upstream_check_peer_t  *c, *prev;
+    ngx_dynamic_upstream_probe_t       *probe;
+    ngx_array_t                        *states, *probes;
+    ngx_pool_t                         *pool = NULL;
+    ngx_dynamic_upstream_job_t         *job;
+    ngx_core_conf_t                    *ccf;
+    ngx_uint_t                          j, workers = 1;
+    uint32_t                            crc;
+    time_t                              now;
+
+    now = ngx_time();
+
+    if (check->last + check->interval > now)
+        return;
+
+    check->last = now;
+
+    if (ngx_process == NGX_PROCESS_WORKER) {
+
+        ccf = (ngx_core_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
+                                               ngx_core_module);
+        workers = ccf->worker_processes;
+    }
+
+    job = ngx_dynamic_upstream_job(last, 4096);
+    if (job == NULL)
+        goto nomem;
+
+    pool = job->pool;
+
+    primary = (typename TypeSelect<S>::peers_type *) uscf->peer.data;
+
+    {
+        ngx_upstream_rr_peers_rlock<typename TypeSelect<S>::peers_type>
+            rl(primary);
+
+        // states are not moved by pushes, probes point to them
+
+        states = ngx_array_create(pool, primary->number
+            + (primary->next != NULL ? primary->next->number : 0) + 1,
+            sizeof(ngx_dynamic_upstream_check_peer_t));
+        probes = ngx_array_create(pool, 16,
+            sizeof(ngx_dynamic_upstream_probe_t));
+
+        if (states == NULL || probes == NULL)
+            goto nomem;
+
+        for (peers = primary, j = 0;
+             peers != NULL && j < 2;
+             peers = peers->next, j++) {
+
+            for (peer = peers->peer;
+                 peer != NULL;
+                 peer = peer->next) {
+
+                if (not_resolved<S>(peer))
+                    continue;
+
+                crc = ngx_crc32_short(peer->name.data, peer->name.len);
+
+                if (crc % workers != (workers > 1 ? ngx_worker : 0))
+                    continue;
+
+                c = (ngx_dynamic_upstream_check_peer_t *)
+                    ngx_array_push(states);
+                if (c == NULL)
+                    goto nomem;
+
+                prev = ngx_dynamic_upstream_check_find(check, peer,
+                                                       &peer->name);
+                if (prev == NULL) {
+
+                    // peers added down by dns wait for the check
+
+                    c->peer = peer;
+                    c->crc = crc;
+                    c->rise = 0;
+                    c->fall = 0;
+                    c->down = peer->down && dscf->add_down == 1;
+
+                } else
+                    *c = *prev;
+
+                if (ngx_dynamic_upstream_draining(peer))
+                    continue;
+
+                if (!peer->down)
+                    // brought up by api
+                    c->down = 0;
+                else if (!c->down)
+                    continue;
+
+                probe = (ngx_dynamic_upstream_probe_t *)
+                    ngx_array_push(probes);
+                if (probe == NULL)
+                    goto nomem;
+
+                ngx_memzero(probe, sizeof(ngx_dynamic_upstream_probe_t));
+
+                probe->sockaddr = (struct sockaddr *) ngx_pnalloc(pool,
+                    peer->socklen);
+                probe->server.data = ngx_pstrdup(pool, &peer->server);
+                probe->name.data = ngx_pstrdup(pool, &peer->name);
+
+                if (probe->sockaddr == NULL || probe->server.data == NULL
+                    || probe->name.data == NULL)
+                    goto nomem;
+
+                ngx_memcpy(probe->sockaddr, peer->sockaddr, peer->socklen);
+                probe->socklen = peer->socklen;
+                probe->server.len = peer->server.len;
+                probe->name.len = peer->name.len;
+                probe->check = c;
+            }
+        }
+    }
+
+    job->run = ngx_dynamic_upstream_check_run;
+    job->done = ngx_dynamic_upstream_check_done<S>;
+    job->uscf = uscf;
+    job->check = check;
+    job->probes = probes;
+    job->states = states;
+
+    return;
+
+nomem:
+
+    // the job is left to free the pool
+
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                  "dynamic upstream: no memory");
+}
+
+
+// the peers are not locked while probed
+
+static void
+ngx_dynamic_upstream_check_run(ngx_dynamic_upstream_job_t *job)
+{
+    job->rc = ngx_dynamic_upstream_check_probe(job->check,
+        (ngx_dynamic_upstream_probe_t *) job->probes->elts,
+        job->probes->nelts, job->pool, ngx_cycle->log);
+}
+
+
+template <class S> static void
+ngx_dynamic_upstream_check_done(ngx_dynamic_upstream_job_t *job)
+{
+    S                                  *uscf = (S *) job->uscf;
+    ngx_dynamic_upstream_check_t       *check = job->check;
+    ngx_dynamic_upstream_check_peer_t  *c;
+    ngx_dynamic_upstream_probe_t       *probe;
+    ngx_array_t                        *probes = job->probes;
+    ngx_array_t                        *states = job->states;
+    ngx_uint_t                          j;
+
+    if (job->rc != NGX_OK) {
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "dynamic upstream: no memory");
+        return;
+    }
+
+    probe = (ngx_dynamic_upstream_probe_t *) probes->elts;
+
+    for (j = 0; j < probes->nelts; j++) {
+
+        c = probe[j].check;
+
+        if (probe[j].err == NULL) {
+
+            c->fall = 0;
+            c->rise++;
+
+            if (c->down && c->rise >= check->rise
+                && ngx_dynamic_upstream_check_apply(uscf, probe + j, 1)
+                       == NGX_OK)
+                c->down = 0;
+
+            continue;
+        }
+
+        ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                      "%V: check of peer %V failed: %s",
+                      &uscf->host, &probe[j].name, probe[j].err);
+
+        c->rise = 0;
+        c->fall++;
+
+        if (!c->down && c->fall >= check->fall
+            && ngx_dynamic_upstream_check_apply(uscf, probe + j, 0)
+                   == NGX_OK) {
+
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                          "%V: peer %V is down by check: %s",
+                          &uscf->host, &probe[j].name, probe[j].err);
+            c->down = 1;
+        }
+    }
+
+    ngx_qsort(states->elts, states->nelts,
+              sizeof(ngx_dynamic_upstream_check_peer_t),
+              ngx_dynamic_upstream_check_cmp);
+
+    if (check->pool != NULL)
+        ngx_destroy_pool(check->pool);
+
+    // the states are kept in the pool of the job
+
+    check->pool = job->pool;
+    check->peers = states;
+
+    job->pool = NULL;
+}
+
+
+// ejects the outliers and restores the peers with expired ejection,
+// at most max_percent of the primary peers but one are ejected at once,
+// none with max_percent=0, and the last primary peer up is never ejected
+
+template <class S> static void
+ngx_dynamic_upstream_outlier(S *uscf, ngx_dynamic_upstream_srv_conf_t *dscf)
+{
+    typename TypeSelect<S>::peer_type   *peer;
+    typename TypeSelect<S>::peers_type  *primary;
+
+    ngx_dynamic_upstream_outlier_conf_t  *oc = dscf->outlier;
+    ngx_dynamic_upstream_outlier_t       *table = oc->table;
+    ngx_dynamic_upstream_outlier_stat_t  *stat;
+    ngx_dynamic_upstream_probe_t         *probe;
+    ngx_array_t                          *change;
+    ngx_pool_t                           *pool;
+    ngx_uint_t                            j, ejected = 0, limit, up = 0;
+    ngx_flag_t                            slow;
+    time_t                                now, t;
+    const char                           *reason;
+
+    if (table == NULL)
+        return;
+
+    pool = ngx_create_pool(1024, ngx_cycle->log);
+    if (pool == NULL)
+        goto nomem;
+
+    // probe.err is the reason of the ejection, NULL to restore
+
+    change = ngx_array_create(pool, 4, sizeof(ngx_dynamic_upstream_probe_t));
+    if (change == NULL)
+        goto nomem;
+
+    now = ngx_time();
+
+    primary = (typename TypeSelect<S>::peers_type *) uscf->peer.data;
+
+    {
+        ngx_upstream_rr_peers_wlock<typename TypeSelect<S>::peers_type>
+            wl(primary);
+
+        limit = oc->max_percent == 0
+            ? 0 : ngx_max(primary->number * oc->max_percent / 100, 1);
+
+        for (j = 0; j < table->number; j++)
+            if (table->stat[j].ejected != 0)
+                ejected++;
+
+        for (peer = primary->peer; peer != NULL; peer = peer->next)
+            if (!peer->down)
+                up++;
+
+        for (j = 0; j < table->number; j++) {
+
+            stat = table->stat + j;
+            peer = (typename TypeSelect<S>::peer_type *) stat->peer;
+
+            reason = NULL;
+
+            if (stat->ejected != 0) {
+
+                if (stat->ejected > now)
+                    goto next;
+
+                stat->ejected = 0;
+                stat->restored = now;
+                stat->errors = 0;
+
+                ejected--;
+
+                // still down by the ejection, the api and the checks
+                // cancel it
+
+                if (peer->down && !ngx_dynamic_upstream_draining(peer))
+                    goto push;
+
+                goto next;
+            }
+
+            if (stat->ejections != 0
+                && stat->restored + oc->max_eject_time <= now)
+                stat->ejections = 0;
+
+            slow = oc->latency != 0
+                && stat->requests >= NGX_DYNAMIC_UPSTREAM_OUTLIER_REQUESTS
+                && stat->usec / stat->requests > (uint64_t) oc->latency * 1000;
+
+            if (oc->errors != 0 && stat->errors >= oc->errors)
+                reason = "errors";
+            else if (slow)
+                reason = "latency";
+            else
+                goto next;
+
+            if (peer->down || ejected >= limit || up <= 1)
+                goto next;
+
+            t = oc->eject_time << ngx_min(stat->ejections, 16);
+
+            stat->ejected = now + ngx_min(t, oc->max_eject_time);
+            stat->ejections++;
+
+            ejected++;
+            up--;
+
+push:
+
+            probe = (ngx_dynamic_upstream_probe_t *) ngx_array_push(change);
+            if (probe == NULL)
+                goto nomem;
+
+            ngx_memzero(probe, sizeof(ngx_dynamic_upstream_probe_t));
+
+            probe->server.data = ngx_pstrdup(pool, &peer->server);
+            probe->name.data = ngx_pstrdup(pool, &peer->name);
 
-            b = ngx_create_temp_buf(r->pool, ngx_pagesize * 32);
-            if (b == NULL) {
+            if (probe->server.data == NULL || probe->name.data == NULL)
+                goto nomem;
 
-                ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "no memory");
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
-            }
+            probe->server.len = peer->server.len;
+            probe->name.len = peer->name.len;
+            probe->err = reason;
 
-            ngx_dynamic_upstream_response(&conf, b, &op);
+next:
 
-            cv.value.len = b->last - b->start;
-            cv.value.data = b->start;
+            stat->requests = 0;
+            stat->usec = 0;
         }
+    }
 
-    } else {
+    probe = (ngx_dynamic_upstream_probe_t *) change->elts;
 
-        if (op.status == NGX_HTTP_INTERNAL_SERVER_ERROR) {
+    for (j = 0; j < change->nelts; j++) {
 
-            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "%V: %s",
-                          &op.upstream, op.err);
-        }
+        if (ngx_dynamic_upstream_check_apply(uscf, probe + j,
+                                             probe[j].err == NULL,
+                                             probe[j].err != NULL) != NGX_OK)
+            continue;
 
-        cv.value.len = strlen(op.err);
-        cv.value.data = (u_char *) op.err;
+        if (probe[j].err != NULL)
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                          "%V: peer %V is ejected by %s",
+                          &uscf->host, &probe[j].name, probe[j].err);
+        else
+            ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                          "%V: peer %V is restored",
+                          &uscf->host, &probe[j].name);
     }
 
-    return ngx_http_send_response(r, op.status, &TEXT_PLAIN, &cv);
-}
+    ngx_destroy_pool(pool);
 
+    return;
 
-static char *
-ngx_dynamic_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    ngx_http_core_loc_conf_t  *clcf;
+nomem:
 
-    clcf = (ngx_http_core_loc_conf_t *) ngx_http_conf_get_module_loc_conf(cf,
-        ngx_http_core_module);
-    clcf->handler = ngx_dynamic_upstream_handler;
+    if (pool != NULL)
+        ngx_destroy_pool(pool);
 
-    return NGX_CONF_OK;
+    ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                  "dynamic upstream: no memory");
 }
 
 
-static void *
-ngx_dynamic_upstream_create_srv_conf(ngx_conf_t *cf)
-{
-    ngx_dynamic_upstream_srv_conf_t  *conf;
-
-    conf = (ngx_dynamic_upstream_srv_conf_t *)
-        ngx_pcalloc(cf->pool, sizeof(ngx_dynamic_upstream_srv_conf_t));
-    if (conf == NULL)
-        return NULL;
+// the state file is rendered on the event loop and written by the job
 
-    conf->interval = NGX_CONF_UNSET_MSEC;
-    conf->last = 0;
-    conf->ipv6 = NGX_CONF_UNSET;
-    conf->add_down = NGX_CONF_UNSET;
+static void
+ngx_dynamic_upstream_save_run(ngx_dynamic_upstream_job_t *job)
+{
+    FILE         *f;
+    ngx_chain_t  *cl;
 
-    return conf;
-}
+    f = state_open(&job->file, "w+");
+    if (f == NULL)
+        return;
 
+    for (cl = job->text; cl != NULL; cl = cl->next)
+        fwrite(cl->buf->pos, cl->buf->last - cl->buf->pos, 1, f);
 
-template <class S> ngx_int_t
-not_resolved(typename TypeSelect<S>::peer_type  *peer)
-{
-    extern ngx_int_t is_reserved_addr(ngx_str_t *addr);
-    return is_reserved_addr(&peer->name) && !is_reserved_addr(&peer->server);
+    fclose(f);
 }
 
 
 template <class S> void
-ngx_http_dynamic_upstream_save(S *uscf, ngx_str_t file)
+ngx_http_dynamic_upstream_save(S *uscf, ngx_str_t file,
+    ngx_dynamic_upstream_job_t ***last)
 {
     typename TypeSelect<S>::peer_type   *peer;
     typename TypeSelect<S>::peers_type  *peers;
 
-    ngx_uint_t       j, i;
-    u_char           srv[10240], *c;
-    FILE            *f;
-    ngx_pool_t      *pool;
-    ngx_array_t     *servers;
-    ngx_str_t       *server, *s;
+    ngx_uint_t                   j, i;
+    ngx_array_t                 *servers;
+    ngx_str_t                   *server, *s;
+    ngx_dynamic_upstream_out_t   out;
+    ngx_dynamic_upstream_job_t  *job;
 
     static const ngx_str_t
         default_server = ngx_string("server 0.0.0.0:1 down;");
 
-    pool = ngx_create_pool(2048, ngx_cycle->log);
-    if (pool == NULL) {
+    extern ngx_int_t is_reserved_addr(ngx_str_t *addr);
+
+    job = ngx_dynamic_upstream_job(last, 2048);
+    if (job == NULL) {
         ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
                       "dynamic upstream: no memory");
         return;
     }
 
-    f = state_open(&file, "w+");
-    if (f == NULL) {
-        ngx_destroy_pool(pool);
-        return;
-    }
+    ngx_dynamic_upstream_out_init(&out, job->pool);
 
     peers = (typename TypeSelect<S>::peers_type *) uscf->peer.data;
 
     ngx_upstream_rr_peers_rlock<typename TypeSelect<S>::peers_type> rl(peers);
 
-    servers = ngx_array_create(pool, 100, sizeof(ngx_str_t));
+    servers = ngx_array_create(job->pool, 100, sizeof(ngx_str_t));
     if (servers == NULL)
         goto nomem;
 
@@ -737,8 +3831,9 @@ ngx_http_dynamic_upstream_save(S *uscf, ngx_str_t file)
              peer != NULL;
              peer = peer->next) {
 
-            if (not_resolved<S>(peer))
-                continue;
+            // the placeholder of a hostname is saved by the name, to be
+            // resolved again after the restart. Down and draining peers
+            // are saved down, the placeholder is down until resolved
 
             for (i = 0; i < servers->nelts; i++)
                 if (ngx_memn2cmp(peer->server.data, server[i].data,
@@ -751,49 +3846,153 @@ ngx_http_dynamic_upstream_save(S *uscf, ngx_str_t file)
                 if (s == NULL)
                     goto nomem;
                 *s = peer->server;
-                c = ngx_snprintf(srv, 10240,
-                    "server %V max_conns=%d max_fails=%d fail_timeout=%d "
-                    "weight=%d",
-                    &peer->server, peer->max_conns, peer->max_fails,
-                    peer->fail_timeout, peer->weight);
-                fwrite(srv, c - srv, 1, f);
-                if (j == 1)
-                    fwrite(" backup", 7, 1, f);
-                fwrite(";\n", 2, 1, f);
+                if (ngx_dynamic_upstream_printf(&out,
+                        "server %V"
+#if defined(nginx_version) && (nginx_version >= 1011005)
+                        " max_conns=%d"
+#endif
+                        " max_fails=%d fail_timeout=%d weight=%d%s%s;\n",
+                        &peer->server,
+#if defined(nginx_version) && (nginx_version >= 1011005)
+                        peer->max_conns,
+#endif
+                        peer->max_fails, peer->fail_timeout, peer->weight,
+                        peer->down && !is_reserved_addr(&peer->name)
+                            ? " down" : "",
+                        j == 1 ? " backup" : "") == NGX_ERROR)
+                    goto nomem;
             }
         }
     }
 
-    if (ftell(f) == 0)
-        fwrite(default_server.data, default_server.len, 1, f);
-
-end:
-
-    fclose(f);
+    if (out.size == 0
+        && ngx_dynamic_upstream_printf(&out, "%V", &default_server)
+               == NGX_ERROR)
+        goto nomem;
 
-    ngx_destroy_pool(pool);
+    job->text = out.out;
+    job->file = file;
+    job->run = ngx_dynamic_upstream_save_run;
 
     return;
 
 nomem:
 
+    // the job is left to free the pool
+
     ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
                   "dynamic upstream: no memory");
-    goto end;
+}
+
+
+static ngx_event_t                  ngx_dynamic_upstream_ev;
+static ngx_connection_t             ngx_dynamic_upstream_conn;
+static ngx_uint_t                   ngx_dynamic_upstream_busy;  // jobs
+static ngx_dynamic_upstream_job_t  *ngx_dynamic_upstream_next;
+static ngx_dynamic_upstream_job_t **ngx_dynamic_upstream_last =
+    &ngx_dynamic_upstream_next;
+
+#if (NGX_THREADS)
+static ngx_thread_pool_t           *ngx_dynamic_upstream_tp;
+#else
+static pthread_t                    ngx_dynamic_upstream_thr;
+static pthread_mutex_t              ngx_dynamic_upstream_mtx =
+    PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t               ngx_dynamic_upstream_cond =
+    PTHREAD_COND_INITIALIZER;
+static ngx_dynamic_upstream_job_t  *ngx_dynamic_upstream_posted;
+static ngx_dynamic_upstream_job_t  *ngx_dynamic_upstream_ready;
+static ngx_flag_t                   ngx_dynamic_upstream_stop;
+#endif
+
+
+// jobs queued by the completion handler go to the next batch
+
+static ngx_dynamic_upstream_job_t ***
+ngx_dynamic_upstream_pending()
+{
+    return &ngx_dynamic_upstream_last;
+}
+
+
+// the servers are resolved by the job, the peers are synced with them
+// on the event loop
+
+template <class S> static void
+ngx_dynamic_upstream_sync_run(ngx_dynamic_upstream_job_t *job)
+{
+    struct timeval  start;
+
+    ngx_gettimeofday(&start);
+
+    job->rc = ngx_dynamic_upstream_do_op<S>(ngx_cycle->log, &job->op,
+                                            job->uscf);
+
+    job->elapsed = ngx_dynamic_upstream_elapsed(&start);
+}
+
+
+template <class S> static void
+ngx_dynamic_upstream_sync_done(ngx_dynamic_upstream_job_t *job)
+{
+    S                                *uscf = (S *) job->uscf;
+    ngx_dynamic_upstream_op_t        *op = &job->op;
+    ngx_dynamic_upstream_srv_conf_t  *dscf = srv_conf(uscf);
+    ngx_dynamic_upstream_metrics_t   *m;
+    ngx_int_t                         rc = job->rc;
+
+    if (job->resolve && (m = ngx_dynamic_upstream_get_metrics(uscf)) != NULL)
+        ngx_dynamic_upstream_hist_observe(&m->dns_sync, job->elapsed);
+
+    if (rc == NGX_OK) {
+
+        // servers changed while resolved are synced by the next pass
+
+        op->op = NGX_DYNAMIC_UPSTEAM_OP_SYNC;
+        op->lock_stat = NULL;
+        op->resolve_failed = 0;   // counted by the resolve
+
+        rc = ngx_dynamic_upstream_do_op<S>(ngx_cycle->log, op, uscf);
+    }
+
+    if (rc == NGX_OK) {
+
+        // names failed to resolve are backing off in dns
+
+        if (dscf->dns == NULL || dscf->dns->pool == NULL)
+            dscf->unresolved = 0;
+
+        if (op->status == NGX_HTTP_OK)
+            ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
+                          "%V: dns synced", &op->upstream);
+
+    } else if (op->status == NGX_HTTP_INTERNAL_SERVER_ERROR)
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "%V: %s",
+                      &op->upstream, op->err);
+
+    if (rc != NGX_OK || job->old_hash == op->hash)
+        return;
+
+    if (dscf->file.data != NULL)
+        ngx_http_dynamic_upstream_save(uscf, dscf->file,
+                                       ngx_dynamic_upstream_pending());
+
+    dscf->hash = op->hash;
 }
 
 
 template <class M, class S> void
-ngx_dynamic_upstream_loop()
+ngx_dynamic_upstream_loop(ngx_dynamic_upstream_job_t ***last)
 {
     M                                *umcf = NULL;
     S                               **uscf = NULL;
     ngx_dynamic_upstream_op_t         op;
     ngx_uint_t                        j;
     ngx_dynamic_upstream_srv_conf_t  *dscf;
-    time_t                            now = 0;
+    ngx_dynamic_upstream_job_t       *job;
+    time_t                            now = ngx_time();
     ngx_core_conf_t                  *ccf;
-    ngx_uint_t                        old_hash;
+    ngx_flag_t                        resolve;
 
     ccf = (ngx_core_conf_t *) ngx_get_conf(ngx_cycle->conf_ctx,
                                            ngx_core_module);
@@ -811,11 +4010,29 @@ ngx_dynamic_upstream_loop()
         if (uscf[j]->srv_conf == NULL || uscf[j]->shm_zone == NULL)
             continue;
 
+        dscf = srv_conf(uscf[j]);
+
+        // the peers of the upstream are spread over the workers
+
+        if (dscf->check != NULL && last != NULL)
+            ngx_dynamic_upstream_check(uscf[j], dscf, last);
+
         if (ngx_process == NGX_PROCESS_WORKER
             && j % ccf->worker_processes != ngx_worker)
             continue;
 
-        dscf = srv_conf(uscf[j]);
+        ngx_dynamic_upstream_drain(uscf[j]);
+
+        if (dscf->slow_start > 0)
+            ngx_dynamic_upstream_slow_start(uscf[j], dscf);
+
+        if (dscf->outlier != NULL)
+            ngx_dynamic_upstream_outlier(uscf[j], dscf);
+
+        // the jobs of the previous pass are not completed yet
+
+        if (last == NULL)
+            continue;
 
         ngx_memzero(&op, sizeof(ngx_dynamic_upstream_op_t));
 
@@ -824,7 +4041,7 @@ ngx_dynamic_upstream_loop()
 
         TypeSelect<S>::make_op(&op);
 
-        old_hash = op.hash = dscf->hash;
+        op.hash = dscf->hash;
 
         if (dscf->interval == NGX_CONF_UNSET_MSEC) {
 
@@ -832,98 +4049,342 @@ ngx_dynamic_upstream_loop()
 
                 op.op = NGX_DYNAMIC_UPSTEAM_OP_HASH;
                 if (ngx_dynamic_upstream_do_op<S>(ngx_cycle->log, &op, uscf[j])
-                        == NGX_DECLINED)
-                    goto save;
+                        == NGX_DECLINED) {
+
+                    ngx_http_dynamic_upstream_save(uscf[j], dscf->file, last);
+                    dscf->hash = op.hash;
+                }
             }
 
-            continue;
-        }
+            // hostnames of the state file are resolved after the start
 
-        time(&now);
+            if (!dscf->unresolved)
+                continue;
+
+            resolve = 1;
+            op.hash = dscf->hash;
 
-        if (dscf->last + (time_t) dscf->interval <= now) {
+        } else if (dscf->last + (time_t) dscf->interval <= now) {
 
-            dscf->hash = 0;
+            resolve = 1;
             dscf->last = now;
+
+        } else {
+
+            // servers added or removed by api are resolved at once
+
+            resolve = 0;
+
+            op.op = NGX_DYNAMIC_UPSTEAM_OP_HASH;
+            if (ngx_dynamic_upstream_do_op<S>(ngx_cycle->log, &op, uscf[j])
+                    != NGX_DECLINED)
+                continue;
+
+            op.hash = dscf->hash;
+        }
+
+        if (dscf->dns == NULL) {
+
+            dscf->dns = (ngx_dynamic_upstream_dns_t *)
+                ngx_calloc(sizeof(ngx_dynamic_upstream_dns_t),
+                           ngx_cycle->log);
+
+            if (dscf->dns != NULL) {
+
+                dscf->dns->interval =
+                    dscf->interval != NGX_CONF_UNSET_MSEC
+                        ? (time_t) dscf->interval : 1;
+                dscf->dns->max_backoff =
+                    dscf->dns_max_backoff != NGX_CONF_UNSET
+                        ? dscf->dns_max_backoff
+                        : NGX_DYNAMIC_UPSTREAM_DNS_MAX_BACKOFF;
+                dscf->dns->max_stale =
+                    dscf->dns_max_stale != NGX_CONF_UNSET
+                        ? dscf->dns_max_stale : 0;
+
+                if (dscf->dns_hold_count != NGX_CONF_UNSET_UINT) {
+
+                    dscf->dns->hold_count = dscf->dns_hold_count;
+                    dscf->dns->hold_time = dscf->dns_hold_time;
+                }
+
+                if (dscf->dns_subset != NGX_CONF_UNSET_UINT) {
+
+                    dscf->dns->subset = dscf->dns_subset;
+                    dscf->dns->subset_id = dscf->dns_subset_id;
+
+                    if (dscf->dns_subset_id.data == NULL) {
+
+                        dscf->dns->subset_id.data = ngx_cycle->hostname.data;
+                        dscf->dns->subset_id.len = ngx_cycle->hostname.len;
+                    }
+                }
+
+                dscf->dns->srv_resolver = dscf->dns_srv_resolver;
+            }
+        }
+
+        job = ngx_dynamic_upstream_job(last, 4096);
+        if (job == NULL) {
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                          "dynamic upstream: no memory");
+            continue;
         }
 
-        op.op = NGX_DYNAMIC_UPSTEAM_OP_SYNC;
-        op.upstream = uscf[j]->host;
-        op.op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_RESOLVE_SYNC;
+        job->run = ngx_dynamic_upstream_sync_run<S>;
+        job->done = ngx_dynamic_upstream_sync_done<S>;
+        job->uscf = uscf[j];
+        job->old_hash = dscf->hash;
+        job->resolve = resolve;
+
+        job->op = op;
+        job->op.op = NGX_DYNAMIC_UPSTEAM_OP_RESOLVE;
+        job->op.upstream = uscf[j]->host;
+        job->op.op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_RESOLVE_SYNC;
+        job->op.dns = dscf->dns;
+        job->op.pool = job->pool;
+        job->op.now = now;
         if (dscf->ipv6 == 1)
-            op.op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_IPV6;
+            job->op.op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_IPV6;
         if (dscf->add_down != NGX_CONF_UNSET && dscf->add_down) {
 
-            op.op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN;
-            op.down = 1;
+            job->op.op_param |= NGX_DYNAMIC_UPSTEAM_OP_PARAM_DOWN;
+            job->op.down = 1;
         }
+    }
+}
+
 
-        ngx_time_update();
+static void
+ngx_dynamic_upstream_job_run(void *data, ngx_log_t *log)
+{
+    ngx_dynamic_upstream_job_t  *job = (ngx_dynamic_upstream_job_t *) data;
 
-        if (ngx_dynamic_upstream_do_op<S>(ngx_cycle->log, &op, uscf[j])
-                == NGX_OK) {
+    if (job->run != NULL)
+        job->run(job);
+}
 
-            if (op.status == NGX_HTTP_OK)
-                ngx_log_error(NGX_LOG_INFO, ngx_cycle->log, 0,
-                              "%V: dns synced", &op.upstream);
 
-        } else if (op.status == NGX_HTTP_INTERNAL_SERVER_ERROR)
-            ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, 0, "%V: %s",
-                          &op.upstream, op.err);
+static void
+ngx_dynamic_upstream_job_done(ngx_dynamic_upstream_job_t *job)
+{
+    if (job->done != NULL)
+        job->done(job);
 
-save:
+    if (job->pool != NULL)
+        ngx_destroy_pool(job->pool);
+}
 
-        if (old_hash != op.hash) {
 
-            if (dscf->file.data != NULL)
-                ngx_http_dynamic_upstream_save(uscf[j], dscf->file);
+#if (NGX_THREADS)
 
-            dscf->hash = op.hash;
-        }
+static void
+ngx_dynamic_upstream_job_event(ngx_event_t *ev)
+{
+    ngx_dynamic_upstream_busy--;
+
+    ngx_dynamic_upstream_job_done((ngx_dynamic_upstream_job_t *) ev->data);
+}
+
+#else
+
+// background thread of the worker, runs the posted batch and leaves it
+// to the timer
+
+static void *
+ngx_dynamic_upstream_thread(void *)
+{
+    ngx_dynamic_upstream_job_t  *batch, *job;
+
+    pthread_mutex_lock(&ngx_dynamic_upstream_mtx);
+
+    for ( ;; ) {
+
+        while (ngx_dynamic_upstream_posted == NULL
+               && !ngx_dynamic_upstream_stop)
+            pthread_cond_wait(&ngx_dynamic_upstream_cond,
+                              &ngx_dynamic_upstream_mtx);
+
+        if (ngx_dynamic_upstream_stop)
+            break;
+
+        batch = ngx_dynamic_upstream_posted;
+        ngx_dynamic_upstream_posted = NULL;
+
+        pthread_mutex_unlock(&ngx_dynamic_upstream_mtx);
+
+        for (job = batch; job != NULL; job = job->next)
+            ngx_dynamic_upstream_job_run(job, ngx_cycle->log);
+
+        pthread_mutex_lock(&ngx_dynamic_upstream_mtx);
+
+        ngx_dynamic_upstream_ready = batch;
     }
+
+    pthread_mutex_unlock(&ngx_dynamic_upstream_mtx);
+
+    return NULL;
 }
 
 
-static volatile pthread_t
-DNS_sync_thr = 0;
+// the completed batch is taken back on the event loop
 
+static void
+ngx_dynamic_upstream_batch_done()
+{
+    ngx_dynamic_upstream_job_t  *job, *next;
 
-static void *
-ngx_http_dynamic_upstream_thread(void *)
+    pthread_mutex_lock(&ngx_dynamic_upstream_mtx);
+
+    job = ngx_dynamic_upstream_ready;
+    ngx_dynamic_upstream_ready = NULL;
+
+    pthread_mutex_unlock(&ngx_dynamic_upstream_mtx);
+
+    for (/* void */; job != NULL; job = next) {
+
+        next = job->next;
+
+        ngx_dynamic_upstream_busy--;
+
+        ngx_dynamic_upstream_job_done(job);
+    }
+}
+
+#endif
+
+
+// with thread pools every job is a task of its own, the jobs of a batch
+// run in parallel; without them the batch goes to the background thread
+
+static void
+ngx_dynamic_upstream_batch_post()
 {
-    unsigned j;
+    ngx_dynamic_upstream_job_t  *job, *next;
+
+#if (NGX_THREADS)
+    ngx_thread_task_t           *task;
+#endif
+
+    job = ngx_dynamic_upstream_next;
+
+    ngx_dynamic_upstream_next = NULL;
+    ngx_dynamic_upstream_last = &ngx_dynamic_upstream_next;
+
+#if (NGX_THREADS)
+
+    for (/* void */; job != NULL; job = next) {
+
+        next = job->next;
 
-    while (DNS_sync_thr) {
-        ngx_dynamic_upstream_loop<ngx_http_upstream_main_conf_t,
-                                  ngx_http_upstream_srv_conf_t>();
+        if (ngx_dynamic_upstream_tp != NULL
+            && (task = ngx_thread_task_alloc(job->pool, 0)) != NULL) {
 
-        ngx_dynamic_upstream_loop<ngx_stream_upstream_main_conf_t,
-                                  ngx_stream_upstream_srv_conf_t>();
+            task->ctx = job;
+            task->handler = ngx_dynamic_upstream_job_run;
+            task->event.handler = ngx_dynamic_upstream_job_event;
+            task->event.data = job;
+            task->event.log = ngx_cycle->log;
 
-        for (j = 0; j < 10 && DNS_sync_thr; j++)
-            ngx_msleep(100);
+            if (ngx_thread_task_post(ngx_dynamic_upstream_tp, task) == NGX_OK) {
+                ngx_dynamic_upstream_busy++;
+                continue;
+            }
+        }
+
+        // dropped, the next pass makes the job again
+
+        ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                      "dynamic upstream: background job not posted");
+
+        ngx_destroy_pool(job->pool);
     }
 
-    return 0;
+#else
+
+    if (job == NULL)
+        return;
+
+    for (next = job; next != NULL; next = next->next)
+        ngx_dynamic_upstream_busy++;
+
+    pthread_mutex_lock(&ngx_dynamic_upstream_mtx);
+
+    ngx_dynamic_upstream_posted = job;
+    pthread_cond_signal(&ngx_dynamic_upstream_cond);
+
+    pthread_mutex_unlock(&ngx_dynamic_upstream_mtx);
+
+#endif
+}
+
+
+static void
+ngx_dynamic_upstream_tick(ngx_event_t *ev)
+{
+    ngx_dynamic_upstream_job_t  ***last = NULL;
+
+    if (ngx_exiting || ngx_terminate || ngx_quit)
+        return;
+
+#if !(NGX_THREADS)
+    ngx_dynamic_upstream_batch_done();
+#endif
+
+    if (ngx_dynamic_upstream_busy == 0)
+        last = &ngx_dynamic_upstream_last;
+
+    ngx_dynamic_upstream_loop<ngx_http_upstream_main_conf_t,
+                              ngx_http_upstream_srv_conf_t>(last);
+
+    ngx_dynamic_upstream_loop<ngx_stream_upstream_main_conf_t,
+                              ngx_stream_upstream_srv_conf_t>(last);
+
+    if (ngx_dynamic_upstream_busy == 0)
+        ngx_dynamic_upstream_batch_post();
+
+    ngx_add_timer(ev, 1000);
 }
 
 
 static ngx_int_t
 ngx_http_dynamic_upstream_init_worker(ngx_cycle_t *cycle)
 {
+#if (NGX_THREADS)
+    static ngx_str_t  default_pool = ngx_string("default");
+#endif
+
     if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE)
         return NGX_OK;
 
-    if (pthread_create((pthread_t *) &DNS_sync_thr, NULL,
-        ngx_http_dynamic_upstream_thread, NULL) != 0) {
+#if (NGX_THREADS)
 
-        ngx_log_error(NGX_LOG_CRIT, cycle->log, 0,
-                      "errno=%d, %s", errno, strerror(errno));
+    ngx_dynamic_upstream_tp = ngx_thread_pool_get(cycle, &default_pool);
+
+#else
+
+    ngx_dynamic_upstream_stop = 0;
+
+    if (pthread_create(&ngx_dynamic_upstream_thr, NULL,
+                       ngx_dynamic_upstream_thread, NULL) != 0) {
+
+        ngx_log_error(NGX_LOG_CRIT, cycle->log, ngx_errno,
+                      "dynamic upstream: background thread not started");
         return NGX_ERROR;
     }
 
-    ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
-                  "dynamic upstream: background thread started");
+#endif
+
+    ngx_memzero(&ngx_dynamic_upstream_ev, sizeof(ngx_event_t));
+    ngx_memzero(&ngx_dynamic_upstream_conn, sizeof(ngx_connection_t));
+
+    ngx_dynamic_upstream_conn.fd = -1;
+    ngx_dynamic_upstream_ev.handler = ngx_dynamic_upstream_tick;
+    ngx_dynamic_upstream_ev.data = &ngx_dynamic_upstream_conn;
+    ngx_dynamic_upstream_ev.log = cycle->log;
+    ngx_dynamic_upstream_ev.cancelable = 1;
+
+    ngx_add_timer(&ngx_dynamic_upstream_ev, 1000);
 
     return NGX_OK;
 }
@@ -932,17 +4393,24 @@ ngx_http_dynamic_upstream_init_worker(ngx_cycle_t *cycle)
 static void
 ngx_http_dynamic_upstream_exit_worker(ngx_cycle_t *cycle)
 {
-    pthread_t saved = DNS_sync_thr;
-
     if (ngx_process != NGX_PROCESS_WORKER && ngx_process != NGX_PROCESS_SINGLE)
         return;
 
-    if (DNS_sync_thr) {
+    if (ngx_dynamic_upstream_ev.timer_set)
+        ngx_del_timer(&ngx_dynamic_upstream_ev);
 
-        DNS_sync_thr = 0;
-        pthread_join(saved, NULL);
+#if !(NGX_THREADS)
 
-        ngx_log_error(NGX_LOG_NOTICE, cycle->log, 0,
-                      "dynamic upstream: background thread stopped");
-    }
+    // a job in flight is finished, its result is not applied
+
+    pthread_mutex_lock(&ngx_dynamic_upstream_mtx);
+
+    ngx_dynamic_upstream_stop = 1;
+    pthread_cond_signal(&ngx_dynamic_upstream_cond);
+
+    pthread_mutex_unlock(&ngx_dynamic_upstream_mtx);
+
+    pthread_join(ngx_dynamic_upstream_thr, NULL);
+
+#endif
 }
@@ -0,0 +1,97 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: list all
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+    upstream frontends {
+        zone zone_for_frontends 128k;
+        server 127.0.0.1:7001;
+        server 127.0.0.1:7002 backup;
+    }
+--- stream_config
+    upstream backends_stream {
+        zone zone_for_backends_stream 128k;
+        server 127.0.0.1:6003;
+    }
+--- stream_server_config
+    proxy_pass backends_stream;
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?all=
+--- response_body
+upstream backends {
+    server 127.0.0.1:6001 addr=127.0.0.1:6001;
+    server 127.0.0.1:6002 addr=127.0.0.1:6002;
+}
+upstream frontends {
+    server 127.0.0.1:7001 addr=127.0.0.1:7001;
+    server 127.0.0.1:7002 addr=127.0.0.1:7002 backup;
+}
+stream upstream backends_stream {
+    server 127.0.0.1:6003 addr=127.0.0.1:6003;
+}
+
+
+=== TEST 2: list all by prefix
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+    upstream frontends {
+        zone zone_for_frontends 128k;
+        server 127.0.0.1:7001;
+    }
+--- stream_config
+    upstream backends_stream {
+        zone zone_for_backends_stream 128k;
+        server 127.0.0.1:6003;
+    }
+--- stream_server_config
+    proxy_pass backends_stream;
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?all=&prefix=back&verbose=
+--- response_body
+upstream backends {
+    server 127.0.0.1:6001 addr=127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+    server 127.0.0.1:6002 addr=127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+}
+stream upstream backends_stream {
+    server 127.0.0.1:6003 addr=127.0.0.1:6003 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+}
+
+
+=== TEST 3: modify all is not allowed
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?all=&server=127.0.0.1:6001&down=
+--- response_body_like: only list is allowed for all upstreams
+--- error_code: 400
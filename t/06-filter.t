@@ -0,0 +1,133 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: filter by state
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 down;
+        server 127.0.0.1:6003;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=backends&state=down
+--- response_body
+server 127.0.0.1:6002 addr=127.0.0.1:6002 down;
+
+
+=== TEST 2: filter backup
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 backup;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=backends&backup=
+--- response_body
+server 127.0.0.1:6002 addr=127.0.0.1:6002 backup;
+
+
+=== TEST 3: filter primary
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 backup;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=backends&primary=
+--- response_body
+server 127.0.0.1:6001 addr=127.0.0.1:6001;
+
+
+=== TEST 4: filter by server prefix and cidr
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.2:6001;
+        server 127.0.0.2:6002;
+        server 127.0.0.3:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=backends&match=127.0.0&cidr=127.0.0.2/32,127.0.0.3/32
+--- response_body
+server 127.0.0.2:6001 addr=127.0.0.2:6001;
+server 127.0.0.2:6002 addr=127.0.0.2:6002;
+server 127.0.0.3:6001 addr=127.0.0.3:6001;
+
+
+=== TEST 5: first page
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=backends&limit=2
+--- response_body
+server 127.0.0.1:6001 addr=127.0.0.1:6001;
+server 127.0.0.1:6002 addr=127.0.0.1:6002;
+
+
+=== TEST 6: next page
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=backends&limit=2&cursor=2-0
+--- response_body
+server 127.0.0.1:6003 addr=127.0.0.1:6003;
+
+
+=== TEST 7: invalid cursor
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=backends&cursor=abc
+--- response_body_like: cursor: invalid value
+--- error_code: 400
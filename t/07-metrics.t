@@ -0,0 +1,88 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: peer metrics
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001 weight=2;
+        server 127.0.0.1:6002 down;
+        server 127.0.0.1:6003 backup;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?metrics=
+--- response_body_like
+# TYPE nginx_dynamic_upstream_peer_conns gauge
+nginx_dynamic_upstream_peer_conns\{type="http",upstream="backends",server="127.0.0.1:6001",addr="127.0.0.1:6001",backup="0"\} 0
+nginx_dynamic_upstream_peer_conns\{type="http",upstream="backends",server="127.0.0.1:6002",addr="127.0.0.1:6002",backup="0"\} 0
+nginx_dynamic_upstream_peer_conns\{type="http",upstream="backends",server="127.0.0.1:6003",addr="127.0.0.1:6003",backup="1"\} 0
+(.|\n)*nginx_dynamic_upstream_peer_down\{type="http",upstream="backends",server="127.0.0.1:6002",addr="127.0.0.1:6002",backup="0"\} 1
+(.|\n)*nginx_dynamic_upstream_peer_weight\{type="http",upstream="backends",server="127.0.0.1:6001",addr="127.0.0.1:6001",backup="0"\} 2
+(.|\n)*nginx_dynamic_upstream_zone_size_bytes\{type="http",upstream="backends",zone="zone_for_backends"\} \d+
+(.|\n)*nginx_dynamic_upstream_zone_free_bytes\{type="http",upstream="backends",zone="zone_for_backends"\} \d+
+
+
+=== TEST 2: stream upstream metrics
+--- stream_config
+    upstream backends_stream {
+        zone zone_for_backends_stream 128k;
+        server 127.0.0.1:6001;
+    }
+--- stream_server_config
+    proxy_pass backends_stream;
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?metrics=
+--- response_body_like
+nginx_dynamic_upstream_dns_sync_seconds_bucket\{type="stream",upstream="backends_stream",le="0.000010"\} 0
+(.|\n)*nginx_dynamic_upstream_dns_sync_seconds_count\{type="stream",upstream="backends_stream"\} 0
+(.|\n)*nginx_dynamic_upstream_trash_peers 0
+
+
+=== TEST 3: lock metrics
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_lock_stats on;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?metrics=
+--- response_body_like
+# TYPE nginx_dynamic_upstream_lock_wait_seconds histogram
+(.|\n)*nginx_dynamic_upstream_lock_wait_seconds_count\{type="http",upstream="backends",op="add"\} 0
+(.|\n)*nginx_dynamic_upstream_lock_hold_seconds_count\{type="http",upstream="backends",op="sync"\} 0
+
+
+=== TEST 4: label values escaped
+--- http_config
+    upstream "back\"end\\s" {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?metrics=
+--- response_body_like
+nginx_dynamic_upstream_peer_conns\{type="http",upstream="back\\"end\\\\s",server="127.0.0.1:6001",addr="127.0.0.1:6001",backup="0"\} 0
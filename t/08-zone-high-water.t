@@ -0,0 +1,60 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: add below high water mark
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_zone_high_water 90;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=backends&add=&server=127.0.0.1:6002
+--- response_body
+server 127.0.0.1:6001 addr=127.0.0.1:6001;
+server 127.0.0.1:6002 addr=127.0.0.1:6002;
+
+
+=== TEST 2: add above high water mark
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_zone_high_water 1;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=backends&add=&server=127.0.0.1:6002
+--- response_body_like: zone high water mark exceeded
+--- error_code: 507
+
+
+=== TEST 3: zone metrics
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?metrics=
+--- response_body_like
+nginx_dynamic_upstream_zone_largest_free_bytes\{type="http",upstream="backends",zone="zone_for_backends"\} \d+
+(.|\n)*nginx_dynamic_upstream_zone_alloc_failures_total\{type="http",upstream="backends"\} 0
+(.|\n)*nginx_dynamic_upstream_zone_refused_total\{type="http",upstream="backends"\} 0
@@ -0,0 +1,165 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: replace
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+PUT /dynamic?upstream=backends
+server 127.0.0.1:6002 weight=5;
+server 127.0.0.1:6004 max_fails=3 fail_timeout=30s;
+--- response_body
+server 127.0.0.1:6002 addr=127.0.0.1:6002 weight=5 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+server 127.0.0.1:6004 addr=127.0.0.1:6004 weight=1 max_fails=3 fail_timeout=30 max_conns=0 conns=0;
+
+
+=== TEST 2: replace with the same servers
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 weight=2;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+PUT /dynamic?upstream=backends
+# comments are allowed
+server 127.0.0.1:6001;
+server 127.0.0.1:6002 weight=2;
+--- error_code: 304
+--- response_body
+
+
+=== TEST 3: replace moves server to backup
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+PUT /dynamic?upstream=backends
+server 127.0.0.1:6001; server 127.0.0.1:6002 backup down;
+--- response_body
+server 127.0.0.1:6001 addr=127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+server 127.0.0.1:6002 addr=127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0 down backup;
+
+
+=== TEST 4: replace with nothing
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+PUT /dynamic?upstream=backends
+--- response_body
+server 0.0.0.0:1 addr=0.0.0.0:1 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0 down;
+
+
+=== TEST 5: replace with unknown parameter
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+PUT /dynamic?upstream=backends
+server 127.0.0.1:6001 slow=1;
+--- response_body_like: unknown parameter "slow=1", weight, max_fails, fail_timeout, max_conns, backup and down are expected
+--- error_code: 400
+
+
+=== TEST 6: replace with domain name without dns_update
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+PUT /dynamic?upstream=backends
+server localhost:6001;
+--- response_body_like: domain names are supported only for upstreams with 'dns_update' directive
+--- error_code: 400
+
+
+=== TEST 7: replace keeps the peers of a known domain name up
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dns_update 1s;
+        server localhost:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          for i = 1, 2 do
+             assert(ngx.location.capture("/dynamic?upstream=backends", {
+                method = ngx.HTTP_PUT,
+                body = "server localhost:6001;\n"
+             }))
+          end
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          ngx.print(resp.body)
+       }
+    }
+--- request
+    GET /test
+--- response_body
+server localhost:6001 addr=127.0.0.1:6001;
+
+
+
+=== TEST 8: replace with invalid value
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+PUT /dynamic?upstream=backends
+server 127.0.0.1:6001 max_fails=x;
+--- response_body_like: invalid parameter "max_fails=x"
+--- error_code: 400
@@ -0,0 +1,115 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 3 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: slow start of added peer
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        slow_start 30s;
+        server 127.0.0.1:6001 weight=10;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          ngx.sleep(2)
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6002&weight=10&add=&verbose="))
+          ngx.sleep(2)
+          resp = assert(ngx.location.capture("/dynamic?upstream=backends&verbose="))
+          ngx.print(resp.body)
+       }
+    }
+--- request
+    GET /test
+--- response_body_like
+server 127.0.0.1:6001 addr=127.0.0.1:6001 weight=10 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+server 127.0.0.1:6002 addr=127.0.0.1:6002 weight=10 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+--- error_log
+slow start peer 127.0.0.1:6002
+--- timeout: 10
+
+
+=== TEST 2: slow start after up
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        slow_start 30s;
+        server 127.0.0.1:6001 weight=10;
+        server 127.0.0.1:6002 weight=10;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6002&down="))
+          ngx.sleep(2)
+          resp = assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6002&up="))
+          ngx.sleep(2)
+          resp = assert(ngx.location.capture("/dynamic?upstream=backends&verbose="))
+          ngx.print(resp.body)
+       }
+    }
+--- request
+    GET /test
+--- response_body_like
+server 127.0.0.1:6001 addr=127.0.0.1:6001 weight=10 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+server 127.0.0.1:6002 addr=127.0.0.1:6002 weight=10 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+--- error_log
+slow start peer 127.0.0.1:6002
+--- timeout: 10
+
+
+=== TEST 3: ramped peer gets the share of the ramped weight
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        slow_start 30s;
+        server 127.0.0.1:6001 weight=10;
+    }
+    server {
+        listen 6001;
+        return 200 A;
+    }
+    server {
+        listen 6002;
+        return 200 B;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /proxy {
+        proxy_pass http://backends/;
+    }
+    location /test {
+       content_by_lua_block {
+          ngx.sleep(2)
+          assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6002&weight=10&add="))
+          ngx.sleep(2)
+          -- weight 1 of 11 in the first seconds of the ramp
+          local b = 0
+          for i = 1, 110 do
+             if assert(ngx.location.capture("/proxy")).body == "B" then
+                b = b + 1
+             end
+          end
+          ngx.say(b >= 5 and b <= 15 and "ramped" or "not ramped " .. b)
+       }
+    }
+--- request
+    GET /test
+--- response_body
+ramped
+--- error_log
+slow start peer 127.0.0.1:6002
+--- timeout: 10
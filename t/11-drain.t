@@ -0,0 +1,113 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: drain
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6003&drain=30s"))
+          ngx.print(resp.body)
+          ngx.sleep(2)
+          resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          ngx.print(resp.body)
+       }
+    }
+--- request
+    GET /test
+--- response_body
+server 127.0.0.1:6001 addr=127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+server 127.0.0.1:6002 addr=127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+server 127.0.0.1:6003 addr=127.0.0.1:6003 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0 draining;
+server 127.0.0.1:6001 addr=127.0.0.1:6001;
+server 127.0.0.1:6002 addr=127.0.0.1:6002;
+--- timeout: 5
+
+
+=== TEST 2: drain with up or down
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6002&drain=&up="))
+          ngx.say(resp.status)
+          resp = assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6002&drain=&down="))
+          ngx.say(resp.status)
+       }
+    }
+--- request
+    GET /test
+--- response_body
+400
+400
+
+
+=== TEST 3: drain with invalid time
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=backends&server=127.0.0.1:6001&drain=abc
+--- error_code: 400
+--- response_body_like: drain: invalid time
+
+
+=== TEST 4: down cancels the drain
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6002&drain=30s"))
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          ngx.print(resp.body)
+          assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6002&down="))
+          ngx.sleep(2)
+          resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          ngx.print(resp.body)
+       }
+    }
+--- request
+    GET /test
+--- response_body
+server 127.0.0.1:6001 addr=127.0.0.1:6001;
+server 127.0.0.1:6002 addr=127.0.0.1:6002 draining;
+server 127.0.0.1:6001 addr=127.0.0.1:6001;
+server 127.0.0.1:6002 addr=127.0.0.1:6002 down;
+--- timeout: 5
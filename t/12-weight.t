@@ -0,0 +1,111 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: selection after weight update
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001 weight=2;
+        server 127.0.0.1:6002 weight=2;
+        server 127.0.0.1:6003 weight=2;
+    }
+    server {
+        listen 6001;
+        return 200 A;
+    }
+    server {
+        listen 6002;
+        return 200 B;
+    }
+    server {
+        listen 6003;
+        return 200 C;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /proxy {
+        proxy_pass http://backends/;
+    }
+    location /test {
+       content_by_lua_block {
+          local function picks(n)
+             local s = ""
+             for i = 1, n do
+                s = s .. assert(ngx.location.capture("/proxy")).body
+             end
+             return s
+          end
+          ngx.say(picks(5))
+          assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6003&weight=6"))
+          ngx.say(picks(10))
+          assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6003&weight=2"))
+          ngx.say(picks(6))
+       }
+    }
+--- request
+    GET /test
+--- response_body
+ABCAB
+CACBCCACBC
+ABCABC
+
+
+=== TEST 2: selection after replace
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001 weight=2;
+        server 127.0.0.1:6002 weight=2;
+        server 127.0.0.1:6003 weight=2;
+    }
+    server {
+        listen 6001;
+        return 200 A;
+    }
+    server {
+        listen 6002;
+        return 200 B;
+    }
+    server {
+        listen 6003;
+        return 200 C;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /proxy {
+        proxy_pass http://backends/;
+    }
+    location /replace {
+        proxy_pass http://127.0.0.1:$server_port/dynamic?upstream=backends;
+        proxy_method PUT;
+        proxy_set_body "server 127.0.0.1:6001 weight=2; server 127.0.0.1:6002 weight=2; server 127.0.0.1:6003 weight=6;";
+    }
+    location /test {
+       content_by_lua_block {
+          local function picks(n)
+             local s = ""
+             for i = 1, n do
+                s = s .. assert(ngx.location.capture("/proxy")).body
+             end
+             return s
+          end
+          ngx.say(picks(5))
+          assert(ngx.location.capture("/replace"))
+          ngx.say(picks(10))
+       }
+    }
+--- request
+    GET /test
+--- response_body
+ABCAB
+CACBCCACBC
@@ -0,0 +1,63 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: consistent hash with added and removed peer
+--- http_config
+    upstream backends {
+        zone zone_for_backends 1m;
+        dynamic_hash $arg_key;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+    }
+    server {
+        listen 6001;
+        return 200 A;
+    }
+    server {
+        listen 6002;
+        return 200 B;
+    }
+    server {
+        listen 6003;
+        return 200 C;
+    }
+    server {
+        listen 6004;
+        return 200 D;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /proxy {
+        proxy_pass http://backends/;
+    }
+    location /test {
+       content_by_lua_block {
+          local function picks()
+             local s = ""
+             for i = 1, 20 do
+                s = s .. assert(ngx.location.capture("/proxy?key=k" .. i)).body
+             end
+             return s
+          end
+          ngx.say(picks())
+          assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6004&add="))
+          ngx.say(picks())
+          assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6004&remove="))
+          ngx.say(picks())
+       }
+    }
+--- request
+    GET /test
+--- response_body
+ACBCBBBCACACBAACBAAB
+ACBCBDBCADACBDACDDAB
+ACBCBBBCACACBAACBAAB
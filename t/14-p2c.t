@@ -0,0 +1,67 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: slow peer avoided, added peer tried
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_p2c;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+    server {
+        listen 6001;
+        location / {
+            content_by_lua_block {
+                ngx.sleep(0.05)
+                ngx.print("A")
+            }
+        }
+    }
+    server {
+        listen 6002;
+        return 200 B;
+    }
+    server {
+        listen 6003;
+        return 200 C;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /proxy {
+        proxy_pass http://backends/;
+    }
+    location /test {
+       content_by_lua_block {
+          local function picks(n)
+             local s = ""
+             for i = 1, n do
+                s = s .. assert(ngx.location.capture("/proxy")).body
+             end
+             return s
+          end
+          -- the first peer is random, the other one is tried next
+          local first = {}
+          for c in picks(10):gmatch(".") do
+             table.insert(first, c)
+          end
+          table.sort(first)
+          ngx.say(table.concat(first))
+          assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6002&remove="))
+          assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6003&add="))
+          ngx.say(picks(5))
+       }
+    }
+--- request
+    GET /test
+--- response_body
+ABBBBBBBBB
+CCCCC
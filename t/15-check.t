@@ -0,0 +1,86 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: http check
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_check interval=1s timeout=500ms rise=1 fall=1 uri=/health;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+        server 127.0.0.1:6003;
+    }
+    server {
+        listen 6001;
+        location /health {
+            return 200 ok;
+        }
+    }
+    server {
+        listen 6003;
+        location /health {
+            return 500;
+        }
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          ngx.sleep(2)
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          ngx.print(resp.body)
+       }
+    }
+--- request
+    GET /test
+--- response_body
+server 127.0.0.1:6001 addr=127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+server 127.0.0.1:6002 addr=127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0 down;
+server 127.0.0.1:6003 addr=127.0.0.1:6003 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0 down;
+--- timeout: 10
+
+
+=== TEST 2: tcp check keeps peer down by api
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_check interval=1s timeout=500ms rise=1 fall=1;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+    server {
+        listen 6001;
+        return 200 ok;
+    }
+    server {
+        listen 6002;
+        return 200 ok;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6002&down="))
+          assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6003&add="))
+          ngx.sleep(2)
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          ngx.print(resp.body)
+       }
+    }
+--- request
+    GET /test
+--- response_body
+server 127.0.0.1:6001 addr=127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+server 127.0.0.1:6002 addr=127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0 down;
+server 127.0.0.1:6003 addr=127.0.0.1:6003 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0 down;
+--- timeout: 10
@@ -0,0 +1,215 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: peer ejected by errors
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_outlier errors=3 eject_time=30s max_percent=50;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+    server {
+        listen 6001;
+        return 500;
+    }
+    server {
+        listen 6002;
+        return 200 B;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /proxy {
+        proxy_pass http://backends/;
+    }
+    location /test {
+       content_by_lua_block {
+          for i = 1, 10 do
+             assert(ngx.location.capture("/proxy"))
+          end
+          ngx.sleep(2)
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          ngx.print(resp.body)
+          local s = ""
+          for i = 1, 4 do
+             s = s .. assert(ngx.location.capture("/proxy")).body
+          end
+          ngx.say(s)
+       }
+    }
+--- request
+    GET /test
+--- response_body
+server 127.0.0.1:6001 addr=127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0 down;
+server 127.0.0.1:6002 addr=127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+BBBB
+--- timeout: 10
+
+
+=== TEST 2: ejection limited by max_percent
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_outlier errors=3;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+    server {
+        listen 6001;
+        return 500;
+    }
+    server {
+        listen 6002;
+        return 500;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /proxy {
+        proxy_pass http://backends/;
+    }
+    location /test {
+       content_by_lua_block {
+          for i = 1, 10 do
+             assert(ngx.location.capture("/proxy"))
+          end
+          ngx.sleep(2)
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          local _, n = string.gsub(resp.body, " down;", "")
+          ngx.say(n)
+       }
+    }
+--- request
+    GET /test
+--- response_body
+1
+--- timeout: 10
+
+
+=== TEST 3: peer changed by api not restored
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_outlier errors=3 eject_time=3s max_percent=50;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+    server {
+        listen 6001;
+        return 500;
+    }
+    server {
+        listen 6002;
+        return 200 B;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /proxy {
+        proxy_pass http://backends/;
+    }
+    location /test {
+       content_by_lua_block {
+          for i = 1, 10 do
+             assert(ngx.location.capture("/proxy"))
+          end
+          ngx.sleep(2)
+          assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6001&up="))
+          assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6001&down="))
+          ngx.sleep(4)
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          ngx.print(resp.body)
+       }
+    }
+--- request
+    GET /test
+--- response_body
+server 127.0.0.1:6001 addr=127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0 down;
+server 127.0.0.1:6002 addr=127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+--- timeout: 10
+
+
+=== TEST 4: last peer up not ejected
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_outlier errors=3 max_percent=100;
+        server 127.0.0.1:6001;
+    }
+    server {
+        listen 6001;
+        return 500;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /proxy {
+        proxy_pass http://backends/;
+    }
+    location /test {
+       content_by_lua_block {
+          for i = 1, 10 do
+             assert(ngx.location.capture("/proxy"))
+          end
+          ngx.sleep(2)
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          ngx.print(resp.body)
+       }
+    }
+--- request
+    GET /test
+--- response_body
+server 127.0.0.1:6001 addr=127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+--- timeout: 10
+
+
+=== TEST 5: max_percent=0 never ejects
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_outlier errors=3 max_percent=0;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+    server {
+        listen 6001;
+        return 500;
+    }
+    server {
+        listen 6002;
+        return 200 B;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /proxy {
+        proxy_pass http://backends/;
+    }
+    location /test {
+       content_by_lua_block {
+          for i = 1, 10 do
+             assert(ngx.location.capture("/proxy"))
+          end
+          ngx.sleep(2)
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          ngx.print(resp.body)
+       }
+    }
+--- request
+    GET /test
+--- response_body
+server 127.0.0.1:6001 addr=127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+server 127.0.0.1:6002 addr=127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+--- timeout: 10
@@ -0,0 +1,104 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 5 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: failing name is retried with the backoff
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dns_update 1s;
+        dns_max_backoff 4s;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends&server=nonexistent.invalid:6004&add="))
+          ngx.say(resp.body)
+          -- failures at 1s, 2s and 4s, the next one at 8s
+          ngx.sleep(6.5)
+          resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          ngx.print(resp.body)
+       }
+    }
+--- request
+    GET /test
+--- response_body
+DNS resolving in progress
+server 127.0.0.1:6001 addr=127.0.0.1:6001;
+server nonexistent.invalid:6004 addr=0.0.0.0:1 down;
+--- log_level: info
+--- error_log
+server nonexistent.invalid:6004: host not found, 2 failures, next in 2s
+server nonexistent.invalid:6004: host not found, 3 failures, next in 4s
+--- no_error_log
+4 failures
+--- timeout: 10
+
+
+
+=== TEST 2: stale peers are removed after dns_max_stale
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dns_update 1s;
+        dns_max_backoff 1s;
+        dns_max_stale 2s;
+        dns_srv_resolver 127.0.0.1:1953;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          assert(ngx.location.capture("/dynamic?upstream=backends&server=_http._tcp.example.test&add="))
+          ngx.sleep(2.5)
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          ngx.print(resp.body)
+          ngx.sleep(6)
+          resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          ngx.print(resp.body)
+       }
+    }
+--- udp_listen: 1953
+--- udp_reply eval
+my $n = 0;
+sub {
+    my $req = shift;
+    my $qlen = 12;
+    $qlen += ord(substr($req, $qlen, 1)) + 1 while ord(substr($req, $qlen, 1));
+    $qlen += 5;
+    # the name is found by the first queries, then it is gone
+    if ($n++ >= 3) {
+        return substr($req, 0, 2) . pack("n n n n n", 0x8183, 1, 0, 0, 0)
+               . substr($req, 12, $qlen - 12);
+    }
+    my $target = pack("C/a* C", "localhost", 0);
+    my $answer = pack("n n n N n n n n", 0xc00c, 33, 1, 60,
+                      6 + length($target), 10, 10, 6002) . $target;
+    return substr($req, 0, 2) . pack("n n n n n", 0x8180, 1, 1, 0, 0)
+           . substr($req, 12, $qlen - 12) . $answer;
+}
+--- request
+    GET /test
+--- response_body
+server 127.0.0.1:6001 addr=127.0.0.1:6001;
+server _http._tcp.example.test addr=127.0.0.1:6002;
+server 127.0.0.1:6001 addr=127.0.0.1:6001;
+server _http._tcp.example.test addr=0.0.0.0:1 down;
+--- error_log eval
+qr/server _http._tcp.example.test: failed to resolve for \d+s, stale peers removed/
+--- no_error_log
+[error]
+[crit]
+--- timeout: 15
@@ -0,0 +1,68 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 3 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: peer absent in the answer is held until the hold time expires
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dns_update 1s;
+        dns_srv_resolver 127.0.0.1:1953;
+        dns_hold_down time=4s;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends&server=_http._tcp.example.test&add="))
+          ngx.say(resp.body)
+          ngx.sleep(3.5)
+          resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          ngx.print(resp.body)
+          ngx.sleep(5)
+          resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          ngx.print(resp.body)
+       }
+    }
+--- udp_listen: 1953
+--- udp_reply eval
+my $n = 0;
+sub {
+    my $req = shift;
+    my $qlen = 12;
+    $qlen += ord(substr($req, $qlen, 1)) + 1 while ord(substr($req, $qlen, 1));
+    $qlen += 5;
+    my $target = pack("C/a* C", "localhost", 0);
+    # the first answer has both peers, the next ones lose the second
+    my @records = $n++ == 0 ? ([10, 10, 6002], [10, 10, 6003])
+                            : ([10, 10, 6002]);
+    my $answer = "";
+    for my $r (@records) {
+        $answer .= pack("n n n N n n n n", 0xc00c, 33, 1, 60,
+                        6 + length($target), @$r) . $target;
+    }
+    return substr($req, 0, 2)
+           . pack("n n n n n", 0x8180, 1, scalar(@records), 0, 0)
+           . substr($req, 12, $qlen - 12) . $answer;
+}
+--- request
+    GET /test
+--- response_body
+DNS resolving in progress
+server 127.0.0.1:6001 addr=127.0.0.1:6001;
+server _http._tcp.example.test addr=127.0.0.1:6002;
+server _http._tcp.example.test addr=127.0.0.1:6003;
+server 127.0.0.1:6001 addr=127.0.0.1:6001;
+server _http._tcp.example.test addr=127.0.0.1:6002;
+--- log_level: info
+--- error_log
+server _http._tcp.example.test peer 127.0.0.1:6003: absent in dns, held down
+--- timeout: 15
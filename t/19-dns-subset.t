@@ -0,0 +1,72 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+use File::Temp qw(tempfile);
+
+# the name of the test resolves to the addresses of a hosts file
+# by nss_wrapper
+
+my ($wrapper) = grep { -f $_ } map { "$_/libnss_wrapper.so" }
+    qw(/usr/lib /usr/lib64 /usr/lib/x86_64-linux-gnu /usr/local/lib);
+
+plan skip_all => 'nss_wrapper is required' unless defined $wrapper;
+
+my ($fh, $hosts) = tempfile(UNLINK => 1);
+print $fh "127.0.0.$_ backends.test\n" for 11 .. 15;
+close $fh;
+
+$ENV{LD_PRELOAD} = $wrapper;
+$ENV{NSS_WRAPPER_HOSTS} = $hosts;
+
+plan tests => repeat_each() * 3 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: name with more addresses than the subset
+--- main_config
+    env NSS_WRAPPER_HOSTS;
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dns_update 1s;
+        dns_subset 2 id=proxy1;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          local function subset()
+             local resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+             local peers = {}
+             for addr in resp.body:gmatch("server backends.test:6004 addr=([%d.:]+);") do
+                table.insert(peers, addr)
+             end
+             return peers
+          end
+          assert(ngx.location.capture("/dynamic?upstream=backends&server=backends.test:6004&add="))
+          ngx.sleep(3)
+          local first = subset()
+          ngx.say(#first)
+          -- the same addresses are chosen on every pass
+          for i = 1, 3 do
+             ngx.sleep(1.5)
+             local next = subset()
+             ngx.say(table.concat(next, " ") == table.concat(first, " ")
+                     and "stable" or "changed")
+          end
+       }
+    }
+--- request
+    GET /test
+--- response_body
+2
+stable
+stable
+stable
+--- no_error_log
+[error]
+--- timeout: 15
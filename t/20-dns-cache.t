@@ -0,0 +1,52 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 4 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: host shared by upstreams with different ports is resolved once
+--- log_level: info
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dns_update 2s;
+        server 127.0.0.1:6001;
+    }
+    upstream others {
+        zone zone_for_others 128k;
+        dns_update 2s;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends&server=localhost:6004&add="))
+          ngx.say(resp.body)
+          resp = assert(ngx.location.capture("/dynamic?upstream=others&server=localhost:6005&add="))
+          ngx.say(resp.body)
+          ngx.sleep(5)
+          resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          ngx.print(resp.body)
+          resp = assert(ngx.location.capture("/dynamic?upstream=others"))
+          ngx.print(resp.body)
+       }
+    }
+--- request
+    GET /test
+--- response_body_like
+DNS resolving in progress
+DNS resolving in progress
+server 127.0.0.1:6001 addr=127.0.0.1:6001;
+server localhost:6004 addr=127.0.0.1:6004;
+server 127.0.0.1:6002 addr=127.0.0.1:6002;
+server localhost:6005 addr=127.0.0.1:6005;
+--- error_log
+dynamic upstream: dns cache hit localhost
+--- no_error_log
+[error]
@@ -0,0 +1,85 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 3 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: service without SRV records is kept
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dns_update 1s;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends&server=_http._tcp.nonexistent.invalid&add="))
+          ngx.say(resp.body)
+          ngx.sleep(3)
+          resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          ngx.print(resp.body)
+       }
+    }
+--- request
+    GET /test
+--- response_body_like
+DNS resolving in progress
+server 127.0.0.1:6001 addr=127.0.0.1:6001;
+server _http._tcp.nonexistent.invalid addr=0.0.0.0:1 down;
+--- error_log
+server _http._tcp.nonexistent.invalid: SRV records not found
+
+
+=== TEST 2: service is discovered with the scaled weights of the records
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dns_update 1s;
+        dns_srv_resolver 127.0.0.1:1953;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends&server=_http._tcp.example.test&add="))
+          ngx.say(resp.body)
+          ngx.sleep(3)
+          resp = assert(ngx.location.capture("/dynamic?upstream=backends&verbose="))
+          ngx.print(resp.body)
+       }
+    }
+--- udp_listen: 1953
+--- udp_reply eval
+sub {
+    my $req = shift;
+    my $qlen = 12;
+    $qlen += ord(substr($req, $qlen, 1)) + 1 while ord(substr($req, $qlen, 1));
+    $qlen += 5;
+    my $target = pack("C/a* C", "localhost", 0);
+    my $answer = "";
+    for my $r ([10, 50, 6002], [10, 1000, 6003], [20, 1, 6004]) {
+        $answer .= pack("n n n N n n n n", 0xc00c, 33, 1, 60,
+                        6 + length($target), @$r) . $target;
+    }
+    return substr($req, 0, 2) . pack("n n n n n", 0x8180, 1, 3, 0, 0)
+           . substr($req, 12, $qlen - 12) . $answer;
+}
+--- request
+    GET /test
+--- response_body_like
+DNS resolving in progress
+server 127.0.0.1:6001 addr=127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+server _http._tcp.example.test addr=127.0.0.1:6002 weight=5 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+server _http._tcp.example.test addr=127.0.0.1:6003 weight=100 max_fails=1 fail_timeout=10 max_conns=0 conns=0;$
+--- no_error_log
+[error]
@@ -0,0 +1,64 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 3 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: state file written in background
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_state_file backends.peers;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6001&add="))
+          ngx.sleep(3)
+          local f = assert(io.open(ngx.config.prefix() .. "conf/backends.peers"))
+          ngx.print(f:read("*a"))
+          f:close()
+       }
+    }
+--- request
+    GET /test
+--- response_body_like
+server 127.0.0.1:6001 max_conns=\d+ max_fails=\d+ fail_timeout=\d+ weight=1;
+--- no_error_log
+[error]
+
+
+=== TEST 2: dns sync on the event loop
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dns_update 1s;
+        server 127.0.0.1:6001;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends&server=localhost:6002&add="))
+          ngx.say(resp.body)
+          ngx.sleep(3)
+          resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          ngx.print(resp.body)
+       }
+    }
+--- request
+    GET /test
+--- response_body_like
+DNS resolving in progress
+server 127.0.0.1:6001 addr=127.0.0.1:6001;
+server localhost:6002 addr=127.0.0.1:6002;
+--- no_error_log
+[error]
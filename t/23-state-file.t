@@ -0,0 +1,141 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+
+plan tests => repeat_each() * 3 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: hostnames of the state file resolved after the start
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_state_file ../html/backends.peers;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          ngx.sleep(3)
+          local resp = assert(ngx.location.capture("/dynamic?upstream=backends"))
+          ngx.print(resp.body)
+       }
+    }
+--- user_files
+>>> backends.peers
+server localhost:6001;
+server 127.0.0.1:6002;
+--- request
+    GET /test
+--- response_body_like
+server 127.0.0.1:6002 addr=127.0.0.1:6002;
+server localhost:6001 addr=127.0.0.1:6001;
+--- no_error_log
+[error]
+
+
+
+=== TEST 2: hostnames not resolved are kept in the state file
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_state_file ../html/backends.peers;
+    }
+--- config
+    location /test {
+       content_by_lua_block {
+          ngx.sleep(3)
+          local f = assert(io.open(ngx.config.prefix() .. "html/backends.peers"))
+          ngx.print(f:read("*a"))
+          f:close()
+       }
+    }
+--- user_files
+>>> backends.peers
+server unknown.invalid:6001;
+server 127.0.0.1:6002;
+--- request
+    GET /test
+--- response_body_like
+server unknown\.invalid:6001 max_conns=0 max_fails=1 fail_timeout=10 weight=1;
+--- no_error_log
+[alert]
+
+
+
+=== TEST 3: the saved state file is read back
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_state_file ../html/backends.peers;
+    }
+    upstream copy {
+        zone zone_for_copy 128k;
+        server 127.0.0.1:6009;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          assert(ngx.location.capture("/dynamic?upstream=backends&add=&server=127.0.0.1:6003&weight=3&max_fails=5"))
+          ngx.sleep(3)
+          local f = assert(io.open(ngx.config.prefix() .. "html/backends.peers"))
+          local saved = f:read("*a")
+          f:close()
+          local resp = assert(ngx.location.capture("/dynamic?upstream=copy",
+                                                   { method = ngx.HTTP_PUT, body = saved }))
+          ngx.print(resp.body)
+       }
+    }
+--- user_files
+>>> backends.peers
+server 127.0.0.1:6001 max_conns=0 max_fails=1 fail_timeout=10 weight=1;
+server 127.0.0.1:6002 max_conns=0 max_fails=3 fail_timeout=30 weight=2;
+--- request
+    GET /test
+--- response_body_like
+server 127.0.0.1:6001 addr=127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+server 127.0.0.1:6002 addr=127.0.0.1:6002 weight=2 max_fails=3 fail_timeout=30 max_conns=0 conns=0;
+server 127.0.0.1:6003 addr=127.0.0.1:6003 weight=3 max_fails=5 fail_timeout=10 max_conns=0 conns=0;
+--- no_error_log
+[error]
+
+
+
+=== TEST 4: down peers are saved down
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_state_file ../html/backends.peers;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6002&down="))
+          ngx.sleep(3)
+          local f = assert(io.open(ngx.config.prefix() .. "html/backends.peers"))
+          ngx.print(f:read("*a"))
+          f:close()
+       }
+    }
+--- user_files
+>>> backends.peers
+server 127.0.0.1:6001;
+server 127.0.0.1:6002;
+server 127.0.0.1:6003 down;
+--- request
+    GET /test
+--- response_body
+server 127.0.0.1:6001 max_conns=0 max_fails=1 fail_timeout=10 weight=1;
+server 127.0.0.1:6002 max_conns=0 max_fails=1 fail_timeout=10 weight=1 down;
+server 127.0.0.1:6003 max_conns=0 max_fails=1 fail_timeout=10 weight=1 down;
+--- no_error_log
+[error]
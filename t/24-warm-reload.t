@@ -0,0 +1,97 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+master_on();
+
+plan tests => repeat_each() * 3 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: warm reload, peers of the config at the start
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_warm_reload on;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 weight=2;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=backends&verbose=
+--- response_body
+server 127.0.0.1:6001 addr=127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+server 127.0.0.1:6002 addr=127.0.0.1:6002 weight=2 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+--- no_error_log
+[error]
+
+
+=== TEST 2: warm reload, stream upstream
+--- stream_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_warm_reload on;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002 backup;
+    }
+--- stream_server_config
+    proxy_pass backends;
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+--- request
+    GET /dynamic?upstream=backends&stream=
+--- response_body
+server 127.0.0.1:6001 addr=127.0.0.1:6001;
+server 127.0.0.1:6002 addr=127.0.0.1:6002 backup;
+--- no_error_log
+[error]
+
+
+
+=== TEST 3: peers added and changed at runtime survive a reload
+--- http_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        dynamic_warm_reload on;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+       content_by_lua_block {
+          assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6003&weight=3&max_fails=5&add="))
+          assert(ngx.location.capture("/dynamic?upstream=backends&server=127.0.0.1:6002&down="))
+          local f = assert(io.open(ngx.config.prefix() .. "logs/nginx.pid"))
+          local pid = f:read("*n")
+          f:close()
+          os.execute("kill -HUP " .. pid)
+          ngx.sleep(2)
+          -- this worker is exiting, the list is asked from the new ones
+          local sock = ngx.socket.tcp()
+          assert(sock:connect("127.0.0.1", ngx.var.server_port))
+          assert(sock:send("GET /dynamic?upstream=backends&verbose= HTTP/1.0\r\n"
+                           .. "Host: localhost\r\n\r\n"))
+          local resp = assert(sock:receive("*a"))
+          sock:close()
+          ngx.print(resp:match("\r\n\r\n(.*)$"))
+       }
+    }
+--- request
+    GET /test
+--- response_body
+server 127.0.0.1:6001 addr=127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+server 127.0.0.1:6002 addr=127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0 down;
+server 127.0.0.1:6003 addr=127.0.0.1:6003 weight=3 max_fails=5 fail_timeout=10 max_conns=0 conns=0;
+--- error_log
+upstream "backends": warm reload, 2 peers carried, 1 added and 0 removed at runtime
+--- timeout: 10
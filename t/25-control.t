@@ -0,0 +1,194 @@
+use lib 'lib';
+use Test::Nginx::Socket;
+use Test::Nginx::Socket::Lua::Stream;
+
+plan tests => repeat_each() * 2 * blocks();
+
+run_tests();
+
+__DATA__
+
+=== TEST 1: binary control, pipelined requests
+--- stream_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+        server 127.0.0.1:6002;
+    }
+    server {
+        listen unix:$TEST_NGINX_HTML_DIR/control.sock;
+        dynamic_upstream_control;
+    }
+--- stream_server_config
+    proxy_pass backends;
+--- config
+    location /dynamic {
+        dynamic_upstream;
+    }
+    location /test {
+        content_by_lua_block {
+            local function u16(n)
+                return string.char(bit.band(bit.rshift(n, 8), 255),
+                                   bit.band(n, 255))
+            end
+            local function u32(n)
+                return u16(bit.rshift(n, 16)) .. u16(bit.band(n, 65535))
+            end
+            local function get16(s, i)
+                return s:byte(i) * 256 + s:byte(i + 1)
+            end
+            local function req(id, op, param, upstream, server)
+                local body = string.char(1, op) .. u16(0) .. u32(id)
+                    .. u32(param) .. u32(0) .. u32(0) .. u32(0) .. u32(0)
+                    .. u32(0) .. u16(#upstream) .. u16(#server) .. u16(0)
+                    .. u16(0) .. upstream .. server
+                return u32(#body) .. body
+            end
+            local sock = ngx.socket.tcp()
+            assert(sock:connect("unix:" .. ngx.config.prefix()
+                                .. "/html/control.sock"))
+            assert(sock:send(
+                req(1, 2, 1024, "backends", "127.0.0.1:6003")
+                .. req(2, 8, 1024 + 16, "backends", "127.0.0.1:6001")
+                .. req(3, 4, 1024, "backends", "127.0.0.1:6009")
+                .. req(4, 4, 1024, "unknown", "127.0.0.1:6001")))
+            for i = 1, 4 do
+                local reply = assert(sock:receive(12))
+                local err = ""
+                if get16(reply, 11) > 0 then
+                    err = " " .. assert(sock:receive(get16(reply, 11)))
+                end
+                ngx.say(get16(reply, 7), " ", get16(reply, 9), err)
+            end
+            sock:close()
+            local resp = ngx.location.capture(
+                "/dynamic?upstream=backends&stream=&verbose=")
+            ngx.print(resp.body)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+1 200
+2 200
+3 304
+4 404 upstream is not found
+server 127.0.0.1:6001 addr=127.0.0.1:6001 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0 down;
+server 127.0.0.1:6002 addr=127.0.0.1:6002 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+server 127.0.0.1:6003 addr=127.0.0.1:6003 weight=1 max_fails=1 fail_timeout=10 max_conns=0 conns=0;
+
+
+=== TEST 2: binary control, invalid request
+--- stream_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+    server {
+        listen unix:$TEST_NGINX_HTML_DIR/control.sock;
+        dynamic_upstream_control;
+    }
+--- stream_server_config
+    proxy_pass backends;
+--- config
+    location /test {
+        content_by_lua_block {
+            local sock = ngx.socket.tcp()
+            assert(sock:connect("unix:" .. ngx.config.prefix()
+                                .. "/html/control.sock"))
+            assert(sock:send(string.char(0, 0, 0, 4, 1, 2, 0, 0)))
+            local reply, err = sock:receive(12)
+            ngx.say(err)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+closed
+
+
+=== TEST 3: binary control, values out of range
+--- stream_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+    server {
+        listen unix:$TEST_NGINX_HTML_DIR/control.sock;
+        dynamic_upstream_control;
+    }
+--- stream_server_config
+    proxy_pass backends;
+--- config
+    location /test {
+        content_by_lua_block {
+            local function u16(n)
+                return string.char(bit.band(bit.rshift(n, 8), 255),
+                                   bit.band(n, 255))
+            end
+            local function u32(n)
+                return u16(bit.band(bit.rshift(n, 16), 65535))
+                       .. u16(bit.band(n, 65535))
+            end
+            local function get16(s, i)
+                return s:byte(i) * 256 + s:byte(i + 1)
+            end
+            local function req(id, param, weight, max_fails, upstream, server)
+                local body = string.char(1, 8) .. u16(0) .. u32(id)
+                    .. u32(param) .. u32(weight) .. u32(max_fails) .. u32(0)
+                    .. u32(0) .. u32(0) .. u16(#upstream) .. u16(#server)
+                    .. u16(0) .. u16(0) .. upstream .. server
+                return u32(#body) .. body
+            end
+            local sock = ngx.socket.tcp()
+            assert(sock:connect("unix:" .. ngx.config.prefix()
+                                .. "/html/control.sock"))
+            assert(sock:send(
+                req(1, 1024 + 1, 0, 0, "backends", "127.0.0.1:6001")
+                .. req(2, 1024 + 2, 1, -1, "backends", "127.0.0.1:6001")))
+            for i = 1, 2 do
+                local reply = assert(sock:receive(12))
+                local err = ""
+                if get16(reply, 11) > 0 then
+                    err = " " .. assert(sock:receive(get16(reply, 11)))
+                end
+                ngx.say(get16(reply, 7), " ", get16(reply, 9), err)
+            end
+            sock:close()
+        }
+    }
+--- request
+    GET /test
+--- response_body
+1 400 weight: must be positive
+2 400 max_fails: must not be negative
+
+
+=== TEST 4: binary control, idle session closed
+--- stream_config
+    upstream backends {
+        zone zone_for_backends 128k;
+        server 127.0.0.1:6001;
+    }
+    server {
+        listen unix:$TEST_NGINX_HTML_DIR/control.sock;
+        dynamic_upstream_control timeout=1s;
+    }
+--- stream_server_config
+    proxy_pass backends;
+--- config
+    location /test {
+        content_by_lua_block {
+            local sock = ngx.socket.tcp()
+            sock:settimeout(5000)
+            assert(sock:connect("unix:" .. ngx.config.prefix()
+                                .. "/html/control.sock"))
+            local reply, err = sock:receive(12)
+            ngx.say(err)
+        }
+    }
+--- request
+    GET /test
+--- response_body
+closed
+--- timeout: 10